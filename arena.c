@@ -0,0 +1,66 @@
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define CHUNK_SIZE 1024
+#define ALIGNMENT alignof(max_align_t)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	alignas(max_align_t) unsigned char data[];
+};
+
+void arena_init(struct arena *arena) {
+	arena->chunks = NULL;
+	arena->used = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+	size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	struct arena_chunk *chunk = arena->chunks;
+	if (chunk != NULL && chunk->size - arena->used >= size) {
+		void *p = chunk->data + arena->used;
+		arena->used += size;
+		return p;
+	}
+
+	// Allocations that don't fit in a chunk get one of their own, which is
+	// linked behind the current chunk, so its free space is not lost.
+	size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+	chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	chunk->size = chunk_size;
+	if (chunk_size > CHUNK_SIZE && arena->chunks != NULL) {
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->used = size;
+	}
+	return chunk->data;
+}
+
+char *arena_strdup(struct arena *arena, const char *s) {
+	size_t length = strlen(s);
+	char *copy = arena_alloc(arena, length + 1);
+	if (copy != NULL) {
+		memcpy(copy, s, length + 1);
+	}
+	return copy;
+}
+
+void arena_free(struct arena *arena) {
+	struct arena_chunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct arena_chunk *save_next = chunk->next;
+		free(chunk);
+		chunk = save_next;
+	}
+	arena->chunks = NULL;
+	arena->used = 0;
+}
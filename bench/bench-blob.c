@@ -0,0 +1,166 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+
+/*
+ * Measures the latency of calls whose reply is a large payload, sent inline
+ * as an ay, and sent in a sealed memfd, for a range of sizes. The client
+ * reads the payload and touches every page of it, so the cost of mapping the
+ * memfd is included. The CPU time of the bus daemon per call shows the copies
+ * that the memfd saves.
+ */
+
+static const size_t sizes[] = {
+	4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024,
+};
+
+static char *payload;
+
+static dbus_bool_t handle_get(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	DBusMessageIter iter;
+	dbus_uint64_t length;
+	dbus_message_iter_init(msg, &iter);
+	if (!subd_message_read(&iter, err, &length, NULL)) {
+		return FALSE;
+	}
+
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	dbus_message_iter_init_append(reply, &iter);
+	if (!subd_blob_append(conn, &iter, payload, length, err)) {
+		dbus_message_unref(reply);
+		return FALSE;
+	}
+	if (!dbus_connection_send(conn, reply, NULL)) {
+		dbus_message_unref(reply);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	dbus_message_unref(reply);
+	return TRUE;
+}
+
+static const struct subd_member members[] = {
+	{ .type = SUBD_METHOD, .m = { "Get", handle_get, "t", "v", 0, NULL } },
+	{ .type = SUBD_MEMBERS_END },
+};
+
+/**
+ * Helper function that fetches a payload of "length" bytes, reads it, and
+ * returns the round-trip time.
+ */
+static uint64_t fetch(DBusConnection *client, dbus_uint64_t length) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	DBusMessage *msg = dbus_message_new_method_call(BENCH_SERVICE, BENCH_PATH,
+		BENCH_INTERFACE, "Get");
+	if (msg == NULL || !dbus_message_append_args(msg, DBUS_TYPE_UINT64,
+			&length, DBUS_TYPE_INVALID)) {
+		bench_fail("creating a call", NULL);
+	}
+
+	uint64_t start = bench_now();
+	DBusMessage *reply = dbus_connection_send_with_reply_and_block(client, msg,
+		DBUS_TIMEOUT_USE_DEFAULT, &err);
+	dbus_message_unref(msg);
+	if (reply == NULL) {
+		bench_fail("Get", &err);
+	}
+
+	DBusMessageIter iter;
+	struct subd_blob blob;
+	dbus_message_iter_init(reply, &iter);
+	if (!subd_blob_read(&iter, &blob, &err)) {
+		bench_fail("subd_blob_read", &err);
+	}
+	if (blob.length != length) {
+		bench_fail("payload length", NULL);
+	}
+	volatile unsigned char sum = 0;
+	const unsigned char *data = blob.data;
+	for (size_t i = 0; i < blob.length; i += 4096) {
+		sum += data[i];
+	}
+	subd_blob_release(&blob);
+	uint64_t elapsed = bench_now() - start;
+
+	dbus_message_unref(reply);
+	return elapsed;
+}
+
+static void run(DBusConnection *client, const char *name, size_t threshold,
+		size_t length, long count) {
+	subd_set_blob_threshold(threshold);
+
+	uint64_t *samples = malloc(count * sizeof(uint64_t));
+	if (samples == NULL) {
+		bench_fail("allocating samples", NULL);
+	}
+
+	for (long i = 0; i < count / 10 + 1; ++i) {
+		fetch(client, length);
+	}
+	uint64_t bus_start = bench_bus_cpu_time();
+	for (long i = 0; i < count; ++i) {
+		samples[i] = fetch(client, length);
+	}
+	uint64_t bus_time = bench_bus_cpu_time() - bus_start;
+
+	struct bench_summary summary;
+	bench_summarize(samples, count, &summary);
+	free(samples);
+
+	bench_json_result_begin();
+	bench_json_string("name", name);
+	bench_json_int("bytes", length);
+	bench_json_summary(&summary);
+	bench_json_double("mib_per_sec",
+		length / (1024.0 * 1024.0) * 1e9 / summary.mean);
+	bench_json_double("bus_cpu_per_call", (double)bus_time / count);
+	bench_json_result_end();
+}
+
+int main(void) {
+	long count = bench_param("BENCH_ITERATIONS", 200);
+	size_t largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	if ((payload = malloc(largest)) == NULL) {
+		bench_fail("allocating the payload", NULL);
+	}
+	memset(payload, 0x5a, largest);
+
+	bench_start_bus();
+	DBusConnection *client = bench_client_open();
+	DBusConnection *service = bench_service_open();
+	DBusError err;
+	dbus_error_init(&err);
+	if (!subd_add_object_vtable(service, BENCH_PATH, BENCH_INTERFACE, members,
+			NULL, &err)) {
+		bench_fail("subd_add_object_vtable", &err);
+	}
+	struct bench_loop *loop = bench_loop_start(service, BENCH_LOOP_POLL,
+		NULL, 0);
+
+	// Large payloads take long to copy, so fewer of them are fetched.
+	bench_json_begin("blob");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		long n = count * 64 * 1024 / sizes[i];
+		n = n < 10 ? 10 : n > count ? count : n;
+		run(client, "inline", SIZE_MAX, sizes[i], n);
+		run(client, "memfd", 0, sizes[i], n);
+	}
+	bench_json_end();
+
+	bench_loop_stop(loop);
+	bench_close(service);
+	bench_close(client);
+	free(payload);
+	return EXIT_SUCCESS;
+}
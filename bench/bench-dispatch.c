@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+
+/*
+ * Measures how registration and dispatch cost grow with the number of paths,
+ * interfaces per path, and members per interface. Every configuration starts
+ * with a fresh service connection, and calls the member that was registered
+ * last.
+ */
+
+#define NAME_SIZE 64
+
+struct config {
+	int paths;
+	int interfaces;
+	int members;
+};
+
+static const struct config configs[] = {
+	{ 1, 1, 1 },
+	{ 100, 1, 1 },
+	{ 10000, 1, 1 },
+	{ 1, 16, 1 },
+	{ 1, 256, 1 },
+	{ 1, 1, 16 },
+	{ 1, 1, 256 },
+	{ 1, 1, 4096 },
+	{ 1000, 8, 16 },
+};
+
+static dbus_bool_t handle_call(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	return subd_reply_method_return(conn, msg, err, DBUS_TYPE_INVALID);
+}
+
+static void run(const struct config *config, long count) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	// The names have to outlive the registrations.
+	char (*names)[NAME_SIZE] = malloc(config->members * NAME_SIZE);
+	struct subd_member *members = calloc(config->members + 1,
+		sizeof(struct subd_member));
+	if (names == NULL || members == NULL) {
+		bench_fail("allocating members", NULL);
+	}
+	for (int i = 0; i < config->members; ++i) {
+		snprintf(names[i], NAME_SIZE, "Method%d", i);
+		members[i].type = SUBD_METHOD;
+		members[i].m.name = names[i];
+		members[i].m.handler = handle_call;
+		members[i].m.input_signature = "";
+		members[i].m.output_signature = "";
+	}
+	members[config->members].type = SUBD_MEMBERS_END;
+
+	DBusConnection *service = bench_service_open();
+	char path[NAME_SIZE];
+	char interface[NAME_SIZE];
+
+	uint64_t start = bench_now();
+	for (int p = 0; p < config->paths; ++p) {
+		snprintf(path, sizeof(path), BENCH_PATH "/object%d", p);
+		for (int i = 0; i < config->interfaces; ++i) {
+			snprintf(interface, sizeof(interface), BENCH_INTERFACE ".I%d", i);
+			if (!subd_add_object_vtable(service, path, interface, members,
+					NULL, &err)) {
+				bench_fail("subd_add_object_vtable", &err);
+			}
+		}
+	}
+	uint64_t registration = bench_now() - start;
+
+	struct bench_loop *loop = bench_loop_start(service, BENCH_LOOP_POLL,
+		NULL, 0);
+	DBusConnection *client = bench_client_open();
+
+	uint64_t *samples = malloc(count * sizeof(uint64_t));
+	if (samples == NULL) {
+		bench_fail("allocating samples", NULL);
+	}
+	const char *method = names[config->members - 1];
+	for (long i = 0; i < count / 10; ++i) {
+		bench_call(client, path, interface, method);
+	}
+	for (long i = 0; i < count; ++i) {
+		samples[i] = bench_call(client, path, interface, method);
+	}
+	double busy = bench_loop_stop(loop);
+
+	struct bench_summary summary;
+	bench_summarize(samples, count, &summary);
+
+	bench_json_result_begin();
+	bench_json_int("paths", config->paths);
+	bench_json_int("interfaces", config->interfaces);
+	bench_json_int("members", config->members);
+	bench_json_int("registration_elapsed", registration);
+	bench_json_double("process_watches", busy);
+	bench_json_summary(&summary);
+	bench_json_result_end();
+
+	free(samples);
+	bench_close(client);
+	bench_close(service);
+	free(members);
+	free(names);
+}
+
+int main(void) {
+	long count = bench_param("BENCH_ITERATIONS", 5000);
+
+	bench_start_bus();
+	bench_json_begin("dispatch");
+	for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+		run(&configs[i], count);
+	}
+	bench_json_end();
+
+	return EXIT_SUCCESS;
+}
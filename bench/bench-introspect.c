@@ -0,0 +1,143 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+
+/*
+ * Measures the cost of Introspect calls as the number of interfaces and
+ * members grows. Cold calls are the first ones on each path, which generate
+ * the introspection data, warm calls are answered from the cache.
+ */
+
+#define NAME_SIZE 64
+
+struct config {
+	int interfaces;
+	int members;
+};
+
+static const struct config configs[] = {
+	{ 1, 4 },
+	{ 1, 64 },
+	{ 8, 4 },
+	{ 8, 64 },
+	{ 64, 16 },
+};
+
+static dbus_bool_t handle_call(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	return subd_reply_method_return(conn, msg, err, DBUS_TYPE_INVALID);
+}
+
+static void run(const struct config *config, int paths, long count) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	// Every interface has methods, signals and properties in equal numbers.
+	char (*names)[NAME_SIZE] = malloc(config->members * NAME_SIZE);
+	struct subd_member *members = calloc(config->members + 1,
+		sizeof(struct subd_member));
+	if (names == NULL || members == NULL) {
+		bench_fail("allocating members", NULL);
+	}
+	for (int i = 0; i < config->members; ++i) {
+		snprintf(names[i], NAME_SIZE, "Member%d", i);
+		switch (i % 3) {
+		case 0:
+			members[i].type = SUBD_METHOD;
+			members[i].m.name = names[i];
+			members[i].m.handler = handle_call;
+			members[i].m.input_signature = "sa{sv}";
+			members[i].m.output_signature = "a(ii)";
+			break;
+		case 1:
+			members[i].type = SUBD_SIGNAL;
+			members[i].s.name = names[i];
+			members[i].s.signature = "sv";
+			break;
+		default:
+			members[i].type = SUBD_PROPERTY;
+			members[i].p.name = names[i];
+			members[i].p.signature = "u";
+			members[i].p.access = SUBD_PROPERTY_READ;
+			break;
+		}
+	}
+	members[config->members].type = SUBD_MEMBERS_END;
+
+	DBusConnection *service = bench_service_open();
+	char path[NAME_SIZE];
+	char interface[NAME_SIZE];
+	for (int p = 0; p < paths; ++p) {
+		snprintf(path, sizeof(path), BENCH_PATH "/object%d", p);
+		for (int i = 0; i < config->interfaces; ++i) {
+			snprintf(interface, sizeof(interface), BENCH_INTERFACE ".I%d", i);
+			if (!subd_add_object_vtable(service, path, interface, members,
+					NULL, &err)) {
+				bench_fail("subd_add_object_vtable", &err);
+			}
+		}
+	}
+
+	struct bench_loop *loop = bench_loop_start(service, BENCH_LOOP_POLL,
+		NULL, 0);
+	DBusConnection *client = bench_client_open();
+
+	long size = paths > count ? paths : count;
+	uint64_t *samples = malloc(size * sizeof(uint64_t));
+	if (samples == NULL) {
+		bench_fail("allocating samples", NULL);
+	}
+
+	for (int p = 0; p < paths; ++p) {
+		snprintf(path, sizeof(path), BENCH_PATH "/object%d", p);
+		samples[p] = bench_call(client, path, DBUS_INTERFACE_INTROSPECTABLE,
+			"Introspect");
+	}
+	struct bench_summary cold;
+	bench_summarize(samples, paths, &cold);
+
+	for (long i = 0; i < count; ++i) {
+		samples[i] = bench_call(client, path, DBUS_INTERFACE_INTROSPECTABLE,
+			"Introspect");
+	}
+	struct bench_summary warm;
+	bench_summarize(samples, count, &warm);
+	bench_loop_stop(loop);
+
+	bench_json_result_begin();
+	bench_json_string("name", "cold");
+	bench_json_int("interfaces", config->interfaces);
+	bench_json_int("members", config->members);
+	bench_json_summary(&cold);
+	bench_json_result_end();
+
+	bench_json_result_begin();
+	bench_json_string("name", "warm");
+	bench_json_int("interfaces", config->interfaces);
+	bench_json_int("members", config->members);
+	bench_json_summary(&warm);
+	bench_json_result_end();
+
+	free(samples);
+	bench_close(client);
+	bench_close(service);
+	free(members);
+	free(names);
+}
+
+int main(void) {
+	long count = bench_param("BENCH_ITERATIONS", 2000);
+	int paths = bench_param("BENCH_PATHS", 200);
+
+	bench_start_bus();
+	bench_json_begin("introspect");
+	for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+		run(&configs[i], paths, count);
+	}
+	bench_json_end();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+
+/*
+ * Measures the throughput of a method whose reply is a list of strings, with
+ * a window of asynchronous calls in flight, once with the handler building
+ * the reply on every call, and once with the reply memoized. BENCH_WORK
+ * spins that many nanoseconds in the handler, to simulate replies that are
+ * expensive to compute.
+ */
+
+#define WINDOW 64
+#define STRINGS 64
+
+static uint64_t work;
+static char strings[STRINGS][32];
+
+static dbus_bool_t handle_capabilities(DBusConnection *conn,
+		DBusMessage *msg, void *userdata, DBusError *err) {
+	uint64_t start = bench_now();
+	while (bench_now() - start < work);
+
+	const char *list[STRINGS];
+	for (int i = 0; i < STRINGS; ++i) {
+		list[i] = strings[i];
+	}
+	const char **array = list;
+	return subd_reply_method_return(conn, msg, err,
+		DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &array, STRINGS, DBUS_TYPE_INVALID);
+}
+
+static const struct subd_member members[] = {
+	{ .type = SUBD_METHOD, .m = { "Capabilities", handle_capabilities, "",
+		"as", 0, NULL } },
+	{ .type = SUBD_MEMBERS_END },
+};
+
+static const struct subd_member cached_members[] = {
+	{ .type = SUBD_METHOD, .m = { "Capabilities", handle_capabilities, "",
+		"as", SUBD_METHOD_CACHEABLE, NULL } },
+	{ .type = SUBD_MEMBERS_END },
+};
+
+static void handle_reply(DBusMessage *reply, void *data) {
+	long *pending = data;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		bench_fail("async Capabilities", NULL);
+	}
+	--*pending;
+}
+
+static void run(DBusConnection *client, const char *name,
+		const struct subd_member *m, long count) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	DBusConnection *service = bench_service_open();
+	if (!subd_add_object_vtable(service, BENCH_PATH, BENCH_INTERFACE, m, NULL,
+			&err)) {
+		bench_fail("subd_add_object_vtable", &err);
+	}
+	struct bench_loop *loop = bench_loop_start(service, BENCH_LOOP_POLL,
+		NULL, 0);
+
+	long pending = 0;
+	uint64_t start = bench_now();
+	for (long sent = 0; sent < count || pending > 0; ) {
+		while (sent < count && pending < WINDOW) {
+			if (!subd_call_async(client, BENCH_SERVICE, BENCH_PATH,
+					BENCH_INTERFACE, "Capabilities", DBUS_TIMEOUT_USE_DEFAULT,
+					handle_reply, &pending, &err, DBUS_TYPE_INVALID)) {
+				bench_fail("subd_call_async", &err);
+			}
+			++sent;
+			++pending;
+		}
+		dbus_connection_read_write_dispatch(client, -1);
+	}
+	uint64_t elapsed = bench_now() - start;
+	bench_loop_stop(loop);
+
+	struct subd_cache_stats stats;
+	subd_get_reply_cache_stats(service, &stats);
+	bench_close(service);
+
+	bench_json_result_begin();
+	bench_json_string("name", name);
+	bench_json_int("calls", count);
+	bench_json_int("work", work);
+	bench_json_int("elapsed", elapsed);
+	bench_json_double("calls_per_sec", count * 1e9 / elapsed);
+	bench_json_int("hits", stats.hits);
+	bench_json_int("misses", stats.misses);
+	bench_json_result_end();
+}
+
+int main(void) {
+	long count = bench_param("BENCH_ITERATIONS", 20000);
+	work = bench_param("BENCH_WORK", 20000);
+
+	for (int i = 0; i < STRINGS; ++i) {
+		snprintf(strings[i], sizeof(strings[i]), "org.subd.Capability%d", i);
+	}
+
+	bench_start_bus();
+	DBusConnection *client = bench_client_open();
+
+	bench_json_begin("memo");
+	run(client, "handler", members, count);
+	run(client, "memoized", cached_members, count);
+	bench_json_end();
+
+	bench_close(client);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "harness.h"
+
+/*
+ * Compares method calls through the bus daemon with calls on a direct
+ * connection to a subd server: synchronous calls one at a time for the
+ * percentiles, and pipelined asynchronous calls for the throughput. The CPU
+ * time the daemon used during each run is reported too.
+ */
+
+static dbus_bool_t handle_echo(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	DBusMessageIter iter;
+	dbus_int32_t value;
+	dbus_message_iter_init(msg, &iter);
+	if (!subd_message_read(&iter, err, &value, NULL)) {
+		return FALSE;
+	}
+	return subd_reply_method_return(conn, msg, err,
+		DBUS_TYPE_INT32, &value, DBUS_TYPE_INVALID);
+}
+
+static const struct subd_member members[] = {
+	{ .type = SUBD_METHOD, .m = { "Echo", handle_echo, "i", "i", 0, NULL } },
+	{ .type = SUBD_MEMBERS_END },
+};
+
+/**
+ * The connection the server accepted, and its loop.
+ */
+static DBusConnection *peer;
+static struct bench_loop *peer_loop;
+static atomic_bool accepted;
+
+static void accept_peer(DBusConnection *conn, void *data) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	if (!subd_add_object_vtable(conn, BENCH_PATH, BENCH_INTERFACE, members,
+			NULL, &err)) {
+		bench_fail("subd_add_object_vtable", &err);
+	}
+	peer = conn;
+	peer_loop = bench_loop_start(conn, BENCH_LOOP_POLL, NULL, 0);
+	atomic_store(&accepted, true);
+}
+
+static DBusMessage *new_echo(dbus_int32_t value) {
+	DBusMessage *msg = dbus_message_new_method_call(BENCH_SERVICE, BENCH_PATH,
+		BENCH_INTERFACE, "Echo");
+	if (msg == NULL || !dbus_message_append_args(msg, DBUS_TYPE_INT32, &value,
+			DBUS_TYPE_INVALID)) {
+		bench_fail("creating a call", NULL);
+	}
+	return msg;
+}
+
+static void run_sync(DBusConnection *client, const char *name, long count) {
+	uint64_t *samples = malloc(count * sizeof(uint64_t));
+	if (samples == NULL) {
+		bench_fail("allocating samples", NULL);
+	}
+
+	for (long i = 0; i < count / 10; ++i) {
+		bench_send(client, new_echo(i));
+	}
+	uint64_t cpu = bench_bus_cpu_time();
+	for (long i = 0; i < count; ++i) {
+		samples[i] = bench_send(client, new_echo(i));
+	}
+	cpu = bench_bus_cpu_time() - cpu;
+
+	struct bench_summary summary;
+	bench_summarize(samples, count, &summary);
+	free(samples);
+
+	bench_json_result_begin();
+	bench_json_string("name", name);
+	bench_json_string("mode", "sync");
+	bench_json_summary(&summary);
+	bench_json_double("calls_per_sec", 1e9 / summary.mean);
+	bench_json_int("bus_cpu", cpu);
+	bench_json_result_end();
+}
+
+static void handle_reply(DBusMessage *reply, void *data) {
+	long *pending = data;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		bench_fail("async Echo", NULL);
+	}
+	--*pending;
+}
+
+static void run_async(DBusConnection *client, const char *name, long count,
+		long window) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	long pending = 0;
+	uint64_t cpu = bench_bus_cpu_time();
+	uint64_t start = bench_now();
+	for (long sent = 0; sent < count || pending > 0; ) {
+		while (sent < count && pending < window) {
+			dbus_int32_t value = sent;
+			if (!subd_call_async(client, BENCH_SERVICE, BENCH_PATH,
+					BENCH_INTERFACE, "Echo", DBUS_TIMEOUT_USE_DEFAULT,
+					handle_reply, &pending, &err,
+					DBUS_TYPE_INT32, &value, DBUS_TYPE_INVALID)) {
+				bench_fail("subd_call_async", &err);
+			}
+			++sent;
+			++pending;
+		}
+		dbus_connection_read_write_dispatch(client, -1);
+	}
+	uint64_t elapsed = bench_now() - start;
+	cpu = bench_bus_cpu_time() - cpu;
+
+	bench_json_result_begin();
+	bench_json_string("name", name);
+	bench_json_string("mode", "async");
+	bench_json_int("calls", count);
+	bench_json_int("window", window);
+	bench_json_int("elapsed", elapsed);
+	bench_json_double("calls_per_sec", count * 1e9 / elapsed);
+	bench_json_int("bus_cpu", cpu);
+	bench_json_result_end();
+}
+
+int main(void) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	long count = bench_param("BENCH_ITERATIONS", 20000);
+
+	bench_start_bus();
+	DBusConnection *service = bench_service_open();
+	if (!subd_add_object_vtable(service, BENCH_PATH, BENCH_INTERFACE, members,
+			NULL, &err)) {
+		bench_fail("subd_add_object_vtable", &err);
+	}
+	struct bench_loop *loop = bench_loop_start(service, BENCH_LOOP_POLL,
+		NULL, 0);
+	DBusConnection *client = bench_client_open();
+
+	// The listening socket has a loop of its own, without a connection.
+	struct bench_loop *server_loop = bench_loop_start(NULL, BENCH_LOOP_POLL,
+		NULL, 0);
+	struct subd_server *server = subd_server_listen("unix:tmpdir=/tmp",
+		bench_loop_watches(server_loop), accept_peer, NULL, &err);
+	char *address = server != NULL ? subd_server_get_address(server) : NULL;
+	if (address == NULL) {
+		bench_fail("subd_server_listen", &err);
+	}
+	DBusConnection *direct = subd_open_peer(address, &err);
+	dbus_free(address);
+	if (direct == NULL) {
+		bench_fail("subd_open_peer", &err);
+	}
+	const struct timespec ms = { 0, 1000000 };
+	while (!atomic_load(&accepted)) {
+		nanosleep(&ms, NULL);
+	}
+
+	bench_json_begin("peer");
+	run_sync(client, "bus", count);
+	run_sync(direct, "direct", count);
+	run_async(client, "bus", count, 64);
+	run_async(direct, "direct", count, 64);
+	bench_json_end();
+
+	bench_close(direct);
+	bench_loop_stop(peer_loop);
+	bench_close(peer);
+	subd_server_free(server);
+	bench_loop_stop(server_loop);
+	bench_close(client);
+	bench_loop_stop(loop);
+	bench_close(service);
+	return EXIT_SUCCESS;
+}
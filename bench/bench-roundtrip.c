@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+
+/*
+ * Measures the latency of method calls from a client to a service running the
+ * poll based loop: synchronous calls one at a time for the percentiles, and
+ * pipelined asynchronous calls for the throughput. Setting BENCH_STATS to 1
+ * enables call statistics on the service, and setting BENCH_TRACE to a ring
+ * size enables tracing, to measure their overhead.
+ */
+
+static dbus_bool_t handle_ping(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	return subd_reply_method_return(conn, msg, err, DBUS_TYPE_INVALID);
+}
+
+static dbus_bool_t handle_echo(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	DBusMessageIter iter;
+	dbus_int32_t value;
+	dbus_message_iter_init(msg, &iter);
+	if (!subd_message_read(&iter, err, &value, NULL)) {
+		return FALSE;
+	}
+	return subd_reply_method_return(conn, msg, err,
+		DBUS_TYPE_INT32, &value, DBUS_TYPE_INVALID);
+}
+
+static const struct subd_member members[] = {
+	{ .type = SUBD_METHOD, .m = { "Ping", handle_ping, "", "", 0, NULL } },
+	{ .type = SUBD_METHOD, .m = { "Echo", handle_echo, "i", "i", 0, NULL } },
+	{ .type = SUBD_MEMBERS_END },
+};
+
+/**
+ * Helper function that calls "method" once, with an int argument if it is
+ * Echo, and returns the round-trip time.
+ */
+static uint64_t call(DBusConnection *client, const char *method,
+		dbus_int32_t value) {
+	DBusMessage *msg = dbus_message_new_method_call(BENCH_SERVICE, BENCH_PATH,
+		BENCH_INTERFACE, method);
+	if (msg == NULL || (strcmp(method, "Echo") == 0 &&
+			!dbus_message_append_args(msg, DBUS_TYPE_INT32, &value,
+				DBUS_TYPE_INVALID))) {
+		bench_fail("creating a call", NULL);
+	}
+	return bench_send(client, msg);
+}
+
+static void run_sync(DBusConnection *client, const char *method, long count) {
+	uint64_t *samples = malloc(count * sizeof(uint64_t));
+	if (samples == NULL) {
+		bench_fail("allocating samples", NULL);
+	}
+
+	for (long i = 0; i < count / 10; ++i) {
+		call(client, method, i);
+	}
+	for (long i = 0; i < count; ++i) {
+		samples[i] = call(client, method, i);
+	}
+
+	struct bench_summary summary;
+	bench_summarize(samples, count, &summary);
+	free(samples);
+
+	bench_json_result_begin();
+	bench_json_string("name", "sync");
+	bench_json_string("method", method);
+	bench_json_summary(&summary);
+	bench_json_double("calls_per_sec", 1e9 / summary.mean);
+	bench_json_result_end();
+}
+
+static void handle_reply(DBusMessage *reply, void *data) {
+	long *pending = data;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		bench_fail("async Echo", NULL);
+	}
+	--*pending;
+}
+
+static void run_async(DBusConnection *client, long count, long window) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	long pending = 0;
+	uint64_t start = bench_now();
+	for (long sent = 0; sent < count || pending > 0; ) {
+		while (sent < count && pending < window) {
+			dbus_int32_t value = sent;
+			if (!subd_call_async(client, BENCH_SERVICE, BENCH_PATH,
+					BENCH_INTERFACE, "Echo", DBUS_TIMEOUT_USE_DEFAULT,
+					handle_reply, &pending, &err,
+					DBUS_TYPE_INT32, &value, DBUS_TYPE_INVALID)) {
+				bench_fail("subd_call_async", &err);
+			}
+			++sent;
+			++pending;
+		}
+		dbus_connection_read_write_dispatch(client, -1);
+	}
+	uint64_t elapsed = bench_now() - start;
+
+	bench_json_result_begin();
+	bench_json_string("name", "async");
+	bench_json_string("method", "Echo");
+	bench_json_int("calls", count);
+	bench_json_int("window", window);
+	bench_json_int("elapsed", elapsed);
+	bench_json_double("calls_per_sec", count * 1e9 / elapsed);
+	bench_json_result_end();
+}
+
+int main(void) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	long count = bench_param("BENCH_ITERATIONS", 20000);
+	bool stats = bench_param("BENCH_STATS", 0) != 0;
+	long trace = bench_param("BENCH_TRACE", 0);
+
+	bench_start_bus();
+	DBusConnection *service = bench_service_open();
+	if (!subd_add_object_vtable(service, BENCH_PATH, BENCH_INTERFACE, members,
+			NULL, &err)) {
+		bench_fail("subd_add_object_vtable", &err);
+	}
+	if (stats && !subd_enable_stats(service, &err)) {
+		bench_fail("subd_enable_stats", &err);
+	}
+	if (trace > 0 && !subd_trace_start(trace, &err)) {
+		bench_fail("subd_trace_start", &err);
+	}
+	struct bench_loop *loop = bench_loop_start(service, BENCH_LOOP_POLL,
+		NULL, 0);
+	DBusConnection *client = bench_client_open();
+
+	bench_json_begin("roundtrip");
+	run_sync(client, "Ping", count);
+	run_sync(client, "Echo", count);
+	run_async(client, count, 1);
+	run_async(client, count, 64);
+	bench_json_end();
+
+	bench_close(client);
+	bench_loop_stop(loop);
+	bench_close(service);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+
+/*
+ * Measures the aggregate method throughput of a service spread over 1, 2, 4
+ * and 8 shards. Every shard has a client thread of its own, which keeps a
+ * window of asynchronous calls in flight to the name of its shard. Setting
+ * BENCH_WORK spins that many nanoseconds in every handler, to simulate
+ * handlers that are bound by the CPU rather than by the bus.
+ */
+
+#define SHARDS_SERVICE "org.subd.BenchShards"
+#define WINDOW 64
+
+static uint64_t work;
+
+static dbus_bool_t handle_echo(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	DBusMessageIter iter;
+	dbus_int32_t value;
+	dbus_message_iter_init(msg, &iter);
+	if (!subd_message_read(&iter, err, &value, NULL)) {
+		return FALSE;
+	}
+	uint64_t start = bench_now();
+	while (bench_now() - start < work);
+	return subd_reply_method_return(conn, msg, err,
+		DBUS_TYPE_INT32, &value, DBUS_TYPE_INVALID);
+}
+
+static const struct subd_member members[] = {
+	{ .type = SUBD_METHOD, .m = { "Echo", handle_echo, "i", "i", 0, NULL } },
+	{ .type = SUBD_MEMBERS_END },
+};
+
+struct client {
+	pthread_t thread;
+	const char *name;
+	long count;
+};
+
+static void handle_reply(DBusMessage *reply, void *data) {
+	long *pending = data;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		bench_fail("async Echo", NULL);
+	}
+	--*pending;
+}
+
+static void *run_client(void *data) {
+	struct client *client = data;
+	DBusError err;
+	dbus_error_init(&err);
+
+	DBusConnection *conn = bench_client_open();
+	long pending = 0;
+	for (long sent = 0; sent < client->count || pending > 0; ) {
+		while (sent < client->count && pending < WINDOW) {
+			dbus_int32_t value = sent;
+			if (!subd_call_async(conn, client->name, BENCH_PATH,
+					BENCH_INTERFACE, "Echo", DBUS_TIMEOUT_USE_DEFAULT,
+					handle_reply, &pending, &err,
+					DBUS_TYPE_INT32, &value, DBUS_TYPE_INVALID)) {
+				bench_fail("subd_call_async", &err);
+			}
+			++sent;
+			++pending;
+		}
+		dbus_connection_read_write_dispatch(conn, -1);
+	}
+	bench_close(conn);
+	return NULL;
+}
+
+static void run(int count, long calls) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	char service[64];
+	snprintf(service, sizeof(service), SHARDS_SERVICE "%d", count);
+	struct subd_shards *shards = subd_shards_open(service, count, &err);
+	if (shards == NULL ||
+			!subd_shards_add_object_vtable(shards, BENCH_PATH,
+				BENCH_INTERFACE, members, NULL, &err) ||
+			!subd_shards_enable_stats(shards, &err) ||
+			!subd_shards_start(shards, &err)) {
+		bench_fail("setting up the shards", &err);
+	}
+
+	struct client clients[count];
+	uint64_t start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		clients[i] = (struct client){
+			.name = subd_shards_get_name(shards, i),
+			.count = calls / count,
+		};
+		if (pthread_create(&clients[i].thread, NULL, run_client,
+				&clients[i]) != 0) {
+			bench_fail("starting a client", NULL);
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		pthread_join(clients[i].thread, NULL);
+	}
+	uint64_t elapsed = bench_now() - start;
+
+	// Every shard counts its own calls.
+	long min = -1, max = 0;
+	for (int i = 0; i < count; ++i) {
+		int length;
+		struct subd_method_stats *stats = subd_stats_snapshot(
+			subd_shards_get_connection(shards, i), &length, &err);
+		if (stats == NULL && dbus_error_is_set(&err)) {
+			bench_fail("subd_stats_snapshot", &err);
+		}
+		long shard_calls = length > 0 ? (long)stats[0].calls : 0;
+		min = min == -1 || shard_calls < min ? shard_calls : min;
+		max = shard_calls > max ? shard_calls : max;
+		subd_stats_free(stats, length);
+	}
+	subd_shards_free(shards);
+
+	bench_json_result_begin();
+	bench_json_int("shards", count);
+	bench_json_int("calls", calls / count * count);
+	bench_json_int("elapsed", elapsed);
+	bench_json_double("calls_per_sec", calls / count * count * 1e9 / elapsed);
+	bench_json_int("min_shard_calls", min);
+	bench_json_int("max_shard_calls", max);
+	bench_json_result_end();
+}
+
+int main(void) {
+	long calls = bench_param("BENCH_ITERATIONS", 40000);
+	work = bench_param("BENCH_WORK", 0);
+
+	bench_start_bus();
+
+	bench_json_begin("shards");
+	for (int count = 1; count <= 8; count *= 2) {
+		run(count, calls);
+	}
+	bench_json_end();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+
+/*
+ * Measures signal throughput from the service to a client that subscribed to
+ * them, for each way of emitting a signal. The emission time only includes
+ * marshalling and queueing the signals, the delivery time lasts until the
+ * client received the last one. The signals are also emitted from several
+ * threads at once while the service runs its event loop, either sending them
+ * directly, or through the send queue of the loop.
+ */
+
+struct sample {
+	dbus_int32_t id;
+	double value;
+};
+
+static atomic_long received;
+static atomic_bool stop;
+
+static DBusHandlerResult count_signal(DBusConnection *conn, DBusMessage *msg,
+		void *data) {
+	if (dbus_message_is_signal(msg, BENCH_INTERFACE, "Sample")) {
+		atomic_fetch_add(&received, 1);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void *receive(void *data) {
+	DBusConnection *client = data;
+	while (!atomic_load(&stop)) {
+		dbus_connection_read_write_dispatch(client, 10);
+	}
+	return NULL;
+}
+
+static void wait_received(long count) {
+	const struct timespec ms = { 0, 1000000 };
+	while (atomic_load(&received) < count) {
+		nanosleep(&ms, NULL);
+	}
+}
+
+static void run(DBusConnection *service, const char *name, long count) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	struct subd_signal_template *tmpl = subd_signal_template_new(BENCH_PATH,
+		BENCH_INTERFACE, "Sample", &err);
+	struct subd_plan *plan = subd_plan_new("id", &err);
+	if (tmpl == NULL || plan == NULL) {
+		bench_fail("creating the signal", &err);
+	}
+
+	atomic_store(&received, 0);
+	uint64_t start = bench_now();
+	for (long i = 0; i < count; ++i) {
+		struct sample sample = { i, i * 0.5 };
+		dbus_bool_t ret;
+		if (strcmp(name, "plain") == 0) {
+			ret = subd_emit_signal(service, BENCH_PATH, BENCH_INTERFACE,
+				"Sample", &err, DBUS_TYPE_INT32, &sample.id,
+				DBUS_TYPE_DOUBLE, &sample.value, DBUS_TYPE_INVALID);
+		} else if (strcmp(name, "template") == 0) {
+			ret = subd_emit_signal_template(service, tmpl, &err,
+				DBUS_TYPE_INT32, &sample.id, DBUS_TYPE_DOUBLE, &sample.value,
+				DBUS_TYPE_INVALID);
+		} else {
+			ret = subd_emit_signal_encoded(service, tmpl, plan, &sample, &err);
+		}
+		if (!ret) {
+			bench_fail(name, &err);
+		}
+	}
+	uint64_t emitted = bench_now() - start;
+	dbus_connection_flush(service);
+	wait_received(count);
+	uint64_t delivered = bench_now() - start;
+
+	subd_plan_free(plan);
+	subd_signal_template_free(tmpl);
+
+	bench_json_result_begin();
+	bench_json_string("name", name);
+	bench_json_int("signals", count);
+	bench_json_double("emit_per_signal", (double)emitted / count);
+	bench_json_int("delivery_elapsed", delivered);
+	bench_json_double("signals_per_sec", count * 1e9 / delivered);
+	bench_json_result_end();
+}
+
+struct producer {
+	pthread_t thread;
+	DBusConnection *service;
+	struct subd_queue *queue;
+	long count;
+};
+
+static void *produce(void *data) {
+	struct producer *producer = data;
+	DBusError err;
+	dbus_error_init(&err);
+
+	for (long i = 0; i < producer->count; ++i) {
+		DBusMessage *signal = dbus_message_new_signal(BENCH_PATH,
+			BENCH_INTERFACE, "Sample");
+		dbus_int32_t id = i;
+		if (signal == NULL || !dbus_message_append_args(signal,
+				DBUS_TYPE_INT32, &id, DBUS_TYPE_INVALID)) {
+			bench_fail("creating the signal", NULL);
+		}
+		dbus_bool_t ret = producer->queue != NULL ?
+			subd_send_queued(producer->queue, signal, &err) :
+			dbus_connection_send(producer->service, signal, NULL);
+		if (!ret) {
+			bench_fail("sending the signal", &err);
+		}
+		dbus_message_unref(signal);
+	}
+	return NULL;
+}
+
+static void run_threads(DBusConnection *service, bool queued, int threads,
+		long count) {
+	struct producer producers[threads];
+	long per_thread = count / threads;
+	struct subd_queue *queue = queued ? subd_get_queue(service) : NULL;
+
+	atomic_store(&received, 0);
+	uint64_t start = bench_now();
+	for (int i = 0; i < threads; ++i) {
+		producers[i] = (struct producer){
+			.service = service,
+			.queue = queue,
+			.count = per_thread,
+		};
+		if (pthread_create(&producers[i].thread, NULL, produce,
+				&producers[i]) != 0) {
+			bench_fail("starting a producer", NULL);
+		}
+	}
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(producers[i].thread, NULL);
+	}
+	uint64_t emitted = bench_now() - start;
+	wait_received(per_thread * threads);
+	uint64_t delivered = bench_now() - start;
+
+	bench_json_result_begin();
+	bench_json_string("name", queued ? "queued" : "direct");
+	bench_json_int("threads", threads);
+	bench_json_int("signals", per_thread * threads);
+	bench_json_double("emit_per_signal",
+		(double)emitted / (per_thread * threads));
+	bench_json_int("delivery_elapsed", delivered);
+	bench_json_double("signals_per_sec",
+		per_thread * threads * 1e9 / delivered);
+	bench_json_result_end();
+}
+
+int main(void) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	long count = bench_param("BENCH_ITERATIONS", 100000);
+
+	bench_start_bus();
+	DBusConnection *service = bench_service_open();
+	DBusConnection *client = bench_client_open();
+
+	dbus_bus_add_match(client, "type='signal',interface='" BENCH_INTERFACE
+		"'", &err);
+	if (dbus_error_is_set(&err) ||
+			!dbus_connection_add_filter(client, count_signal, NULL, NULL)) {
+		bench_fail("subscribing", &err);
+	}
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, receive, client) != 0) {
+		bench_fail("starting the receiver", NULL);
+	}
+
+	bench_json_begin("signals");
+	run(service, "plain", count);
+	run(service, "template", count);
+	run(service, "encoded", count);
+
+	// The send queue belongs to the event loop, so the threaded runs need one.
+	struct bench_loop *loop = bench_loop_start(service, BENCH_LOOP_POLL,
+		NULL, 0);
+	for (int threads = 1; threads <= 8; threads *= 2) {
+		run_threads(service, false, threads, count);
+		run_threads(service, true, threads, count);
+	}
+	bench_loop_stop(loop);
+	bench_json_end();
+
+	atomic_store(&stop, true);
+	pthread_join(thread, NULL);
+	bench_close(client);
+	bench_close(service);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+
+/*
+ * Measures the CPU time a subscriber spends per relevant signal while the
+ * service also emits signals the subscriber is not interested in. The
+ * subscriber either adds one match rule for the whole interface and checks
+ * every signal against its members in a filter, or subscribes to each member
+ * with subd_subscribe. The number of signals that reach the subscriber is
+ * reported as well.
+ */
+
+#define MAX_MEMBERS 256
+#define NOISE 3
+
+static char members[MAX_MEMBERS][32];
+static int member_count;
+static atomic_long relevant;
+static atomic_long delivered;
+
+struct subscriber {
+	pthread_t thread;
+	DBusConnection *conn;
+	long target;
+	uint64_t cpu;
+};
+
+static uint64_t thread_cpu_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static DBusHandlerResult count_delivered(DBusConnection *conn,
+		DBusMessage *msg, void *data) {
+	if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL) {
+		atomic_fetch_add(&delivered, 1);
+	}
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusHandlerResult filter_chain(DBusConnection *conn, DBusMessage *msg,
+		void *data) {
+	for (int i = 0; i < member_count; ++i) {
+		if (dbus_message_is_signal(msg, BENCH_INTERFACE, members[i])) {
+			atomic_fetch_add(&relevant, 1);
+			return DBUS_HANDLER_RESULT_HANDLED;
+		}
+	}
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void handle_signal(DBusConnection *conn, DBusMessage *msg, void *data) {
+	atomic_fetch_add(&relevant, 1);
+}
+
+static void *receive(void *data) {
+	struct subscriber *subscriber = data;
+	uint64_t start = thread_cpu_time();
+	while (atomic_load(&relevant) < subscriber->target) {
+		dbus_connection_read_write_dispatch(subscriber->conn, 10);
+	}
+	subscriber->cpu = thread_cpu_time() - start;
+	return NULL;
+}
+
+static void run(DBusConnection *service, const char *name, int count,
+		long signals) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	member_count = count;
+	DBusConnection *conn = bench_client_open();
+	if (!dbus_connection_add_filter(conn, count_delivered, NULL, NULL)) {
+		bench_fail("dbus_connection_add_filter", NULL);
+	}
+
+	struct subd_subscription *subscriptions[MAX_MEMBERS];
+	if (strcmp(name, "filter") == 0) {
+		dbus_bus_add_match(conn,
+			"type='signal',interface='" BENCH_INTERFACE "'", &err);
+		if (dbus_error_is_set(&err) ||
+				!dbus_connection_add_filter(conn, filter_chain, NULL, NULL)) {
+			bench_fail("adding the filter", &err);
+		}
+	} else {
+		for (int i = 0; i < count; ++i) {
+			subscriptions[i] = subd_subscribe(conn, BENCH_INTERFACE,
+				members[i], NULL, FALSE, handle_signal, NULL, &err);
+			if (subscriptions[i] == NULL) {
+				bench_fail("subd_subscribe", &err);
+			}
+		}
+		// The rules are added asynchronously, a round trip to the bus makes
+		// sure they are in place.
+		dbus_bus_name_has_owner(conn, BENCH_SERVICE, &err);
+		if (dbus_error_is_set(&err)) {
+			bench_fail("dbus_bus_name_has_owner", &err);
+		}
+	}
+
+	atomic_store(&relevant, 0);
+	atomic_store(&delivered, 0);
+	struct subscriber subscriber = { .conn = conn, .target = signals };
+	if (pthread_create(&subscriber.thread, NULL, receive, &subscriber) != 0) {
+		bench_fail("starting the subscriber", NULL);
+	}
+
+	uint64_t start = bench_now();
+	for (long i = 0; i < signals; ++i) {
+		// The last signal is a relevant one, so every signal emitted before
+		// has arrived when the subscriber stops.
+		for (int j = 0; j < NOISE; ++j) {
+			if (!subd_emit_signal(service, BENCH_PATH, BENCH_INTERFACE,
+					"Noise", &err, DBUS_TYPE_INVALID)) {
+				bench_fail("subd_emit_signal", &err);
+			}
+		}
+		if (!subd_emit_signal(service, BENCH_PATH, BENCH_INTERFACE,
+				members[i % count], &err, DBUS_TYPE_INVALID)) {
+			bench_fail("subd_emit_signal", &err);
+		}
+	}
+	dbus_connection_flush(service);
+	pthread_join(subscriber.thread, NULL);
+	uint64_t elapsed = bench_now() - start;
+
+	if (strcmp(name, "subscribe") == 0) {
+		for (int i = 0; i < count; ++i) {
+			subd_unsubscribe(conn, subscriptions[i]);
+		}
+	}
+	bench_close(conn);
+
+	bench_json_result_begin();
+	bench_json_string("name", name);
+	bench_json_int("members", count);
+	bench_json_int("relevant", signals);
+	bench_json_int("delivered", atomic_load(&delivered));
+	bench_json_double("cpu_per_relevant", (double)subscriber.cpu / signals);
+	bench_json_int("elapsed", elapsed);
+	bench_json_result_end();
+}
+
+int main(void) {
+	long signals = bench_param("BENCH_ITERATIONS", 20000);
+
+	for (int i = 0; i < MAX_MEMBERS; ++i) {
+		snprintf(members[i], sizeof(members[i]), "Member%d", i);
+	}
+
+	bench_start_bus();
+	DBusConnection *service = bench_service_open();
+
+	bench_json_begin("subscribe");
+	for (int count = 1; count <= MAX_MEMBERS; count *= 16) {
+		run(service, "filter", count, signals);
+		run(service, "subscribe", count, signals);
+	}
+	bench_json_end();
+
+	bench_close(service);
+	return EXIT_SUCCESS;
+}
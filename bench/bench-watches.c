@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+/*
+ * Measures the overhead of idle non-DBus file descriptors on the event loop:
+ * the round-trip latency of a call, and for the poll based loop the time
+ * spent in subd_process_watches per iteration. Where epoll is available, the
+ * same configurations are run with subd_run_once for comparison.
+ */
+
+static const int idle_counts[] = { 0, 16, 256, 1024, 4096 };
+
+static dbus_bool_t handle_ping(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	return subd_reply_method_return(conn, msg, err, DBUS_TYPE_INVALID);
+}
+
+static const struct subd_member members[] = {
+	{ .type = SUBD_METHOD, .m = { "Ping", handle_ping, "", "", 0, NULL } },
+	{ .type = SUBD_MEMBERS_END },
+};
+
+/**
+ * Helper function that raises the file descriptor limit as far as allowed,
+ * and returns it.
+ */
+static rlim_t raise_fd_limit(void) {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+		return 0;
+	}
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	return limit.rlim_cur;
+}
+
+static void run(enum bench_loop_type type, int idle, long count) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	// Only the read ends are watched, the write ends keep them idle.
+	int *fds = malloc(2 * (idle + 1) * sizeof(int));
+	if (fds == NULL) {
+		bench_fail("allocating pipes", NULL);
+	}
+	for (int i = 0; i < idle; ++i) {
+		if (pipe(&fds[2 * i]) == -1) {
+			bench_fail("creating pipes", NULL);
+		}
+	}
+	int *read_ends = malloc((idle + 1) * sizeof(int));
+	if (read_ends == NULL) {
+		bench_fail("allocating pipes", NULL);
+	}
+	for (int i = 0; i < idle; ++i) {
+		read_ends[i] = fds[2 * i];
+	}
+
+	DBusConnection *service = bench_service_open();
+	if (!subd_add_object_vtable(service, BENCH_PATH, BENCH_INTERFACE, members,
+			NULL, &err)) {
+		bench_fail("subd_add_object_vtable", &err);
+	}
+	struct bench_loop *loop = bench_loop_start(service, type, read_ends, idle);
+	DBusConnection *client = bench_client_open();
+
+	uint64_t *samples = malloc(count * sizeof(uint64_t));
+	if (samples == NULL) {
+		bench_fail("allocating samples", NULL);
+	}
+	for (long i = 0; i < count / 10; ++i) {
+		bench_call(client, BENCH_PATH, BENCH_INTERFACE, "Ping");
+	}
+	for (long i = 0; i < count; ++i) {
+		samples[i] = bench_call(client, BENCH_PATH, BENCH_INTERFACE, "Ping");
+	}
+	double busy = bench_loop_stop(loop);
+
+	struct bench_summary summary;
+	bench_summarize(samples, count, &summary);
+
+	bench_json_result_begin();
+	bench_json_string("loop", type == BENCH_LOOP_POLL ? "poll" : "epoll");
+	bench_json_int("idle_fds", idle);
+	if (type == BENCH_LOOP_POLL) {
+		bench_json_double("process_watches", busy);
+	}
+	bench_json_summary(&summary);
+	bench_json_result_end();
+
+	free(samples);
+	bench_close(client);
+	bench_close(service);
+	for (int i = 0; i < 2 * idle; ++i) {
+		close(fds[i]);
+	}
+	free(read_ends);
+	free(fds);
+}
+
+int main(void) {
+	long count = bench_param("BENCH_ITERATIONS", 5000);
+	rlim_t limit = raise_fd_limit();
+
+	bench_start_bus();
+	bench_json_begin("watches");
+	for (size_t i = 0; i < sizeof(idle_counts) / sizeof(idle_counts[0]); ++i) {
+		int idle = idle_counts[i];
+		// Leave room for the connections, and whatever else is open.
+		if ((rlim_t)2 * idle + 64 > limit) {
+			continue;
+		}
+		run(BENCH_LOOP_POLL, idle, count);
+#ifdef HAVE_EPOLL
+		run(BENCH_LOOP_EPOLL, idle, count);
+#endif
+	}
+	bench_json_end();
+
+	return EXIT_SUCCESS;
+}
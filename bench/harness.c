@@ -0,0 +1,425 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+#ifndef DBUS_DAEMON
+#define DBUS_DAEMON "dbus-daemon"
+#endif
+
+#define LOOP_TIMEOUT 10
+
+static pid_t daemon_pid = -1;
+static char bus_dir[] = "/tmp/subd-bench-XXXXXX";
+
+static void stop_bus(void) {
+	if (daemon_pid > 0) {
+		kill(daemon_pid, SIGTERM);
+		waitpid(daemon_pid, NULL, 0);
+		daemon_pid = -1;
+	}
+	rmdir(bus_dir);
+}
+
+void bench_start_bus(void) {
+	const char *daemon = getenv("DBUS_DAEMON");
+	if (daemon == NULL) {
+		daemon = DBUS_DAEMON;
+	}
+
+	int fds[2];
+	if (mkdtemp(bus_dir) == NULL || pipe(fds) == -1) {
+		perror("bench");
+		exit(EXIT_FAILURE);
+	}
+
+	char address[sizeof(bus_dir) + 32];
+	char print_address[32];
+	snprintf(address, sizeof(address), "--address=unix:tmpdir=%s", bus_dir);
+	snprintf(print_address, sizeof(print_address), "--print-address=%d",
+		fds[1]);
+
+	daemon_pid = fork();
+	if (daemon_pid == -1) {
+		perror("bench");
+		exit(EXIT_FAILURE);
+	}
+	if (daemon_pid == 0) {
+		close(fds[0]);
+#ifdef __linux__
+		// Don't leave the daemon behind if the benchmark crashes.
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+		execlp(daemon, daemon, "--session", "--nofork", "--nopidfile",
+			address, print_address, (char *)NULL);
+		_exit(127);
+	}
+	atexit(stop_bus);
+	close(fds[1]);
+
+	// The daemon prints its address once it is listening.
+	char line[1024] = {0};
+	FILE *f = fdopen(fds[0], "r");
+	if (f == NULL || fgets(line, sizeof(line), f) == NULL) {
+		fprintf(stderr, "bench: could not start %s\n", daemon);
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+	line[strcspn(line, "\n")] = '\0';
+	setenv("DBUS_SESSION_BUS_ADDRESS", line, 1);
+}
+
+void bench_fail(const char *what, DBusError *err) {
+	fprintf(stderr, "bench: %s: %s\n", what,
+		err != NULL && dbus_error_is_set(err) ? err->message : "failed");
+	exit(EXIT_FAILURE);
+}
+
+long bench_param(const char *name, long fallback) {
+	const char *value = getenv(name);
+	if (value == NULL) {
+		return fallback;
+	}
+	long n = strtol(value, NULL, 10);
+	return n > 0 ? n : fallback;
+}
+
+uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+DBusConnection *bench_service_open(void) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	if (!dbus_threads_init_default()) {
+		bench_fail("dbus_threads_init_default", NULL);
+	}
+
+	DBusConnection *conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+	if (conn == NULL) {
+		bench_fail("connecting to the bus", &err);
+	}
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+	// The connection of the previous configuration might not be gone yet,
+	// so the name is taken over from it.
+	int ret = dbus_bus_request_name(conn, BENCH_SERVICE,
+		DBUS_NAME_FLAG_ALLOW_REPLACEMENT | DBUS_NAME_FLAG_REPLACE_EXISTING |
+		DBUS_NAME_FLAG_DO_NOT_QUEUE, &err);
+	if (ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		bench_fail("requesting " BENCH_SERVICE, &err);
+	}
+
+	return conn;
+}
+
+DBusConnection *bench_client_open(void) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	DBusConnection *conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+	if (conn == NULL) {
+		bench_fail("connecting to the bus", &err);
+	}
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+	return conn;
+}
+
+void bench_close(DBusConnection *conn) {
+	dbus_connection_close(conn);
+	dbus_connection_unref(conn);
+}
+
+struct bench_loop {
+	DBusConnection *conn;
+	enum bench_loop_type type;
+	pthread_t thread;
+	atomic_bool stop;
+	struct subd_watches *watches;
+#ifdef HAVE_EPOLL
+	struct subd_epoll *ep;
+#endif
+	uint64_t busy;
+	uint64_t iterations;
+};
+
+static void handle_idle_fd(int fd, unsigned int flags, void *data) {
+}
+
+static void *run_loop(void *data) {
+	struct bench_loop *loop = data;
+
+	while (!atomic_load(&loop->stop)) {
+#ifdef HAVE_EPOLL
+		if (loop->type == BENCH_LOOP_EPOLL) {
+			subd_run_once(loop->conn, loop->ep, LOOP_TIMEOUT);
+			continue;
+		}
+#endif
+		struct subd_watches *watches = loop->watches;
+		if (poll(watches->fds, watches->length, LOOP_TIMEOUT) > 0) {
+			uint64_t start = bench_now();
+			subd_process_watches(loop->conn, watches);
+			loop->busy += bench_now() - start;
+			++loop->iterations;
+		}
+	}
+
+	return NULL;
+}
+
+struct bench_loop *bench_loop_start(DBusConnection *conn,
+		enum bench_loop_type type, const int *fds, int count) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	struct bench_loop *loop = calloc(1, sizeof(struct bench_loop));
+	if (loop == NULL) {
+		bench_fail("allocating the loop", NULL);
+	}
+	loop->conn = conn;
+	loop->type = type;
+	atomic_init(&loop->stop, false);
+
+	if (type == BENCH_LOOP_POLL) {
+		loop->watches = subd_init_watches(conn, NULL, 0, &err);
+		if (loop->watches == NULL) {
+			bench_fail("subd_init_watches", &err);
+		}
+		for (int i = 0; i < count; ++i) {
+			if (subd_watches_add_fd(loop->watches, fds[i], DBUS_WATCH_READABLE,
+					handle_idle_fd, NULL, &err) == -1) {
+				bench_fail("subd_watches_add_fd", &err);
+			}
+		}
+	} else {
+#ifdef HAVE_EPOLL
+		if ((loop->ep = subd_init_epoll(conn, &err)) == NULL) {
+			bench_fail("subd_init_epoll", &err);
+		}
+		for (int i = 0; i < count; ++i) {
+			if (!subd_epoll_add_fd(loop->ep, fds[i], DBUS_WATCH_READABLE,
+					handle_idle_fd, NULL, &err)) {
+				bench_fail("subd_epoll_add_fd", &err);
+			}
+		}
+#else
+		bench_fail("epoll is not available", NULL);
+#endif
+	}
+
+	if (pthread_create(&loop->thread, NULL, run_loop, loop) != 0) {
+		bench_fail("starting the loop", NULL);
+	}
+
+	return loop;
+}
+
+double bench_loop_stop(struct bench_loop *loop) {
+	atomic_store(&loop->stop, true);
+	pthread_join(loop->thread, NULL);
+
+	double busy = loop->iterations > 0 ?
+		(double)loop->busy / loop->iterations : 0;
+
+	if (loop->type == BENCH_LOOP_POLL) {
+		subd_free_watches(loop->conn, loop->watches);
+	}
+#ifdef HAVE_EPOLL
+	else {
+		subd_free_epoll(loop->conn, loop->ep);
+	}
+#endif
+
+	free(loop);
+	return busy;
+}
+
+struct subd_watches *bench_loop_watches(struct bench_loop *loop) {
+	return loop->watches;
+}
+
+uint64_t bench_bus_cpu_time(void) {
+#ifdef __linux__
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)daemon_pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	// The command name is in parentheses, and utime and stime are the 12th
+	// and 13th fields after it.
+	unsigned long utime = 0, stime = 0;
+	int matched = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u "
+		"%*u %*u %*u %lu %lu", &utime, &stime);
+	fclose(f);
+	if (matched != 2) {
+		return 0;
+	}
+	return (utime + stime) * (1000000000u / sysconf(_SC_CLK_TCK));
+#else
+	return 0;
+#endif
+}
+
+uint64_t bench_send(DBusConnection *conn, DBusMessage *call) {
+	DBusError err;
+	dbus_error_init(&err);
+
+	uint64_t start = bench_now();
+	DBusMessage *reply = dbus_connection_send_with_reply_and_block(conn, call,
+		DBUS_TIMEOUT_USE_DEFAULT, &err);
+	uint64_t elapsed = bench_now() - start;
+	if (reply == NULL) {
+		bench_fail(dbus_message_get_member(call), &err);
+	}
+
+	dbus_message_unref(reply);
+	dbus_message_unref(call);
+	return elapsed;
+}
+
+uint64_t bench_call(DBusConnection *conn, const char *path,
+		const char *interface, const char *method) {
+	DBusMessage *call = dbus_message_new_method_call(BENCH_SERVICE, path,
+		interface, method);
+	if (call == NULL) {
+		bench_fail("creating a call", NULL);
+	}
+	return bench_send(conn, call);
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Helper function that returns the "q" quantile of the sorted samples, using
+ * the nearest-rank method.
+ */
+static uint64_t quantile(const uint64_t *samples, size_t count, double q) {
+	size_t rank = (size_t)(q * count + 0.999999);
+	if (rank < 1) {
+		rank = 1;
+	}
+	if (rank > count) {
+		rank = count;
+	}
+	return samples[rank - 1];
+}
+
+void bench_summarize(uint64_t *samples, size_t count,
+		struct bench_summary *summary) {
+	memset(summary, 0, sizeof(struct bench_summary));
+	if (count == 0) {
+		return;
+	}
+
+	qsort(samples, count, sizeof(uint64_t), compare_samples);
+
+	double sum = 0;
+	for (size_t i = 0; i < count; ++i) {
+		sum += samples[i];
+	}
+
+	summary->count = count;
+	summary->mean = sum / count;
+	summary->min = samples[0];
+	summary->p50 = quantile(samples, count, 0.50);
+	summary->p90 = quantile(samples, count, 0.90);
+	summary->p99 = quantile(samples, count, 0.99);
+	summary->p999 = quantile(samples, count, 0.999);
+	summary->max = samples[count - 1];
+}
+
+static bool first_result;
+static bool first_field;
+
+static void print_string(const char *s) {
+	putchar('"');
+	for (; *s != '\0'; ++s) {
+		if (*s == '"' || *s == '\\') {
+			putchar('\\');
+		}
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+static void print_key(const char *key) {
+	if (!first_field) {
+		fputs(", ", stdout);
+	}
+	first_field = false;
+	print_string(key);
+	fputs(": ", stdout);
+}
+
+void bench_json_begin(const char *benchmark) {
+	fputs("{\"benchmark\": ", stdout);
+	print_string(benchmark);
+	fputs(", \"results\": [", stdout);
+	first_result = true;
+}
+
+void bench_json_result_begin(void) {
+	fputs(first_result ? "\n  {" : ",\n  {", stdout);
+	first_result = false;
+	first_field = true;
+}
+
+void bench_json_string(const char *key, const char *value) {
+	print_key(key);
+	print_string(value);
+}
+
+void bench_json_int(const char *key, long long value) {
+	print_key(key);
+	printf("%lld", value);
+}
+
+void bench_json_double(const char *key, double value) {
+	print_key(key);
+	printf("%.1f", value);
+}
+
+void bench_json_summary(const struct bench_summary *summary) {
+	bench_json_int("samples", summary->count);
+	bench_json_double("mean", summary->mean);
+	bench_json_int("min", summary->min);
+	bench_json_int("p50", summary->p50);
+	bench_json_int("p90", summary->p90);
+	bench_json_int("p99", summary->p99);
+	bench_json_int("p999", summary->p999);
+	bench_json_int("max", summary->max);
+}
+
+void bench_json_result_end(void) {
+	putchar('}');
+	fflush(stdout);
+}
+
+void bench_json_end(void) {
+	fputs("\n]}\n", stdout);
+	fflush(stdout);
+}
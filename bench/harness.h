@@ -0,0 +1,141 @@
+#ifndef _BENCH_HARNESS_H
+#define _BENCH_HARNESS_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "subd.h"
+
+#define BENCH_SERVICE "org.subd.Bench"
+#define BENCH_INTERFACE "org.subd.Bench"
+#define BENCH_PATH "/org/subd/Bench"
+
+/**
+ * Starts a private dbus-daemon in a temporary directory, and points
+ * DBUS_SESSION_BUS_ADDRESS at it. The daemon is killed when the benchmark
+ * exits. Exits the benchmark on failure.
+ */
+void bench_start_bus(void);
+
+/**
+ * Exits the benchmark with an error message.
+ */
+void bench_fail(const char *what, DBusError *err);
+
+/**
+ * Returns the value of the environment variable "name" as a positive number,
+ * or "fallback" if it is not set. Lets iteration counts be tuned without
+ * rebuilding.
+ */
+long bench_param(const char *name, long fallback);
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t bench_now(void);
+
+/**
+ * Opens a private connection to the bus that owns BENCH_SERVICE, so every
+ * configuration can start with a fresh set of registrations.
+ */
+DBusConnection *bench_service_open(void);
+
+/**
+ * Closes a connection opened by bench_service_open or bench_client_open.
+ */
+void bench_close(DBusConnection *conn);
+
+/**
+ * Opens a private client connection to the bus.
+ */
+DBusConnection *bench_client_open(void);
+
+enum bench_loop_type {
+	BENCH_LOOP_POLL,
+	BENCH_LOOP_EPOLL,
+};
+
+/**
+ * An event loop running the service connection on its own thread.
+ */
+struct bench_loop;
+
+/**
+ * Starts an event loop of the given type for "conn", which also watches the
+ * "count" idle file descriptors in "fds". "conn" can be NULL for a loop that
+ * only watches file descriptors. Exits the benchmark on failure.
+ */
+struct bench_loop *bench_loop_start(DBusConnection *conn,
+	enum bench_loop_type type, const int *fds, int count);
+
+/**
+ * Stops the loop. For poll loops, returns the average time in nanoseconds
+ * spent in subd_process_watches per iteration, for epoll loops returns 0.
+ */
+double bench_loop_stop(struct bench_loop *loop);
+
+/**
+ * Returns the watches of a poll loop, so more file descriptors can be added
+ * to it.
+ */
+struct subd_watches *bench_loop_watches(struct bench_loop *loop);
+
+/**
+ * Returns the CPU time (user and system) the bus daemon used so far in
+ * nanoseconds, or 0 if that is not known.
+ */
+uint64_t bench_bus_cpu_time(void);
+
+/**
+ * Sends "call" to BENCH_SERVICE, waits for the reply, and returns the
+ * round-trip time in nanoseconds. The call is unreferenced.
+ */
+uint64_t bench_send(DBusConnection *conn, DBusMessage *call);
+
+/**
+ * Calls "method" of "interface" on "path" with no arguments, and returns the
+ * round-trip time in nanoseconds.
+ */
+uint64_t bench_call(DBusConnection *conn, const char *path,
+	const char *interface, const char *method);
+
+/**
+ * Summary of a set of latency samples.
+ */
+struct bench_summary {
+	size_t count;
+	double mean;
+	uint64_t min;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+/**
+ * Sorts "samples" in place, and summarizes them.
+ */
+void bench_summarize(uint64_t *samples, size_t count,
+	struct bench_summary *summary);
+
+/*
+ * Results are written to stdout as a single JSON object:
+ *
+ *   {"benchmark": "<name>", "results": [{...}, ...]}
+ *
+ * Every result is an object of numbers and strings. Times are nanoseconds
+ * unless the key says otherwise.
+ */
+void bench_json_begin(const char *benchmark);
+void bench_json_result_begin(void);
+void bench_json_string(const char *key, const char *value);
+void bench_json_int(const char *key, long long value);
+void bench_json_double(const char *key, double value);
+void bench_json_summary(const struct bench_summary *summary);
+void bench_json_result_end(void);
+void bench_json_end(void);
+
+#endif
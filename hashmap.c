@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hashmap.h"
+
+uint32_t hashmap_hash(const char *key, size_t length) {
+	// 32 bit FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+struct hashmap_t *hashmap_create(size_t capacity) {
+	// Capacity is always a power of two, so bucket index can be computed
+	// by masking the hash.
+	size_t c = 8;
+	while (c < capacity) {
+		c <<= 1;
+	}
+
+	struct hashmap_t *map = malloc(sizeof(struct hashmap_t));
+	if (map == NULL) {
+		return NULL;
+	}
+
+	map->buckets = calloc(c, sizeof(struct hashmap_entry *));
+	if (map->buckets == NULL) {
+		free(map);
+		return NULL;
+	}
+	map->capacity = c;
+	map->size = 0;
+
+	return map;
+}
+
+void hashmap_destroy(struct hashmap_t *map, void (*free_data)(void *)) {
+	for (size_t i = 0; i < map->capacity; ++i) {
+		struct hashmap_entry *e = map->buckets[i];
+		while (e != NULL) {
+			struct hashmap_entry *save_next = e->next;
+			if (free_data != NULL) {
+				free_data(e->data);
+			}
+			free(e->key);
+			free(e);
+			e = save_next;
+		}
+	}
+	free(map->buckets);
+	free(map);
+}
+
+static int grow(struct hashmap_t *map) {
+	size_t c = map->capacity * 2;
+	struct hashmap_entry **buckets = calloc(c, sizeof(struct hashmap_entry *));
+	if (buckets == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < map->capacity; ++i) {
+		struct hashmap_entry *e = map->buckets[i];
+		while (e != NULL) {
+			struct hashmap_entry *save_next = e->next;
+			e->next = buckets[e->hash & (c - 1)];
+			buckets[e->hash & (c - 1)] = e;
+			e = save_next;
+		}
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->capacity = c;
+
+	return 0;
+}
+
+int hashmap_set(struct hashmap_t *map, const char *key, void *data) {
+	size_t length = strlen(key);
+	uint32_t hash = hashmap_hash(key, length);
+	for (struct hashmap_entry *e = map->buckets[hash & (map->capacity - 1)];
+			e != NULL; e = e->next) {
+		if (e->hash == hash && strcmp(e->key, key) == 0) {
+			e->data = data;
+			return 0;
+		}
+	}
+
+	// Keep the load factor under 3/4.
+	if ((map->size + 1) * 4 > map->capacity * 3 && grow(map) == -1) {
+		return -1;
+	}
+
+	struct hashmap_entry *entry = malloc(sizeof(struct hashmap_entry));
+	if (entry == NULL) {
+		return -1;
+	}
+	entry->key = malloc(length + 1);
+	if (entry->key == NULL) {
+		free(entry);
+		return -1;
+	}
+	memcpy(entry->key, key, length + 1);
+	entry->data = data;
+	entry->hash = hash;
+	entry->next = map->buckets[hash & (map->capacity - 1)];
+	map->buckets[hash & (map->capacity - 1)] = entry;
+	map->size++;
+
+	return 0;
+}
+
+void *hashmap_get_n(const struct hashmap_t *map, const char *key,
+		size_t length) {
+	uint32_t hash = hashmap_hash(key, length);
+	for (struct hashmap_entry *e = map->buckets[hash & (map->capacity - 1)];
+			e != NULL; e = e->next) {
+		if (e->hash == hash && strncmp(e->key, key, length) == 0 &&
+				e->key[length] == '\0') {
+			return e->data;
+		}
+	}
+
+	return NULL;
+}
+
+void *hashmap_get(const struct hashmap_t *map, const char *key) {
+	return hashmap_get_n(map, key, strlen(key));
+}
+
+void *hashmap_remove(struct hashmap_t *map, const char *key) {
+	uint32_t hash = hashmap_hash(key, strlen(key));
+	struct hashmap_entry **prev = &map->buckets[hash & (map->capacity - 1)];
+	for (struct hashmap_entry *e = *prev; e != NULL; e = e->next) {
+		if (e->hash == hash && strcmp(e->key, key) == 0) {
+			void *data = e->data;
+			*prev = e->next;
+			free(e->key);
+			free(e);
+			map->size--;
+			return data;
+		}
+		prev = &e->next;
+	}
+
+	return NULL;
+}
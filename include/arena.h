@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * A bump allocator. Allocations can not be freed one by one, everything is
+ * freed at once with arena_free, so objects that live and die together can be
+ * allocated without a malloc call each.
+ */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;
+	size_t used;	// bytes used in the first chunk
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *s);
+void arena_free(struct arena *arena);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <dbus/dbus.h>
+
+void coalescer_flush(DBusConnection *conn);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct hashmap_entry {
+	char *key;
+	void *data;
+	uint32_t hash;
+	struct hashmap_entry *next;
+};
+
+struct hashmap_t {
+	struct hashmap_entry **buckets;
+	size_t capacity;
+	size_t size;
+};
+
+uint32_t hashmap_hash(const char *key, size_t length);
+struct hashmap_t *hashmap_create(size_t capacity);
+void hashmap_destroy(struct hashmap_t *map, void (*free_data)(void *));
+int hashmap_set(struct hashmap_t *map, const char *key, void *data);
+void *hashmap_get(const struct hashmap_t *map, const char *key);
+void *hashmap_get_n(const struct hashmap_t *map, const char *key, size_t length);
+void *hashmap_remove(struct hashmap_t *map, const char *key);
+
+#endif
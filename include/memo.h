@@ -0,0 +1,61 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "subd.h"
+
+/**
+ * The size of the reply cache of a connection if it is not set with
+ * subd_set_reply_cache_size.
+ */
+#define MEMO_DEFAULT_SIZE (1024 * 1024)
+
+/**
+ * Memoized replies of the methods marked with SUBD_METHOD_CACHEABLE, keyed by
+ * the path, interface and member of the call and its arguments.
+ */
+struct memo;
+
+/**
+ * A call whose reply is being captured. It is set for the thread that runs
+ * the handler, and the reply helpers hand their reply to it.
+ */
+struct memo_capture {
+	char *key;
+	size_t length;
+	uint32_t hash;
+	dbus_uint32_t serial;
+	unsigned long generation;
+	DBusMessage *reply;
+	struct memo_capture *previous;
+};
+
+extern _Thread_local struct memo_capture *memo_capturing;
+
+struct memo *memo_create(size_t size);
+void memo_free(struct memo *memo);
+void memo_set_size(struct memo *memo, size_t size);
+DBusMessage *memo_lookup(struct memo *memo, DBusMessage *msg);
+bool memo_capture_begin(struct memo *memo, struct memo_capture *capture,
+	DBusMessage *msg);
+void memo_capture_end(struct memo *memo, struct memo_capture *capture,
+	bool ok, unsigned int ttl);
+void memo_capture_reply(DBusMessage *reply);
+void memo_invalidate(struct memo *memo, const char *path,
+	const char *interface, const char *member);
+void memo_get_stats(struct memo *memo, struct subd_cache_stats *stats);
+
+/**
+ * Hands "reply" to the call being captured on this thread, if there is one.
+ * When there is not, this costs a single thread-local load.
+ */
+static inline void memo_sent(DBusMessage *reply) {
+	if (memo_capturing != NULL) {
+		memo_capture_reply(reply);
+	}
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <dbus/dbus.h>
+#include <stdbool.h>
+
+bool copy_arguments(DBusMessageIter *from, DBusMessageIter *to);
+
+/**
+ * Tells whether arrays of "type" are handled as a whole, without going through
+ * the elements. File descriptors are duplicated one by one when they are read
+ * or appended, so libdbus does not allow that for them.
+ */
+static inline bool is_view_element(int type) {
+	return dbus_type_is_fixed(type) && type != DBUS_TYPE_UNIX_FD;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+
+struct subd_pool;
+
+bool pool_submit(struct subd_pool *pool, void (*function)(void *),
+	void *data);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <dbus/dbus.h>
+
+struct subd_queue;
+
+struct subd_queue *queue_create(DBusConnection *conn, DBusError *err);
+void queue_destroy(DBusConnection *conn, struct subd_queue *queue);
+int queue_get_fd(const struct subd_queue *queue);
+void queue_handle(struct subd_queue *queue);
+void queue_wake(struct subd_queue *queue);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vtable.h"
+
+/**
+ * Passed as the queue delay of calls whose delay is not known (e.g. when the
+ * connection is not driven by a subd event loop).
+ */
+#define STATS_UNKNOWN UINT64_MAX
+
+/**
+ * Per-method call statistics of a connection. Every thread records into its
+ * own shard, so recording takes no locks, and the shards are only summed up
+ * when a snapshot is taken.
+ */
+struct stats;
+
+struct stats *stats_create(void);
+void stats_free(struct stats *stats);
+uint64_t stats_now(void);
+void stats_mark_batch(void);
+uint64_t stats_batch_start(void);
+void stats_record(struct stats *stats, struct method *method,
+	uint64_t queue_delay, uint64_t handler_time, bool error);
+
+#endif
@@ -11,9 +11,11 @@
  *
  *  - Opening a connection to the bus.
  *  - Reading and sending messages.
- *  - Implementing the Introspectable interface.
+ *  - Calling methods asynchronously.
+ *  - Implementing the Introspectable, Properties and ObjectManager interfaces.
  *  - Dispatching handlers for method type members.
- *  - Handling watches.
+ *  - Handling watches, either with @c poll or with @c epoll.
+ *  - Handling timeouts (e.g. of pending calls) with a timer wheel.
  * 
  * @see https://github.com/sghctoma/subd
  * @see https://dbus.freedesktop.org/doc/api/html/group__DBus.html
@@ -24,8 +26,11 @@
 
 #include <dbus/dbus.h>
 #include <semaphore.h>
+#include <stdint.h>
 
 struct pollfd;
+struct subd_queue;
+struct subd_timeouts;
 
 /**
  * @brief Initializes a connection to the session bus.
@@ -39,6 +44,22 @@ struct pollfd;
  */
 DBusConnection *subd_open_session(const char *service_name, DBusError *err);
 
+/**
+ * @brief Opens a direct connection to a subd server.
+ *
+ * This function initializes the internal DBus locks, and connects to the
+ * server listening on @p address (see #subd_server_listen). Messages on the
+ * connection don't go through the bus daemon, but the connection can be used
+ * with every other subd function (except the ones that talk to the bus), and
+ * its watches are handled the same way. The connection is private, so it has
+ * to be closed with @c dbus_connection_close before it is unreferenced.
+ * @param address The DBus address of the server (e.g.
+ *                @c unix:path=/run/example).
+ * @param err Will contain error information in case of failure.
+ * @return Pointer to the created DBus connection, or NULL.
+ */
+DBusConnection *subd_open_peer(const char *address, DBusError *err);
+
 /**
  * @brief Sends a signal message.
  *
@@ -59,6 +80,107 @@ DBusConnection *subd_open_session(const char *service_name, DBusError *err);
 dbus_bool_t subd_emit_signal(DBusConnection *conn, const char *path,
 	const char *interface, const char *name, DBusError *err,  ...);
 
+/**
+ * @brief A prebuilt signal header.
+ *
+ * Creating a signal message validates and marshals its path, interface and
+ * name every time. Templates do that only once, when they are created, so
+ * emitting a signal from a template only costs copying the header and
+ * marshalling the body.
+ */
+struct subd_signal_template;
+
+/**
+ * @brief Creates a signal template.
+ *
+ * @param path The path to the object emitting the signal.
+ * @param interface The interface the signal is emitted from.
+ * @param name The name of the signal.
+ * @param err Will contain error information in case of failure.
+ * @return A pointer to the created template, or @c NULL.
+ */
+struct subd_signal_template *subd_signal_template_new(const char *path,
+	const char *interface, const char *name, DBusError *err);
+
+/**
+ * @brief Frees a signal template.
+ *
+ * @param tmpl A pointer to the template.
+ */
+void subd_signal_template_free(struct subd_signal_template *tmpl);
+
+/**
+ * @brief Sends a signal message built from a template.
+ *
+ * The variable argument list is the same as with #subd_emit_signal.
+ * @param conn A pointer to the DBus connection.
+ * @param tmpl The template of the signal.
+ * @param err Will contain error information in case of failure.
+ * @param va_list The fields to construct the signal body from.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_emit_signal_template(DBusConnection *conn,
+	const struct subd_signal_template *tmpl, DBusError *err, ...);
+
+/**
+ * @brief Sends the same signal from many objects.
+ *
+ * The body is marshalled only once, and a copy of the signal is sent with the
+ * path replaced by each of @p paths. The path of the template is not used. No
+ * signal is sent if any of the paths is invalid. The variable argument list is
+ * the same as with #subd_emit_signal.
+ * @param conn A pointer to the DBus connection.
+ * @param tmpl The template of the signal.
+ * @param paths The paths to the objects emitting the signal.
+ * @param count The number of elements in @p paths.
+ * @param err Will contain error information in case of failure.
+ * @param va_list The fields to construct the signal body from.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_emit_signal_fanout(DBusConnection *conn,
+	const struct subd_signal_template *tmpl, const char *const *paths,
+	int count, DBusError *err, ...);
+
+/**
+ * @brief Policies for combining coalesced signals.
+ */
+enum subd_coalesce_policy {
+	/** Only the last emitted value is sent. */
+	SUBD_COALESCE_LATEST,
+	/**
+	 * All emitted values are sent in one signal, in which every argument is
+	 * an array of the values emitted for that argument (e.g. a signal emitted
+	 * with a @c double is sent with an array of doubles). Only basic type
+	 * arguments can be accumulated.
+	 */
+	SUBD_COALESCE_ACCUMULATE,
+};
+
+/**
+ * @brief Emits a signal through the coalescer.
+ *
+ * Instead of sending the signal right away, this function stores it, and
+ * combines it with the other emissions of the same signal (same @p path,
+ * @p interface and @p name) according to @p policy. Pending signals are sent
+ * once per event loop iteration (by #subd_process_watches or #subd_run_once),
+ * but a signal is sent at most once every @p interval milliseconds. The last
+ * emitted state is always sent eventually. The variable argument list is the
+ * same as with #subd_emit_signal.
+ * @param conn A pointer to the DBus connection.
+ * @param path The path to the object emitting the signal.
+ * @param interface The interface the signal is emitted from.
+ * @param name The name of the signal.
+ * @param policy How emissions are combined.
+ * @param interval Minimum time between two signals in milliseconds.
+ * @param err Will contain error information in case of failure.
+ * @param va_list The fields to construct the signal from.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_emit_signal_coalesced(DBusConnection *conn, const char *path,
+	const char *interface, const char *name,
+	enum subd_coalesce_policy policy, unsigned int interval,
+	DBusError *err, ...);
+
 /**
  * @brief Sends a reply to method call.
  *
@@ -74,67 +196,716 @@ dbus_bool_t subd_emit_signal(DBusConnection *conn, const char *path,
  * @return A @c bool that represents success or failure.
  * @see https://dbus.freedesktop.org/doc/api/html/group__DBusMessage.html#ga591f3aab5dd2c87e56e05423c2a671d9
  */
-dbus_bool_t subd_reply_method_return(DBusConnection *conn, DBusMessage *msg,
-	DBusError *err, ...);
+dbus_bool_t subd_reply_method_return(DBusConnection *conn, DBusMessage *msg,
+	DBusError *err, ...);
+
+/**
+ * @brief A view of an array.
+ *
+ * Arrays of fixed-size types (e.g. @c ay or @c ad) are not copied when they
+ * are read, @p data points into the message, so it is valid as long as the
+ * message is. Other arrays (including arrays of file descriptors, which are
+ * duplicated when read) are decoded by #subd_message_decode into an allocated
+ * array of elements, which is freed by #subd_plan_release.
+ */
+struct subd_array {
+	const void *data;	/**< The elements */
+	int length;			/**< The number of elements */
+};
+
+/**
+ * @brief The value of a variant.
+ *
+ * When a variant is decoded, @p iter points to its contents, and @p plan is
+ * @c NULL. When a variant is encoded, its contents are encoded from @p value
+ * with @p plan (which must describe a single complete type), or copied from
+ * @p iter if @p plan is @c NULL, so decoded variants can be sent as they are.
+ */
+struct subd_variant {
+	DBusMessageIter iter;			/**< The contents of the variant */
+	const struct subd_plan *plan;	/**< The plan of @p value, or @c NULL */
+	const void *value;				/**< The value to encode */
+};
+
+/**
+ * @brief Reads values of basic types, and arrays of fixed-size types.
+ *
+ * This function uses a message iterator to read the message. It can be used to
+ * conveniently read multiple values from a message, while advancing an
+ * iterator, so that reading can be continued later. Arrays of fixed-size types
+ * are read into a #subd_array with a single call, regardless of their length.
+ * Arrays of file descriptors can only be read by #subd_message_decode. The
+ * types of the values are not checked, so the message must have the expected
+ * signature. Method handlers are only called for calls that match the input
+ * signature of the method, other messages (e.g. signals and replies) have to
+ * be checked first, e.g. with @c dbus_message_has_signature.
+ * @param iter The previously initialized message iterator
+ * @param err Will contain error information in case of failure.
+ * @param va_list Pointers to basic types or #subd_array structs to read values
+ *                into, terminated by @c NULL.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_message_read(DBusMessageIter *iter, DBusError *err, ...);
+
+/**
+ * @brief A signature compiled into the layout of a C struct.
+ *
+ * A plan maps every complete type of a signature to a field of a C struct, as
+ * if the struct was declared with the fields in the same order. Basic types
+ * map to their libdbus C types (@c dbus_bool_t for booleans, @c int for file
+ * descriptors, and <tt>const char *</tt> for strings, object paths and
+ * signatures), arrays and dictionaries to #subd_array, structs and dict
+ * entries to nested structs, and variants to #subd_variant. For example, the
+ * signature
+ * <tt>sa(id)</tt> maps to:
+ *
+ * @code{.c}
+ * struct example {
+ *   const char *name;
+ *   struct subd_array samples; // elements are struct { dbus_int32_t; double; }
+ * };
+ * @endcode
+ *
+ * Plans are meant to be compiled once, and used for any number of messages.
+ */
+struct subd_plan;
+
+/**
+ * @brief Compiles a signature into a plan.
+ *
+ * @param signature The signature of the values.
+ * @param err Will contain error information in case of failure.
+ * @return A pointer to the plan, or @c NULL.
+ */
+struct subd_plan *subd_plan_new(const char *signature, DBusError *err);
+
+/**
+ * @brief Frees a plan.
+ *
+ * @param plan A pointer to the plan.
+ */
+void subd_plan_free(struct subd_plan *plan);
+
+/**
+ * @brief Returns the signature a plan was compiled from.
+ *
+ * @param plan A pointer to the plan.
+ * @return The signature.
+ */
+const char *subd_plan_signature(const struct subd_plan *plan);
+
+/**
+ * @brief Returns the size of the C struct described by a plan.
+ *
+ * @param plan A pointer to the plan.
+ * @return The size in bytes.
+ */
+size_t subd_plan_size(const struct subd_plan *plan);
+
+/**
+ * @brief Decodes values into a C struct.
+ *
+ * This function reads the values described by @p plan from @p iter into
+ * @p value, advancing the iterator past them. Strings and arrays of
+ * fixed-size types (except file descriptors) point into the message. Other
+ * arrays are allocated, and file descriptors are duplicated, so @p value has
+ * to be released with #subd_plan_release when it is not needed anymore. The
+ * caller owns the decoded file descriptors until then (a field set to -1 is
+ * not closed). If the message does not match the plan, nothing has to be
+ * released, and the iterator is not advanced.
+ * @param iter The previously initialized message iterator.
+ * @param plan The plan of the values.
+ * @param value The struct to decode the values into.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_message_decode(DBusMessageIter *iter,
+	const struct subd_plan *plan, void *value, DBusError *err);
+
+/**
+ * @brief Frees the arrays allocated by #subd_message_decode.
+ *
+ * It also closes the decoded file descriptors.
+ * @param plan The plan the values were decoded with.
+ * @param value The decoded struct.
+ */
+void subd_plan_release(const struct subd_plan *plan, void *value);
+
+/**
+ * @brief Encodes values from a C struct.
+ *
+ * This function appends the fields of @p value to @p iter as described by
+ * @p plan. It is the reverse of #subd_message_decode, except that strings can
+ * not be @c NULL, and arrays of any type are taken from #subd_array views. No
+ * variable argument list is interpreted, so this is the cheapest way of
+ * building messages that are sent often.
+ * @param iter The iterator to append the values to.
+ * @param plan The plan of the values.
+ * @param value The struct to encode the values from.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_message_encode(DBusMessageIter *iter,
+	const struct subd_plan *plan, const void *value, DBusError *err);
+
+/**
+ * @brief Sends a reply encoded from a C struct.
+ *
+ * The same as #subd_reply_method_return, but the reply is encoded by
+ * #subd_message_encode.
+ * @param conn A pointer to the DBus connection.
+ * @param msg The message to reply to.
+ * @param plan The plan of the reply.
+ * @param value The struct to encode the reply from.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_reply_encoded(DBusConnection *conn, DBusMessage *msg,
+	const struct subd_plan *plan, const void *value, DBusError *err);
+
+/**
+ * @brief Sends a signal built from a template, encoded from a C struct.
+ *
+ * The same as #subd_emit_signal_template, but the body is encoded by
+ * #subd_message_encode.
+ * @param conn A pointer to the DBus connection.
+ * @param tmpl The template of the signal.
+ * @param plan The plan of the signal body.
+ * @param value The struct to encode the signal body from.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_emit_signal_encoded(DBusConnection *conn,
+	const struct subd_signal_template *tmpl, const struct subd_plan *plan,
+	const void *value, DBusError *err);
+
+/**
+ * @brief A view of a large payload read by #subd_blob_read.
+ *
+ * Payloads that were sent inline point into the message, payloads that were
+ * sent in a memfd are mapped read-only. In both cases, the view has to be
+ * released with #subd_blob_release.
+ */
+struct subd_blob {
+	const void *data;	/**< The contents of the payload */
+	size_t length;		/**< The length of the payload in bytes */
+	void *mapping;		/**< The mapping of the memfd, or @c NULL */
+};
+
+/**
+ * @brief Sets the size from which payloads are sent in a memfd.
+ *
+ * Payloads smaller than @p size are sent inline as a byte array, larger ones
+ * in a sealed memfd, so that their contents are not copied through the bus.
+ * The default is 64 KiB. The threshold is shared by all connections.
+ * @param size The smallest payload size in bytes that is sent in a memfd.
+ */
+void subd_set_blob_threshold(size_t size);
+
+/**
+ * @brief Appends a large payload to a message.
+ *
+ * The payload is appended as a variant. Payloads at least as large as the
+ * threshold set by #subd_set_blob_threshold are copied into a memfd, which
+ * is sealed against modification, and sent as a <tt>(ht)</tt> struct of the
+ * file descriptor and the length, if @p conn supports passing file
+ * descriptors. Smaller payloads (and every payload on systems without memfd)
+ * are sent inline as an @c ay. The cost of sending a payload in a memfd does
+ * not depend on the bus, only on the single copy into the memfd.
+ * @param conn The DBus connection the message will be sent on.
+ * @param iter The iterator to append the payload to.
+ * @param data The payload.
+ * @param length The length of the payload in bytes.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_blob_append(DBusConnection *conn, DBusMessageIter *iter,
+	const void *data, size_t length, DBusError *err);
+
+/**
+ * @brief Reads a large payload appended by #subd_blob_append.
+ *
+ * This function reads the payload at @p iter into @p blob, and advances the
+ * iterator past it. Payloads sent in a memfd are mapped read-only, after
+ * checking that the memfd is sealed, so that the sender can not change or
+ * truncate it while it is read. The received file descriptor is closed.
+ * @param iter The previously initialized message iterator.
+ * @param blob The view to read the payload into.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_blob_read(DBusMessageIter *iter, struct subd_blob *blob,
+	DBusError *err);
+
+/**
+ * @brief Releases a payload read by #subd_blob_read.
+ *
+ * @param blob The view of the payload.
+ */
+void subd_blob_release(struct subd_blob *blob);
+
+/**
+ * @brief Sends a reply that consists of a single large payload.
+ *
+ * The same as #subd_reply_method_return, but the reply body is appended by
+ * #subd_blob_append.
+ * @param conn A pointer to the DBus connection.
+ * @param msg The message to reply to.
+ * @param data The payload.
+ * @param length The length of the payload in bytes.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_reply_blob(DBusConnection *conn, DBusMessage *msg,
+	const void *data, size_t length, DBusError *err);
+
+/**
+ * @brief Function called when the reply to an asynchronous call arrives.
+ *
+ * @param reply The reply. This is either a method return, or an error message
+ *              (e.g. @c DBUS_ERROR_NO_REPLY if the call timed out). The reply
+ *              is unreferenced when the function returns.
+ * @param data The data that was passed with the call.
+ */
+typedef void (*subd_reply_function)(DBusMessage *reply, void *data);
+
+/**
+ * @brief Calls a method without waiting for the reply.
+ *
+ * This function creates a method call message from the fields passed as the
+ * variable argument list, and sends it. The same rules apply regarding this
+ * list as with #subd_emit_signal. When the reply arrives, @p function is called
+ * from the thread that dispatches the connection, so the connection has to be
+ * driven by an event loop (e.g. #subd_process_watches). Any number of calls can
+ * be in flight at the same time.
+ * @param conn A pointer to the DBus connection.
+ * @param destination The bus name to send the call to.
+ * @param path The path of the object to call.
+ * @param interface The interface of the method.
+ * @param method The name of the method.
+ * @param timeout Timeout in milliseconds, or -1 for the default.
+ * @param function The function to call with the reply. Can be @c NULL.
+ * @param data Arbitrary data to pass to @p function.
+ * @param err Will contain error information in case of failure.
+ * @param va_list The fields to construct the call from.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_call_async(DBusConnection *conn, const char *destination,
+	const char *path, const char *interface, const char *method,
+	int timeout, subd_reply_function function, void *data,
+	DBusError *err, ...);
+
+/**
+ * @brief A batch of asynchronous calls.
+ *
+ * Calls are added to the batch with #subd_batch_call, and they are sent
+ * together with #subd_batch_flush.
+ */
+struct subd_batch;
+
+/**
+ * @brief Creates an empty batch of calls.
+ *
+ * @param conn A pointer to the DBus connection the calls will be sent on.
+ * @return A pointer to the batch, or @c NULL if out of memory.
+ */
+struct subd_batch *subd_batch_new(DBusConnection *conn);
+
+/**
+ * @brief Frees a batch, including the calls that were not sent yet.
+ *
+ * @param batch A pointer to the batch.
+ */
+void subd_batch_free(struct subd_batch *batch);
+
+/**
+ * @brief Adds a call to a batch.
+ *
+ * The call is marshalled right away, but it is only sent by
+ * #subd_batch_flush. The parameters are the same as for #subd_call_async.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_batch_call(struct subd_batch *batch, const char *destination,
+	const char *path, const char *interface, const char *method,
+	int timeout, subd_reply_function function, void *data,
+	DBusError *err, ...);
+
+/**
+ * @brief Sends all calls in a batch.
+ *
+ * The calls are queued on the connection back to back, without waiting for
+ * them to be written, so this function does not block, and it can be called
+ * from the thread of the event loop, which writes them out. The batch is empty
+ * afterwards, and can be reused. If a call could not be sent, it and the ones
+ * after it stay in the batch.
+ * @param batch A pointer to the batch.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_batch_flush(struct subd_batch *batch, DBusError *err);
+
+/**
+ * @brief A subscription to signals.
+ *
+ * Subscriptions are created by #subd_subscribe, and removed by
+ * #subd_unsubscribe.
+ */
+struct subd_subscription;
+
+/**
+ * @brief A function to be called with the signals of a subscription.
+ *
+ * @param conn A pointer to the DBus connection the signal arrived on.
+ * @param msg The signal. It is unreferenced when the function returns.
+ * @param data The data that was passed to #subd_subscribe.
+ */
+typedef void (*subd_signal_function)(DBusConnection *conn, DBusMessage *msg,
+	void *data);
+
+/**
+ * @brief Subscribes to signals.
+ *
+ * The function is called for every signal of @p interface that matches
+ * @p member and @p path, from the thread that dispatches the connection.
+ * Signals are looked up in a hash table by their interface and member, so
+ * their cost does not grow with the number of subscriptions. A match rule is
+ * added to the bus for every subscription, unless an equal or a broader rule
+ * is already in use, and rules are added and removed without waiting for the
+ * replies of the bus. On peer-to-peer connections, no rules are added.
+ * @param conn A pointer to the DBus connection.
+ * @param interface The interface of the signals.
+ * @param member The name of the signals, or @c NULL for every signal of
+ *               @p interface.
+ * @param path The path of the object emitting the signals, or @c NULL for
+ *             every object.
+ * @param path_namespace Whether objects below @p path match as well.
+ * @param function The function to call with the signals.
+ * @param data Arbitrary data to pass to @p function.
+ * @param err Will contain error information in case of failure.
+ * @return A pointer to the subscription, or @c NULL.
+ */
+struct subd_subscription *subd_subscribe(DBusConnection *conn,
+	const char *interface, const char *member, const char *path,
+	dbus_bool_t path_namespace, subd_signal_function function,
+	void *data, DBusError *err);
+
+/**
+ * @brief Removes a subscription.
+ *
+ * The match rule of the subscription is removed from the bus if no other
+ * subscription needs it. This function can be called from the function of
+ * any subscription.
+ * @param conn A pointer to the DBus connection.
+ * @param subscription A pointer to the subscription.
+ */
+void subd_unsubscribe(DBusConnection *conn,
+	struct subd_subscription *subscription);
+
+/**
+ * @brief A storage for DBus waches
+ *
+ * This struct stores the DBus watches, and their corresponging file
+ * descriptors. This will be auto-updated whenever DBus needs additional file
+ * descriptors to watch. You can also store other, not DBus-related file
+ * descriptors here, with a function that #subd_process_watches calls when
+ * they are ready, so you can directly use @p fds as a parameter for @c poll().
+ * Every file descriptor has a slot, which is its handle. Slots never move, so
+ * adding, removing, enabling and disabling a file descriptor takes constant
+ * time, but the entries of @p fds are moved around. Disabled entries stay in
+ * @p fds with a negative file descriptor, which @c poll ignores. Where timerfd
+ * is available, the file descriptor that drives the DBus timeouts is also in
+ * @p fds, and it is handled by #subd_process_watches. So is the file descriptor
+ * of the send queue (see #subd_send_queued), which wakes up @c poll whenever
+ * another thread needs the event loop.
+ */
+struct subd_watches {
+	struct pollfd *fds;			/**< Array of @c pollfd structs */
+	struct subd_watch_slots *slots;	/**< The slots of the entries of @p fds */
+	int capacity;				/**< Currently allocated size in item number */
+	int length;					/**< Number of currently allocated items */
+	sem_t mutex;				/**< Lock for safe watch addition/removal */
+	struct subd_timeouts *timeouts;	/**< DBus timeouts, or @c NULL */
+	struct subd_queue *queue;	/**< Messages sent from other threads */
+};
+
+/**
+ * @brief Initializes and registers a subd_watches structure
+ *
+ * This function creates a subd_watches instance, and pre-populates it with
+ * the non-DBus file descriptors passed as @p fds. If @p conn is @c NULL, only
+ * non-DBus file descriptors can be watched (e.g. for the listening sockets of
+ * a #subd_server). These have no function, so you have to check their
+ * @c revents after @c poll, and their handles are 0 to @p size - 1. It also
+ * registers the add, remove and toggle functions that will handle automatic
+ * file descriptor additions/removals, and the functions that handle DBus
+ * timeouts (e.g. the timeouts of pending calls) using a timer wheel and a
+ * single timerfd.
+ * @param conn A pointer to the DBus connection.
+ * @param fds Array of non-dbus file descriptors.
+ * @param size Size of @p fds
+ * @param err Will contain error information in case of failure
+ * @return A pointer to the created subd_watches structure, or NULL.
+ * @see https://dbus.freedesktop.org/doc/api/html/group__DBusConnection.html#gaebf031eb444b4f847606aa27daa3d8e6
+ */
+struct subd_watches *subd_init_watches(DBusConnection *conn, struct pollfd *fds,
+	int size, DBusError *err);
+
+/**
+ * @brief Handles DBus watches
+ *
+ * This function should be called from the event loop after a successful @c poll
+ * to handle the DBus watches that need to be handled (= the watches whose file
+ * descriptor returned an event), and the DBus timeouts that expired, and to
+ * call the functions of the non-DBus file descriptors that became ready. The
+ * lock is not held while they are handled, so the functions can add and
+ * remove file descriptors.
+ * @param conn A pointer to the DBus connection.
+ * @param watches A pointer to the subd_watches structure.
+ */
+void subd_process_watches(DBusConnection *conn, struct subd_watches *watches);
+
+/**
+ * @brief Function called when a registered file descriptor has events.
+ *
+ * @param fd The file descriptor.
+ * @param flags The events that occured as @c DBusWatchFlags (i.e.
+ *              @c DBUS_WATCH_READABLE, @c DBUS_WATCH_WRITABLE,
+ *              @c DBUS_WATCH_HANGUP and @c DBUS_WATCH_ERROR).
+ * @param data The data that was passed when the function was registered.
+ */
+typedef void (*subd_fd_function)(int fd, unsigned int flags, void *data);
+
+/**
+ * @brief Frees a subd_watches structure.
+ *
+ * This function unregisters the watch functions from @p conn (if it is not
+ * @c NULL), and frees @p watches. It must not be called while
+ * #subd_process_watches is running.
+ * @param conn A pointer to the DBus connection.
+ * @param watches A pointer to the subd_watches structure.
+ */
+void subd_free_watches(DBusConnection *conn, struct subd_watches *watches);
+
+/**
+ * @brief Registers a non-DBus file descriptor.
+ *
+ * Adds @p fd to @p watches, so that @p function is called from
+ * #subd_process_watches whenever the events in @p flags (or a hangup or error)
+ * occur. It can be called at any time, also from @p function itself.
+ * @param watches A pointer to the subd_watches structure.
+ * @param fd The file descriptor to watch.
+ * @param flags The events to watch for (@c DBUS_WATCH_READABLE and/or
+ *              @c DBUS_WATCH_WRITABLE).
+ * @param function The function to call when the events occur.
+ * @param data Arbitrary data to pass to @p function.
+ * @param err Will contain error information in case of failure
+ * @return The handle of the file descriptor, or -1.
+ */
+int subd_watches_add_fd(struct subd_watches *watches, int fd,
+	unsigned int flags, subd_fd_function function, void *data,
+	DBusError *err);
+
+/**
+ * @brief Unregisters a non-DBus file descriptor.
+ *
+ * The handle can be reused by a later registration.
+ * @param watches A pointer to the subd_watches structure.
+ * @param handle The handle returned by #subd_watches_add_fd.
+ */
+void subd_watches_remove_fd(struct subd_watches *watches, int handle);
+
+/**
+ * @brief Changes the events a non-DBus file descriptor is watched for.
+ *
+ * @param watches A pointer to the subd_watches structure.
+ * @param handle The handle returned by #subd_watches_add_fd.
+ * @param flags The events to watch for, or 0 to disable the file descriptor
+ *              until it is enabled again.
+ */
+void subd_watches_set_fd_flags(struct subd_watches *watches, int handle,
+	unsigned int flags);
+
+#ifdef __linux__
+/**
+ * @brief An epoll based event loop.
+ *
+ * This is an alternative to subd_watches. DBus watches and non-DBus file
+ * descriptors are registered with an epoll instance, so an iteration of the
+ * event loop only costs as much as the number of file descriptors that are
+ * actually ready, regardless of how many are watched.
+ */
+struct subd_epoll;
+
+/**
+ * @brief Initializes and registers an epoll based event loop.
+ *
+ * This function creates an epoll instance, and registers add, remove and toggle
+ * functions that add the connection's watches to it. DBus timeouts are handled
+ * the same way as with #subd_init_watches. If @p conn is @c NULL, only non-DBus
+ * file descriptors can be watched.
+ * @param conn A pointer to the DBus connection.
+ * @param err Will contain error information in case of failure
+ * @return A pointer to the created subd_epoll structure, or NULL.
+ */
+struct subd_epoll *subd_init_epoll(DBusConnection *conn, DBusError *err);
+
+/**
+ * @brief Frees an epoll based event loop.
+ *
+ * This function unregisters the watch functions from @p conn (if it is not
+ * @c NULL), and frees @p ep. It must not be called while #subd_run_once is
+ * running.
+ * @param conn A pointer to the DBus connection.
+ * @param ep A pointer to the subd_epoll structure.
+ */
+void subd_free_epoll(DBusConnection *conn, struct subd_epoll *ep);
+
+/**
+ * @brief Registers a non-DBus file descriptor.
+ *
+ * Registers @p fd with the event loop, so that @p function is called from
+ * #subd_run_once whenever the events in @p flags (or a hangup or error) occur.
+ * A file descriptor can be registered only once.
+ * @param ep A pointer to the subd_epoll structure.
+ * @param fd The file descriptor to watch.
+ * @param flags The events to watch for (@c DBUS_WATCH_READABLE and/or
+ *              @c DBUS_WATCH_WRITABLE).
+ * @param function The function to call when the events occur.
+ * @param data Arbitrary data to pass to @p function.
+ * @param err Will contain error information in case of failure
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_epoll_add_fd(struct subd_epoll *ep, int fd,
+	unsigned int flags, subd_fd_function function, void *data,
+	DBusError *err);
+
+/**
+ * @brief Unregisters a non-DBus file descriptor.
+ *
+ * @param ep A pointer to the subd_epoll structure.
+ * @param fd The file descriptor previously registered with
+ *           #subd_epoll_add_fd.
+ */
+void subd_epoll_remove_fd(struct subd_epoll *ep, int fd);
+
+/**
+ * @brief Runs one iteration of the epoll based event loop.
+ *
+ * This function waits at most @p timeout milliseconds for events, handles the
+ * DBus watches and expired timeouts, calls the functions of the non-DBus file
+ * descriptors that became ready, and dispatches the incoming messages.
+ * @param conn A pointer to the DBus connection.
+ * @param ep A pointer to the subd_epoll structure.
+ * @param timeout Maximum time to wait in milliseconds, or -1 to wait
+ *                indefinitely.
+ * @return The number of ready file descriptors, or -1 (with @c errno set).
+ */
+int subd_run_once(DBusConnection *conn, struct subd_epoll *ep, int timeout);
+
+#endif
+
+/**
+ * @brief Returns the send queue of a connection.
+ *
+ * Every connection whose watches are handled by subd (#subd_init_watches or
+ * #subd_init_epoll) has a send queue, which lets other threads hand messages
+ * over to the event loop. The queue is valid until the watches are freed.
+ * @param conn A pointer to the DBus connection.
+ * @return A pointer to the send queue, or @c NULL.
+ */
+struct subd_queue *subd_get_queue(DBusConnection *conn);
+
+/**
+ * @brief Sends a message from the event loop thread.
+ *
+ * This function can be called from any thread. It only pushes @p msg onto a
+ * lock-free queue, and wakes up the event loop if the queue was empty, so
+ * threads that emit signals or send replies don't contend on the connection
+ * lock. The event loop sends the queued messages in the order they were
+ * queued (per thread), at the start of its next iteration. @p msg is
+ * referenced until it is sent, and must not be modified after this call.
+ * @param queue The send queue returned by #subd_get_queue.
+ * @param msg The message to send.
+ * @param err Will contain error information in case of failure
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_send_queued(struct subd_queue *queue, DBusMessage *msg,
+	DBusError *err);
+
+/**
+ * @brief A server that accepts direct connections from peers.
+ *
+ * Peer-to-peer connections bypass the bus daemon, so a message takes one hop
+ * instead of two. The listening sockets of the server are handled by an event
+ * loop, like non-DBus file descriptors. The loop can be one without a
+ * connection (see #subd_init_watches).
+ */
+struct subd_server;
+
+/**
+ * @brief Function that is called when a peer connected to a server.
+ *
+ * The function owns a reference to @p conn. It can register objects on it
+ * (e.g. with #subd_add_object_vtable), and set up an event loop for it (e.g.
+ * with #subd_init_watches). To reject the peer, or when the connection is not
+ * needed anymore, it has to be closed with @c dbus_connection_close, and
+ * unreferenced.
+ * @param conn A pointer to the new DBus connection.
+ * @param data The data passed when the server was created.
+ */
+typedef void (*subd_connection_function)(DBusConnection *conn, void *data);
 
 /**
- * @brief Reads values of basic types.
+ * @brief Creates a server listening for direct connections.
  *
- * This function uses a message iterator to read the message. It can be used to
- * conveniently read multiple basic values from a message, while advancing an
- * iterator, so that reading can be continued later.
- * @param iter The previously initialized message iterator
+ * @param address The DBus address to listen on (e.g.
+ *                @c unix:path=/run/example, @c unix:abstract=example, or
+ *                @c unix:tmpdir=/tmp to let libdbus choose a name).
+ * @param watches The event loop that handles the listening sockets.
+ * @param function The function to call when a peer connected.
+ * @param data Arbitrary data to pass to @p function.
  * @param err Will contain error information in case of failure.
- * @param va_list Pointers to basic types to read values into.
- * @return A @c bool that represents success or failure.
+ * @return A pointer to the created server, or @c NULL.
  */
-dbus_bool_t subd_message_read(DBusMessageIter *iter, DBusError *err, ...);
+struct subd_server *subd_server_listen(const char *address,
+	struct subd_watches *watches, subd_connection_function function,
+	void *data, DBusError *err);
 
+#ifdef __linux__
 /**
- * @brief A storage for DBus waches
+ * @brief Creates a server listening for direct connections.
  *
- * This struct stores the DBus watches, and their corresponging file
- * descriptors. This will be auto-updated whenever DBus needs additional file
- * descriptors to watch. You can also store other, not DBus-related file
- * descriptors here, so you can directly use @p fds as a parameter for @c poll().
- * If you add non-watch file descriptors, make sure to set their corresponding
- * watch to @c NULL, so that #subd_process_watches knows to skip them.
+ * This is the same as #subd_server_listen, except that the listening sockets
+ * are handled by an epoll based event loop.
+ * @param address The DBus address to listen on.
+ * @param ep The event loop that handles the listening sockets.
+ * @param function The function to call when a peer connected.
+ * @param data Arbitrary data to pass to @p function.
+ * @param err Will contain error information in case of failure.
+ * @return A pointer to the created server, or @c NULL.
  */
-struct subd_watches {
-	struct pollfd *fds;			/**< Array of @c pollfd structs */
-	DBusWatch **watches;		/**< Arrah of DBus watches */
-	int capacity;				/**< Currently allocated size in item number */
-	int length;					/**< Number of currently allocated items */
-	sem_t mutex;				/**< Lock for safe watch addition/removal */
-};
+struct subd_server *subd_server_listen_epoll(const char *address,
+	struct subd_epoll *ep, subd_connection_function function, void *data,
+	DBusError *err);
+#endif
 
 /**
- * @brief Initializes and registers a subd_watches structure
+ * @brief Returns the address peers can connect to.
  *
- * This function creates a subd_watches instance, and pre-populates it with
- * the non-DBus file descriptors passed as @p fds. It also registers the add,
- * remove and toggle functions that will handle automatic file descriptor
- * additions/removals.
- * @param conn A pointer to the DBus connection.
- * @param fds Array of non-dbus file descriptors.
- * @param size Size of @p fds
- * @param err Will contain error information in case of failure
- * @return A pointer to the created subd_watches structure, or NULL.
- * @see https://dbus.freedesktop.org/doc/api/html/group__DBusConnection.html#gaebf031eb444b4f847606aa27daa3d8e6
+ * @param server A pointer to the server.
+ * @return The address, which has to be freed with @c dbus_free, or @c NULL if
+ *         out of memory.
  */
-struct subd_watches *subd_init_watches(DBusConnection *conn, struct pollfd *fds,
-	int size, DBusError *err);
+char *subd_server_get_address(struct subd_server *server);
 
 /**
- * @brief Handles DBus watches
+ * @brief Stops and frees a server.
  *
- * This function should be called from the event loop after a successful @c poll
- * to handle the DBus watches that need to be handled (= the watches whose file
- * descriptor returned an event).
- * @param conn A pointer to the DBus connection.
- * @param watches A pointer to the subd_watches structure.
+ * The server stops listening, but the connections it accepted are not
+ * affected.
+ * @param server A pointer to the server.
  */
-void subd_process_watches(DBusConnection *conn, struct subd_watches *watches);
+void subd_server_free(struct subd_server *server);
 
 /**
  * @brief Represents the three DBus member types.
@@ -155,6 +926,66 @@ enum subd_property_access {
 	SUBD_PROPERTY_READWRITE,	/**< "readwrite" access */
 };
 
+/**
+ * @brief Flags that modify how a method type member is dispatched.
+ */
+enum subd_method_flags {
+	/**
+	 * The handler is called on the connection's worker pool (see
+	 * #subd_set_pool) instead of the thread that dispatches the message, so
+	 * slow handlers don't hold up other messages. The handler has to be
+	 * thread-safe, and it sends its reply just like any other handler.
+	 */
+	SUBD_METHOD_OFFLOAD = 1 << 0,
+	/**
+	 * The reply of the method is memoized, and repeated calls with the same
+	 * arguments to the same object are answered with a copy of it, without
+	 * calling the handler, for @c cache_ttl milliseconds (or until the reply
+	 * is invalidated with #subd_invalidate_replies if it is 0). Only replies
+	 * sent with #subd_reply_method_return or #subd_reply_encoded are
+	 * memoized, and calls with file descriptors are never answered from the
+	 * cache.
+	 */
+	SUBD_METHOD_CACHEABLE = 1 << 1,
+};
+
+/**
+ * @brief Function that reads the value of a property.
+ *
+ * The function appends the value of the property to @p iter, which is the
+ * inside of a variant of the property's signature.
+ * @param conn A pointer to the DBus connection.
+ * @param path The path of the object.
+ * @param interface The interface of the property.
+ * @param property The name of the property.
+ * @param iter The iterator to append the value to.
+ * @param userdata The data that was passed when the path was registered.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+typedef dbus_bool_t (*subd_property_getter)(DBusConnection *conn,
+	const char *path, const char *interface, const char *property,
+	DBusMessageIter *iter, void *userdata, DBusError *err);
+
+/**
+ * @brief Function that changes the value of a property.
+ *
+ * The signature of the new value is checked before the function is called.
+ * When it returns successfully, the property is reported as changed (see
+ * #subd_properties_changed).
+ * @param conn A pointer to the DBus connection.
+ * @param path The path of the object.
+ * @param interface The interface of the property.
+ * @param property The name of the property.
+ * @param value An iterator pointing to the new value.
+ * @param userdata The data that was passed when the path was registered.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+typedef dbus_bool_t (*subd_property_setter)(DBusConnection *conn,
+	const char *path, const char *interface, const char *property,
+	DBusMessageIter *value, void *userdata, DBusError *err);
+
 /**
  * @brief Represents a DBus member object.
  *
@@ -165,13 +996,27 @@ enum subd_property_access {
  *  - It has the metadata for the member (name, output and/or input signatures,
  *    access) that introspection data can be built from.
  *
+ * Methods can also have flags (see #subd_method_flags), which are zero when
+ * omitted from the initializer, and cacheable methods a time to live for
+ * their memoized replies in milliseconds. Methods and signals can also refer
+ * to the plan their replies or bodies are encoded with (see
+ * #subd_message_encode). The plan is referred to through a pointer to a
+ * variable, so member arrays can be static, but the plan has to be compiled
+ * before the members are registered, and its signature has to match
+ * @p output_signature or @p signature.
+ * Properties can have a getter and a setter (see #subd_property_getter and
+ * #subd_property_setter), which are used by the org.freedesktop.DBus.Properties
+ * interface every path implements. A property without a getter can not be
+ * read, and one without a setter can not be written, regardless of its access.
+ *
  * Example member array that contains one method, one signal, and one property:
  *
  * @code{.c}
  * struct subd_member members[] = {
  *   {SUBD_METHOD, .m = {"SomeMethod", some_handler, "u", "as"}},
  *   {SUBD_SIGNAL, .s = {"SomeSignal", "u"}},
- *   {SUBD_PROPERTY, .p = {"SomeProperty", "s", SUBD_PROPERTY_READ}},
+ *   {SUBD_PROPERTY, .p = {"SomeProperty", "s", SUBD_PROPERTY_READ,
+ *     some_getter}},
  *   {SUBD_MEMBERS_END, .e=0},
  * };
  * @endcode
@@ -184,15 +1029,21 @@ struct subd_member {
 			dbus_bool_t (*handler)(DBusConnection *, DBusMessage *, void *, DBusError *);
 			const char *input_signature;
 			const char *output_signature;
+			unsigned int flags;
+			struct subd_plan *const *plan;
+			unsigned int cache_ttl;
 		} m;
 		struct {
 			const char *name;
 			const char *signature;
+			struct subd_plan *const *plan;
 		} s;
 		struct {
 			const char *name;
 			const char *signature;
 			enum subd_property_access access;
+			subd_property_getter getter;
+			subd_property_setter setter;
 		} p;
 		int e;
 	};
@@ -205,7 +1056,10 @@ struct subd_member {
  * interface of one path. You should create a separate array of subd_members
  * for all of your interfaces you want vtable handlers for, and register them
  * with DBus using this function. The last element of the array always should be
- * SUBD_MEMBERS_END.
+ * SUBD_MEMBERS_END. Registered paths are kept in a registry that belongs to
+ * @p conn, so different connections can register the same path independently.
+ * Introspection data is not generated on registration, only when the path is
+ * first introspected.
  * @param conn A pointer to the DBus connection.
  * @param path The DBus object path to register @p interface to.
  * @param interface The DBus interface that are to be registered to @p path.
@@ -219,4 +1073,491 @@ dbus_bool_t subd_add_object_vtable(DBusConnection *conn, const char *path,
 	const char *interface, const struct subd_member *members,
 	void *userdata, DBusError *err);
 
+/**
+ * @brief Unregisters method handlers.
+ *
+ * This function removes @p interface from @p path, or every interface of
+ * @p path if @p interface is NULL. When no other interface than the standard
+ * ones remains, the path itself is unregistered, and everything that was
+ * allocated for it is freed. If the path is managed by an object manager, an
+ * InterfacesRemoved signal is sent. Method calls that are already running
+ * (e.g. on a worker pool) finish normally, and the path is only freed after
+ * them. Everything registered on a connection is freed when the connection is
+ * finalized.
+ * @param conn A pointer to the DBus connection.
+ * @param path The DBus object path to remove @p interface from.
+ * @param interface The DBus interface to remove, or NULL to remove all.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_remove_object_vtable(DBusConnection *conn, const char *path,
+	const char *interface, DBusError *err);
+
+/**
+ * @brief Makes a path an object manager.
+ *
+ * This function registers the org.freedesktop.DBus.ObjectManager interface on
+ * @p path. Every path below it (that is not below a closer object manager) is
+ * managed by it, including the ones registered later, so clients can get all
+ * of them with their interfaces and properties in one GetManagedObjects call.
+ * Interfaces registered on managed paths are announced with InterfacesAdded.
+ * @param conn A pointer to the DBus connection.
+ * @param path The path of the object manager.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_add_object_manager(DBusConnection *conn, const char *path,
+	DBusError *err);
+
+/**
+ * @brief An interface of an object, for registering many objects at once.
+ */
+struct subd_object {
+	const char *path;					/**< The path of the object */
+	const char *interface;				/**< The registered interface */
+	const struct subd_member *members;	/**< The members of @p interface */
+	void *userdata;						/**< Data to pass to handlers */
+};
+
+/**
+ * @brief Registers many objects at once.
+ *
+ * This function registers every element of @p objects the same way as
+ * #subd_add_object_vtable does. A path can appear more than once, with
+ * different interfaces. InterfacesAdded is sent only once for every path in
+ * the batch (with all of its new interfaces). The signals are queued, and
+ * written by the event loop, so this function does not block. If an element
+ * can not be registered, the ones before it stay registered, and they are
+ * announced as well.
+ * @param conn A pointer to the DBus connection.
+ * @param objects The objects to register.
+ * @param count The number of elements in @p objects.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_add_objects(DBusConnection *conn,
+	const struct subd_object *objects, int count, DBusError *err);
+
+/**
+ * @brief Reports that properties of an object changed.
+ *
+ * This function drops the cached values of the interface (which are sent in
+ * reply to GetAll), and queues a PropertiesChanged signal. Changes are
+ * batched, so only one signal per interface is sent in an event loop iteration
+ * (by #subd_process_watches or #subd_run_once), no matter how many times this
+ * function is called. The signal contains the new values of the readable
+ * properties, and invalidates the rest. It can be called from any thread.
+ * @param conn A pointer to the DBus connection.
+ * @param path The path of the object.
+ * @param interface The interface of the properties.
+ * @param err Will contain error information in case of failure.
+ * @param va_list The names of the changed properties, terminated by @c NULL.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_properties_changed(DBusConnection *conn, const char *path,
+	const char *interface, DBusError *err, ...);
+
+/**
+ * @brief A fixed-size pool of worker threads.
+ *
+ * Handlers of methods marked with #SUBD_METHOD_OFFLOAD are executed on a pool.
+ * Each worker has its own job queue, and idle workers steal jobs from the
+ * others.
+ */
+struct subd_pool;
+
+/**
+ * @brief Creates a worker pool.
+ *
+ * @param size The number of worker threads.
+ * @param err Will contain error information in case of failure.
+ * @return A pointer to the created pool, or @c NULL.
+ */
+struct subd_pool *subd_pool_create(int size, DBusError *err);
+
+/**
+ * @brief Destroys a worker pool.
+ *
+ * This function runs the jobs that are still queued, then stops and joins the
+ * worker threads. The pool must not be used by any connection anymore.
+ * @param pool A pointer to the pool.
+ */
+void subd_pool_destroy(struct subd_pool *pool);
+
+/**
+ * @brief Sets the worker pool of a connection.
+ *
+ * Handlers of methods marked with #SUBD_METHOD_OFFLOAD that are registered on
+ * @p conn will be executed on @p pool. The message is referenced until the
+ * handler returns, and the reply (or the error, if the handler fails) is sent
+ * from the worker thread. Passing @c NULL makes all handlers run on the
+ * dispatching thread again.
+ * @param conn A pointer to the DBus connection.
+ * @param pool A pointer to the pool, or @c NULL.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_set_pool(DBusConnection *conn, struct subd_pool *pool,
+	DBusError *err);
+
+/**
+ * @brief Priority classes of method calls.
+ */
+enum subd_priority {
+	/** Dispatched as soon as it is read, ahead of any queued call. */
+	SUBD_PRIORITY_HIGH,
+	/** The default priority. */
+	SUBD_PRIORITY_NORMAL,
+	/** Dispatched only when there are no other calls to dispatch. */
+	SUBD_PRIORITY_LOW,
+};
+
+/**
+ * @brief Sets the priority of a method, or of every method of an interface.
+ *
+ * Once a priority is set on @p conn, the event loop (#subd_process_watches or
+ * #subd_run_once) only dispatches calls of high priority methods right away.
+ * The other calls are put aside, and dispatched after the incoming messages,
+ * normal priority calls first, in the order they arrived. So control methods
+ * don't have to wait for the bulk calls queued before them. A priority set for
+ * a method overrides the priority of its interface. This function should be
+ * called before the event loop starts.
+ * @param conn A pointer to the DBus connection.
+ * @param interface The name of the interface.
+ * @param member The name of the method, or @c NULL for every method of
+ *               @p interface.
+ * @param priority The priority of the calls.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_set_priority(DBusConnection *conn, const char *interface,
+	const char *member, enum subd_priority priority, DBusError *err);
+
+/**
+ * @brief Limits the work the event loop does in one iteration.
+ *
+ * The event loop (#subd_process_watches or #subd_run_once) stops dispatching
+ * messages once it dispatched @p messages messages, or spent @p time
+ * microseconds dispatching them, and returns to the caller, so a burst of
+ * messages does not starve the other file descriptors. The rest of the
+ * messages are dispatched in the next iterations, which don't wait for file
+ * descriptor activity until they are all dispatched. Zero means no limit.
+ * This function should be called before the event loop starts.
+ * @param conn A pointer to the DBus connection.
+ * @param messages The maximum number of messages per iteration, or 0.
+ * @param time The maximum dispatch time per iteration in microseconds, or 0.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_set_dispatch_budget(DBusConnection *conn,
+	unsigned int messages, unsigned int time, DBusError *err);
+
+/**
+ * @brief Counters of the reply cache of a connection.
+ */
+struct subd_cache_stats {
+	uint64_t hits;		/**< Calls answered from the cache. */
+	uint64_t misses;	/**< Calls of cacheable methods passed to the handler. */
+	uint64_t evictions;	/**< Replies dropped to make room for others. */
+	size_t size;		/**< The bytes used by the cached replies. */
+	int entries;		/**< The number of cached replies. */
+};
+
+/**
+ * @brief Sets the size of the reply cache of a connection.
+ *
+ * The replies of methods marked with #SUBD_METHOD_CACHEABLE are kept until
+ * they take up more than @p size bytes, then the least recently used ones are
+ * dropped. The default size is 1 MiB.
+ * @param conn A pointer to the DBus connection.
+ * @param size The size of the cache in bytes.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_set_reply_cache_size(DBusConnection *conn, size_t size,
+	DBusError *err);
+
+/**
+ * @brief Drops memoized replies.
+ *
+ * Drops the replies of the methods that match @p path, @p interface and
+ * @p member, where @c NULL matches everything. Replies that are being
+ * produced while this function runs are not memoized either, so the next call
+ * gets a fresh reply.
+ * @param conn A pointer to the DBus connection.
+ * @param path The path of the objects, or @c NULL.
+ * @param interface The interface of the methods, or @c NULL.
+ * @param member The name of the methods, or @c NULL.
+ */
+void subd_invalidate_replies(DBusConnection *conn, const char *path,
+	const char *interface, const char *member);
+
+/**
+ * @brief Reads the counters of the reply cache of a connection.
+ *
+ * @param conn A pointer to the DBus connection.
+ * @param stats Will contain the counters, which are all zero if no cacheable
+ *              method was registered on @p conn.
+ */
+void subd_get_reply_cache_stats(DBusConnection *conn,
+	struct subd_cache_stats *stats);
+
+/**
+ * @brief The object path of the statistics object.
+ */
+#define SUBD_STATS_PATH "/org/subd/Stats"
+
+/**
+ * @brief The interface of the statistics object.
+ *
+ * It has a single method, <tt>GetStats() -> a(ssstta(tt)a(tt))</tt>, which
+ * returns the path, interface and member name, the number of calls and
+ * errors, and the handler time and queue delay histograms of every method
+ * that was called. Histograms are arrays of (bucket limit, count) pairs of
+ * the non-empty buckets, in nanoseconds.
+ */
+#define SUBD_STATS_INTERFACE "org.subd.Stats"
+
+/**
+ * @brief The number of buckets in a #subd_histogram.
+ */
+#define SUBD_HISTOGRAM_BUCKETS 304
+
+/**
+ * @brief A latency histogram.
+ *
+ * Buckets are logarithmic with 8 linear sub-buckets each, so a bucket is at
+ * most 12.5% wide, from nanoseconds up to about 18 minutes. The largest value
+ * a bucket counts is returned by #subd_histogram_bucket_limit.
+ */
+struct subd_histogram {
+	uint64_t count;								/**< The number of values */
+	uint64_t buckets[SUBD_HISTOGRAM_BUCKETS];	/**< The bucket counts */
+};
+
+/**
+ * @brief Statistics of a method of an object.
+ *
+ * The handler time is the time spent in the method's handler. The queue delay
+ * is the time the call waited before the handler was called: since the event
+ * loop woke up to read it, or since it was submitted to the worker pool. It is
+ * not recorded for calls on connections that are not driven by
+ * #subd_process_watches or #subd_run_once.
+ */
+struct subd_method_stats {
+	char *path;							/**< The object path */
+	char *interface;					/**< The interface name */
+	char *member;						/**< The method name */
+	uint64_t calls;						/**< The number of calls */
+	uint64_t errors;					/**< The number of failed calls */
+	struct subd_histogram handler_time;	/**< Handler times in ns */
+	struct subd_histogram queue_delay;	/**< Queue delays in ns */
+};
+
+/**
+ * @brief Enables per-method call statistics on a connection.
+ *
+ * From now on, the calls of every method on @p conn are counted, and their
+ * handler times and queue delays are recorded in histograms. Every thread
+ * records into its own counters, so recording takes no locks. The statistics
+ * are published on @p conn by an object at #SUBD_STATS_PATH implementing
+ * #SUBD_STATS_INTERFACE. Enabling statistics again has no effect.
+ * @param conn A pointer to the DBus connection.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_enable_stats(DBusConnection *conn, DBusError *err);
+
+/**
+ * @brief Takes a snapshot of the call statistics of a connection.
+ *
+ * The snapshot has an entry for every method that was called at least once
+ * since statistics were enabled. Calls that are being recorded while the
+ * snapshot is taken might be partially included.
+ * @param conn A pointer to the DBus connection.
+ * @param count Will contain the number of entries.
+ * @param err Will contain error information in case of failure.
+ * @return The entries, to be freed with #subd_stats_free, or @c NULL.
+ */
+struct subd_method_stats *subd_stats_snapshot(DBusConnection *conn,
+	int *count, DBusError *err);
+
+/**
+ * @brief Frees a snapshot taken by #subd_stats_snapshot.
+ *
+ * @param stats The entries of the snapshot.
+ * @param count The number of entries.
+ */
+void subd_stats_free(struct subd_method_stats *stats, int count);
+
+/**
+ * @brief Returns the largest value counted by a bucket of a histogram.
+ *
+ * @param bucket The index of the bucket.
+ * @return The limit of the bucket.
+ */
+uint64_t subd_histogram_bucket_limit(int bucket);
+
+/**
+ * @brief Returns a percentile of a histogram.
+ *
+ * @param histogram A pointer to the histogram.
+ * @param percentile The percentile, between 0 and 100.
+ * @return The limit of the bucket the percentile falls into, or 0 if the
+ *         histogram is empty.
+ */
+uint64_t subd_histogram_percentile(const struct subd_histogram *histogram,
+	double percentile);
+
+/**
+ * @brief A service spread over several connections.
+ *
+ * A connection serializes all of its traffic on one socket, and one dispatch
+ * thread, so a single connection can only use one core. Shards are separate
+ * connections to the bus, each with its own event loop, which is run by its
+ * own thread. Shard @c i owns the name <tt>service_name.Shardi</tt>, and
+ * shard 0 also owns @c service_name itself, so clients can spread their calls
+ * over the shards by name. The objects are registered on every shard, and
+ * every shard has its own statistics, which can be read with
+ * #subd_stats_snapshot on its connection, or on the bus from its name.
+ */
+struct subd_shards;
+
+/**
+ * @brief Connects the shards of a service to the session bus.
+ *
+ * The event loops of the shards are not started until #subd_shards_start is
+ * called, so objects can be registered on them before.
+ * @param service_name The well-known name of the service.
+ * @param count The number of shards.
+ * @param err Will contain error information in case of failure.
+ * @return A pointer to the created shards, or @c NULL.
+ */
+struct subd_shards *subd_shards_open(const char *service_name, int count,
+	DBusError *err);
+
+/**
+ * @brief Starts the event loop threads of the shards.
+ *
+ * @param shards A pointer to the shards.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_shards_start(struct subd_shards *shards, DBusError *err);
+
+/**
+ * @brief Stops the event loop threads of the shards, and closes them.
+ *
+ * @param shards A pointer to the shards.
+ */
+void subd_shards_free(struct subd_shards *shards);
+
+/**
+ * @brief Returns the number of shards.
+ *
+ * @param shards A pointer to the shards.
+ * @return The number of shards.
+ */
+int subd_shards_count(const struct subd_shards *shards);
+
+/**
+ * @brief Returns the connection of a shard.
+ *
+ * Every function that takes a connection can be used on it (e.g. to set the
+ * priorities of the shard). Functions that change registrations should be
+ * called before the shards are started.
+ * @param shards A pointer to the shards.
+ * @param index The index of the shard.
+ * @return The connection of the shard, or @c NULL if there is no such shard.
+ */
+DBusConnection *subd_shards_get_connection(const struct subd_shards *shards,
+	int index);
+
+/**
+ * @brief Returns the well-known name of a shard.
+ *
+ * @param shards A pointer to the shards.
+ * @param index The index of the shard.
+ * @return The name of the shard, or @c NULL if there is no such shard.
+ */
+const char *subd_shards_get_name(const struct subd_shards *shards,
+	int index);
+
+/**
+ * @brief Registers an object on every shard.
+ *
+ * This is the same as calling #subd_add_object_vtable on the connection of
+ * every shard. If it fails on a shard, the interface is removed from the
+ * shards it was added to. The handlers are called from the threads of every
+ * shard at the same time, so they, and @p userdata have to be thread-safe.
+ * @param shards A pointer to the shards.
+ * @param path The object path to register.
+ * @param interface The name of the interface.
+ * @param members The members of the interface.
+ * @param userdata Arbitrary data to pass to the handlers.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_shards_add_object_vtable(struct subd_shards *shards,
+	const char *path, const char *interface,
+	const struct subd_member *members, void *userdata, DBusError *err);
+
+/**
+ * @brief Enables per-method call statistics on every shard.
+ *
+ * @param shards A pointer to the shards.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_shards_enable_stats(struct subd_shards *shards,
+	DBusError *err);
+
+/**
+ * @brief Starts recording trace events.
+ *
+ * Every thread records the events of the event loops, dispatching, method
+ * handlers and sending into its own ring buffer of @p events events, without
+ * taking locks. When a ring is full, its oldest events are overwritten. The
+ * size only applies to the rings of threads that did not record any events
+ * yet. Tracing is process-wide, and disabled by default.
+ * @param events The number of events kept per thread, rounded up to a power
+ *               of two.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_trace_start(int events, DBusError *err);
+
+/**
+ * @brief Stops recording trace events.
+ *
+ * The recorded events are kept, so they can still be dumped.
+ */
+void subd_trace_stop(void);
+
+/**
+ * @brief Writes the recorded trace events to a file.
+ *
+ * The file is in a compact binary format, which can be converted to the
+ * Chrome trace event format (viewable in @c chrome://tracing or Perfetto) with
+ * the @c subd-trace2json tool.
+ * @param path The path of the file.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_trace_dump(const char *path, DBusError *err);
+
+/**
+ * @brief Writes the recorded trace events to a file when a signal arrives.
+ *
+ * This function installs a handler for @p signo, which wakes up a thread that
+ * calls #subd_trace_dump with @p path, so a trace can be taken from a running
+ * service (e.g. with <tt>kill -USR1</tt>) after a latency spike.
+ * @param signo The signal to dump the trace on.
+ * @param path The path of the file.
+ * @param err Will contain error information in case of failure.
+ * @return A @c bool that represents success or failure.
+ */
+dbus_bool_t subd_trace_dump_on_signal(int signo, const char *path,
+	DBusError *err);
+
 #endif
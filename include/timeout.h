@@ -0,0 +1,35 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include <stdbool.h>
+
+#include <dbus/dbus.h>
+
+#include "timer-wheel.h"
+
+struct subd_timeouts;
+
+/**
+ * A timer on the same wheel as the DBus timeouts. The function is called from
+ * the event loop, without any lock held. Periodic timers (with a non-zero
+ * interval) are rescheduled before the function is called.
+ */
+struct subd_timer {
+	struct wheel_timer wheel_timer;	// must be the first member
+	void (*function)(struct subd_timer *timer);
+	unsigned int interval;
+};
+
+struct subd_timeouts *timeouts_create(DBusConnection *conn, DBusError *err);
+void timeouts_destroy(DBusConnection *conn, struct subd_timeouts *timeouts);
+struct subd_timeouts *timeouts_get(DBusConnection *conn);
+int timeouts_get_fd(const struct subd_timeouts *timeouts);
+void timeouts_handle(struct subd_timeouts *timeouts);
+void timer_init(struct subd_timer *timer,
+	void (*function)(struct subd_timer *timer));
+void timer_schedule(struct subd_timeouts *timeouts, struct subd_timer *timer,
+	unsigned int delay);
+void timer_cancel(struct subd_timeouts *timeouts, struct subd_timer *timer);
+bool timer_stop(struct subd_timeouts *timeouts, struct subd_timer *timer);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;
+	uint64_t expires;
+	int slot;	// level * WHEEL_SLOTS + index, or -1 if not in the wheel
+};
+
+struct timer_wheel {
+	uint64_t now;
+	uint64_t occupied[WHEEL_LEVELS];
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void wheel_init(struct timer_wheel *wheel, uint64_t now);
+void wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+	uint64_t expires);
+void wheel_remove(struct timer_wheel *wheel, struct wheel_timer *timer);
+bool wheel_pending(const struct wheel_timer *timer);
+uint64_t wheel_next_expiry(const struct timer_wheel *wheel);
+void wheel_advance(struct timer_wheel *wheel, uint64_t now,
+	struct wheel_timer **expired);
+
+#endif
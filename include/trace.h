@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <dbus/dbus.h>
+
+/*
+ * A trace file starts with TRACE_MAGIC, followed by uint32_t values of the
+ * format version and the number of names. Every name is a uint32_t length
+ * followed by that many bytes (no terminator), and names are numbered from 0
+ * in the order they appear. Then comes the number of threads, and for every
+ * thread its number, the number of its events, and the events themselves as
+ * struct trace_event. Everything is in host byte order.
+ */
+#define TRACE_MAGIC "SUBDTRC\n"
+#define TRACE_VERSION 1
+
+enum trace_type {
+	TRACE_WAKEUP,			// the event loop woke up, arg: ready descriptors
+	TRACE_DISPATCH_BEGIN,	// a message reached an object, arg: serial
+	TRACE_DISPATCH_END,		// arg: serial
+	TRACE_HANDLER_ENTER,	// id: method name, arg: serial
+	TRACE_HANDLER_EXIT,		// id: method name, arg: 1 on success, 0 on error
+	TRACE_SEND,				// id: message type, arg: serial
+	TRACE_OUTGOING,			// arg: bytes in the outgoing queue
+};
+
+struct trace_event {
+	uint64_t time;		// CLOCK_MONOTONIC in nanoseconds
+	uint64_t arg;
+	uint32_t type;
+	uint32_t id;
+};
+
+extern atomic_bool trace_enabled;
+
+void trace_record(enum trace_type type, uint32_t id, uint64_t arg);
+uint32_t trace_name(const char *path, const char *interface,
+	const char *member);
+void trace_send(DBusConnection *conn, DBusMessage *msg);
+
+/**
+ * Records an event if tracing is enabled. When it is not, this costs a single
+ * relaxed load.
+ */
+static inline void trace(enum trace_type type, uint32_t id, uint64_t arg) {
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+		trace_record(type, id, arg);
+	}
+}
+
+/**
+ * Records that "msg" was queued on "conn", if tracing is enabled.
+ */
+static inline void trace_sent(DBusConnection *conn, DBusMessage *msg) {
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+		trace_send(conn, msg);
+	}
+}
+
+static inline bool tracing(void) {
+	return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef VTABLE_H
+#define VTABLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "hashmap.h"
+#include "memo.h"
+#include "subd.h"
+#ifdef HAVE_TIMERFD
+#include "timeout.h"
+#endif
+
+// libdbus does not define this one.
+#define INTERFACE_OBJECT_MANAGER "org.freedesktop.DBus.ObjectManager"
+
+/**
+ * Members are indexed by "interface.member" keys. Member names can not contain
+ * dots, so the key is unambiguous, and it always fits into this size.
+ */
+#define METHOD_KEY_SIZE (2 * DBUS_MAXIMUM_NAME_LENGTH + 2)
+
+/**
+ * An interface registered on a path. Besides the members, it holds the cached
+ * GetAll reply of its properties, and the properties that changed since the
+ * last PropertiesChanged signal. The interface is on the registry's changed
+ * list whenever changed_length is not zero.
+ *
+ * The interface, its name and its methods are allocated in one block. The
+ * path holds a reference to it while it is registered, and whoever uses it
+ * without the mutex held (e.g. an offloaded method call) holds another one,
+ * which also keeps the path alive. The block is freed with the last one.
+ */
+struct interface {
+	const struct subd_member *members;
+	struct path *path;
+	atomic_int refs;
+	DBusMessage *properties;
+	unsigned int generation;	// incremented when the cache is invalidated
+	bool removed;		// set when it is removed from its path
+	const struct subd_member **changed;
+	int changed_capacity;
+	int changed_length;
+	struct interface *next_changed;
+	struct method *methods;	// the method type members, indexed by the path
+	char *xml;		// introspection fragment, generated on demand
+	size_t xml_length;
+	char name[];
+};
+
+/**
+ * A method registered on a path. The method index maps keys to these, so a
+ * single lookup finds both the member and its statistics.
+ */
+struct method {
+	const struct subd_member *member;
+	struct interface *interface;
+	atomic_int stats_id;	// assigned on the first recorded call, or -1
+	atomic_int trace_id;	// assigned on the first traced call, or -1
+};
+
+/**
+ * A method call that was put aside by vtable_dispatch because of its priority.
+ * The message and the path are referenced until the call is dispatched.
+ */
+struct deferred_call {
+	struct method *method;
+	DBusMessage *msg;
+	uint64_t queued;
+	struct deferred_call *next;
+};
+
+/**
+ * The per-connection registry of object paths. It is attached to the
+ * connection using a libdbus data slot, so connections don't share it. The
+ * mutex protects the path map, the interface lists, the introspection and
+ * property caches, the change lists, and the deferred calls.
+ */
+struct registry {
+#ifdef HAVE_TIMERFD
+	struct subd_timer timer;	// must be the first member
+	struct subd_timeouts *timeouts;	// the timeouts the timer was scheduled on
+#endif
+	DBusConnection *conn;
+	struct hashmap_t *paths;
+	struct subd_pool *pool;
+	struct interface *changed;
+	struct manager *managers;
+	struct stats *_Atomic stats;	// NULL unless statistics are enabled
+	struct memo *_Atomic memo;	// NULL unless a cacheable method is registered
+	struct hashmap_t *priorities;	// NULL unless priorities are set
+	struct deferred_call *deferred[2];	// normal and low priority calls
+	struct deferred_call *deferred_tail[2];
+	unsigned long deferrals;	// incremented whenever a call is deferred
+	bool deferring;				// true while dispatch_messages runs
+	unsigned int budget_messages;
+	unsigned int budget_time;	// in microseconds
+	pthread_mutex_t mutex;
+	pthread_mutex_t paths_mutex;	// held while paths are (un)registered
+};
+
+/**
+ * A registered object path. This is also the user data libdbus passes to
+ * vtable_dispatch, so it has everything needed to dispatch a method call. The
+ * cached Introspect reply is dropped whenever an interface is added or
+ * removed, and it is built again from the interfaces' fragments on the next
+ * call.
+ *
+ * The name of the path is allocated from the path's arena. The path is
+ * referenced by the registry, by libdbus while it is registered, and by
+ * whoever uses it without the mutex held (e.g. the handler of a Properties
+ * method).
+ */
+struct path {
+	char *path;
+	DBusMessage *introspection;
+	struct interface **interfaces;	// in the order they were added
+	int interfaces_capacity;
+	int interfaces_length;
+	struct hashmap_t *interface_map;
+	struct hashmap_t *methods;
+	struct hashmap_t *properties;
+	struct registry *registry;
+	struct manager *manager;	// the object manager of this path, or NULL
+	void *userdata;
+	atomic_int refs;
+	struct arena arena;
+};
+
+/**
+ * An object manager, and the paths below it that it manages. A path is
+ * managed by the closest object manager above it.
+ */
+struct manager {
+	struct path *path;
+	struct path **objects;
+	int capacity;
+	int length;
+	struct manager *next;
+};
+
+extern const struct subd_member properties_members[];
+
+struct path *add_object(DBusConnection *conn, const char *path_name,
+	const char *interface, const struct subd_member *members,
+	void *userdata, int *added, DBusError *err);
+void path_ref(struct path *path);
+void path_unref(struct path *path);
+void interface_ref(struct interface *interface);
+void interface_unref(struct interface *interface);
+dbus_bool_t send_cached_reply(DBusConnection *conn, DBusMessage *msg,
+	DBusMessage *cache, DBusError *err);
+size_t method_key(char *key, const char *interface, const char *member);
+struct registry *get_registry(DBusConnection *conn);
+struct registry *find_registry(DBusConnection *conn);
+bool dispatch_messages(DBusConnection *conn);
+struct path *find_path(DBusConnection *conn, const char *path_name);
+bool append_cached_properties(DBusConnection *conn, struct interface *interface,
+	DBusMessageIter *iter, DBusError *err);
+void release_properties(struct interface *interface);
+void properties_flush(DBusConnection *conn);
+bool manage_path(struct registry *registry, struct path *path);
+void unmanage_path(struct registry *registry, struct path *path);
+void release_manager(struct registry *registry, struct path *path);
+DBusMessage *new_interfaces_added(DBusConnection *conn, struct path *path,
+	int added);
+DBusMessage *new_interfaces_removed(struct path *path,
+	const char *const *names, int count);
+void free_managers(struct registry *registry);
+#ifdef HAVE_TIMERFD
+void properties_timer(struct subd_timer *timer);
+#endif
+
+#endif
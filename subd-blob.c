@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "subd.h"
+#include "trace.h"
+
+#define INLINE_SIGNATURE "ay"
+#define MEMFD_SIGNATURE "(ht)"
+
+#ifdef HAVE_MEMFD
+#define BLOB_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#endif
+
+static _Atomic size_t threshold = 64 * 1024;
+
+void subd_set_blob_threshold(size_t size) {
+	atomic_store_explicit(&threshold, size, memory_order_relaxed);
+}
+
+/**
+ * Helper function that appends "data" as an "ay" variant.
+ */
+static bool append_inline(DBusMessageIter *iter, const void *data,
+		size_t length, DBusError *err) {
+	if (length > DBUS_MAXIMUM_ARRAY_LENGTH) {
+		dbus_set_error(err, DBUS_ERROR_LIMITS_EXCEEDED,
+			"Blob of %zu bytes is too large to be sent inline", length);
+		return false;
+	}
+
+	DBusMessageIter variant, array;
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT,
+			INLINE_SIGNATURE, &variant)) {
+		goto error;
+	}
+	if (!dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY,
+			DBUS_TYPE_BYTE_AS_STRING, &array)) {
+		dbus_message_iter_abandon_container(iter, &variant);
+		goto error;
+	}
+	// libdbus dereferences the pointer even for empty arrays.
+	const void *bytes = length > 0 ? data : "";
+	if (!dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &bytes,
+				(int)length) ||
+			!dbus_message_iter_close_container(&variant, &array)) {
+		dbus_message_iter_abandon_container(&variant, &array);
+		dbus_message_iter_abandon_container(iter, &variant);
+		goto error;
+	}
+	if (!dbus_message_iter_close_container(iter, &variant)) {
+		goto error;
+	}
+
+	return true;
+
+error:
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return false;
+}
+
+#ifdef HAVE_MEMFD
+/**
+ * Helper function that copies "data" into a new memfd, and seals it, so that
+ * its size and contents can not change anymore. Returns the file descriptor,
+ * or -1.
+ */
+static int create_memfd(const void *data, size_t length, DBusError *err) {
+	int fd = memfd_create("subd-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		goto error;
+	}
+
+	const char *p = data;
+	size_t left = length;
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto error;
+		}
+		p += n;
+		left -= n;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, BLOB_SEALS | F_SEAL_SEAL) == -1) {
+		goto error;
+	}
+
+	return fd;
+
+error:
+	dbus_set_error(err, DBUS_ERROR_FAILED, "Could not create memfd: %s",
+		strerror(errno));
+	if (fd != -1) {
+		close(fd);
+	}
+	return -1;
+}
+
+/**
+ * Helper function that appends "data" as a "(ht)" variant, with the contents
+ * in a sealed memfd.
+ */
+static bool append_memfd(DBusMessageIter *iter, const void *data,
+		size_t length, DBusError *err) {
+	int fd = create_memfd(data, length, err);
+	if (fd == -1) {
+		return false;
+	}
+
+	// The file descriptor is duplicated by libdbus, ours can be closed.
+	dbus_uint64_t size = length;
+	DBusMessageIter variant, entry;
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT,
+			MEMFD_SIGNATURE, &variant)) {
+		goto error;
+	}
+	if (!dbus_message_iter_open_container(&variant, DBUS_TYPE_STRUCT, NULL,
+			&entry)) {
+		dbus_message_iter_abandon_container(iter, &variant);
+		goto error;
+	}
+	if (!dbus_message_iter_append_basic(&entry, DBUS_TYPE_UNIX_FD, &fd) ||
+			!dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &size) ||
+			!dbus_message_iter_close_container(&variant, &entry)) {
+		dbus_message_iter_abandon_container(&variant, &entry);
+		dbus_message_iter_abandon_container(iter, &variant);
+		goto error;
+	}
+	if (!dbus_message_iter_close_container(iter, &variant)) {
+		goto error;
+	}
+
+	close(fd);
+	return true;
+
+error:
+	close(fd);
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return false;
+}
+#endif
+
+dbus_bool_t subd_blob_append(DBusConnection *conn, DBusMessageIter *iter,
+		const void *data, size_t length, DBusError *err) {
+#ifdef HAVE_MEMFD
+	if (length >= atomic_load_explicit(&threshold, memory_order_relaxed) &&
+			dbus_connection_can_send_type(conn, DBUS_TYPE_UNIX_FD)) {
+		return append_memfd(iter, data, length, err);
+	}
+#endif
+	return append_inline(iter, data, length, err);
+}
+
+/**
+ * Helper function that maps "length" bytes of the file "fd" read-only. On
+ * Linux, the file has to be a memfd sealed against writing and shrinking, so
+ * the contents can't change, and the mapping can't fault while it is read.
+ */
+static bool map_memfd(int fd, size_t length, struct subd_blob *blob,
+		DBusError *err) {
+#ifdef HAVE_MEMFD
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals == -1 || (seals & BLOB_SEALS) != BLOB_SEALS) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Blob file descriptor is not sealed");
+		return false;
+	}
+#endif
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "Could not stat blob: %s",
+			strerror(errno));
+		return false;
+	}
+	if (st.st_size < 0 || (uintmax_t)st.st_size < length) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Blob file is smaller than its length");
+		return false;
+	}
+
+	if (length == 0) {
+		blob->data = NULL;
+		blob->length = 0;
+		return true;
+	}
+
+	void *mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "Could not map blob: %s",
+			strerror(errno));
+		return false;
+	}
+
+	blob->data = mapping;
+	blob->length = length;
+	blob->mapping = mapping;
+	return true;
+}
+
+dbus_bool_t subd_blob_read(DBusMessageIter *iter, struct subd_blob *blob,
+		DBusError *err) {
+	blob->data = NULL;
+	blob->length = 0;
+	blob->mapping = NULL;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS, "Expected a blob variant");
+		return FALSE;
+	}
+
+	DBusMessageIter variant;
+	dbus_message_iter_recurse(iter, &variant);
+	char *signature = dbus_message_iter_get_signature(&variant);
+	if (signature == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	bool ret = false;
+	if (strcmp(signature, INLINE_SIGNATURE) == 0) {
+		// The view points into the message, nothing is copied.
+		DBusMessageIter array;
+		int length;
+		dbus_message_iter_recurse(&variant, &array);
+		dbus_message_iter_get_fixed_array(&array, &blob->data, &length);
+		blob->length = length;
+		ret = true;
+	} else if (strcmp(signature, MEMFD_SIGNATURE) == 0) {
+		DBusMessageIter entry;
+		int fd;
+		dbus_uint64_t length;
+		dbus_message_iter_recurse(&variant, &entry);
+		// The file descriptor is duplicated by libdbus, it is ours to close.
+		dbus_message_iter_get_basic(&entry, &fd);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_get_basic(&entry, &length);
+		if (length > SIZE_MAX) {
+			dbus_set_error(err, DBUS_ERROR_LIMITS_EXCEEDED,
+				"Blob is too large to be mapped");
+		} else {
+			ret = map_memfd(fd, length, blob, err);
+		}
+		close(fd);
+	} else {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Blob variant has unexpected signature %s", signature);
+	}
+	dbus_free(signature);
+
+	if (ret) {
+		dbus_message_iter_next(iter);
+	}
+	return ret;
+}
+
+void subd_blob_release(struct subd_blob *blob) {
+	if (blob->mapping != NULL) {
+		munmap(blob->mapping, blob->length);
+		blob->mapping = NULL;
+	}
+	blob->data = NULL;
+	blob->length = 0;
+}
+
+dbus_bool_t subd_reply_blob(DBusConnection *conn, DBusMessage *msg,
+		const void *data, size_t length, DBusError *err) {
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	DBusMessageIter iter;
+	dbus_message_iter_init_append(reply, &iter);
+	if (!subd_blob_append(conn, &iter, data, length, err)) {
+		dbus_message_unref(reply);
+		return FALSE;
+	}
+
+	dbus_bool_t ret = dbus_connection_send(conn, reply, NULL);
+	if (ret) {
+		trace_sent(conn, reply);
+	}
+	dbus_message_unref(reply);
+	if (!ret) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return ret;
+}
@@ -0,0 +1,220 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "subd.h"
+
+/**
+ * A call waiting for its reply. The completion function might be called both
+ * by libdbus and by subd_call_async (if the reply arrived before the notify
+ * function was set), the flag makes sure only one of them runs it.
+ */
+struct call {
+	subd_reply_function function;
+	void *data;
+	atomic_flag completed;
+};
+
+struct queued_call {
+	DBusMessage *msg;
+	int timeout;
+	subd_reply_function function;
+	void *data;
+};
+
+struct subd_batch {
+	DBusConnection *conn;
+	struct queued_call *calls;
+	int capacity;
+	int length;
+};
+
+static void complete_call(DBusPendingCall *pending, void *data) {
+	struct call *call = data;
+	if (atomic_flag_test_and_set(&call->completed)) {
+		return;
+	}
+
+	DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+	if (call->function != NULL) {
+		call->function(reply, call->data);
+	}
+	if (reply != NULL) {
+		dbus_message_unref(reply);
+	}
+
+	// This is the reference returned by dbus_connection_send_with_reply. The
+	// call itself is freed when the pending call is finalized.
+	dbus_pending_call_unref(pending);
+}
+
+/**
+ * Helper function that sends "msg", and makes sure "function" is called when
+ * the reply arrives (or the call times out).
+ */
+static dbus_bool_t send_call(DBusConnection *conn, DBusMessage *msg,
+		int timeout, subd_reply_function function, void *data,
+		DBusError *err) {
+	struct call *call = malloc(sizeof(struct call));
+	if (call == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	call->function = function;
+	call->data = data;
+	atomic_flag_clear(&call->completed);
+
+	DBusPendingCall *pending = NULL;
+	if (!dbus_connection_send_with_reply(conn, msg, &pending, timeout)) {
+		free(call);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	if (pending == NULL) {
+		free(call);
+		dbus_set_error(err, DBUS_ERROR_DISCONNECTED,
+			"Connection is closed.");
+		return FALSE;
+	}
+
+	// Once the notify function is set, an other thread can complete the call,
+	// which releases the reference above. This one keeps both the pending
+	// call and "call" (freed with it) alive until the check below is done.
+	dbus_pending_call_ref(pending);
+	if (!dbus_pending_call_set_notify(pending, complete_call, call, free)) {
+		dbus_pending_call_cancel(pending);
+		dbus_pending_call_unref(pending);
+		dbus_pending_call_unref(pending);
+		free(call);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	// The reply might have been dispatched by an other thread before the
+	// notify function was set. The completed flag makes sure only one of
+	// the two runs the completion.
+	if (dbus_pending_call_get_completed(pending)) {
+		complete_call(pending, call);
+	}
+	dbus_pending_call_unref(pending);
+
+	return TRUE;
+}
+
+/**
+ * Helper function that creates a method call message, and appends the
+ * arguments in "ap" to it.
+ */
+static DBusMessage *new_call(const char *destination, const char *path,
+		const char *interface, const char *method, int first_arg_type,
+		va_list ap) {
+	DBusMessage *msg =
+		dbus_message_new_method_call(destination, path, interface, method);
+	if (msg == NULL) {
+		return NULL;
+	}
+
+	if (!dbus_message_append_args_valist(msg, first_arg_type, ap)) {
+		dbus_message_unref(msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+dbus_bool_t subd_call_async(DBusConnection *conn, const char *destination,
+		const char *path, const char *interface, const char *method,
+		int timeout, subd_reply_function function, void *data,
+		DBusError *err, ...) {
+	va_list ap;
+	va_start(ap, err);
+	DBusMessage *msg = new_call(destination, path, interface, method,
+		va_arg(ap, int), ap);
+	va_end(ap);
+	if (msg == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	dbus_bool_t ret = send_call(conn, msg, timeout, function, data, err);
+	dbus_message_unref(msg);
+	return ret;
+}
+
+struct subd_batch *subd_batch_new(DBusConnection *conn) {
+	struct subd_batch *batch = malloc(sizeof(struct subd_batch));
+	if (batch == NULL) {
+		return NULL;
+	}
+	batch->conn = conn;
+	batch->calls = NULL;
+	batch->capacity = 0;
+	batch->length = 0;
+	return batch;
+}
+
+void subd_batch_free(struct subd_batch *batch) {
+	for (int i = 0; i < batch->length; ++i) {
+		dbus_message_unref(batch->calls[i].msg);
+	}
+	free(batch->calls);
+	free(batch);
+}
+
+dbus_bool_t subd_batch_call(struct subd_batch *batch, const char *destination,
+		const char *path, const char *interface, const char *method,
+		int timeout, subd_reply_function function, void *data,
+		DBusError *err, ...) {
+	if (batch->length == batch->capacity) {
+		int c = batch->capacity == 0 ? 16 : batch->capacity * 2;
+		void *t = realloc(batch->calls, sizeof(struct queued_call) * c);
+		if (t == NULL) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			return FALSE;
+		}
+		batch->calls = t;
+		batch->capacity = c;
+	}
+
+	va_list ap;
+	va_start(ap, err);
+	DBusMessage *msg = new_call(destination, path, interface, method,
+		va_arg(ap, int), ap);
+	va_end(ap);
+	if (msg == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	batch->calls[batch->length++] = (struct queued_call){
+		.msg = msg,
+		.timeout = timeout,
+		.function = function,
+		.data = data,
+	};
+	return TRUE;
+}
+
+dbus_bool_t subd_batch_flush(struct subd_batch *batch, DBusError *err) {
+	// All messages are already marshalled, so they are queued back to back.
+	// They are written by the event loop, which libdbus wakes up.
+	int sent = 0;
+	dbus_bool_t ret = TRUE;
+	for (; sent < batch->length; ++sent) {
+		struct queued_call *call = &batch->calls[sent];
+		if (!send_call(batch->conn, call->msg, call->timeout, call->function,
+				call->data, err)) {
+			ret = FALSE;
+			break;
+		}
+		dbus_message_unref(call->msg);
+	}
+
+	// Calls that could not be sent stay in the batch.
+	for (int i = sent; i < batch->length; ++i) {
+		batch->calls[i - sent] = batch->calls[i];
+	}
+	batch->length -= sent;
+
+	return ret;
+}
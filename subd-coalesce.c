@@ -0,0 +1,438 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coalesce.h"
+#include "hashmap.h"
+#include "subd.h"
+#ifdef HAVE_TIMERFD
+#include "timeout.h"
+#endif
+
+/**
+ * A coalesced signal, identified by its path, interface and name. It holds the
+ * messages emitted since the signal was last sent: only the latest one with
+ * SUBD_COALESCE_LATEST, all of them with SUBD_COALESCE_ACCUMULATE. Signals
+ * are forgotten once nothing is pending and their rate limit has passed, so
+ * the coalescer doesn't grow with every path that ever emitted one.
+ */
+struct coalesced_signal {
+#ifdef HAVE_TIMERFD
+	struct subd_timer timer;	// must be the first member
+	struct subd_timeouts *timeouts;	// the timeouts the timer was scheduled on
+#endif
+	struct coalescer *coalescer;
+	enum subd_coalesce_policy policy;
+	unsigned int interval;
+	uint64_t last_sent;
+	bool dirty;
+	DBusMessage **messages;
+	int capacity;
+	int length;
+	struct coalesced_signal *next_dirty;
+	char key[];
+};
+
+/**
+ * The per-connection state of the coalescer. Signals are put on the dirty list
+ * when they are emitted, and the list is flushed once per event loop
+ * iteration. Signals that can't be sent yet because of their rate limit are
+ * sent by a timer (if the event loop has timeouts), or on a later iteration.
+ */
+struct coalescer {
+	DBusConnection *conn;
+	struct hashmap_t *signals;
+	struct coalesced_signal *dirty;
+	pthread_mutex_t mutex;
+};
+
+static dbus_int32_t coalescer_slot = -1;
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void clear_messages(struct coalesced_signal *signal) {
+	for (int i = 0; i < signal->length; ++i) {
+		dbus_message_unref(signal->messages[i]);
+	}
+	signal->length = 0;
+}
+
+static void free_signal(void *data) {
+	struct coalesced_signal *signal = data;
+#ifdef HAVE_TIMERFD
+	if (signal->timeouts != NULL) {
+		timer_cancel(signal->timeouts, &signal->timer);
+	}
+#endif
+	clear_messages(signal);
+	free(signal->messages);
+	free(signal);
+}
+
+static void free_coalescer(void *data) {
+	struct coalescer *coalescer = data;
+	hashmap_destroy(coalescer->signals, free_signal);
+	pthread_mutex_destroy(&coalescer->mutex);
+	free(coalescer);
+	dbus_connection_free_data_slot(&coalescer_slot);
+}
+
+/**
+ * Helper function that merges accumulated messages into one signal, in which
+ * every argument is an array of the values of that argument in the original
+ * messages. Returns NULL if the messages have non-basic arguments.
+ */
+static DBusMessage *merge_messages(struct coalesced_signal *signal) {
+	DBusMessage *first = signal->messages[0];
+	DBusMessage *merged = dbus_message_new_signal(dbus_message_get_path(first),
+		dbus_message_get_interface(first), dbus_message_get_member(first));
+	if (merged == NULL) {
+		return NULL;
+	}
+
+	DBusMessageIter out;
+	dbus_message_iter_init_append(merged, &out);
+
+	DBusMessageIter first_iter;
+	int index = 0;
+	bool has_args = dbus_message_iter_init(first, &first_iter);
+	while (has_args) {
+		int type = dbus_message_iter_get_arg_type(&first_iter);
+		if (!dbus_type_is_basic(type)) {
+			dbus_message_unref(merged);
+			return NULL;
+		}
+
+		char element[2] = {(char)type, '\0'};
+		DBusMessageIter array;
+		if (!dbus_message_iter_open_container(&out, DBUS_TYPE_ARRAY, element,
+				&array)) {
+			dbus_message_unref(merged);
+			return NULL;
+		}
+		for (int i = 0; i < signal->length; ++i) {
+			DBusMessageIter iter;
+			bool valid = dbus_message_iter_init(signal->messages[i], &iter);
+			for (int j = 0; valid && j < index; ++j) {
+				valid = dbus_message_iter_next(&iter);
+			}
+			DBusBasicValue value;
+			if (!valid || dbus_message_iter_get_arg_type(&iter) != type) {
+				dbus_message_iter_abandon_container(&out, &array);
+				dbus_message_unref(merged);
+				return NULL;
+			}
+			dbus_message_iter_get_basic(&iter, &value);
+			if (!dbus_message_iter_append_basic(&array, type, &value)) {
+				dbus_message_iter_abandon_container(&out, &array);
+				dbus_message_unref(merged);
+				return NULL;
+			}
+		}
+		if (!dbus_message_iter_close_container(&out, &array)) {
+			dbus_message_unref(merged);
+			return NULL;
+		}
+
+		has_args = dbus_message_iter_next(&first_iter);
+		++index;
+	}
+
+	return merged;
+}
+
+/**
+ * Helper function that puts "signal" on the dirty list, unless it is on it
+ * already. Must be called with the mutex held.
+ */
+static void mark_dirty(struct coalescer *coalescer,
+		struct coalesced_signal *signal) {
+	if (!signal->dirty) {
+		signal->dirty = true;
+		signal->next_dirty = coalescer->dirty;
+		coalescer->dirty = signal;
+	}
+}
+
+/**
+ * Sends the pending messages of "signal". Must be called with the mutex held.
+ */
+static void send_signal(struct coalescer *coalescer,
+		struct coalesced_signal *signal, uint64_t now) {
+	if (signal->length == 0) {
+		return;
+	}
+
+	DBusMessage *merged = NULL;
+	if (signal->policy == SUBD_COALESCE_ACCUMULATE) {
+		merged = merge_messages(signal);
+	}
+
+	if (merged != NULL) {
+		dbus_connection_send(coalescer->conn, merged, NULL);
+		dbus_message_unref(merged);
+	} else {
+		// With SUBD_COALESCE_LATEST there is only one message. If merging
+		// accumulated messages failed, they are sent one by one.
+		for (int i = 0; i < signal->length; ++i) {
+			dbus_connection_send(coalescer->conn, signal->messages[i], NULL);
+		}
+	}
+
+	clear_messages(signal);
+	signal->last_sent = now;
+}
+
+#ifdef HAVE_TIMERFD
+static void handle_timer(struct subd_timer *timer) {
+	struct coalesced_signal *signal = (struct coalesced_signal *)timer;
+	struct coalescer *coalescer = signal->coalescer;
+	pthread_mutex_lock(&coalescer->mutex);
+	send_signal(coalescer, signal, now_ms());
+	// The next flush forgets the signal once its rate limit has passed.
+	mark_dirty(coalescer, signal);
+	pthread_mutex_unlock(&coalescer->mutex);
+}
+#endif
+
+/**
+ * Helper function that stops the timer of "signal", and returns true if the
+ * signal can be freed. Must be called with the mutex held.
+ */
+static bool stop_timer(struct coalesced_signal *signal) {
+#ifdef HAVE_TIMERFD
+	// Timeouts other than the current ones were destroyed with their event
+	// loop, which unscheduled the timer.
+	if (signal->timeouts != NULL &&
+			signal->timeouts == timeouts_get(signal->coalescer->conn)) {
+		return timer_stop(signal->timeouts, &signal->timer);
+	}
+#endif
+	return true;
+}
+
+/**
+ * Helper function that returns the coalescer of "conn", creating it first if
+ * it does not exist yet. Returns NULL if out of memory.
+ */
+static struct coalescer *get_coalescer(DBusConnection *conn) {
+	struct coalescer *coalescer = NULL;
+	if (coalescer_slot != -1) {
+		coalescer = dbus_connection_get_data(conn, coalescer_slot);
+		if (coalescer != NULL) {
+			return coalescer;
+		}
+	}
+
+	if (!dbus_connection_allocate_data_slot(&coalescer_slot)) {
+		return NULL;
+	}
+
+	coalescer = malloc(sizeof(struct coalescer));
+	if (coalescer == NULL) {
+		dbus_connection_free_data_slot(&coalescer_slot);
+		return NULL;
+	}
+	coalescer->conn = conn;
+	coalescer->dirty = NULL;
+	coalescer->signals = hashmap_create(0);
+	if (coalescer->signals == NULL) {
+		free(coalescer);
+		dbus_connection_free_data_slot(&coalescer_slot);
+		return NULL;
+	}
+	pthread_mutex_init(&coalescer->mutex, NULL);
+
+	if (!dbus_connection_set_data(conn, coalescer_slot, coalescer,
+			free_coalescer)) {
+		free_coalescer(coalescer);
+		return NULL;
+	}
+
+	return coalescer;
+}
+
+/**
+ * Helper function that returns the coalesced signal for "key", creating it
+ * if necessary. Must be called with the mutex held.
+ */
+static struct coalesced_signal *get_signal(struct coalescer *coalescer,
+		const char *key) {
+	struct coalesced_signal *signal = hashmap_get(coalescer->signals, key);
+	if (signal != NULL) {
+		return signal;
+	}
+
+	signal = calloc(1, sizeof(struct coalesced_signal) + strlen(key) + 1);
+	if (signal == NULL) {
+		return NULL;
+	}
+	signal->coalescer = coalescer;
+	strcpy(signal->key, key);
+#ifdef HAVE_TIMERFD
+	timer_init(&signal->timer, handle_timer);
+#endif
+	if (hashmap_set(coalescer->signals, key, signal) == -1) {
+		free(signal);
+		return NULL;
+	}
+	return signal;
+}
+
+dbus_bool_t subd_emit_signal_coalesced(DBusConnection *conn, const char *path,
+		const char *interface, const char *name,
+		enum subd_coalesce_policy policy, unsigned int interval,
+		DBusError *err, ...) {
+	DBusMessage *msg = dbus_message_new_signal(path, interface, name);
+	if (msg == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	va_list ap;
+	va_start(ap, err);
+	if (!dbus_message_append_args_valist(msg, va_arg(ap, int), ap)) {
+		va_end(ap);
+		dbus_message_unref(msg);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	va_end(ap);
+
+	struct coalescer *coalescer = get_coalescer(conn);
+	if (coalescer == NULL) {
+		dbus_message_unref(msg);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	// Spaces are not allowed in any of the parts, so the key is unambiguous.
+	size_t size = strlen(path) + strlen(interface) + strlen(name) + 3;
+	char *key = malloc(size);
+	if (key == NULL) {
+		dbus_message_unref(msg);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	strcpy(key, path);
+	strcat(key, " ");
+	strcat(key, interface);
+	strcat(key, ".");
+	strcat(key, name);
+
+	pthread_mutex_lock(&coalescer->mutex);
+	struct coalesced_signal *signal = get_signal(coalescer, key);
+	free(key);
+	if (signal == NULL) {
+		goto error;
+	}
+
+	if (signal->policy != policy) {
+		// Don't mix messages coalesced with different policies.
+		send_signal(coalescer, signal, signal->last_sent);
+		signal->policy = policy;
+	}
+	signal->interval = interval;
+
+	if (policy == SUBD_COALESCE_LATEST) {
+		clear_messages(signal);
+	}
+	if (signal->length == signal->capacity) {
+		int c = signal->capacity == 0 ? 1 : signal->capacity * 2;
+		void *t = realloc(signal->messages, sizeof(DBusMessage *) * c);
+		if (t == NULL) {
+			goto error;
+		}
+		signal->messages = t;
+		signal->capacity = c;
+	}
+	signal->messages[signal->length++] = msg;
+	mark_dirty(coalescer, signal);
+
+#ifdef HAVE_TIMERFD
+	// The timer makes sure the signal is sent even if the event loop has
+	// nothing else to do. The timeouts are looked up every time, because the
+	// event loop might have been freed (and recreated) since the timer was
+	// last scheduled. That also unscheduled the timer, and timer_cancel
+	// doesn't touch the timeouts of unscheduled timers, so the stale pointer
+	// is never used.
+	struct subd_timeouts *timeouts = timeouts_get(conn);
+	if (timeouts != NULL && !wheel_pending(&signal->timer.wheel_timer)) {
+		uint64_t now = now_ms();
+		uint64_t due = signal->last_sent + signal->interval;
+		signal->timeouts = timeouts;
+		timer_schedule(timeouts, &signal->timer, due > now ? due - now : 0);
+	}
+#endif
+
+	pthread_mutex_unlock(&coalescer->mutex);
+	return TRUE;
+
+error:
+	pthread_mutex_unlock(&coalescer->mutex);
+	dbus_message_unref(msg);
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return FALSE;
+}
+
+void coalescer_flush(DBusConnection *conn) {
+	if (coalescer_slot == -1) {
+		return;
+	}
+	struct coalescer *coalescer = dbus_connection_get_data(conn, coalescer_slot);
+	if (coalescer == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&coalescer->mutex);
+	uint64_t now = now_ms();
+	struct coalesced_signal *signal = coalescer->dirty;
+	coalescer->dirty = NULL;
+	while (signal != NULL) {
+		struct coalesced_signal *save_next = signal->next_dirty;
+		signal->dirty = false;
+		bool due = now >= signal->last_sent + signal->interval;
+		if (signal->length > 0 && due) {
+			send_signal(coalescer, signal, now);
+#ifdef HAVE_TIMERFD
+			if (signal->timeouts != NULL) {
+				timer_cancel(signal->timeouts, &signal->timer);
+			}
+#endif
+			due = signal->interval == 0;
+		}
+
+		if (signal->length == 0 && due) {
+			// Nothing is pending and the rate limit has passed, so the
+			// signal is forgotten. If its timer is running, it is tried
+			// again on the next iteration.
+			if (stop_timer(signal)) {
+				hashmap_remove(coalescer->signals, signal->key);
+				free_signal(signal);
+			} else {
+				mark_dirty(coalescer, signal);
+			}
+		}
+#ifdef HAVE_TIMERFD
+		else if (signal->length > 0 && signal->timeouts != NULL &&
+				wheel_pending(&signal->timer.wheel_timer)) {
+			// The timer will send it, and put it back on the list.
+		}
+#endif
+		else {
+			// Try again on the next iteration.
+			mark_dirty(coalescer, signal);
+		}
+		signal = save_next;
+	}
+	pthread_mutex_unlock(&coalescer->mutex);
+}
@@ -1,4 +1,9 @@
+#include <stdlib.h>
+
+#include "memo.h"
+#include "plan.h"
 #include "subd.h"
+#include "trace.h"
 
 DBusConnection *subd_open_session(const char* service_name, DBusError *err) {
 	if (!dbus_threads_init_default()) {
@@ -19,6 +24,20 @@ DBusConnection *subd_open_session(const char* service_name, DBusError *err) {
 	return connection;
 }
 
+DBusConnection *subd_open_peer(const char *address, DBusError *err) {
+	if (!dbus_threads_init_default()) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	// A peer closing the connection should not terminate the process.
+	DBusConnection *connection = dbus_connection_open_private(address, err);
+	if (connection != NULL) {
+		dbus_connection_set_exit_on_disconnect(connection, FALSE);
+	}
+	return connection;
+}
+
 dbus_bool_t subd_emit_signal(DBusConnection *conn, const char *path,
 		const char *interface, const char *name, DBusError *err, ...) {
 	DBusMessage *signal = NULL;
@@ -36,6 +55,7 @@ dbus_bool_t subd_emit_signal(DBusConnection *conn, const char *path,
 	if (!dbus_connection_send(conn, signal, NULL)) {
 		goto error;
 	}
+	trace_sent(conn, signal);
 
 	dbus_message_unref(signal);
 	return TRUE;
@@ -46,6 +66,157 @@ error:
 	return FALSE;
 }
 
+/**
+ * A signal template is a signal message without a body. The header is built
+ * and validated once, emissions append the body to a copy of it.
+ */
+struct subd_signal_template {
+	DBusMessage *signal;
+};
+
+struct subd_signal_template *subd_signal_template_new(const char *path,
+		const char *interface, const char *name, DBusError *err) {
+	if (!dbus_validate_path(path, err) ||
+			!dbus_validate_interface(interface, err) ||
+			!dbus_validate_member(name, err)) {
+		return NULL;
+	}
+
+	struct subd_signal_template *tmpl =
+		malloc(sizeof(struct subd_signal_template));
+	if (tmpl == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	if ((tmpl->signal = dbus_message_new_signal(path, interface, name)) == NULL) {
+		free(tmpl);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	return tmpl;
+}
+
+void subd_signal_template_free(struct subd_signal_template *tmpl) {
+	dbus_message_unref(tmpl->signal);
+	free(tmpl);
+}
+
+/**
+ * Helper function that copies the template, and appends the arguments in "ap"
+ * to the copy.
+ */
+static DBusMessage *instantiate(const struct subd_signal_template *tmpl,
+		int first_arg_type, va_list ap) {
+	DBusMessage *signal = dbus_message_copy(tmpl->signal);
+	if (signal == NULL) {
+		return NULL;
+	}
+
+	if (!dbus_message_append_args_valist(signal, first_arg_type, ap)) {
+		dbus_message_unref(signal);
+		return NULL;
+	}
+
+	return signal;
+}
+
+dbus_bool_t subd_emit_signal_template(DBusConnection *conn,
+		const struct subd_signal_template *tmpl, DBusError *err, ...) {
+	va_list ap;
+	va_start(ap, err);
+	DBusMessage *signal = instantiate(tmpl, va_arg(ap, int), ap);
+	va_end(ap);
+	if (signal == NULL) {
+		goto error;
+	}
+
+	if (!dbus_connection_send(conn, signal, NULL)) {
+		dbus_message_unref(signal);
+		goto error;
+	}
+	trace_sent(conn, signal);
+
+	dbus_message_unref(signal);
+	return TRUE;
+
+error:
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return FALSE;
+}
+
+dbus_bool_t subd_emit_signal_encoded(DBusConnection *conn,
+		const struct subd_signal_template *tmpl, const struct subd_plan *plan,
+		const void *value, DBusError *err) {
+	DBusMessage *signal = dbus_message_copy(tmpl->signal);
+	if (signal == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	DBusMessageIter iter;
+	dbus_message_iter_init_append(signal, &iter);
+	if (!subd_message_encode(&iter, plan, value, err)) {
+		dbus_message_unref(signal);
+		return FALSE;
+	}
+
+	dbus_bool_t ret = dbus_connection_send(conn, signal, NULL);
+	if (ret) {
+		trace_sent(conn, signal);
+	}
+	dbus_message_unref(signal);
+	if (!ret) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return ret;
+}
+
+dbus_bool_t subd_emit_signal_fanout(DBusConnection *conn,
+		const struct subd_signal_template *tmpl, const char *const *paths,
+		int count, DBusError *err, ...) {
+	// The paths are checked first, so either all of the signals are sent, or
+	// none of them.
+	for (int i = 0; i < count; ++i) {
+		if (!dbus_validate_path(paths[i], err)) {
+			return FALSE;
+		}
+	}
+
+	// The body is marshalled only once, every path gets a copy of it.
+	va_list ap;
+	va_start(ap, err);
+	DBusMessage *body = instantiate(tmpl, va_arg(ap, int), ap);
+	va_end(ap);
+	if (body == NULL) {
+		goto error;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		DBusMessage *signal = dbus_message_copy(body);
+		if (signal == NULL) {
+			dbus_message_unref(body);
+			goto error;
+		}
+		if (!dbus_message_set_path(signal, paths[i]) ||
+				!dbus_connection_send(conn, signal, NULL)) {
+			dbus_message_unref(signal);
+			dbus_message_unref(body);
+			goto error;
+		}
+		trace_sent(conn, signal);
+		dbus_message_unref(signal);
+	}
+
+	dbus_message_unref(body);
+	return TRUE;
+
+error:
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return FALSE;
+}
+
 dbus_bool_t subd_reply_method_return(DBusConnection *conn, DBusMessage *msg,
 		DBusError *err, ...) {
 	DBusMessage *reply = NULL;
@@ -60,9 +231,11 @@ dbus_bool_t subd_reply_method_return(DBusConnection *conn, DBusMessage *msg,
 	}
 	va_end(ap);
 
+	memo_sent(reply);
 	if (!dbus_connection_send(conn, reply, NULL)) {
 		goto error;
 	}
+	trace_sent(conn, reply);
 
 	dbus_message_unref(reply);
 	return TRUE;
@@ -76,16 +249,63 @@ error:
 dbus_bool_t subd_message_read(DBusMessageIter *iter, DBusError *err, ...) {
 	va_list ap;
 	va_start(ap, err);
-	DBusBasicValue *ptr = NULL;
-	while ((ptr = va_arg(ap, DBusBasicValue *)) != NULL) {
-		dbus_message_iter_get_basic(iter, ptr);
-		if (!dbus_message_iter_next(iter)) {
+	void *ptr = NULL;
+	while ((ptr = va_arg(ap, void *)) != NULL) {
+		int type = dbus_message_iter_get_arg_type(iter);
+		if (type == DBUS_TYPE_INVALID) {
+			va_end(ap);
 			dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
 				"Message has less fields than requested");
 			return FALSE;
 		}
+
+		if (dbus_type_is_basic(type)) {
+			dbus_message_iter_get_basic(iter, ptr);
+		} else if (type == DBUS_TYPE_ARRAY && is_view_element(
+				dbus_message_iter_get_element_type(iter))) {
+			// The view points into the message, nothing is copied.
+			struct subd_array *array = ptr;
+			DBusMessageIter sub;
+			dbus_message_iter_recurse(iter, &sub);
+			dbus_message_iter_get_fixed_array(&sub, &array->data,
+				&array->length);
+		} else {
+			va_end(ap);
+			dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+				"Field of type %c can not be read, use subd_message_decode",
+				type);
+			return FALSE;
+		}
+		dbus_message_iter_next(iter);
 	}
 	va_end(ap);
 
 	return TRUE;
 }
+
+dbus_bool_t subd_reply_encoded(DBusConnection *conn, DBusMessage *msg,
+		const struct subd_plan *plan, const void *value, DBusError *err) {
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	DBusMessageIter iter;
+	dbus_message_iter_init_append(reply, &iter);
+	if (!subd_message_encode(&iter, plan, value, err)) {
+		dbus_message_unref(reply);
+		return FALSE;
+	}
+
+	memo_sent(reply);
+	dbus_bool_t ret = dbus_connection_send(conn, reply, NULL);
+	if (ret) {
+		trace_sent(conn, reply);
+	}
+	dbus_message_unref(reply);
+	if (!ret) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return ret;
+}
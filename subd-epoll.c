@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "coalesce.h"
+#include "queue.h"
+#include "stats.h"
+#include "subd.h"
+#include "timeout.h"
+#include "trace.h"
+#include "vtable.h"
+
+#define MAX_EVENTS 64
+#define MAX_SOURCE_WATCHES 4	// more are handled on later iterations
+
+/**
+ * A DBus watch on a source. A file descriptor can have more than one watch
+ * (e.g. the socket transport uses separate watches for reading and writing).
+ */
+struct watch_node {
+	DBusWatch *watch;
+	struct watch_node *next;
+};
+
+/**
+ * Everything registered on one file descriptor. Sources and watch nodes are
+ * never freed while subd_run_once might be using them, they are moved to the
+ * graveyard instead, and freed at the end of the next iteration.
+ */
+struct source {
+	int fd;
+	uint32_t events;		// events currently registered with epoll
+	uint32_t user_events;	// events requested by the user function
+	bool removed;
+	struct watch_node *watches;
+	subd_fd_function function;
+	void *data;
+	struct source *next_dead;
+};
+
+struct subd_epoll {
+	int fd;
+	struct source **sources;	// indexed by file descriptor
+	int capacity;
+	struct source *dead_sources;
+	struct watch_node *dead_watches;
+	struct subd_timeouts *timeouts;
+	struct subd_queue *queue;
+	pthread_mutex_t mutex;
+};
+
+static uint32_t flags_to_events(unsigned int flags) {
+	uint32_t events = 0;
+	if (flags & DBUS_WATCH_READABLE) {
+		events |= EPOLLIN;
+	}
+	if (flags & DBUS_WATCH_WRITABLE) {
+		events |= EPOLLOUT;
+	}
+	return events;
+}
+
+static unsigned int events_to_flags(uint32_t events) {
+	unsigned int flags = 0;
+	if (events & EPOLLIN) {
+		flags |= DBUS_WATCH_READABLE;
+	}
+	if (events & EPOLLOUT) {
+		flags |= DBUS_WATCH_WRITABLE;
+	}
+	if (events & EPOLLHUP) {
+		flags |= DBUS_WATCH_HANGUP;
+	}
+	if (events & EPOLLERR) {
+		flags |= DBUS_WATCH_ERROR;
+	}
+	return flags;
+}
+
+/**
+ * Returns the source of "fd", creating (but not yet adding to the epoll
+ * instance) it if necessary. Must be called with the mutex held.
+ */
+static struct source *get_source(struct subd_epoll *ep, int fd) {
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fd >= ep->capacity) {
+		int c = ep->capacity * 2;
+		while (c <= fd) {
+			c *= 2;
+		}
+		struct source **t = realloc(ep->sources, sizeof(struct source *) * c);
+		if (t == NULL) {
+			return NULL;
+		}
+		for (int i = ep->capacity; i < c; ++i) {
+			t[i] = NULL;
+		}
+		ep->sources = t;
+		ep->capacity = c;
+	}
+
+	if (ep->sources[fd] == NULL) {
+		struct source *source = calloc(1, sizeof(struct source));
+		if (source == NULL) {
+			return NULL;
+		}
+		source->fd = fd;
+		ep->sources[fd] = source;
+	}
+
+	return ep->sources[fd];
+}
+
+/**
+ * Updates the epoll registration of "source" to match its enabled watches and
+ * its user function, and retires the source if nothing uses it anymore. Must
+ * be called with the mutex held.
+ */
+static bool update_source(struct subd_epoll *ep, struct source *source) {
+	uint32_t events = source->user_events;
+	for (struct watch_node *n = source->watches; n != NULL; n = n->next) {
+		if (dbus_watch_get_enabled(n->watch)) {
+			events |= flags_to_events(dbus_watch_get_flags(n->watch));
+		}
+	}
+
+	if (source->watches == NULL && source->function == NULL) {
+		if (source->events != 0) {
+			epoll_ctl(ep->fd, EPOLL_CTL_DEL, source->fd, NULL);
+		}
+		ep->sources[source->fd] = NULL;
+		source->removed = true;
+		source->next_dead = ep->dead_sources;
+		ep->dead_sources = source;
+		return true;
+	}
+
+	struct epoll_event event = {.events = events, .data.ptr = source};
+	int op = EPOLL_CTL_MOD;
+	if (source->events == 0 && events != 0) {
+		op = EPOLL_CTL_ADD;
+	} else if (source->events != 0 && events == 0) {
+		op = EPOLL_CTL_DEL;
+	} else if (source->events == events) {
+		return true;
+	}
+
+	if (epoll_ctl(ep->fd, op, source->fd, &event) == -1) {
+		return false;
+	}
+	source->events = events;
+
+	return true;
+}
+
+static dbus_bool_t add_watch(DBusWatch *watch, void *data) {
+	struct subd_epoll *ep = data;
+	pthread_mutex_lock(&ep->mutex);
+
+	struct source *source = get_source(ep, dbus_watch_get_unix_fd(watch));
+	struct watch_node *node = malloc(sizeof(struct watch_node));
+	if (source == NULL || node == NULL) {
+		free(node);
+		pthread_mutex_unlock(&ep->mutex);
+		return FALSE;
+	}
+
+	node->watch = watch;
+	node->next = source->watches;
+	source->watches = node;
+	bool ok = update_source(ep, source);
+
+	pthread_mutex_unlock(&ep->mutex);
+	return ok;
+}
+
+static void remove_watch(DBusWatch *watch, void *data) {
+	struct subd_epoll *ep = data;
+	pthread_mutex_lock(&ep->mutex);
+
+	int fd = dbus_watch_get_unix_fd(watch);
+	struct source *source = fd < ep->capacity ? ep->sources[fd] : NULL;
+	if (source != NULL) {
+		struct watch_node **prev = &source->watches;
+		for (struct watch_node *n = *prev; n != NULL; n = n->next) {
+			if (n->watch == watch) {
+				*prev = n->next;
+				n->watch = NULL;
+				n->next = ep->dead_watches;
+				ep->dead_watches = n;
+				break;
+			}
+			prev = &n->next;
+		}
+		update_source(ep, source);
+	}
+
+	pthread_mutex_unlock(&ep->mutex);
+}
+
+static void toggle_watch(DBusWatch *watch, void *data) {
+	struct subd_epoll *ep = data;
+	pthread_mutex_lock(&ep->mutex);
+
+	int fd = dbus_watch_get_unix_fd(watch);
+	struct source *source = fd < ep->capacity ? ep->sources[fd] : NULL;
+	if (source != NULL) {
+		update_source(ep, source);
+	}
+
+	pthread_mutex_unlock(&ep->mutex);
+}
+
+/**
+ * Tells whether "watch" is still registered on "source". Must be called with
+ * the mutex held.
+ */
+static bool has_watch(struct source *source, DBusWatch *watch) {
+	if (source->removed) {
+		return false;
+	}
+	for (struct watch_node *n = source->watches; n != NULL; n = n->next) {
+		if (n->watch == watch) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Frees the sources and watch nodes that were removed since the last call.
+ * Must be called with the mutex held, and only from the event loop.
+ */
+static void bury_dead(struct subd_epoll *ep) {
+	while (ep->dead_sources != NULL) {
+		struct source *save_next = ep->dead_sources->next_dead;
+		free(ep->dead_sources);
+		ep->dead_sources = save_next;
+	}
+	while (ep->dead_watches != NULL) {
+		struct watch_node *save_next = ep->dead_watches->next;
+		free(ep->dead_watches);
+		ep->dead_watches = save_next;
+	}
+}
+
+#ifdef HAVE_TIMERFD
+static void handle_timeouts(int fd, unsigned int flags, void *data) {
+	timeouts_handle(data);
+}
+#endif
+
+static void handle_queue(int fd, unsigned int flags, void *data) {
+	queue_handle(data);
+}
+
+struct subd_epoll *subd_init_epoll(DBusConnection *conn, DBusError *err) {
+	struct subd_epoll *ep = calloc(1, sizeof(struct subd_epoll));
+	if (ep == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	ep->capacity = 16;
+	ep->sources = calloc(ep->capacity, sizeof(struct source *));
+	if (ep->sources == NULL) {
+		free(ep);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	ep->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep->fd == -1) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "epoll_create1 failed (%d).",
+			errno);
+		free(ep->sources);
+		free(ep);
+		return NULL;
+	}
+
+	// Watches are handled without the mutex held (see subd_run_once), so
+	// libdbus calling the toggle function meanwhile doesn't need recursion.
+	pthread_mutex_init(&ep->mutex, NULL);
+
+	// Without a connection (e.g. for the listening socket of a server), only
+	// non-DBus file descriptors are watched.
+	if (conn == NULL) {
+		return ep;
+	}
+
+	if (!dbus_connection_set_watch_functions(conn, add_watch, remove_watch,
+			toggle_watch, ep, NULL)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		subd_free_epoll(NULL, ep);
+		return NULL;
+	}
+
+#ifdef HAVE_TIMERFD
+	// The timerfd that drives the DBus timeouts is just another source.
+	ep->timeouts = timeouts_create(conn, err);
+	if (ep->timeouts == NULL || !subd_epoll_add_fd(ep,
+			timeouts_get_fd(ep->timeouts), DBUS_WATCH_READABLE,
+			handle_timeouts, ep->timeouts, err)) {
+		subd_free_epoll(conn, ep);
+		return NULL;
+	}
+#endif
+
+	// So is the send queue, which also wakes up epoll_wait when another thread
+	// needs the event loop.
+	ep->queue = queue_create(conn, err);
+	if (ep->queue == NULL || !subd_epoll_add_fd(ep, queue_get_fd(ep->queue),
+			DBUS_WATCH_READABLE, handle_queue, ep->queue, err)) {
+		subd_free_epoll(conn, ep);
+		return NULL;
+	}
+
+	return ep;
+}
+
+void subd_free_epoll(DBusConnection *conn, struct subd_epoll *ep) {
+	if (conn != NULL) {
+		// This calls remove_watch for all watches.
+		dbus_connection_set_watch_functions(conn, NULL, NULL, NULL, NULL, NULL);
+	}
+	if (ep->queue != NULL) {
+		queue_destroy(conn, ep->queue);
+	}
+	if (ep->timeouts != NULL) {
+		timeouts_destroy(conn, ep->timeouts);
+	}
+
+	pthread_mutex_lock(&ep->mutex);
+	for (int i = 0; i < ep->capacity; ++i) {
+		struct source *source = ep->sources[i];
+		if (source == NULL) {
+			continue;
+		}
+		while (source->watches != NULL) {
+			struct watch_node *save_next = source->watches->next;
+			free(source->watches);
+			source->watches = save_next;
+		}
+		free(source);
+	}
+	bury_dead(ep);
+	pthread_mutex_unlock(&ep->mutex);
+
+	pthread_mutex_destroy(&ep->mutex);
+	close(ep->fd);
+	free(ep->sources);
+	free(ep);
+}
+
+dbus_bool_t subd_epoll_add_fd(struct subd_epoll *ep, int fd,
+		unsigned int flags, subd_fd_function function, void *data,
+		DBusError *err) {
+	pthread_mutex_lock(&ep->mutex);
+
+	struct source *source = get_source(ep, fd);
+	if (source == NULL) {
+		pthread_mutex_unlock(&ep->mutex);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	if (source->function != NULL) {
+		pthread_mutex_unlock(&ep->mutex);
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"File descriptor %d is already registered.", fd);
+		return FALSE;
+	}
+
+	source->function = function;
+	source->data = data;
+	source->user_events = flags_to_events(flags);
+	if (!update_source(ep, source)) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "epoll_ctl failed (%d).",
+			errno);
+		source->function = NULL;
+		source->user_events = 0;
+		update_source(ep, source);
+		pthread_mutex_unlock(&ep->mutex);
+		return FALSE;
+	}
+
+	pthread_mutex_unlock(&ep->mutex);
+	return TRUE;
+}
+
+void subd_epoll_remove_fd(struct subd_epoll *ep, int fd) {
+	pthread_mutex_lock(&ep->mutex);
+
+	struct source *source = fd >= 0 && fd < ep->capacity ?
+		ep->sources[fd] : NULL;
+	if (source != NULL && source->function != NULL) {
+		source->function = NULL;
+		source->data = NULL;
+		source->user_events = 0;
+		update_source(ep, source);
+	}
+
+	pthread_mutex_unlock(&ep->mutex);
+}
+
+int subd_run_once(DBusConnection *conn, struct subd_epoll *ep, int timeout) {
+	// Messages might have been queued without any file descriptor activity
+	// (e.g. read by a blocking call on another thread), don't wait for them.
+	if (conn != NULL && dbus_connection_get_dispatch_status(conn) ==
+			DBUS_DISPATCH_DATA_REMAINS) {
+		timeout = 0;
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(ep->fd, events, MAX_EVENTS, timeout);
+	if (n == -1) {
+		return errno == EINTR ? 0 : -1;
+	}
+	stats_mark_batch();
+	if (n > 0) {
+		trace(TRACE_WAKEUP, 0, n);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		struct source *source = events[i].data.ptr;
+		unsigned int flags = events_to_flags(events[i].events);
+
+		// The watches that are ready are collected with the mutex held, but
+		// handled without it, because libdbus takes the connection lock when
+		// handling a watch, and other threads (e.g. sending a message) hold
+		// that while adding or toggling watches. Sources are only freed by
+		// bury_dead, so "source" stays valid meanwhile.
+		DBusWatch *ready[MAX_SOURCE_WATCHES];
+		unsigned int ready_flags[MAX_SOURCE_WATCHES];
+		int count = 0;
+		pthread_mutex_lock(&ep->mutex);
+		for (struct watch_node *w = source->watches; !source->removed &&
+				w != NULL && count < MAX_SOURCE_WATCHES; w = w->next) {
+			if (w->watch == NULL || !dbus_watch_get_enabled(w->watch)) {
+				continue;
+			}
+			unsigned int watch_flags = dbus_watch_get_flags(w->watch) |
+				DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR;
+			if (flags & watch_flags) {
+				ready[count] = w->watch;
+				ready_flags[count++] = flags & watch_flags;
+			}
+		}
+		int fd = source->fd;
+		subd_fd_function function = NULL;
+		void *data = source->data;
+		if (!source->removed && (events[i].events & (source->user_events |
+				EPOLLHUP | EPOLLERR))) {
+			function = source->function;
+		}
+		pthread_mutex_unlock(&ep->mutex);
+
+		for (int j = 0; j < count; ++j) {
+			// A watch removed by an earlier one (e.g. when the connection was
+			// closed) is skipped.
+			pthread_mutex_lock(&ep->mutex);
+			bool live = has_watch(source, ready[j]);
+			pthread_mutex_unlock(&ep->mutex);
+			// If libdbus runs out of memory, the watch stays ready, and it is
+			// handled again on the next iteration.
+			if (live) {
+				dbus_watch_handle(ready[j], ready_flags[j]);
+			}
+		}
+
+		if (function != NULL) {
+			function(fd, flags, data);
+		}
+	}
+
+	if (conn != NULL) {
+		// If the dispatch budget ran out, the next epoll_wait must not wait.
+		if (dispatch_messages(conn)) {
+			queue_wake(ep->queue);
+		}
+
+		// Send the signals that were coalesced, and the properties that
+		// changed during this iteration.
+		coalescer_flush(conn);
+		properties_flush(conn);
+	}
+
+	pthread_mutex_lock(&ep->mutex);
+	bury_dead(ep);
+	pthread_mutex_unlock(&ep->mutex);
+
+	return n;
+}
@@ -0,0 +1,511 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "subd.h"
+#include "vtable.h"
+
+/**
+ * Helper function that checks if "path" is below "manager" in the object tree.
+ * The object manager itself is not below itself.
+ */
+static bool is_below(const char *path, const char *manager) {
+	size_t length = strlen(manager);
+	if (length == 1) {
+		// The root manages everything else.
+		return path[1] != '\0';
+	}
+	return strncmp(path, manager, length) == 0 && path[length] == '/';
+}
+
+static bool add_managed(struct manager *manager, struct path *path) {
+	if (manager->length == manager->capacity) {
+		int c = manager->capacity == 0 ? 16 : manager->capacity * 2;
+		void *t = realloc(manager->objects, sizeof(struct path *) * c);
+		if (t == NULL) {
+			return false;
+		}
+		manager->objects = t;
+		manager->capacity = c;
+	}
+	manager->objects[manager->length++] = path;
+	path->manager = manager;
+	return true;
+}
+
+static void remove_managed(struct manager *manager, struct path *path) {
+	for (int i = 0; i < manager->length; ++i) {
+		if (manager->objects[i] == path) {
+			manager->objects[i] = manager->objects[--manager->length];
+			break;
+		}
+	}
+	path->manager = NULL;
+}
+
+/**
+ * Helper function that adds "path" to the closest object manager above it.
+ * Must be called with the mutex held.
+ */
+bool manage_path(struct registry *registry, struct path *path) {
+	struct manager *closest = NULL;
+	size_t closest_length = 0;
+	for (struct manager *m = registry->managers; m != NULL; m = m->next) {
+		size_t length = strlen(m->path->path);
+		if (is_below(path->path, m->path->path) && length >= closest_length) {
+			closest = m;
+			closest_length = length;
+		}
+	}
+	return closest == NULL || add_managed(closest, path);
+}
+
+/**
+ * Helper function that removes "path" from its object manager. Must be called
+ * with the mutex held.
+ */
+void unmanage_path(struct registry *registry, struct path *path) {
+	if (path->manager != NULL) {
+		remove_managed(path->manager, path);
+	}
+}
+
+static struct manager *find_manager(struct registry *registry,
+		struct path *path) {
+	struct manager *manager = registry->managers;
+	while (manager != NULL && manager->path != path) {
+		manager = manager->next;
+	}
+	return manager;
+}
+
+/**
+ * Helper function that drops the object manager of "path", if it has one, and
+ * hands its paths over to the closest manager above them. Must be called with
+ * the mutex held.
+ */
+void release_manager(struct registry *registry, struct path *path) {
+	struct manager **prev = &registry->managers;
+	while (*prev != NULL && (*prev)->path != path) {
+		prev = &(*prev)->next;
+	}
+	struct manager *manager = *prev;
+	if (manager == NULL) {
+		return;
+	}
+	*prev = manager->next;
+
+	// If a path can't be handed over, it is left without a manager.
+	for (int i = 0; i < manager->length; ++i) {
+		manager->objects[i]->manager = NULL;
+		manage_path(registry, manager->objects[i]);
+	}
+	free(manager->objects);
+	free(manager);
+}
+
+void free_managers(struct registry *registry) {
+	struct manager *manager = registry->managers;
+	while (manager != NULL) {
+		struct manager *save_next = manager->next;
+		free(manager->objects);
+		free(manager);
+		manager = save_next;
+	}
+}
+
+static void release_interfaces(struct interface **interfaces, int length) {
+	for (int i = 0; i < length; ++i) {
+		interface_unref(interfaces[i]);
+	}
+	free(interfaces);
+}
+
+/**
+ * Helper function that appends the interfaces of "path" starting at the index
+ * "first" with their properties as an a{sa{sv}} dictionary.
+ */
+static bool append_interfaces(DBusConnection *conn, struct path *path,
+		int first, DBusMessageIter *iter, DBusError *err) {
+	// Take a snapshot of the interfaces, the properties are read without the
+	// lock held. The interfaces are referenced, so they can be removed
+	// meanwhile.
+	pthread_mutex_lock(&path->registry->mutex);
+	int length = path->interfaces_length - first;
+	struct interface **interfaces = length <= 0 ? NULL :
+		malloc(sizeof(struct interface *) * length);
+	for (int i = 0; interfaces != NULL && i < length; ++i) {
+		interfaces[i] = path->interfaces[first + i];
+		interface_ref(interfaces[i]);
+	}
+	pthread_mutex_unlock(&path->registry->mutex);
+	if (interfaces == NULL && length > 0) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+
+	DBusMessageIter array, entry;
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sa{sv}}",
+			&array)) {
+		release_interfaces(interfaces, length);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	for (int i = 0; i < length; ++i) {
+		struct interface *interface = interfaces[i];
+		const char *name = interface->name;
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+				NULL, &entry)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			dbus_message_iter_abandon_container(iter, &array);
+			release_interfaces(interfaces, length);
+			return false;
+		}
+		if (!dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			goto error;
+		}
+		if (!append_cached_properties(conn, interface, &entry, err)) {
+			goto error;
+		}
+		if (!dbus_message_iter_close_container(&array, &entry)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			dbus_message_iter_abandon_container(iter, &array);
+			release_interfaces(interfaces, length);
+			return false;
+		}
+	}
+	release_interfaces(interfaces, length);
+	if (!dbus_message_iter_close_container(iter, &array)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	return true;
+
+error:
+	release_interfaces(interfaces, length);
+	dbus_message_iter_abandon_container(&array, &entry);
+	dbus_message_iter_abandon_container(iter, &array);
+	return false;
+}
+
+static void release_objects(struct path **objects, int length) {
+	for (int i = 0; i < length; ++i) {
+		path_unref(objects[i]);
+	}
+	free(objects);
+}
+
+static dbus_bool_t handle_get_managed_objects(DBusConnection *conn,
+		DBusMessage *msg, void *data, DBusError *err) {
+	struct path *path = find_path(conn, dbus_message_get_path(msg));
+	if (path == NULL) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Path was not found in the registry.");
+		return FALSE;
+	}
+
+	// Take a snapshot of the managed paths, the properties are read without
+	// the lock held. The paths are referenced, so they can be removed
+	// meanwhile.
+	struct registry *registry = path->registry;
+	pthread_mutex_lock(&registry->mutex);
+	struct manager *manager = find_manager(registry, path);
+	int length = manager == NULL ? 0 : manager->length;
+	struct path **objects = malloc(sizeof(struct path *) * (length + 1));
+	for (int i = 0; objects != NULL && i < length; ++i) {
+		objects[i] = manager->objects[i];
+		path_ref(objects[i]);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	path_unref(path);
+	if (objects == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		release_objects(objects, length);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	DBusMessageIter iter, array, entry;
+	dbus_message_iter_init_append(reply, &iter);
+	if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			"{oa{sa{sv}}}", &array)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		goto error;
+	}
+	for (int i = 0; i < length; ++i) {
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+				NULL, &entry)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+		if (!dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+				&objects[i]->path)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			dbus_message_iter_abandon_container(&array, &entry);
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+		if (!append_interfaces(conn, objects[i], 0, &entry, err)) {
+			dbus_message_iter_abandon_container(&array, &entry);
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+		if (!dbus_message_iter_close_container(&array, &entry)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+	}
+	if (!dbus_message_iter_close_container(&iter, &array)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		goto error;
+	}
+	release_objects(objects, length);
+
+	dbus_bool_t ret = dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+	if (!ret) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return ret;
+
+error:
+	release_objects(objects, length);
+	dbus_message_unref(reply);
+	return FALSE;
+}
+
+static const struct subd_member manager_members[] = {
+	{SUBD_METHOD, .m = {"GetManagedObjects", handle_get_managed_objects, "",
+		"a{oa{sa{sv}}}"}},
+	{SUBD_SIGNAL, .s = {"InterfacesAdded", "oa{sa{sv}}"}},
+	{SUBD_SIGNAL, .s = {"InterfacesRemoved", "oas"}},
+	{SUBD_MEMBERS_END, .e=0},
+};
+
+/**
+ * Helper function that creates the InterfacesAdded signal for the interfaces
+ * of "path" starting at the index "added". Returns NULL if the path is not
+ * managed, or out of memory.
+ */
+DBusMessage *new_interfaces_added(DBusConnection *conn, struct path *path,
+		int added) {
+	// The manager might be released by another thread once the mutex is
+	// dropped, so the signal is created while it is held.
+	pthread_mutex_lock(&path->registry->mutex);
+	struct manager *manager = path->manager;
+	DBusMessage *signal = manager == NULL ||
+		added >= path->interfaces_length ? NULL :
+		dbus_message_new_signal(manager->path->path, INTERFACE_OBJECT_MANAGER,
+			"InterfacesAdded");
+	pthread_mutex_unlock(&path->registry->mutex);
+	if (signal == NULL) {
+		return NULL;
+	}
+	DBusMessageIter iter;
+	dbus_message_iter_init_append(signal, &iter);
+	if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
+			&path->path) ||
+			!append_interfaces(conn, path, added, &iter, NULL)) {
+		dbus_message_unref(signal);
+		return NULL;
+	}
+	return signal;
+}
+
+/**
+ * Helper function that creates the InterfacesRemoved signal for the interfaces
+ * of "path" named in "names". Returns NULL if the path is not managed, or out
+ * of memory. Must be called with the mutex held.
+ */
+DBusMessage *new_interfaces_removed(struct path *path,
+		const char *const *names, int count) {
+	struct manager *manager = path->manager;
+	if (manager == NULL || count == 0) {
+		return NULL;
+	}
+
+	DBusMessage *signal = dbus_message_new_signal(manager->path->path,
+		INTERFACE_OBJECT_MANAGER, "InterfacesRemoved");
+	if (signal == NULL) {
+		return NULL;
+	}
+	DBusMessageIter iter, array;
+	dbus_message_iter_init_append(signal, &iter);
+	if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
+			&path->path) ||
+			!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s",
+				&array)) {
+		goto error;
+	}
+	for (int i = 0; i < count; ++i) {
+		if (!dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING,
+				&names[i])) {
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+	}
+	if (!dbus_message_iter_close_container(&iter, &array)) {
+		goto error;
+	}
+	return signal;
+
+error:
+	dbus_message_unref(signal);
+	return NULL;
+}
+
+dbus_bool_t subd_add_object_manager(DBusConnection *conn, const char *path_name,
+		DBusError *err) {
+	int added;
+	struct path *path = add_object(conn, path_name,
+		INTERFACE_OBJECT_MANAGER, manager_members, NULL, &added, err);
+	if (path == NULL) {
+		return FALSE;
+	}
+
+	struct registry *registry = path->registry;
+	pthread_mutex_lock(&registry->mutex);
+	if (find_manager(registry, path) != NULL) {
+		pthread_mutex_unlock(&registry->mutex);
+		path_unref(path);
+		return TRUE;
+	}
+	struct manager *manager = calloc(1, sizeof(struct manager));
+	if (manager == NULL) {
+		pthread_mutex_unlock(&registry->mutex);
+		path_unref(path);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	manager->path = path;
+
+	// Take over the paths below this one from the managers above it.
+	size_t length = strlen(path_name);
+	struct hashmap_t *paths = registry->paths;
+	for (size_t i = 0; i < paths->capacity; ++i) {
+		for (struct hashmap_entry *e = paths->buckets[i]; e != NULL;
+				e = e->next) {
+			struct path *p = e->data;
+			if (!is_below(p->path, path_name) || (p->manager != NULL &&
+					strlen(p->manager->path->path) > length)) {
+				continue;
+			}
+			struct manager *previous = p->manager;
+			if (previous != NULL) {
+				remove_managed(previous, p);
+			}
+			if (!add_managed(manager, p)) {
+				// Give back the paths that were taken over.
+				for (int j = 0; j < manager->length; ++j) {
+					manager->objects[j]->manager = NULL;
+					manage_path(registry, manager->objects[j]);
+				}
+				if (previous != NULL) {
+					add_managed(previous, p);
+				}
+				free(manager->objects);
+				free(manager);
+				pthread_mutex_unlock(&registry->mutex);
+				path_unref(path);
+				dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+				return FALSE;
+			}
+		}
+	}
+	manager->next = registry->managers;
+	registry->managers = manager;
+	pthread_mutex_unlock(&registry->mutex);
+
+	// The object manager itself might be managed by an other one.
+	DBusMessage *signal = new_interfaces_added(conn, path, added);
+	if (signal != NULL) {
+		dbus_connection_send(conn, signal, NULL);
+		dbus_message_unref(signal);
+	}
+	path_unref(path);
+
+	return TRUE;
+}
+
+/**
+ * The interfaces a batch added to a path. Every path in a batch gets only one
+ * InterfacesAdded signal.
+ */
+struct added_object {
+	struct path *path;
+	int added;
+};
+
+dbus_bool_t subd_add_objects(DBusConnection *conn,
+		const struct subd_object *objects, int count, DBusError *err) {
+	if (count <= 0) {
+		return TRUE;
+	}
+
+	struct added_object *added = malloc(sizeof(struct added_object) * count);
+	struct hashmap_t *seen = hashmap_create(count);
+	if (added == NULL || seen == NULL) {
+		free(added);
+		if (seen != NULL) {
+			hashmap_destroy(seen, NULL);
+		}
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	int length = 0;
+	dbus_bool_t ret = TRUE;
+	for (int i = 0; i < count; ++i) {
+		const struct subd_object *o = &objects[i];
+		int first;
+		struct path *path = add_object(conn, o->path, o->interface, o->members,
+			o->userdata, &first, err);
+		if (path == NULL) {
+			ret = FALSE;
+			break;
+		}
+		// The first addition to a path keeps its reference until the signal
+		// is built.
+		if (hashmap_get(seen, path->path) != NULL) {
+			path_unref(path);
+			continue;
+		}
+		added[length] = (struct added_object){path, first};
+		if (hashmap_set(seen, path->path, &added[length]) == -1) {
+			path_unref(path);
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			ret = FALSE;
+			break;
+		}
+		++length;
+	}
+
+	// The objects that were registered are announced even if the batch
+	// failed. The signals are queued back to back, and the event loop writes
+	// them.
+	for (int i = 0; i < length; ++i) {
+		DBusMessage *signal =
+			new_interfaces_added(conn, added[i].path, added[i].added);
+		if (signal != NULL) {
+			dbus_connection_send(conn, signal, NULL);
+			dbus_message_unref(signal);
+		}
+		path_unref(added[i].path);
+	}
+
+	hashmap_destroy(seen, NULL);
+	free(added);
+	return ret;
+}
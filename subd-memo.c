@@ -0,0 +1,469 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "memo.h"
+#include "stats.h"
+
+/**
+ * Calls whose key would be longer than this are not memoized. The key holds
+ * the names of the method, and the arguments.
+ */
+#define MAX_KEY_LENGTH 4096
+
+/**
+ * A memoized reply. The key is the path, the interface and the member of the
+ * call, each terminated by a zero byte, followed by the arguments in the form
+ * written by append_args. Entries are both in a bucket of the hash table, and
+ * on the LRU list, whose head is the most recently used entry.
+ */
+struct entry {
+	uint32_t hash;
+	char *key;
+	size_t length;
+	DBusMessage *reply;
+	size_t size;
+	uint64_t expires;	// 0 if the entry does not expire
+	struct entry *next;
+	struct entry *newer;
+	struct entry *older;
+};
+
+/**
+ * The mutex protects everything. The generation is incremented whenever
+ * entries are invalidated, so replies captured before an invalidation are not
+ * stored after it.
+ */
+struct memo {
+	struct entry **buckets;
+	size_t capacity;
+	size_t count;
+	struct entry *newest;
+	struct entry *oldest;
+	size_t size;
+	size_t max_size;
+	unsigned long generation;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	pthread_mutex_t mutex;
+};
+
+struct key_buffer {
+	char data[MAX_KEY_LENGTH];
+	size_t length;
+};
+
+_Thread_local struct memo_capture *memo_capturing;
+
+static bool put(struct key_buffer *key, const void *data, size_t length) {
+	if (length > MAX_KEY_LENGTH - key->length) {
+		return false;
+	}
+	memcpy(key->data + key->length, data, length);
+	key->length += length;
+	return true;
+}
+
+/**
+ * Helper function that returns the size of the fixed type "type" in a
+ * message.
+ */
+static size_t fixed_size(int type) {
+	switch (type) {
+	case DBUS_TYPE_BYTE:
+		return 1;
+	case DBUS_TYPE_INT16:
+	case DBUS_TYPE_UINT16:
+		return 2;
+	case DBUS_TYPE_BOOLEAN:
+	case DBUS_TYPE_INT32:
+	case DBUS_TYPE_UINT32:
+		return 4;
+	default:
+		return 8;
+	}
+}
+
+/**
+ * Helper function that appends the arguments at "iter" to "key". Every
+ * argument starts with its type code, and every container ends with a zero
+ * byte, so different arguments never have the same form. Returns false if
+ * the key would be too long, or if the arguments contain file descriptors,
+ * which are different in every call.
+ */
+static bool append_args(struct key_buffer *key, DBusMessageIter *iter) {
+	int type;
+	while ((type = dbus_message_iter_get_arg_type(iter)) !=
+			DBUS_TYPE_INVALID) {
+		char code = (char)type;
+		if (!put(key, &code, 1)) {
+			return false;
+		}
+
+		DBusMessageIter sub;
+		switch (type) {
+		case DBUS_TYPE_UNIX_FD:
+			return false;
+		case DBUS_TYPE_STRING:
+		case DBUS_TYPE_OBJECT_PATH:
+		case DBUS_TYPE_SIGNATURE: {
+			const char *s;
+			dbus_message_iter_get_basic(iter, &s);
+			if (!put(key, s, strlen(s) + 1)) {
+				return false;
+			}
+			break;
+		}
+		case DBUS_TYPE_ARRAY: {
+			char *signature = dbus_message_iter_get_signature(iter);
+			bool ok = signature != NULL &&
+				put(key, signature, strlen(signature) + 1);
+			dbus_free(signature);
+			if (!ok) {
+				return false;
+			}
+			int element = dbus_message_iter_get_element_type(iter);
+			dbus_message_iter_recurse(iter, &sub);
+			if (dbus_type_is_fixed(element) && element != DBUS_TYPE_UNIX_FD) {
+				const void *data;
+				int length;
+				dbus_message_iter_get_fixed_array(&sub, &data, &length);
+				dbus_uint32_t n = length;
+				if (!put(key, &n, sizeof(n)) ||
+						!put(key, data, length * fixed_size(element))) {
+					return false;
+				}
+			} else if (!append_args(key, &sub) || !put(key, "", 1)) {
+				return false;
+			}
+			break;
+		}
+		case DBUS_TYPE_STRUCT:
+		case DBUS_TYPE_DICT_ENTRY:
+		case DBUS_TYPE_VARIANT:
+			dbus_message_iter_recurse(iter, &sub);
+			if (!append_args(key, &sub) || !put(key, "", 1)) {
+				return false;
+			}
+			break;
+		default: {
+			DBusBasicValue value;
+			dbus_message_iter_get_basic(iter, &value);
+			if (!put(key, &value, fixed_size(type))) {
+				return false;
+			}
+			break;
+		}
+		}
+		dbus_message_iter_next(iter);
+	}
+	return true;
+}
+
+/**
+ * Helper function that writes the key of the call "msg" into "key". Returns
+ * false if the call can not be memoized.
+ */
+static bool build_key(struct key_buffer *key, DBusMessage *msg) {
+	const char *names[] = {
+		dbus_message_get_path(msg),
+		dbus_message_get_interface(msg),
+		dbus_message_get_member(msg),
+	};
+	key->length = 0;
+	for (int i = 0; i < 3; ++i) {
+		if (names[i] == NULL || !put(key, names[i], strlen(names[i]) + 1)) {
+			return false;
+		}
+	}
+
+	DBusMessageIter iter;
+	dbus_message_iter_init(msg, &iter);
+	return append_args(key, &iter);
+}
+
+struct memo *memo_create(size_t size) {
+	struct memo *memo = calloc(1, sizeof(struct memo));
+	if (memo == NULL) {
+		return NULL;
+	}
+	memo->capacity = 16;
+	memo->buckets = calloc(memo->capacity, sizeof(struct entry *));
+	if (memo->buckets == NULL) {
+		free(memo);
+		return NULL;
+	}
+	memo->max_size = size;
+	pthread_mutex_init(&memo->mutex, NULL);
+	return memo;
+}
+
+static void free_entry(struct entry *entry) {
+	dbus_message_unref(entry->reply);
+	free(entry->key);
+	free(entry);
+}
+
+void memo_free(struct memo *memo) {
+	struct entry *entry = memo->newest;
+	while (entry != NULL) {
+		struct entry *save_older = entry->older;
+		free_entry(entry);
+		entry = save_older;
+	}
+	free(memo->buckets);
+	pthread_mutex_destroy(&memo->mutex);
+	free(memo);
+}
+
+/**
+ * Helper function that returns the entry of "key", or NULL. Must be called
+ * with the mutex held.
+ */
+static struct entry *find_entry(struct memo *memo, uint32_t hash,
+		const char *key, size_t length) {
+	for (struct entry *e = memo->buckets[hash & (memo->capacity - 1)];
+			e != NULL; e = e->next) {
+		if (e->hash == hash && e->length == length &&
+				memcmp(e->key, key, length) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void unlink_lru(struct memo *memo, struct entry *entry) {
+	if (entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	} else {
+		memo->newest = entry->older;
+	}
+	if (entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	} else {
+		memo->oldest = entry->newer;
+	}
+}
+
+static void link_lru(struct memo *memo, struct entry *entry) {
+	entry->newer = NULL;
+	entry->older = memo->newest;
+	if (memo->newest != NULL) {
+		memo->newest->newer = entry;
+	} else {
+		memo->oldest = entry;
+	}
+	memo->newest = entry;
+}
+
+/**
+ * Helper function that removes "entry" from the hash table and the LRU list,
+ * and frees it. Must be called with the mutex held.
+ */
+static void remove_entry(struct memo *memo, struct entry *entry) {
+	struct entry **prev = &memo->buckets[entry->hash & (memo->capacity - 1)];
+	while (*prev != entry) {
+		prev = &(*prev)->next;
+	}
+	*prev = entry->next;
+	unlink_lru(memo, entry);
+	memo->size -= entry->size;
+	--memo->count;
+	free_entry(entry);
+}
+
+/**
+ * Helper function that evicts the least recently used entries until the
+ * cache fits into its size. Must be called with the mutex held.
+ */
+static void evict(struct memo *memo) {
+	while (memo->size > memo->max_size && memo->oldest != NULL) {
+		remove_entry(memo, memo->oldest);
+		++memo->evictions;
+	}
+}
+
+static bool grow(struct memo *memo) {
+	size_t c = memo->capacity * 2;
+	struct entry **buckets = calloc(c, sizeof(struct entry *));
+	if (buckets == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < memo->capacity; ++i) {
+		struct entry *e = memo->buckets[i];
+		while (e != NULL) {
+			struct entry *save_next = e->next;
+			e->next = buckets[e->hash & (c - 1)];
+			buckets[e->hash & (c - 1)] = e;
+			e = save_next;
+		}
+	}
+	free(memo->buckets);
+	memo->buckets = buckets;
+	memo->capacity = c;
+	return true;
+}
+
+void memo_set_size(struct memo *memo, size_t size) {
+	pthread_mutex_lock(&memo->mutex);
+	memo->max_size = size;
+	evict(memo);
+	pthread_mutex_unlock(&memo->mutex);
+}
+
+DBusMessage *memo_lookup(struct memo *memo, DBusMessage *msg) {
+	struct key_buffer key;
+	bool cacheable = build_key(&key, msg);
+	uint32_t hash = cacheable ? hashmap_hash(key.data, key.length) : 0;
+
+	DBusMessage *reply = NULL;
+	pthread_mutex_lock(&memo->mutex);
+	struct entry *entry = cacheable ?
+		find_entry(memo, hash, key.data, key.length) : NULL;
+	if (entry != NULL && entry->expires != 0 &&
+			stats_now() >= entry->expires) {
+		remove_entry(memo, entry);
+		entry = NULL;
+	}
+	if (entry != NULL) {
+		unlink_lru(memo, entry);
+		link_lru(memo, entry);
+		reply = dbus_message_ref(entry->reply);
+		++memo->hits;
+	} else {
+		++memo->misses;
+	}
+	pthread_mutex_unlock(&memo->mutex);
+	return reply;
+}
+
+bool memo_capture_begin(struct memo *memo, struct memo_capture *capture,
+		DBusMessage *msg) {
+	struct key_buffer key;
+	if (!build_key(&key, msg) || (capture->key = malloc(key.length)) == NULL) {
+		return false;
+	}
+	memcpy(capture->key, key.data, key.length);
+	capture->length = key.length;
+	capture->hash = hashmap_hash(key.data, key.length);
+	capture->serial = dbus_message_get_serial(msg);
+	capture->reply = NULL;
+	pthread_mutex_lock(&memo->mutex);
+	capture->generation = memo->generation;
+	pthread_mutex_unlock(&memo->mutex);
+
+	capture->previous = memo_capturing;
+	memo_capturing = capture;
+	return true;
+}
+
+void memo_capture_reply(DBusMessage *reply) {
+	struct memo_capture *capture = memo_capturing;
+	if (capture->reply == NULL &&
+			dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+			dbus_message_get_reply_serial(reply) == capture->serial) {
+		// The reply is copied before it is sent, so it is not read while
+		// libdbus writes it out on another thread.
+		capture->reply = dbus_message_copy(reply);
+	}
+}
+
+/**
+ * Helper function that returns the number of bytes "reply" takes up in the
+ * cache, or 0 if it can not be determined.
+ */
+static size_t reply_size(DBusMessage *reply) {
+	char *data;
+	int length;
+	if (!dbus_message_marshal(reply, &data, &length)) {
+		return 0;
+	}
+	dbus_free(data);
+	return length;
+}
+
+void memo_capture_end(struct memo *memo, struct memo_capture *capture,
+		bool ok, unsigned int ttl) {
+	memo_capturing = capture->previous;
+
+	struct entry *entry = NULL;
+	size_t size = 0;
+	if (ok && capture->reply != NULL) {
+		size = reply_size(capture->reply);
+		entry = size == 0 ? NULL : malloc(sizeof(struct entry));
+	}
+	if (entry == NULL) {
+		goto out;
+	}
+	entry->hash = capture->hash;
+	entry->key = capture->key;
+	entry->length = capture->length;
+	entry->reply = capture->reply;
+	entry->size = sizeof(struct entry) + capture->length + size;
+	entry->expires = ttl == 0 ? 0 : stats_now() + ttl * 1000000ull;
+
+	pthread_mutex_lock(&memo->mutex);
+	if (capture->generation != memo->generation ||
+			entry->size > memo->max_size ||
+			((memo->count + 1) * 4 > memo->capacity * 3 && !grow(memo))) {
+		pthread_mutex_unlock(&memo->mutex);
+		free(entry);
+		goto out;
+	}
+	struct entry *old = find_entry(memo, entry->hash, entry->key,
+		entry->length);
+	if (old != NULL) {
+		remove_entry(memo, old);
+	}
+	size_t bucket = entry->hash & (memo->capacity - 1);
+	entry->next = memo->buckets[bucket];
+	memo->buckets[bucket] = entry;
+	link_lru(memo, entry);
+	memo->size += entry->size;
+	++memo->count;
+	evict(memo);
+	pthread_mutex_unlock(&memo->mutex);
+	return;
+
+out:
+	free(capture->key);
+	if (capture->reply != NULL) {
+		dbus_message_unref(capture->reply);
+	}
+}
+
+void memo_invalidate(struct memo *memo, const char *path,
+		const char *interface, const char *member) {
+	pthread_mutex_lock(&memo->mutex);
+	++memo->generation;
+	struct entry *entry = memo->newest;
+	while (entry != NULL) {
+		struct entry *save_older = entry->older;
+		const char *entry_path = entry->key;
+		const char *entry_interface = entry_path + strlen(entry_path) + 1;
+		const char *entry_member =
+			entry_interface + strlen(entry_interface) + 1;
+		if ((path == NULL || strcmp(path, entry_path) == 0) &&
+				(interface == NULL ||
+					strcmp(interface, entry_interface) == 0) &&
+				(member == NULL || strcmp(member, entry_member) == 0)) {
+			remove_entry(memo, entry);
+		}
+		entry = save_older;
+	}
+	pthread_mutex_unlock(&memo->mutex);
+}
+
+void memo_get_stats(struct memo *memo, struct subd_cache_stats *stats) {
+	pthread_mutex_lock(&memo->mutex);
+	stats->hits = memo->hits;
+	stats->misses = memo->misses;
+	stats->evictions = memo->evictions;
+	stats->size = memo->size;
+	stats->entries = memo->count;
+	pthread_mutex_unlock(&memo->mutex);
+}
@@ -0,0 +1,572 @@
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "plan.h"
+#include "subd.h"
+
+/**
+ * A complete type of the signature, with the C layout of its value. The nodes
+ * of a plan are stored in depth-first order, so the children of a container
+ * follow it, and "next" is the index right after its last descendant.
+ */
+struct plan_node {
+	int type;
+	size_t offset;		// offset of the value in its parent
+	size_t size;
+	size_t align;
+	int next;
+	char *signature;	// signature of the elements of arrays
+};
+
+/**
+ * The first node is the root, a pseudo-struct of the top-level types of the
+ * signature.
+ */
+struct subd_plan {
+	char *signature;
+	int length;
+	int capacity;
+	struct plan_node *nodes;
+};
+
+/**
+ * Helper function that copies the arguments from "from" to "to". Arrays of
+ * fixed-size types are copied with a single call.
+ */
+bool copy_arguments(DBusMessageIter *from, DBusMessageIter *to) {
+	int type;
+	while ((type = dbus_message_iter_get_arg_type(from)) != DBUS_TYPE_INVALID) {
+		DBusMessageIter from_sub, to_sub = DBUS_MESSAGE_ITER_INIT_CLOSED;
+		if (dbus_type_is_basic(type)) {
+			DBusBasicValue value;
+			dbus_message_iter_get_basic(from, &value);
+			if (!dbus_message_iter_append_basic(to, type, &value)) {
+				return false;
+			}
+			dbus_message_iter_next(from);
+			continue;
+		}
+
+		// Arrays and variants need the signature of their contents, structs
+		// and dict entries don't have one.
+		char *signature = NULL;
+		dbus_message_iter_recurse(from, &from_sub);
+		if (type == DBUS_TYPE_ARRAY || type == DBUS_TYPE_VARIANT) {
+			signature = dbus_message_iter_get_signature(
+				type == DBUS_TYPE_ARRAY ? from : &from_sub);
+			if (signature == NULL) {
+				return false;
+			}
+		}
+		const char *contents = signature == NULL ? NULL :
+			type == DBUS_TYPE_ARRAY ? signature + 1 : signature;
+		bool ok = dbus_message_iter_open_container(to, type, contents, &to_sub);
+		if (ok && type == DBUS_TYPE_ARRAY &&
+				is_view_element(dbus_message_iter_get_element_type(from))) {
+			const void *elements;
+			int count;
+			dbus_message_iter_get_fixed_array(&from_sub, &elements, &count);
+			ok = dbus_message_iter_append_fixed_array(&to_sub,
+				dbus_message_iter_get_element_type(from), &elements, count);
+		} else if (ok) {
+			ok = copy_arguments(&from_sub, &to_sub);
+		}
+		dbus_free(signature);
+		if (!ok) {
+			dbus_message_iter_abandon_container_if_open(to, &to_sub);
+			return false;
+		}
+		if (!dbus_message_iter_close_container(to, &to_sub)) {
+			return false;
+		}
+		dbus_message_iter_next(from);
+	}
+	return true;
+}
+
+static size_t align_up(size_t offset, size_t align) {
+	return (offset + align - 1) & ~(align - 1);
+}
+
+/**
+ * Helper function that returns the C size and alignment of a basic type.
+ */
+static void basic_layout(int type, size_t *size, size_t *align) {
+	switch (type) {
+	case DBUS_TYPE_BYTE:
+		*size = sizeof(unsigned char);
+		*align = alignof(unsigned char);
+		break;
+	case DBUS_TYPE_BOOLEAN:
+		*size = sizeof(dbus_bool_t);
+		*align = alignof(dbus_bool_t);
+		break;
+	case DBUS_TYPE_INT16:
+	case DBUS_TYPE_UINT16:
+		*size = sizeof(dbus_int16_t);
+		*align = alignof(dbus_int16_t);
+		break;
+	case DBUS_TYPE_INT32:
+	case DBUS_TYPE_UINT32:
+		*size = sizeof(dbus_int32_t);
+		*align = alignof(dbus_int32_t);
+		break;
+	case DBUS_TYPE_INT64:
+	case DBUS_TYPE_UINT64:
+		*size = sizeof(dbus_int64_t);
+		*align = alignof(dbus_int64_t);
+		break;
+	case DBUS_TYPE_DOUBLE:
+		*size = sizeof(double);
+		*align = alignof(double);
+		break;
+	case DBUS_TYPE_UNIX_FD:
+		*size = sizeof(int);
+		*align = alignof(int);
+		break;
+	default:
+		// strings, object paths and signatures
+		*size = sizeof(const char *);
+		*align = alignof(const char *);
+		break;
+	}
+}
+
+static int add_node(struct subd_plan *plan, int type) {
+	if (plan->length == plan->capacity) {
+		int c = plan->capacity == 0 ? 8 : plan->capacity * 2;
+		void *t = realloc(plan->nodes, sizeof(struct plan_node) * c);
+		if (t == NULL) {
+			return -1;
+		}
+		plan->nodes = t;
+		plan->capacity = c;
+	}
+	plan->nodes[plan->length] = (struct plan_node){.type = type};
+	return plan->length++;
+}
+
+static int compile_type(struct subd_plan *plan, DBusSignatureIter *iter);
+
+/**
+ * Helper function that compiles the types at "iter" as the fields of the
+ * struct-like node "index", laying them out like a C compiler would.
+ */
+static bool compile_fields(struct subd_plan *plan, int index,
+		DBusSignatureIter *iter) {
+	size_t offset = 0;
+	size_t align = 1;
+	do {
+		int child = compile_type(plan, iter);
+		if (child == -1) {
+			return false;
+		}
+		struct plan_node *node = &plan->nodes[child];
+		offset = align_up(offset, node->align);
+		node->offset = offset;
+		offset += node->size;
+		if (node->align > align) {
+			align = node->align;
+		}
+	} while (dbus_signature_iter_next(iter));
+
+	plan->nodes[index].size = align_up(offset, align);
+	plan->nodes[index].align = align;
+	return true;
+}
+
+/**
+ * Helper function that compiles the complete type at "iter" and its contents.
+ * Returns the index of its node, or -1 if out of memory.
+ */
+static int compile_type(struct subd_plan *plan, DBusSignatureIter *iter) {
+	int type = dbus_signature_iter_get_current_type(iter);
+	int index = add_node(plan, type);
+	if (index == -1) {
+		return -1;
+	}
+
+	DBusSignatureIter sub;
+	switch (type) {
+	case DBUS_TYPE_ARRAY:
+		dbus_signature_iter_recurse(iter, &sub);
+		plan->nodes[index].signature = dbus_signature_iter_get_signature(&sub);
+		if (plan->nodes[index].signature == NULL ||
+				compile_type(plan, &sub) == -1) {
+			return -1;
+		}
+		plan->nodes[index].size = sizeof(struct subd_array);
+		plan->nodes[index].align = alignof(struct subd_array);
+		break;
+	case DBUS_TYPE_STRUCT:
+	case DBUS_TYPE_DICT_ENTRY:
+		dbus_signature_iter_recurse(iter, &sub);
+		if (!compile_fields(plan, index, &sub)) {
+			return -1;
+		}
+		break;
+	case DBUS_TYPE_VARIANT:
+		plan->nodes[index].size = sizeof(struct subd_variant);
+		plan->nodes[index].align = alignof(struct subd_variant);
+		break;
+	default:
+		basic_layout(type, &plan->nodes[index].size,
+			&plan->nodes[index].align);
+		break;
+	}
+
+	plan->nodes[index].next = plan->length;
+	return index;
+}
+
+struct subd_plan *subd_plan_new(const char *signature, DBusError *err) {
+	if (!dbus_signature_validate(signature, err)) {
+		return NULL;
+	}
+
+	struct subd_plan *plan = calloc(1, sizeof(struct subd_plan));
+	if (plan == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	plan->signature = malloc(strlen(signature) + 1);
+	if (plan->signature == NULL || add_node(plan, DBUS_TYPE_INVALID) == -1) {
+		goto error;
+	}
+	strcpy(plan->signature, signature);
+
+	plan->nodes[0].align = 1;
+	if (signature[0] != '\0') {
+		DBusSignatureIter iter;
+		dbus_signature_iter_init(&iter, signature);
+		if (!compile_fields(plan, 0, &iter)) {
+			goto error;
+		}
+	}
+	plan->nodes[0].next = plan->length;
+
+	return plan;
+
+error:
+	subd_plan_free(plan);
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return NULL;
+}
+
+void subd_plan_free(struct subd_plan *plan) {
+	for (int i = 0; i < plan->length; ++i) {
+		dbus_free(plan->nodes[i].signature);
+	}
+	free(plan->signature);
+	free(plan->nodes);
+	free(plan);
+}
+
+const char *subd_plan_signature(const struct subd_plan *plan) {
+	return plan->signature;
+}
+
+size_t subd_plan_size(const struct subd_plan *plan) {
+	return plan->nodes[0].size;
+}
+
+static bool decode_value(const struct subd_plan *plan, int index,
+		DBusMessageIter *iter, char *value, DBusError *err);
+
+/**
+ * Helper function that releases the elements of the decoded array "array",
+ * whose element is node "element".
+ */
+static void release_elements(const struct subd_plan *plan, int element,
+		struct subd_array *array, int count);
+
+static void release_value(const struct subd_plan *plan, int index,
+		char *value) {
+	const struct plan_node *node = &plan->nodes[index];
+	if (node->type == DBUS_TYPE_UNIX_FD) {
+		// File descriptors are duplicated when they are decoded.
+		int fd = *(int *)value;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+	if (node->type == DBUS_TYPE_ARRAY) {
+		struct subd_array *array = (struct subd_array *)value;
+		if (!is_view_element(plan->nodes[index + 1].type)) {
+			release_elements(plan, index + 1, array, array->length);
+		}
+		return;
+	}
+	for (int child = index + 1; child < node->next;
+			child = plan->nodes[child].next) {
+		release_value(plan, child, value + plan->nodes[child].offset);
+	}
+}
+
+static void release_elements(const struct subd_plan *plan, int element,
+		struct subd_array *array, int count) {
+	char *data = (char *)array->data;
+	for (int i = 0; i < count; ++i) {
+		release_value(plan, element, data + i * plan->nodes[element].size);
+	}
+	free(data);
+	array->data = NULL;
+	array->length = 0;
+}
+
+/**
+ * Helper function that decodes the fields of the struct-like node "index" from
+ * "iter" into "value", advancing "iter" past them. If a field can not be
+ * decoded, the ones before it are released.
+ */
+static bool decode_fields(const struct subd_plan *plan, int index,
+		DBusMessageIter *iter, char *value, DBusError *err) {
+	const struct plan_node *node = &plan->nodes[index];
+	for (int child = index + 1; child < node->next;
+			child = plan->nodes[child].next) {
+		if (!decode_value(plan, child, iter, value + plan->nodes[child].offset,
+				err)) {
+			for (int c = index + 1; c < child; c = plan->nodes[c].next) {
+				release_value(plan, c, value + plan->nodes[c].offset);
+			}
+			return false;
+		}
+		dbus_message_iter_next(iter);
+	}
+	return true;
+}
+
+/**
+ * Helper function that decodes a non-fixed array element by element into a
+ * newly allocated array.
+ */
+static bool decode_elements(const struct subd_plan *plan, int element,
+		DBusMessageIter *sub, int count, struct subd_array *array,
+		DBusError *err) {
+	size_t size = plan->nodes[element].size;
+	array->data = count == 0 ? NULL : calloc(count, size);
+	array->length = 0;
+	if (count > 0 && array->data == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+
+	char *data = (char *)array->data;
+	for (int i = 0; i < count; ++i) {
+		if (!decode_value(plan, element, sub, data + i * size, err)) {
+			release_elements(plan, element, array, i);
+			return false;
+		}
+		dbus_message_iter_next(sub);
+	}
+	array->length = count;
+	return true;
+}
+
+static bool decode_value(const struct subd_plan *plan, int index,
+		DBusMessageIter *iter, char *value, DBusError *err) {
+	const struct plan_node *node = &plan->nodes[index];
+	int type = dbus_message_iter_get_arg_type(iter);
+	if (type != node->type) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Expected a field of type %c, got %c", node->type,
+			type == DBUS_TYPE_INVALID ? '-' : type);
+		return false;
+	}
+
+	DBusMessageIter sub;
+	switch (type) {
+	case DBUS_TYPE_ARRAY: {
+		struct subd_array *array = (struct subd_array *)value;
+		int element = index + 1;
+		if (dbus_message_iter_get_element_type(iter) !=
+				plan->nodes[element].type) {
+			dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+				"Expected an array of %c", plan->nodes[element].type);
+			return false;
+		}
+		dbus_message_iter_recurse(iter, &sub);
+		if (is_view_element(plan->nodes[element].type)) {
+			// Arrays of fixed types are not copied, the view points into the
+			// message.
+			dbus_message_iter_get_fixed_array(&sub, &array->data,
+				&array->length);
+			return true;
+		}
+		return decode_elements(plan, element, &sub,
+			dbus_message_iter_get_element_count(iter), array, err);
+	}
+	case DBUS_TYPE_STRUCT:
+	case DBUS_TYPE_DICT_ENTRY:
+		dbus_message_iter_recurse(iter, &sub);
+		if (!decode_fields(plan, index, &sub, value, err)) {
+			return false;
+		}
+		if (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+			release_value(plan, index, value);
+			dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+				"Struct has more fields than expected");
+			return false;
+		}
+		return true;
+	case DBUS_TYPE_VARIANT: {
+		struct subd_variant *variant = (struct subd_variant *)value;
+		dbus_message_iter_recurse(iter, &variant->iter);
+		variant->plan = NULL;
+		variant->value = NULL;
+		return true;
+	}
+	default:
+		dbus_message_iter_get_basic(iter, value);
+		return true;
+	}
+}
+
+dbus_bool_t subd_message_decode(DBusMessageIter *iter,
+		const struct subd_plan *plan, void *value, DBusError *err) {
+	// The fields of the root are read from "iter" itself, so the caller can
+	// continue reading after them.
+	DBusMessageIter start = *iter;
+	if (!decode_fields(plan, 0, iter, value, err)) {
+		*iter = start;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void subd_plan_release(const struct subd_plan *plan, void *value) {
+	release_value(plan, 0, value);
+}
+
+static bool encode_value(const struct subd_plan *plan, int index,
+		DBusMessageIter *iter, const char *value, DBusError *err);
+
+static bool encode_fields(const struct subd_plan *plan, int index,
+		DBusMessageIter *iter, const char *value, DBusError *err) {
+	const struct plan_node *node = &plan->nodes[index];
+	for (int child = index + 1; child < node->next;
+			child = plan->nodes[child].next) {
+		if (!encode_value(plan, child, iter, value + plan->nodes[child].offset,
+				err)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Helper function that encodes the contents of a variant, either from its
+ * plan and value, or by copying them from its iterator.
+ */
+static bool encode_variant(const struct subd_variant *variant,
+		DBusMessageIter *sub, DBusError *err) {
+	if (variant->plan != NULL) {
+		return encode_fields(variant->plan, 0, sub, variant->value, err);
+	}
+
+	DBusMessageIter contents = variant->iter;
+	if (!copy_arguments(&contents, sub)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	return true;
+}
+
+static bool encode_value(const struct subd_plan *plan, int index,
+		DBusMessageIter *iter, const char *value, DBusError *err) {
+	const struct plan_node *node = &plan->nodes[index];
+	DBusMessageIter sub;
+	bool ok;
+	switch (node->type) {
+	case DBUS_TYPE_ARRAY: {
+		const struct subd_array *array = (const struct subd_array *)value;
+		const struct plan_node *element = &plan->nodes[index + 1];
+		if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+				node->signature, &sub)) {
+			goto no_memory;
+		}
+		if (is_view_element(element->type)) {
+			// Empty arrays still need a valid pointer, their data may be NULL.
+			static const dbus_uint64_t none = 0;
+			const void *data = array->length == 0 ? &none : array->data;
+			ok = dbus_message_iter_append_fixed_array(&sub, element->type,
+				&data, array->length);
+			if (!ok) {
+				dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			}
+		} else {
+			ok = true;
+			const char *data = array->data;
+			for (int i = 0; ok && i < array->length; ++i) {
+				ok = encode_value(plan, index + 1, &sub,
+					data + i * element->size, err);
+			}
+		}
+		break;
+	}
+	case DBUS_TYPE_STRUCT:
+	case DBUS_TYPE_DICT_ENTRY:
+		if (!dbus_message_iter_open_container(iter, node->type, NULL, &sub)) {
+			goto no_memory;
+		}
+		ok = encode_fields(plan, index, &sub, value, err);
+		break;
+	case DBUS_TYPE_VARIANT: {
+		const struct subd_variant *variant =
+			(const struct subd_variant *)value;
+		char *signature = NULL;
+		const char *contents;
+		if (variant->plan != NULL) {
+			// A variant holds exactly one complete type.
+			const struct subd_plan *p = variant->plan;
+			if (p->length < 2 || p->nodes[1].next != p->length) {
+				dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+					"Variant signature %s is not a single type", p->signature);
+				return false;
+			}
+			contents = p->signature;
+		} else {
+			contents = signature = dbus_message_iter_get_signature(
+				(DBusMessageIter *)&variant->iter);
+			if (signature == NULL) {
+				goto no_memory;
+			}
+		}
+		ok = dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT,
+			contents, &sub);
+		dbus_free(signature);
+		if (!ok) {
+			goto no_memory;
+		}
+		ok = encode_variant(variant, &sub, err);
+		break;
+	}
+	default:
+		if (!dbus_message_iter_append_basic(iter, node->type, value)) {
+			goto no_memory;
+		}
+		return true;
+	}
+
+	if (!ok) {
+		dbus_message_iter_abandon_container(iter, &sub);
+		return false;
+	}
+	if (!dbus_message_iter_close_container(iter, &sub)) {
+		goto no_memory;
+	}
+	return true;
+
+no_memory:
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return false;
+}
+
+dbus_bool_t subd_message_encode(DBusMessageIter *iter,
+		const struct subd_plan *plan, const void *value, DBusError *err) {
+	return encode_fields(plan, 0, iter, value, err);
+}
@@ -0,0 +1,231 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "subd.h"
+
+struct job {
+	void (*function)(void *);
+	void *data;
+};
+
+/**
+ * A worker's double-ended job queue. The owner pushes and pops at the tail,
+ * other workers steal from the head, so a worker keeps working on its most
+ * recent (cache-hot) jobs, while idle workers take the oldest ones.
+ */
+struct deque {
+	pthread_mutex_t mutex;
+	struct job *jobs;
+	size_t capacity;	// always a power of two
+	size_t head;
+	size_t tail;
+};
+
+struct worker {
+	pthread_t thread;
+	struct subd_pool *pool;
+	int index;
+	struct deque deque;
+};
+
+struct subd_pool {
+	struct worker *workers;
+	int size;
+	atomic_uint next;		// round-robin index for submissions
+	atomic_int queued;		// number of jobs in all deques
+	bool stop;
+	pthread_mutex_t mutex;	// protects stop, and is used with idle
+	pthread_cond_t idle;
+};
+
+static bool deque_init(struct deque *deque) {
+	deque->capacity = 64;
+	deque->head = 0;
+	deque->tail = 0;
+	deque->jobs = malloc(sizeof(struct job) * deque->capacity);
+	if (deque->jobs == NULL) {
+		return false;
+	}
+	pthread_mutex_init(&deque->mutex, NULL);
+	return true;
+}
+
+static void deque_destroy(struct deque *deque) {
+	pthread_mutex_destroy(&deque->mutex);
+	free(deque->jobs);
+}
+
+static bool deque_push(struct deque *deque, struct job job) {
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->tail - deque->head == deque->capacity) {
+		size_t c = deque->capacity * 2;
+		struct job *jobs = malloc(sizeof(struct job) * c);
+		if (jobs == NULL) {
+			pthread_mutex_unlock(&deque->mutex);
+			return false;
+		}
+		for (size_t i = deque->head; i != deque->tail; ++i) {
+			jobs[i & (c - 1)] = deque->jobs[i & (deque->capacity - 1)];
+		}
+		free(deque->jobs);
+		deque->jobs = jobs;
+		deque->capacity = c;
+	}
+	deque->jobs[deque->tail++ & (deque->capacity - 1)] = job;
+	pthread_mutex_unlock(&deque->mutex);
+	return true;
+}
+
+static bool deque_pop(struct deque *deque, struct job *job, bool steal) {
+	pthread_mutex_lock(&deque->mutex);
+	bool found = deque->head != deque->tail;
+	if (found && steal) {
+		*job = deque->jobs[deque->head++ & (deque->capacity - 1)];
+	} else if (found) {
+		*job = deque->jobs[--deque->tail & (deque->capacity - 1)];
+	}
+	pthread_mutex_unlock(&deque->mutex);
+	return found;
+}
+
+/**
+ * Takes a job from the worker's own deque, or steals one from the others.
+ */
+static bool take_job(struct worker *worker, struct job *job) {
+	struct subd_pool *pool = worker->pool;
+	if (deque_pop(&worker->deque, job, false)) {
+		return true;
+	}
+	for (int i = 1; i < pool->size; ++i) {
+		struct worker *victim = &pool->workers[(worker->index + i) % pool->size];
+		if (deque_pop(&victim->deque, job, true)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *work(void *data) {
+	struct worker *worker = data;
+	struct subd_pool *pool = worker->pool;
+	struct job job;
+	for (;;) {
+		if (take_job(worker, &job)) {
+			atomic_fetch_sub(&pool->queued, 1);
+			job.function(job.data);
+			continue;
+		}
+
+		// Nothing to do, sleep until a job is submitted. Jobs that are still
+		// queued when the pool is stopped are run before exiting.
+		pthread_mutex_lock(&pool->mutex);
+		while (atomic_load(&pool->queued) == 0 && !pool->stop) {
+			pthread_cond_wait(&pool->idle, &pool->mutex);
+		}
+		bool stop = pool->stop && atomic_load(&pool->queued) == 0;
+		pthread_mutex_unlock(&pool->mutex);
+		if (stop) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+struct subd_pool *subd_pool_create(int size, DBusError *err) {
+	if (size <= 0) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Pool size must be positive.");
+		return NULL;
+	}
+
+	struct subd_pool *pool = malloc(sizeof(struct subd_pool));
+	if (pool == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	pool->workers = calloc(size, sizeof(struct worker));
+	if (pool->workers == NULL) {
+		free(pool);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	pool->size = 0;
+	pool->stop = false;
+	atomic_init(&pool->next, 0);
+	atomic_init(&pool->queued, 0);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	// All deques have to exist before any worker starts stealing.
+	for (int i = 0; i < size; ++i) {
+		struct worker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		if (!deque_init(&worker->deque)) {
+			for (int j = 0; j < i; ++j) {
+				deque_destroy(&pool->workers[j].deque);
+			}
+			pthread_cond_destroy(&pool->idle);
+			pthread_mutex_destroy(&pool->mutex);
+			free(pool->workers);
+			free(pool);
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			return NULL;
+		}
+	}
+	pool->size = size;
+
+	for (int i = 0; i < size; ++i) {
+		struct worker *worker = &pool->workers[i];
+		if (pthread_create(&worker->thread, NULL, work, worker) != 0) {
+			// Shrink the pool to the workers that did start.
+			for (int j = i; j < size; ++j) {
+				deque_destroy(&pool->workers[j].deque);
+			}
+			pool->size = i;
+			subd_pool_destroy(pool);
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY,
+				"Could not start worker threads.");
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void subd_pool_destroy(struct subd_pool *pool) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->idle);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < pool->size; ++i) {
+		pthread_join(pool->workers[i].thread, NULL);
+		deque_destroy(&pool->workers[i].deque);
+	}
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	free(pool);
+}
+
+bool pool_submit(struct subd_pool *pool, void (*function)(void *),
+		void *data) {
+	struct job job = {function, data};
+	unsigned int index = atomic_fetch_add(&pool->next, 1) % pool->size;
+	if (!deque_push(&pool->workers[index].deque, job)) {
+		return false;
+	}
+
+	atomic_fetch_add(&pool->queued, 1);
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cond_signal(&pool->idle);
+	pthread_mutex_unlock(&pool->mutex);
+	return true;
+}
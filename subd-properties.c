@@ -0,0 +1,616 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "plan.h"
+#include "subd.h"
+#include "vtable.h"
+
+static bool is_readable(const struct subd_member *member) {
+	return member->p.access != SUBD_PROPERTY_WRITE && member->p.getter != NULL;
+}
+
+/**
+ * Helper function that returns the property named "name" of "interface" on
+ * "path", or NULL if there is no such property. Must be called with the mutex
+ * held.
+ */
+static const struct subd_member *find_property(struct path *path,
+		const char *interface, const char *name) {
+	char key[METHOD_KEY_SIZE];
+	size_t length = method_key(key, interface, name);
+	return length == 0 ? NULL : hashmap_get_n(path->properties, key, length);
+}
+
+/**
+ * Helper function that appends the value of a property as a variant. The value
+ * itself is appended by the property's getter.
+ */
+static bool append_value(DBusConnection *conn, struct interface *interface,
+		const struct subd_member *member, DBusMessageIter *iter,
+		DBusError *err) {
+	DBusMessageIter variant;
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT,
+			member->p.signature, &variant)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	if (!member->p.getter(conn, interface->path->path, interface->name,
+			member->p.name, &variant, interface->path->userdata, err)) {
+		dbus_message_iter_abandon_container(iter, &variant);
+		return false;
+	}
+	if (!dbus_message_iter_close_container(iter, &variant)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Helper function that appends the readable properties of "interface" as an
+ * a{sv} dictionary.
+ */
+static bool append_properties(DBusConnection *conn, struct interface *interface,
+		DBusMessageIter *iter, DBusError *err) {
+	DBusMessageIter array;
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}",
+			&array)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+
+	for (const struct subd_member *m = interface->members;
+			m->type != SUBD_MEMBERS_END; ++m) {
+		if (m->type != SUBD_PROPERTY || !is_readable(m)) {
+			continue;
+		}
+		DBusMessageIter entry;
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+				NULL, &entry)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			goto error;
+		}
+		if (!dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+				&m->p.name)) {
+			dbus_message_iter_abandon_container(&array, &entry);
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			goto error;
+		}
+		if (!append_value(conn, interface, m, &entry, err)) {
+			dbus_message_iter_abandon_container(&array, &entry);
+			goto error;
+		}
+		if (!dbus_message_iter_close_container(&array, &entry)) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			goto error;
+		}
+	}
+
+	if (!dbus_message_iter_close_container(iter, &array)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	return true;
+
+error:
+	dbus_message_iter_abandon_container(iter, &array);
+	return false;
+}
+
+/**
+ * Helper function that returns a new reference to the cached GetAll reply of
+ * "interface", building it first if necessary. The cache is a method return
+ * without a reply serial, so it has to be copied before it is sent.
+ */
+static DBusMessage *get_properties(DBusConnection *conn,
+		struct interface *interface, DBusError *err) {
+	struct registry *registry = interface->path->registry;
+	pthread_mutex_lock(&registry->mutex);
+	DBusMessage *cache = interface->properties;
+	unsigned int generation = interface->generation;
+	if (cache != NULL) {
+		dbus_message_ref(cache);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	if (cache != NULL) {
+		return cache;
+	}
+
+	// The getters are called without the lock held, so they can report
+	// changes themselves.
+	cache = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (cache == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	DBusMessageIter iter;
+	dbus_message_iter_init_append(cache, &iter);
+	if (!append_properties(conn, interface, &iter, err)) {
+		dbus_message_unref(cache);
+		return NULL;
+	}
+
+	// Don't store the values if a property changed while they were read.
+	pthread_mutex_lock(&registry->mutex);
+	if (interface->properties == NULL && interface->generation == generation &&
+			!interface->removed) {
+		interface->properties = dbus_message_ref(cache);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+
+	return cache;
+}
+
+/**
+ * Helper function that appends the readable properties of "interface" as an
+ * a{sv} dictionary, copied from its cached GetAll reply.
+ */
+bool append_cached_properties(DBusConnection *conn,
+		struct interface *interface, DBusMessageIter *iter, DBusError *err) {
+	DBusMessage *cache = get_properties(conn, interface, err);
+	if (cache == NULL) {
+		return false;
+	}
+
+	DBusMessageIter from;
+	dbus_message_iter_init(cache, &from);
+	bool ok = copy_arguments(&from, iter);
+	dbus_message_unref(cache);
+	if (!ok) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return ok;
+}
+
+/**
+ * Helper function that drops the cached GetAll reply of "interface", and puts
+ * "member" on its changed list. Must be called with the mutex held.
+ */
+static bool queue_change(struct interface *interface,
+		const struct subd_member *member) {
+	struct registry *registry = interface->path->registry;
+	if (interface->properties != NULL) {
+		dbus_message_unref(interface->properties);
+		interface->properties = NULL;
+	}
+	++interface->generation;
+
+	for (int i = 0; i < interface->changed_length; ++i) {
+		if (interface->changed[i] == member) {
+			return true;
+		}
+	}
+	if (interface->changed_length == interface->changed_capacity) {
+		int c = interface->changed_capacity == 0 ?
+			4 : interface->changed_capacity * 2;
+		void *t = realloc(interface->changed,
+			sizeof(struct subd_member *) * c);
+		if (t == NULL) {
+			return false;
+		}
+		interface->changed = t;
+		interface->changed_capacity = c;
+	}
+	if (interface->changed_length == 0) {
+		interface->next_changed = registry->changed;
+		registry->changed = interface;
+	}
+	interface->changed[interface->changed_length++] = member;
+
+#ifdef HAVE_TIMERFD
+	// The timer makes sure the signal is sent even if the event loop has
+	// nothing else to do. The timeouts are looked up every time, because the
+	// event loop might have been freed (and recreated) since the timer was
+	// last scheduled (see subd_emit_signal_coalesced).
+	struct subd_timeouts *timeouts = timeouts_get(registry->conn);
+	if (timeouts != NULL && !wheel_pending(&registry->timer.wheel_timer)) {
+		registry->timeouts = timeouts;
+		timer_schedule(timeouts, &registry->timer, 0);
+	}
+#endif
+
+	return true;
+}
+
+/**
+ * Helper function for the Properties methods that reads the interface name
+ * argument, and finds the interface on the path the message was sent to. The
+ * interface is returned with a reference that the caller has to drop, so it
+ * stays valid while the method is handled.
+ */
+static struct interface *read_interface(DBusConnection *conn, DBusMessage *msg,
+		DBusMessageIter *iter, DBusError *err) {
+	struct path *path = find_path(conn, dbus_message_get_path(msg));
+	if (path == NULL) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Path was not found in the registry.");
+		return NULL;
+	}
+
+	const char *name;
+	if (!dbus_message_iter_init(msg, iter) ||
+			dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) {
+		path_unref(path);
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Interface name is missing.");
+		return NULL;
+	}
+	dbus_message_iter_get_basic(iter, &name);
+	dbus_message_iter_next(iter);
+
+	pthread_mutex_lock(&path->registry->mutex);
+	struct interface *interface = hashmap_get(path->interface_map, name);
+	if (interface != NULL) {
+		interface_ref(interface);
+	}
+	pthread_mutex_unlock(&path->registry->mutex);
+	path_unref(path);
+	if (interface == NULL) {
+		dbus_set_error(err, DBUS_ERROR_UNKNOWN_INTERFACE,
+			"Interface %s does not exist.", name);
+	}
+	return interface;
+}
+
+/**
+ * Helper function for Get and Set that reads the property name argument, and
+ * finds the property in "interface".
+ */
+static const struct subd_member *read_property(struct interface *interface,
+		DBusMessageIter *iter, DBusError *err) {
+	const char *name;
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Property name is missing.");
+		return NULL;
+	}
+	dbus_message_iter_get_basic(iter, &name);
+	dbus_message_iter_next(iter);
+
+	struct registry *registry = interface->path->registry;
+	pthread_mutex_lock(&registry->mutex);
+	const struct subd_member *member =
+		find_property(interface->path, interface->name, name);
+	pthread_mutex_unlock(&registry->mutex);
+	if (member == NULL) {
+		dbus_set_error(err, DBUS_ERROR_UNKNOWN_PROPERTY,
+			"Property %s.%s does not exist.", interface->name, name);
+	}
+	return member;
+}
+
+/**
+ * Helper function for handle_get that replies with the value of the property
+ * named by the arguments following "iter".
+ */
+static dbus_bool_t get_property(DBusConnection *conn, DBusMessage *msg,
+		struct interface *interface, DBusMessageIter *iter, DBusError *err) {
+	const struct subd_member *member = read_property(interface, iter, err);
+	if (member == NULL) {
+		return FALSE;
+	}
+	if (!is_readable(member)) {
+		dbus_set_error(err, DBUS_ERROR_ACCESS_DENIED,
+			"Property %s.%s is not readable.", interface->name, member->p.name);
+		return FALSE;
+	}
+
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	DBusMessageIter out;
+	dbus_message_iter_init_append(reply, &out);
+	if (!append_value(conn, interface, member, &out, err)) {
+		dbus_message_unref(reply);
+		return FALSE;
+	}
+
+	dbus_bool_t ret = dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+	if (!ret) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return ret;
+}
+
+static dbus_bool_t handle_get(DBusConnection *conn, DBusMessage *msg,
+		void *data, DBusError *err) {
+	DBusMessageIter iter;
+	struct interface *interface = read_interface(conn, msg, &iter, err);
+	if (interface == NULL) {
+		return FALSE;
+	}
+	dbus_bool_t ret = get_property(conn, msg, interface, &iter, err);
+	interface_unref(interface);
+	return ret;
+}
+
+/**
+ * Helper function for handle_set that sets the property named by the
+ * arguments following "iter".
+ */
+static dbus_bool_t set_property(DBusConnection *conn, DBusMessage *msg,
+		struct interface *interface, DBusMessageIter *iter, DBusError *err) {
+	const struct subd_member *member = read_property(interface, iter, err);
+	if (member == NULL) {
+		return FALSE;
+	}
+	if (member->p.access == SUBD_PROPERTY_READ || member->p.setter == NULL) {
+		dbus_set_error(err, DBUS_ERROR_PROPERTY_READ_ONLY,
+			"Property %s.%s is read-only.", interface->name, member->p.name);
+		return FALSE;
+	}
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS, "Value is missing.");
+		return FALSE;
+	}
+	DBusMessageIter value;
+	dbus_message_iter_recurse(iter, &value);
+	char *signature = dbus_message_iter_get_signature(&value);
+	bool matches = signature != NULL &&
+		strcmp(signature, member->p.signature) == 0;
+	dbus_free(signature);
+	if (!matches) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_SIGNATURE,
+			"Property %s.%s has type %s.", interface->name, member->p.name,
+			member->p.signature);
+		return FALSE;
+	}
+
+	struct path *path = interface->path;
+	if (!member->p.setter(conn, path->path, interface->name, member->p.name,
+			&value, path->userdata, err)) {
+		return FALSE;
+	}
+
+	// The interface might have been removed while the setter ran.
+	pthread_mutex_lock(&path->registry->mutex);
+	if (!interface->removed) {
+		queue_change(interface, member);
+	}
+	pthread_mutex_unlock(&path->registry->mutex);
+
+	return subd_reply_method_return(conn, msg, err, DBUS_TYPE_INVALID);
+}
+
+static dbus_bool_t handle_set(DBusConnection *conn, DBusMessage *msg,
+		void *data, DBusError *err) {
+	DBusMessageIter iter;
+	struct interface *interface = read_interface(conn, msg, &iter, err);
+	if (interface == NULL) {
+		return FALSE;
+	}
+	dbus_bool_t ret = set_property(conn, msg, interface, &iter, err);
+	interface_unref(interface);
+	return ret;
+}
+
+static dbus_bool_t handle_get_all(DBusConnection *conn, DBusMessage *msg,
+		void *data, DBusError *err) {
+	DBusMessageIter iter;
+	struct interface *interface = read_interface(conn, msg, &iter, err);
+	if (interface == NULL) {
+		return FALSE;
+	}
+
+	DBusMessage *cache = get_properties(conn, interface, err);
+	dbus_bool_t ret = cache != NULL &&
+		send_cached_reply(conn, msg, cache, err);
+	if (cache != NULL) {
+		dbus_message_unref(cache);
+	}
+	interface_unref(interface);
+	return ret;
+}
+
+const struct subd_member properties_members[] = {
+	{SUBD_METHOD, .m = {"Get", handle_get, "ss", "v"}},
+	{SUBD_METHOD, .m = {"Set", handle_set, "ssv", ""}},
+	{SUBD_METHOD, .m = {"GetAll", handle_get_all, "s", "a{sv}"}},
+	{SUBD_SIGNAL, .s = {"PropertiesChanged", "sa{sv}as"}},
+	{SUBD_MEMBERS_END, .e=0},
+};
+
+dbus_bool_t subd_properties_changed(DBusConnection *conn, const char *path_name,
+		const char *interface_name, DBusError *err, ...) {
+	struct path *path = find_path(conn, path_name);
+	if (path == NULL) {
+		dbus_set_error(err, DBUS_ERROR_UNKNOWN_INTERFACE,
+			"Interface %s does not exist on %s.", interface_name, path_name);
+		return FALSE;
+	}
+
+	// Check all names first, so either all of the changes are queued, or
+	// none of them.
+	dbus_bool_t ret = TRUE;
+	pthread_mutex_lock(&path->registry->mutex);
+	struct interface *interface = interface_name == NULL ? NULL :
+		hashmap_get(path->interface_map, interface_name);
+	if (interface == NULL) {
+		dbus_set_error(err, DBUS_ERROR_UNKNOWN_INTERFACE,
+			"Interface %s does not exist on %s.", interface_name, path_name);
+		ret = FALSE;
+	}
+	va_list ap;
+	va_start(ap, err);
+	const char *name;
+	while (ret && (name = va_arg(ap, const char *)) != NULL) {
+		if (find_property(path, interface_name, name) == NULL) {
+			dbus_set_error(err, DBUS_ERROR_UNKNOWN_PROPERTY,
+				"Property %s.%s does not exist.", interface_name, name);
+			ret = FALSE;
+		}
+	}
+	va_end(ap);
+
+	va_start(ap, err);
+	while (ret && (name = va_arg(ap, const char *)) != NULL) {
+		if (!queue_change(interface, find_property(path, interface_name, name))) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			ret = FALSE;
+		}
+	}
+	va_end(ap);
+	pthread_mutex_unlock(&path->registry->mutex);
+	path_unref(path);
+
+	return ret;
+}
+
+/**
+ * Helper function that creates the PropertiesChanged signal of "interface".
+ * The values of readable properties are sent in the signal if "with_values" is
+ * true, otherwise all properties are only invalidated.
+ */
+static DBusMessage *new_properties_changed(DBusConnection *conn,
+		struct interface *interface, const struct subd_member **members,
+		int length, bool with_values) {
+	DBusMessage *signal = dbus_message_new_signal(interface->path->path,
+		DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+	if (signal == NULL) {
+		return NULL;
+	}
+
+	DBusMessageIter iter, array, entry;
+	const char *name = interface->name;
+	dbus_message_iter_init_append(signal, &iter);
+	if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &name) ||
+			!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
+				&array)) {
+		goto error;
+	}
+	for (int i = 0; with_values && i < length; ++i) {
+		if (!is_readable(members[i])) {
+			continue;
+		}
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+				NULL, &entry)) {
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+		if (!dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+				&members[i]->p.name) ||
+				!append_value(conn, interface, members[i], &entry, NULL)) {
+			dbus_message_iter_abandon_container(&array, &entry);
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+		if (!dbus_message_iter_close_container(&array, &entry)) {
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+	}
+	if (!dbus_message_iter_close_container(&iter, &array) ||
+			!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s",
+				&array)) {
+		goto error;
+	}
+	for (int i = 0; i < length; ++i) {
+		if (with_values && is_readable(members[i])) {
+			continue;
+		}
+		if (!dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING,
+				&members[i]->p.name)) {
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+	}
+	if (!dbus_message_iter_close_container(&iter, &array)) {
+		goto error;
+	}
+
+	return signal;
+
+error:
+	dbus_message_unref(signal);
+	return NULL;
+}
+
+struct changed_interface {
+	struct interface *interface;
+	const struct subd_member **members;
+	int length;
+};
+
+void properties_flush(DBusConnection *conn) {
+	struct registry *registry = find_registry(conn);
+	if (registry == NULL) {
+		return;
+	}
+
+	// Take the changed lists under the lock, and send the signals without
+	// it, since the getters are called while building them. The interfaces
+	// are referenced, so they can be removed meanwhile.
+	pthread_mutex_lock(&registry->mutex);
+	int count = 0;
+	for (struct interface *i = registry->changed; i != NULL;
+			i = i->next_changed) {
+		++count;
+	}
+	struct changed_interface *changed = NULL;
+	if (count > 0) {
+		changed = malloc(sizeof(struct changed_interface) * count);
+	}
+	if (changed == NULL) {
+		// Nothing changed, or out of memory, in which case the signals are
+		// sent on a later iteration.
+		pthread_mutex_unlock(&registry->mutex);
+		return;
+	}
+	struct interface *interface = registry->changed;
+	registry->changed = NULL;
+	for (int i = 0; i < count; ++i) {
+		changed[i] = (struct changed_interface){
+			.interface = interface,
+			.members = interface->changed,
+			.length = interface->changed_length,
+		};
+		interface->changed = NULL;
+		interface->changed_capacity = 0;
+		interface->changed_length = 0;
+		interface_ref(interface);
+		interface = interface->next_changed;
+	}
+	pthread_mutex_unlock(&registry->mutex);
+
+	for (int i = 0; i < count; ++i) {
+		struct changed_interface *c = &changed[i];
+		DBusMessage *signal = new_properties_changed(conn, c->interface,
+			c->members, c->length, true);
+		if (signal == NULL) {
+			// A value could not be read, the clients will have to get it.
+			signal = new_properties_changed(conn, c->interface, c->members,
+				c->length, false);
+		}
+		if (signal != NULL) {
+			dbus_connection_send(conn, signal, NULL);
+			dbus_message_unref(signal);
+		}
+		free(c->members);
+		interface_unref(c->interface);
+	}
+	free(changed);
+}
+
+#ifdef HAVE_TIMERFD
+void properties_timer(struct subd_timer *timer) {
+	struct registry *registry = (struct registry *)timer;
+	properties_flush(registry->conn);
+}
+#endif
+
+void release_properties(struct interface *interface) {
+	if (interface->properties != NULL) {
+		dbus_message_unref(interface->properties);
+	}
+	free(interface->changed);
+}
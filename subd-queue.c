@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#include "queue.h"
+#include "subd.h"
+
+struct node {
+	struct node *next;
+	DBusMessage *msg;
+};
+
+/**
+ * A multi-producer, single-consumer queue of messages to send. Producers push
+ * onto a lock-free stack, and the event loop takes the whole stack at once,
+ * and sends it in the order it was pushed. Only the producer that finds the
+ * stack empty wakes the loop, so a burst of messages costs one wakeup.
+ */
+struct subd_queue {
+	DBusConnection *conn;
+	struct node *_Atomic head;	// the most recently pushed node
+	int fd;						// the eventfd, or the read end of the pipe
+#ifndef HAVE_EVENTFD
+	int write_fd;
+#endif
+};
+
+/**
+ * The queue is attached to the connection, so subd_get_queue can find it.
+ */
+static dbus_int32_t queue_slot = -1;
+
+void queue_wake(struct subd_queue *queue) {
+	uint64_t one = 1;
+#ifdef HAVE_EVENTFD
+	int fd = queue->fd;
+#else
+	int fd = queue->write_fd;
+#endif
+	// A full pipe (EAGAIN) is fine, the loop will wake up anyway.
+	while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+/**
+ * Called by libdbus when the loop has to do something because of another
+ * thread (e.g. write a message sent from there).
+ */
+static void wakeup_main(void *data) {
+	queue_wake(data);
+}
+
+static void free_nodes(struct node *node) {
+	while (node != NULL) {
+		struct node *save_next = node->next;
+		dbus_message_unref(node->msg);
+		free(node);
+		node = save_next;
+	}
+}
+
+struct subd_queue *queue_create(DBusConnection *conn, DBusError *err) {
+	struct subd_queue *queue = malloc(sizeof(struct subd_queue));
+	if (queue == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	queue->conn = conn;
+	atomic_init(&queue->head, NULL);
+
+#ifdef HAVE_EVENTFD
+	queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (queue->fd == -1) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "eventfd failed (%d).", errno);
+		free(queue);
+		return NULL;
+	}
+#else
+	int fds[2];
+	if (pipe(fds) == -1) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "pipe failed (%d).", errno);
+		free(queue);
+		return NULL;
+	}
+	for (int i = 0; i < 2; ++i) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	queue->fd = fds[0];
+	queue->write_fd = fds[1];
+#endif
+
+	if (!dbus_connection_allocate_data_slot(&queue_slot)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		close(queue->fd);
+#ifndef HAVE_EVENTFD
+		close(queue->write_fd);
+#endif
+		free(queue);
+		return NULL;
+	}
+
+	if (!dbus_connection_set_data(conn, queue_slot, queue, NULL)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		queue_destroy(conn, queue);
+		return NULL;
+	}
+	dbus_connection_set_wakeup_main_function(conn, wakeup_main, queue, NULL);
+
+	return queue;
+}
+
+void queue_destroy(DBusConnection *conn, struct subd_queue *queue) {
+	if (conn != NULL) {
+		dbus_connection_set_wakeup_main_function(conn, NULL, NULL, NULL);
+		dbus_connection_set_data(conn, queue_slot, NULL, NULL);
+	}
+	dbus_connection_free_data_slot(&queue_slot);
+
+	// Messages that were not sent yet are dropped.
+	free_nodes(atomic_exchange(&queue->head, NULL));
+
+	close(queue->fd);
+#ifndef HAVE_EVENTFD
+	close(queue->write_fd);
+#endif
+	free(queue);
+}
+
+int queue_get_fd(const struct subd_queue *queue) {
+	return queue->fd;
+}
+
+void queue_handle(struct subd_queue *queue) {
+	// The file descriptor is drained before the stack is taken, so a message
+	// pushed after this point wakes the loop again.
+	uint64_t value;
+	ssize_t n;
+	do {
+		n = read(queue->fd, &value, sizeof(value));
+	} while (n > 0 || (n == -1 && errno == EINTR));
+
+	struct node *node = atomic_exchange_explicit(&queue->head, NULL,
+		memory_order_acquire);
+
+	// The stack is in reverse order.
+	struct node *first = NULL;
+	while (node != NULL) {
+		struct node *save_next = node->next;
+		node->next = first;
+		first = node;
+		node = save_next;
+	}
+
+	for (node = first; node != NULL; node = node->next) {
+		dbus_connection_send(queue->conn, node->msg, NULL);
+	}
+	free_nodes(first);
+}
+
+struct subd_queue *subd_get_queue(DBusConnection *conn) {
+	if (queue_slot == -1) {
+		return NULL;
+	}
+	return dbus_connection_get_data(conn, queue_slot);
+}
+
+dbus_bool_t subd_send_queued(struct subd_queue *queue, DBusMessage *msg,
+		DBusError *err) {
+	struct node *node = malloc(sizeof(struct node));
+	if (node == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	node->msg = dbus_message_ref(msg);
+
+	struct node *head = atomic_load_explicit(&queue->head,
+		memory_order_relaxed);
+	do {
+		node->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, node,
+		memory_order_release, memory_order_relaxed));
+
+	if (head == NULL) {
+		queue_wake(queue);
+	}
+	return TRUE;
+}
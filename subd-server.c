@@ -0,0 +1,200 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "subd.h"
+
+struct subd_epoll;
+
+/**
+ * The listening sockets of the server are watched by the event loop it was
+ * created with, just like non-DBus file descriptors.
+ */
+struct subd_server {
+	DBusServer *server;
+	struct subd_watches *watches;	// the poll based loop, or NULL
+#ifdef __linux__
+	struct subd_epoll *ep;			// the epoll based loop, or NULL
+#endif
+	subd_connection_function function;
+	void *data;
+};
+
+/**
+ * A watch of the server. The handle is the one returned by
+ * subd_watches_add_fd, or, with epoll, 0 if the file descriptor is added. It
+ * is -1 if the watch is not in the event loop.
+ */
+struct server_watch {
+	struct subd_server *server;
+	DBusWatch *watch;
+	int handle;
+};
+
+static void handle_watch(int fd, unsigned int flags, void *data) {
+	struct server_watch *sw = data;
+	dbus_watch_handle(sw->watch, flags);
+}
+
+/**
+ * Helper function that adds the watch to the event loop, or enables it if it
+ * is there already.
+ */
+static bool start_watch(struct server_watch *sw) {
+	unsigned int flags = dbus_watch_get_flags(sw->watch);
+	struct subd_server *server = sw->server;
+	if (server->watches != NULL) {
+		if (sw->handle != -1) {
+			subd_watches_set_fd_flags(server->watches, sw->handle, flags);
+		} else {
+			sw->handle = subd_watches_add_fd(server->watches,
+				dbus_watch_get_unix_fd(sw->watch), flags, handle_watch, sw,
+				NULL);
+		}
+		return sw->handle != -1;
+	}
+#ifdef __linux__
+	if (sw->handle == -1 && subd_epoll_add_fd(server->ep,
+			dbus_watch_get_unix_fd(sw->watch), flags, handle_watch, sw, NULL)) {
+		sw->handle = 0;
+	}
+#endif
+	return sw->handle != -1;
+}
+
+/**
+ * Helper function that disables the watch, or removes it from the event loop
+ * if "remove" is true.
+ */
+static void stop_watch(struct server_watch *sw, bool remove) {
+	struct subd_server *server = sw->server;
+	if (sw->handle == -1) {
+		return;
+	}
+	if (server->watches != NULL) {
+		if (remove) {
+			subd_watches_remove_fd(server->watches, sw->handle);
+			sw->handle = -1;
+		} else {
+			subd_watches_set_fd_flags(server->watches, sw->handle, 0);
+		}
+		return;
+	}
+#ifdef __linux__
+	subd_epoll_remove_fd(server->ep, dbus_watch_get_unix_fd(sw->watch));
+	sw->handle = -1;
+#endif
+}
+
+static dbus_bool_t add_watch(DBusWatch *watch, void *data) {
+	struct server_watch *sw = malloc(sizeof(struct server_watch));
+	if (sw == NULL) {
+		return FALSE;
+	}
+	sw->server = data;
+	sw->watch = watch;
+	sw->handle = -1;
+	dbus_watch_set_data(watch, sw, free);
+
+	return !dbus_watch_get_enabled(watch) || start_watch(sw);
+}
+
+static void remove_watch(DBusWatch *watch, void *data) {
+	struct server_watch *sw = dbus_watch_get_data(watch);
+	if (sw != NULL) {
+		stop_watch(sw, true);
+	}
+}
+
+static void toggle_watch(DBusWatch *watch, void *data) {
+	struct server_watch *sw = dbus_watch_get_data(watch);
+	if (sw == NULL) {
+		return;
+	}
+	if (dbus_watch_get_enabled(watch)) {
+		start_watch(sw);
+	} else {
+		stop_watch(sw, false);
+	}
+}
+
+static void new_connection(DBusServer *dbus_server, DBusConnection *conn,
+		void *data) {
+	struct subd_server *server = data;
+	// The connection is dropped unless it is referenced here. The reference
+	// is handed over to the function.
+	dbus_connection_ref(conn);
+	server->function(conn, server->data);
+}
+
+/**
+ * Helper function for subd_server_listen and subd_server_listen_epoll that
+ * creates the server, and adds its watches to whichever loop is given.
+ */
+static struct subd_server *listen_on(const char *address,
+		struct subd_watches *watches, struct subd_epoll *ep,
+		subd_connection_function function, void *data, DBusError *err) {
+	if (function == NULL) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"A connection function is required.");
+		return NULL;
+	}
+	if (!dbus_threads_init_default()) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	struct subd_server *server = calloc(1, sizeof(struct subd_server));
+	if (server == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	server->watches = watches;
+#ifdef __linux__
+	server->ep = ep;
+#endif
+	server->function = function;
+	server->data = data;
+
+	server->server = dbus_server_listen(address, err);
+	if (server->server == NULL) {
+		free(server);
+		return NULL;
+	}
+	dbus_server_set_new_connection_function(server->server, new_connection,
+		server, NULL);
+	if (!dbus_server_set_watch_functions(server->server, add_watch,
+			remove_watch, toggle_watch, server, NULL)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		subd_server_free(server);
+		return NULL;
+	}
+
+	return server;
+}
+
+struct subd_server *subd_server_listen(const char *address,
+		struct subd_watches *watches, subd_connection_function function,
+		void *data, DBusError *err) {
+	return listen_on(address, watches, NULL, function, data, err);
+}
+
+#ifdef __linux__
+struct subd_server *subd_server_listen_epoll(const char *address,
+		struct subd_epoll *ep, subd_connection_function function, void *data,
+		DBusError *err) {
+	return listen_on(address, NULL, ep, function, data, err);
+}
+#endif
+
+char *subd_server_get_address(struct subd_server *server) {
+	return dbus_server_get_address(server->server);
+}
+
+void subd_server_free(struct subd_server *server) {
+	dbus_server_disconnect(server->server);
+	// This calls remove_watch for all watches.
+	dbus_server_set_watch_functions(server->server, NULL, NULL, NULL, NULL,
+		NULL);
+	dbus_server_unref(server->server);
+	free(server);
+}
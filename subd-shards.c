@@ -0,0 +1,239 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef __linux__
+#include <poll.h>
+#endif
+
+#include "queue.h"
+#include "subd.h"
+
+/**
+ * A shard is a connection to the bus with an event loop of its own, which is
+ * run by its own thread.
+ */
+struct shard {
+	struct subd_shards *shards;
+	DBusConnection *conn;
+	char *name;
+#ifdef __linux__
+	struct subd_epoll *ep;
+#else
+	struct subd_watches *watches;
+#endif
+	pthread_t thread;
+	bool running;
+};
+
+struct subd_shards {
+	struct shard *shards;
+	int count;
+	atomic_bool stop;
+};
+
+static void *run_shard(void *data) {
+	struct shard *shard = data;
+	while (!atomic_load(&shard->shards->stop)) {
+#ifdef __linux__
+		subd_run_once(shard->conn, shard->ep, -1);
+#else
+		struct subd_watches *watches = shard->watches;
+		if (poll(watches->fds, watches->length, -1) > 0) {
+			subd_process_watches(shard->conn, watches);
+		}
+#endif
+	}
+	return NULL;
+}
+
+/**
+ * Helper function that requests "name" on "conn", and fails if it is not the
+ * primary owner of it.
+ */
+static bool request_name(DBusConnection *conn, const char *name,
+		DBusError *err) {
+	int ret = dbus_bus_request_name(conn, name, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+		err);
+	if (ret == -1) {
+		return false;
+	}
+	if (ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		dbus_set_error(err, DBUS_ERROR_FAILED,
+			"Name %s is already owned.", name);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Helper function for subd_shards_open that connects shard "index" to the bus,
+ * and sets up its event loop.
+ */
+static bool open_shard(struct shard *shard, const char *service_name,
+		int index, DBusError *err) {
+	int length = snprintf(NULL, 0, "%s.Shard%d", service_name, index);
+	if ((shard->name = malloc(length + 1)) == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	snprintf(shard->name, length + 1, "%s.Shard%d", service_name, index);
+	if (!dbus_validate_bus_name(shard->name, err)) {
+		return false;
+	}
+
+	// The connections are private, because the shared one is the same for
+	// every shard.
+	shard->conn = dbus_bus_get_private(DBUS_BUS_SESSION, err);
+	if (shard->conn == NULL) {
+		return false;
+	}
+	dbus_connection_set_exit_on_disconnect(shard->conn, FALSE);
+	if (!request_name(shard->conn, shard->name, err) ||
+			(index == 0 && !request_name(shard->conn, service_name, err))) {
+		return false;
+	}
+
+#ifdef __linux__
+	shard->ep = subd_init_epoll(shard->conn, err);
+	return shard->ep != NULL;
+#else
+	shard->watches = subd_init_watches(shard->conn, NULL, 0, err);
+	return shard->watches != NULL;
+#endif
+}
+
+struct subd_shards *subd_shards_open(const char *service_name, int count,
+		DBusError *err) {
+	if (count <= 0) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Shard count must be positive.");
+		return NULL;
+	}
+	if (!dbus_threads_init_default()) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	struct subd_shards *shards = malloc(sizeof(struct subd_shards));
+	if (shards == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	shards->shards = calloc(count, sizeof(struct shard));
+	if (shards->shards == NULL) {
+		free(shards);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	shards->count = count;
+	atomic_init(&shards->stop, false);
+
+	for (int i = 0; i < count; ++i) {
+		shards->shards[i].shards = shards;
+		if (!open_shard(&shards->shards[i], service_name, i, err)) {
+			subd_shards_free(shards);
+			return NULL;
+		}
+	}
+
+	return shards;
+}
+
+dbus_bool_t subd_shards_start(struct subd_shards *shards, DBusError *err) {
+	for (int i = 0; i < shards->count; ++i) {
+		struct shard *shard = &shards->shards[i];
+		if (shard->running) {
+			continue;
+		}
+		if (pthread_create(&shard->thread, NULL, run_shard, shard) != 0) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY,
+				"Could not start the thread of shard %d.", i);
+			return FALSE;
+		}
+		shard->running = true;
+	}
+	return TRUE;
+}
+
+void subd_shards_free(struct subd_shards *shards) {
+	// The loops are woken up through their send queues, so they notice that
+	// they have to stop.
+	atomic_store(&shards->stop, true);
+	for (int i = 0; i < shards->count; ++i) {
+		struct shard *shard = &shards->shards[i];
+		if (shard->running) {
+			queue_wake(subd_get_queue(shard->conn));
+		}
+	}
+
+	for (int i = 0; i < shards->count; ++i) {
+		struct shard *shard = &shards->shards[i];
+		if (shard->running) {
+			pthread_join(shard->thread, NULL);
+		}
+#ifdef __linux__
+		if (shard->ep != NULL) {
+			subd_free_epoll(shard->conn, shard->ep);
+		}
+#else
+		if (shard->watches != NULL) {
+			subd_free_watches(shard->conn, shard->watches);
+		}
+#endif
+		if (shard->conn != NULL) {
+			dbus_connection_close(shard->conn);
+			dbus_connection_unref(shard->conn);
+		}
+		free(shard->name);
+	}
+	free(shards->shards);
+	free(shards);
+}
+
+int subd_shards_count(const struct subd_shards *shards) {
+	return shards->count;
+}
+
+DBusConnection *subd_shards_get_connection(const struct subd_shards *shards,
+		int index) {
+	return index >= 0 && index < shards->count ?
+		shards->shards[index].conn : NULL;
+}
+
+const char *subd_shards_get_name(const struct subd_shards *shards,
+		int index) {
+	return index >= 0 && index < shards->count ?
+		shards->shards[index].name : NULL;
+}
+
+dbus_bool_t subd_shards_add_object_vtable(struct subd_shards *shards,
+		const char *path, const char *interface,
+		const struct subd_member *members, void *userdata, DBusError *err) {
+	for (int i = 0; i < shards->count; ++i) {
+		if (!subd_add_object_vtable(shards->shards[i].conn, path, interface,
+				members, userdata, err)) {
+			// Every shard serves the same objects, so the ones that were
+			// registered already are removed.
+			while (i-- > 0) {
+				subd_remove_object_vtable(shards->shards[i].conn, path,
+					interface, NULL);
+			}
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+dbus_bool_t subd_shards_enable_stats(struct subd_shards *shards,
+		DBusError *err) {
+	for (int i = 0; i < shards->count; ++i) {
+		if (!subd_enable_stats(shards->shards[i].conn, err)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
@@ -0,0 +1,637 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashmap.h"
+#include "stats.h"
+#include "subd.h"
+#include "vtable.h"
+
+/*
+ * Histograms have 16 linear buckets for values below 16, and 8 buckets for
+ * every power of two above that, so every bucket is at most 12.5% wide.
+ * Values of 2^40 ns (about 18 minutes) and above go to the last bucket.
+ */
+#define LINEAR_BUCKETS 16
+#define SUB_BUCKETS 8
+#define SUB_BUCKET_BITS 3
+#define MIN_EXPONENT 4
+#define MAX_EXPONENT 39
+
+/*
+ * The counters of a shard are found through a two-level directory of chunks,
+ * which has room for 64M methods, more than the method table could hold.
+ */
+#define CHUNK_SIZE 64
+#define DIRECTORY_SIZE 1024
+#define MAX_DIRECTORIES 1024
+#define MAX_METHODS (CHUNK_SIZE * DIRECTORY_SIZE * MAX_DIRECTORIES)
+
+/**
+ * The counters of one method in one shard. They only have one writer (the
+ * thread owning the shard), so they are updated with plain atomic loads and
+ * stores, which are as cheap as ordinary memory accesses.
+ */
+struct counters {
+	atomic_uint_fast64_t calls;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t handler_time[SUBD_HISTOGRAM_BUCKETS];
+	atomic_uint_fast64_t queue_delay[SUBD_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Counters are allocated on the first call of a method on a thread, in chunks
+ * that are never moved or freed while the statistics exist, so snapshots can
+ * read them without stopping the writers.
+ */
+struct chunk {
+	struct counters *_Atomic counters[CHUNK_SIZE];
+};
+
+struct directory {
+	struct chunk *_Atomic chunks[DIRECTORY_SIZE];
+};
+
+struct shard {
+	pthread_t thread;
+	struct directory *_Atomic directories[MAX_DIRECTORIES];
+	struct shard *next;
+};
+
+/**
+ * The names of a method in the method table. They are copied, because methods
+ * can be removed, and a method that is registered again under the same names
+ * keeps counting into the same counters.
+ */
+struct method_name {
+	char *path;
+	char *interface;
+	char *member;
+};
+
+/**
+ * The mutex protects the shard list and the method table, which are only
+ * changed when a thread or a method is seen for the first time.
+ */
+struct stats {
+	unsigned long serial;
+	struct shard *shards;
+	struct method_name *methods;	// indexed by stats_id
+	struct hashmap_t *ids;	// "path interface.member" to stats_id + 1
+	int capacity;
+	int length;
+	pthread_mutex_t mutex;
+};
+
+/**
+ * Every thread remembers its shard of the last few statistics it recorded
+ * into, keyed by their serial, so serials are never reused.
+ */
+#define CACHE_SIZE 4
+
+struct cached_shard {
+	unsigned long serial;
+	struct shard *shard;
+};
+
+static atomic_ulong next_serial = 1;
+static atomic_int enabled_count;
+static _Thread_local struct cached_shard cache[CACHE_SIZE];
+static _Thread_local uint64_t batch_start;
+
+struct stats *stats_create(void) {
+	struct stats *stats = calloc(1, sizeof(struct stats));
+	if (stats == NULL) {
+		return NULL;
+	}
+	stats->ids = hashmap_create(0);
+	if (stats->ids == NULL) {
+		free(stats);
+		return NULL;
+	}
+	stats->serial = atomic_fetch_add(&next_serial, 1);
+	pthread_mutex_init(&stats->mutex, NULL);
+	atomic_fetch_add(&enabled_count, 1);
+	return stats;
+}
+
+void stats_free(struct stats *stats) {
+	while (stats->shards != NULL) {
+		struct shard *shard = stats->shards;
+		for (int i = 0; i < MAX_DIRECTORIES; ++i) {
+			struct directory *directory = atomic_load(&shard->directories[i]);
+			if (directory == NULL) {
+				continue;
+			}
+			for (int j = 0; j < DIRECTORY_SIZE; ++j) {
+				struct chunk *chunk = atomic_load(&directory->chunks[j]);
+				if (chunk == NULL) {
+					continue;
+				}
+				for (int k = 0; k < CHUNK_SIZE; ++k) {
+					free(atomic_load(&chunk->counters[k]));
+				}
+				free(chunk);
+			}
+			free(directory);
+		}
+		stats->shards = shard->next;
+		free(shard);
+	}
+	for (int i = 0; i < stats->length; ++i) {
+		free(stats->methods[i].path);
+		free(stats->methods[i].interface);
+		free(stats->methods[i].member);
+	}
+	free(stats->methods);
+	hashmap_destroy(stats->ids, NULL);
+	pthread_mutex_destroy(&stats->mutex);
+	free(stats);
+	atomic_fetch_sub(&enabled_count, 1);
+}
+
+uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Called by the event loops when they wake up to handle the messages that
+ * arrived. The time a call spends waiting after this is its queue delay.
+ */
+void stats_mark_batch(void) {
+	if (atomic_load_explicit(&enabled_count, memory_order_relaxed) > 0) {
+		batch_start = stats_now();
+	}
+}
+
+/**
+ * Returns the time of the last stats_mark_batch on this thread, or 0.
+ */
+uint64_t stats_batch_start(void) {
+	return batch_start;
+}
+
+static int bucket_of(uint64_t value) {
+	if (value < LINEAR_BUCKETS) {
+		return value;
+	}
+	int exponent = 63 - __builtin_clzll(value);
+	if (exponent > MAX_EXPONENT) {
+		return SUBD_HISTOGRAM_BUCKETS - 1;
+	}
+	int sub = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return LINEAR_BUCKETS + (exponent - MIN_EXPONENT) * SUB_BUCKETS + sub;
+}
+
+uint64_t subd_histogram_bucket_limit(int bucket) {
+	if (bucket < LINEAR_BUCKETS) {
+		return bucket;
+	}
+	if (bucket >= SUBD_HISTOGRAM_BUCKETS - 1) {
+		return UINT64_MAX;
+	}
+	int exponent = MIN_EXPONENT + (bucket - LINEAR_BUCKETS) / SUB_BUCKETS;
+	int sub = (bucket - LINEAR_BUCKETS) % SUB_BUCKETS;
+	return ((uint64_t)(SUB_BUCKETS + sub + 1) <<
+		(exponent - SUB_BUCKET_BITS)) - 1;
+}
+
+uint64_t subd_histogram_percentile(const struct subd_histogram *histogram,
+		double percentile) {
+	if (histogram->count == 0) {
+		return 0;
+	}
+
+	double position = percentile / 100 * histogram->count;
+	uint64_t rank = position;
+	if (rank < position) {
+		++rank;
+	}
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	uint64_t seen = 0;
+	for (int i = 0; i < SUBD_HISTOGRAM_BUCKETS; ++i) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) {
+			return subd_histogram_bucket_limit(i);
+		}
+	}
+	return subd_histogram_bucket_limit(SUBD_HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * Helper function that increments a counter that has only one writer.
+ */
+static inline void increment(atomic_uint_fast64_t *counter) {
+	atomic_store_explicit(counter,
+		atomic_load_explicit(counter, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+}
+
+/**
+ * Helper function that returns the shard of the calling thread, creating it
+ * if this is the first call recorded by the thread. Returns NULL if out of
+ * memory.
+ */
+static struct shard *get_shard(struct stats *stats) {
+	struct cached_shard *cached = &cache[stats->serial % CACHE_SIZE];
+	if (cached->serial == stats->serial) {
+		return cached->shard;
+	}
+
+	pthread_t self = pthread_self();
+	pthread_mutex_lock(&stats->mutex);
+	struct shard *shard = stats->shards;
+	while (shard != NULL && !pthread_equal(shard->thread, self)) {
+		shard = shard->next;
+	}
+	if (shard == NULL && (shard = calloc(1, sizeof(struct shard))) != NULL) {
+		shard->thread = self;
+		shard->next = stats->shards;
+		stats->shards = shard;
+	}
+	pthread_mutex_unlock(&stats->mutex);
+
+	if (shard != NULL) {
+		cached->serial = stats->serial;
+		cached->shard = shard;
+	}
+	return shard;
+}
+
+/**
+ * Helper function that returns the counters of the method "id" in "shard",
+ * allocating them if needed. Only called by the thread owning the shard.
+ */
+static struct counters *get_counters(struct shard *shard, int id) {
+	struct directory *_Atomic *directory_ptr =
+		&shard->directories[id / CHUNK_SIZE / DIRECTORY_SIZE];
+	struct directory *directory =
+		atomic_load_explicit(directory_ptr, memory_order_relaxed);
+	if (directory == NULL) {
+		if ((directory = calloc(1, sizeof(struct directory))) == NULL) {
+			return NULL;
+		}
+		atomic_store_explicit(directory_ptr, directory, memory_order_release);
+	}
+
+	struct chunk *_Atomic *chunk_ptr =
+		&directory->chunks[id / CHUNK_SIZE % DIRECTORY_SIZE];
+	struct chunk *chunk = atomic_load_explicit(chunk_ptr, memory_order_relaxed);
+	if (chunk == NULL) {
+		if ((chunk = calloc(1, sizeof(struct chunk))) == NULL) {
+			return NULL;
+		}
+		atomic_store_explicit(chunk_ptr, chunk, memory_order_release);
+	}
+
+	struct counters *_Atomic *counters_ptr = &chunk->counters[id % CHUNK_SIZE];
+	struct counters *counters =
+		atomic_load_explicit(counters_ptr, memory_order_relaxed);
+	if (counters == NULL) {
+		if ((counters = calloc(1, sizeof(struct counters))) == NULL) {
+			return NULL;
+		}
+		atomic_store_explicit(counters_ptr, counters, memory_order_release);
+	}
+	return counters;
+}
+
+/**
+ * Helper function that returns the counters of the method "id" in "shard", or
+ * NULL if the thread owning the shard has not recorded a call of it yet.
+ */
+static struct counters *find_counters(struct shard *shard, int id) {
+	struct directory *directory = atomic_load_explicit(
+		&shard->directories[id / CHUNK_SIZE / DIRECTORY_SIZE],
+		memory_order_acquire);
+	struct chunk *chunk = directory == NULL ? NULL : atomic_load_explicit(
+		&directory->chunks[id / CHUNK_SIZE % DIRECTORY_SIZE],
+		memory_order_acquire);
+	return chunk == NULL ? NULL : atomic_load_explicit(
+		&chunk->counters[id % CHUNK_SIZE], memory_order_acquire);
+}
+
+/**
+ * Helper function that adds the names of "method" to the method table, unless
+ * they are there already, and returns its index. Must be called with the mutex
+ * held. Returns -1 if out of memory, or if the table is full.
+ */
+static int add_method(struct stats *stats, const struct method *method,
+		const char *key) {
+	intptr_t found = (intptr_t)hashmap_get(stats->ids, key);
+	if (found != 0) {
+		return found - 1;
+	}
+
+	if (stats->length == MAX_METHODS) {
+		return -1;
+	}
+	if (stats->length == stats->capacity) {
+		int capacity = stats->capacity == 0 ? 16 : 2 * stats->capacity;
+		struct method_name *methods = realloc(stats->methods,
+			capacity * sizeof(struct method_name));
+		if (methods == NULL) {
+			return -1;
+		}
+		stats->methods = methods;
+		stats->capacity = capacity;
+	}
+	struct method_name *name = &stats->methods[stats->length];
+	name->path = strdup(method->interface->path->path);
+	name->interface = strdup(method->interface->name);
+	name->member = strdup(method->member->m.name);
+	if (name->path == NULL || name->interface == NULL ||
+			name->member == NULL ||
+			hashmap_set(stats->ids, key, (void *)(intptr_t)(stats->length + 1)) ==
+				-1) {
+		free(name->path);
+		free(name->interface);
+		free(name->member);
+		return -1;
+	}
+	return stats->length++;
+}
+
+/**
+ * Helper function that finds or adds "method" in the method table, and returns
+ * its index, or -1 if out of memory.
+ */
+static int assign_id(struct stats *stats, struct method *method) {
+	const char *path = method->interface->path->path;
+	const char *interface = method->interface->name;
+	const char *member = method->member->m.name;
+	size_t length = strlen(path) + strlen(interface) + strlen(member) + 3;
+	char *key = malloc(length);
+	if (key == NULL) {
+		return -1;
+	}
+	snprintf(key, length, "%s %s.%s", path, interface, member);
+
+	pthread_mutex_lock(&stats->mutex);
+	int id = atomic_load(&method->stats_id);
+	if (id < 0) {
+		id = add_method(stats, method, key);
+		if (id >= 0) {
+			atomic_store(&method->stats_id, id);
+		}
+	}
+	pthread_mutex_unlock(&stats->mutex);
+	free(key);
+	return id;
+}
+
+void stats_record(struct stats *stats, struct method *method,
+		uint64_t queue_delay, uint64_t handler_time, bool error) {
+	int id = atomic_load_explicit(&method->stats_id, memory_order_acquire);
+	if (id < 0 && (id = assign_id(stats, method)) < 0) {
+		return;
+	}
+
+	struct shard *shard = get_shard(stats);
+	struct counters *counters = shard == NULL ? NULL :
+		get_counters(shard, id);
+	if (counters == NULL) {
+		return;
+	}
+
+	increment(&counters->calls);
+	if (error) {
+		increment(&counters->errors);
+	}
+	increment(&counters->handler_time[bucket_of(handler_time)]);
+	if (queue_delay != STATS_UNKNOWN) {
+		increment(&counters->queue_delay[bucket_of(queue_delay)]);
+	}
+}
+
+/**
+ * Helper function that adds the buckets of "from" to "histogram".
+ */
+static void add_histogram(struct subd_histogram *histogram,
+		atomic_uint_fast64_t *from) {
+	for (int i = 0; i < SUBD_HISTOGRAM_BUCKETS; ++i) {
+		uint64_t n = atomic_load_explicit(&from[i], memory_order_relaxed);
+		histogram->buckets[i] += n;
+		histogram->count += n;
+	}
+}
+
+/**
+ * Helper function that copies the names of "method" into "result".
+ */
+static bool copy_names(struct subd_method_stats *result,
+		const struct method_name *method) {
+	result->path = strdup(method->path);
+	result->interface = strdup(method->interface);
+	result->member = strdup(method->member);
+	return result->path != NULL && result->interface != NULL &&
+		result->member != NULL;
+}
+
+struct subd_method_stats *subd_stats_snapshot(DBusConnection *conn,
+		int *count, DBusError *err) {
+	struct registry *registry = find_registry(conn);
+	struct stats *stats = registry == NULL ? NULL :
+		atomic_load(&registry->stats);
+	if (stats == NULL) {
+		dbus_set_error(err, DBUS_ERROR_FAILED,
+			"Statistics are not enabled on the connection");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&stats->mutex);
+	int length = stats->length;
+	struct subd_method_stats *result =
+		calloc(length > 0 ? length : 1, sizeof(struct subd_method_stats));
+	if (result == NULL) {
+		goto error;
+	}
+
+	for (int i = 0; i < length; ++i) {
+		if (!copy_names(&result[i], &stats->methods[i])) {
+			subd_stats_free(result, length);
+			result = NULL;
+			goto error;
+		}
+	}
+
+	// The writers keep going meanwhile, so the snapshot is not atomic, but
+	// every counter is read whole.
+	for (struct shard *shard = stats->shards; shard != NULL;
+			shard = shard->next) {
+		for (int i = 0; i < length; ++i) {
+			struct counters *counters = find_counters(shard, i);
+			if (counters == NULL) {
+				continue;
+			}
+			result[i].calls += atomic_load_explicit(&counters->calls,
+				memory_order_relaxed);
+			result[i].errors += atomic_load_explicit(&counters->errors,
+				memory_order_relaxed);
+			add_histogram(&result[i].handler_time, counters->handler_time);
+			add_histogram(&result[i].queue_delay, counters->queue_delay);
+		}
+	}
+	pthread_mutex_unlock(&stats->mutex);
+
+	*count = length;
+	return result;
+
+error:
+	pthread_mutex_unlock(&stats->mutex);
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return NULL;
+}
+
+void subd_stats_free(struct subd_method_stats *stats, int count) {
+	for (int i = 0; i < count; ++i) {
+		free(stats[i].path);
+		free(stats[i].interface);
+		free(stats[i].member);
+	}
+	free(stats);
+}
+
+/**
+ * Helper function that appends the non-empty buckets of "histogram" as an
+ * array of (limit, count) pairs.
+ */
+static bool append_histogram(DBusMessageIter *iter,
+		const struct subd_histogram *histogram) {
+	DBusMessageIter array, entry;
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "(tt)",
+			&array)) {
+		return false;
+	}
+	for (int i = 0; i < SUBD_HISTOGRAM_BUCKETS; ++i) {
+		if (histogram->buckets[i] == 0) {
+			continue;
+		}
+		dbus_uint64_t limit = subd_histogram_bucket_limit(i);
+		dbus_uint64_t n = histogram->buckets[i];
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL,
+				&entry)) {
+			dbus_message_iter_abandon_container(iter, &array);
+			return false;
+		}
+		if (!dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &limit) ||
+				!dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &n) ||
+				!dbus_message_iter_close_container(&array, &entry)) {
+			dbus_message_iter_abandon_container(&array, &entry);
+			dbus_message_iter_abandon_container(iter, &array);
+			return false;
+		}
+	}
+	return dbus_message_iter_close_container(iter, &array);
+}
+
+/**
+ * Helper function that appends the statistics of one method as a
+ * (ssstta(tt)a(tt)) struct.
+ */
+static bool append_method_stats(DBusMessageIter *iter,
+		const struct subd_method_stats *stats) {
+	DBusMessageIter entry;
+	dbus_uint64_t calls = stats->calls;
+	dbus_uint64_t errors = stats->errors;
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
+			&entry)) {
+		return false;
+	}
+	if (!dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+				&stats->path) ||
+			!dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+				&stats->interface) ||
+			!dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+				&stats->member) ||
+			!dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &calls) ||
+			!dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &errors) ||
+			!append_histogram(&entry, &stats->handler_time) ||
+			!append_histogram(&entry, &stats->queue_delay)) {
+		dbus_message_iter_abandon_container(iter, &entry);
+		return false;
+	}
+	return dbus_message_iter_close_container(iter, &entry);
+}
+
+static dbus_bool_t handle_get_stats(DBusConnection *conn, DBusMessage *msg,
+		void *userdata, DBusError *err) {
+	int count;
+	struct subd_method_stats *stats = subd_stats_snapshot(conn, &count, err);
+	if (stats == NULL) {
+		return FALSE;
+	}
+
+	DBusMessage *reply = dbus_message_new_method_return(msg);
+	if (reply == NULL) {
+		goto error;
+	}
+
+	DBusMessageIter iter, array;
+	dbus_message_iter_init_append(reply, &iter);
+	if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			"(ssstta(tt)a(tt))", &array)) {
+		goto error;
+	}
+	for (int i = 0; i < count; ++i) {
+		if (!append_method_stats(&array, &stats[i])) {
+			dbus_message_iter_abandon_container(&iter, &array);
+			goto error;
+		}
+	}
+	if (!dbus_message_iter_close_container(&iter, &array) ||
+			!dbus_connection_send(conn, reply, NULL)) {
+		goto error;
+	}
+
+	dbus_message_unref(reply);
+	subd_stats_free(stats, count);
+	return TRUE;
+
+error:
+	if (reply != NULL) {
+		dbus_message_unref(reply);
+	}
+	subd_stats_free(stats, count);
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return FALSE;
+}
+
+static const struct subd_member stats_members[] = {
+	{SUBD_METHOD, .m = {"GetStats", handle_get_stats, "",
+		"a(ssstta(tt)a(tt))"}},
+	{SUBD_MEMBERS_END, .e=0},
+};
+
+dbus_bool_t subd_enable_stats(DBusConnection *conn, DBusError *err) {
+	struct registry *registry = get_registry(conn);
+	struct stats *stats = registry == NULL ? NULL : stats_create();
+	if (stats == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&registry->mutex);
+	bool enabled = atomic_load(&registry->stats) != NULL;
+	if (!enabled) {
+		atomic_store(&registry->stats, stats);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	if (enabled) {
+		stats_free(stats);
+		return TRUE;
+	}
+
+	return subd_add_object_vtable(conn, SUBD_STATS_PATH, SUBD_STATS_INTERFACE,
+		stats_members, NULL, err);
+}
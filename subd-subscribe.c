@@ -0,0 +1,467 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "subd.h"
+
+/**
+ * A match rule, shared by the subscriptions that have the same interface,
+ * member and path. A rule is only added to the bus if no other rule covers it,
+ * so a subscription to a whole interface or path namespace makes the rules of
+ * the narrower subscriptions unnecessary.
+ */
+struct match_rule {
+	char *text;
+	char *interface;
+	char *member;
+	char *path;
+	bool path_namespace;
+	int refs;
+	bool installed;
+};
+
+struct subd_subscription {
+	struct match_rule *rule;
+	char *key;
+	subd_signal_function function;
+	void *data;
+	bool removed;
+	struct subd_subscription *next;
+	struct subd_subscription *next_garbage;
+};
+
+/**
+ * The per-connection state of the subscriptions. The index maps
+ * "interface member" (or just "interface" for subscriptions to every member of
+ * an interface) to a list of subscriptions, so a signal is only matched
+ * against the subscriptions to its own interface and member. Subscriptions
+ * removed while signals are dispatched are freed when dispatching ends, so
+ * callbacks can unsubscribe.
+ */
+struct subscriptions {
+	struct hashmap_t *index;
+	struct hashmap_t *rules;
+	int dispatching;
+	struct subd_subscription *garbage;
+	pthread_mutex_t mutex;
+};
+
+static dbus_int32_t subscriptions_slot = -1;
+
+static void free_rule(void *data) {
+	struct match_rule *rule = data;
+	free(rule->text);
+	free(rule->interface);
+	free(rule->member);
+	free(rule->path);
+	free(rule);
+}
+
+static void free_subscription(struct subd_subscription *subscription) {
+	free(subscription->key);
+	free(subscription);
+}
+
+static void free_list(void *data) {
+	struct subd_subscription *subscription = data;
+	while (subscription != NULL) {
+		struct subd_subscription *save_next = subscription->next;
+		free_subscription(subscription);
+		subscription = save_next;
+	}
+}
+
+static void free_garbage(struct subscriptions *subscriptions) {
+	struct subd_subscription *subscription = subscriptions->garbage;
+	while (subscription != NULL) {
+		struct subd_subscription *save_next = subscription->next_garbage;
+		free_subscription(subscription);
+		subscription = save_next;
+	}
+	subscriptions->garbage = NULL;
+}
+
+static void free_subscriptions(void *data) {
+	struct subscriptions *subscriptions = data;
+	hashmap_destroy(subscriptions->index, free_list);
+	hashmap_destroy(subscriptions->rules, free_rule);
+	free_garbage(subscriptions);
+	pthread_mutex_destroy(&subscriptions->mutex);
+	free(subscriptions);
+	dbus_connection_free_data_slot(&subscriptions_slot);
+}
+
+/**
+ * Helper function that checks whether "path" is "path_namespace" itself, or
+ * is below it.
+ */
+static bool in_namespace(const char *path, const char *path_namespace) {
+	size_t length = strlen(path_namespace);
+	return strncmp(path, path_namespace, length) == 0 &&
+		(path[length] == '\0' || path[length] == '/');
+}
+
+static bool path_matches(const struct match_rule *rule, const char *path) {
+	if (rule->path == NULL) {
+		return true;
+	}
+	if (path == NULL) {
+		return false;
+	}
+	return rule->path_namespace ? in_namespace(path, rule->path) :
+		strcmp(path, rule->path) == 0;
+}
+
+/**
+ * Helper function that checks whether every signal matched by rule "b" is
+ * also matched by rule "a".
+ */
+static bool rule_covers(const struct match_rule *a,
+		const struct match_rule *b) {
+	if (strcmp(a->interface, b->interface) != 0) {
+		return false;
+	}
+	if (a->member != NULL &&
+			(b->member == NULL || strcmp(a->member, b->member) != 0)) {
+		return false;
+	}
+	if (a->path == NULL) {
+		return true;
+	}
+	if (b->path == NULL || (b->path_namespace && !a->path_namespace)) {
+		return false;
+	}
+	return path_matches(a, b->path);
+}
+
+/**
+ * Helper function that adds the rules that became necessary to the bus, and
+ * removes the ones that are not needed anymore. New rules are added before
+ * the ones they replace are removed, so no signals are lost in between. The
+ * rules are sent without waiting for the replies. Must be called with the
+ * mutex held.
+ */
+static void update_rules(DBusConnection *conn,
+		struct subscriptions *subscriptions) {
+	// Peer-to-peer connections have no bus to add rules to, every signal is
+	// delivered to them.
+	bool bus = dbus_bus_get_unique_name(conn) != NULL;
+	struct hashmap_t *rules = subscriptions->rules;
+
+	for (int pass = 0; pass < 2; ++pass) {
+		for (size_t i = 0; i < rules->capacity; ++i) {
+			struct hashmap_entry *e = rules->buckets[i];
+			while (e != NULL) {
+				struct hashmap_entry *save_next = e->next;
+				struct match_rule *rule = e->data;
+
+				bool needed = rule->refs > 0;
+				for (size_t j = 0; needed && j < rules->capacity; ++j) {
+					for (struct hashmap_entry *f = rules->buckets[j];
+							needed && f != NULL; f = f->next) {
+						struct match_rule *other = f->data;
+						needed = other == rule || other->refs == 0 ||
+							!rule_covers(other, rule);
+					}
+				}
+
+				if (pass == 0 && needed && !rule->installed) {
+					if (bus) {
+						dbus_bus_add_match(conn, rule->text, NULL);
+					}
+					rule->installed = true;
+				} else if (pass == 1 && !needed) {
+					if (rule->installed && bus) {
+						dbus_bus_remove_match(conn, rule->text, NULL);
+					}
+					rule->installed = false;
+					if (rule->refs == 0) {
+						hashmap_remove(rules, rule->text);
+						free_rule(rule);
+					}
+				}
+				e = save_next;
+			}
+		}
+	}
+}
+
+/**
+ * Helper function that calls the callbacks of the subscriptions in the list
+ * stored under "key" that match the path of "msg". The mutex is released
+ * while a callback runs. Removed subscriptions are not freed while
+ * dispatching, so the list can be followed even if it changed meanwhile.
+ */
+static void dispatch_list(DBusConnection *conn,
+		struct subscriptions *subscriptions, const char *key, size_t length,
+		DBusMessage *msg) {
+	const char *path = dbus_message_get_path(msg);
+	struct subd_subscription *subscription =
+		hashmap_get_n(subscriptions->index, key, length);
+	while (subscription != NULL) {
+		if (!subscription->removed &&
+				path_matches(subscription->rule, path)) {
+			subd_signal_function function = subscription->function;
+			void *data = subscription->data;
+			pthread_mutex_unlock(&subscriptions->mutex);
+			function(conn, msg, data);
+			pthread_mutex_lock(&subscriptions->mutex);
+		}
+		subscription = subscription->next;
+	}
+}
+
+static DBusHandlerResult handle_signal(DBusConnection *conn,
+		DBusMessage *msg, void *data) {
+	struct subscriptions *subscriptions = data;
+	const char *interface = dbus_message_get_interface(msg);
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL ||
+			interface == NULL) {
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	char key[DBUS_MAXIMUM_NAME_LENGTH * 2 + 2];
+	int length = snprintf(key, sizeof(key), "%s %s", interface,
+		dbus_message_get_member(msg));
+	if (length < 0 || (size_t)length >= sizeof(key)) {
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	pthread_mutex_lock(&subscriptions->mutex);
+	++subscriptions->dispatching;
+	dispatch_list(conn, subscriptions, key, length, msg);
+	dispatch_list(conn, subscriptions, key, strlen(interface), msg);
+	if (--subscriptions->dispatching == 0) {
+		free_garbage(subscriptions);
+	}
+	pthread_mutex_unlock(&subscriptions->mutex);
+
+	// Other filters and handlers might be interested in the signal as well.
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * Helper function that returns the subscriptions of "conn", creating them and
+ * installing the filter that dispatches signals first if they do not exist
+ * yet. Returns NULL if out of memory.
+ */
+static struct subscriptions *get_subscriptions(DBusConnection *conn) {
+	struct subscriptions *subscriptions = NULL;
+	if (subscriptions_slot != -1) {
+		subscriptions = dbus_connection_get_data(conn, subscriptions_slot);
+		if (subscriptions != NULL) {
+			return subscriptions;
+		}
+	}
+
+	if (!dbus_connection_allocate_data_slot(&subscriptions_slot)) {
+		return NULL;
+	}
+
+	subscriptions = calloc(1, sizeof(struct subscriptions));
+	if (subscriptions == NULL) {
+		dbus_connection_free_data_slot(&subscriptions_slot);
+		return NULL;
+	}
+	subscriptions->index = hashmap_create(0);
+	subscriptions->rules = hashmap_create(0);
+	if (subscriptions->index == NULL || subscriptions->rules == NULL) {
+		if (subscriptions->index != NULL) {
+			hashmap_destroy(subscriptions->index, NULL);
+		}
+		if (subscriptions->rules != NULL) {
+			hashmap_destroy(subscriptions->rules, NULL);
+		}
+		free(subscriptions);
+		dbus_connection_free_data_slot(&subscriptions_slot);
+		return NULL;
+	}
+	pthread_mutex_init(&subscriptions->mutex, NULL);
+
+	if (!dbus_connection_add_filter(conn, handle_signal, subscriptions,
+			NULL)) {
+		free_subscriptions(subscriptions);
+		return NULL;
+	}
+	if (!dbus_connection_set_data(conn, subscriptions_slot, subscriptions,
+			free_subscriptions)) {
+		dbus_connection_remove_filter(conn, handle_signal, subscriptions);
+		free_subscriptions(subscriptions);
+		return NULL;
+	}
+
+	return subscriptions;
+}
+
+/**
+ * Helper function that returns the rule for the given fields, creating it if
+ * necessary. Must be called with the mutex held.
+ */
+static struct match_rule *get_rule(struct subscriptions *subscriptions,
+		const char *interface, const char *member, const char *path,
+		bool path_namespace) {
+	size_t size = strlen("type='signal',interface=''") + strlen(interface) + 1;
+	if (member != NULL) {
+		size += strlen(",member=''") + strlen(member);
+	}
+	if (path != NULL) {
+		size += strlen(",path_namespace=''") + strlen(path);
+	}
+	char *text = malloc(size);
+	if (text == NULL) {
+		return NULL;
+	}
+	int length = snprintf(text, size, "type='signal',interface='%s'",
+		interface);
+	if (member != NULL) {
+		length += snprintf(text + length, size - length, ",member='%s'",
+			member);
+	}
+	if (path != NULL) {
+		snprintf(text + length, size - length, ",%s='%s'",
+			path_namespace ? "path_namespace" : "path", path);
+	}
+
+	struct match_rule *rule = hashmap_get(subscriptions->rules, text);
+	if (rule != NULL) {
+		free(text);
+		return rule;
+	}
+
+	rule = calloc(1, sizeof(struct match_rule));
+	if (rule == NULL) {
+		free(text);
+		return NULL;
+	}
+	rule->text = text;
+	rule->interface = strdup(interface);
+	rule->member = member != NULL ? strdup(member) : NULL;
+	rule->path = path != NULL ? strdup(path) : NULL;
+	rule->path_namespace = path_namespace;
+	if (rule->interface == NULL || (member != NULL && rule->member == NULL) ||
+			(path != NULL && rule->path == NULL) ||
+			hashmap_set(subscriptions->rules, text, rule) == -1) {
+		free_rule(rule);
+		return NULL;
+	}
+	return rule;
+}
+
+struct subd_subscription *subd_subscribe(DBusConnection *conn,
+		const char *interface, const char *member, const char *path,
+		dbus_bool_t path_namespace, subd_signal_function function,
+		void *data, DBusError *err) {
+	if (interface == NULL || !dbus_validate_interface(interface, NULL) ||
+			(member != NULL && !dbus_validate_member(member, NULL)) ||
+			(path != NULL && !dbus_validate_path(path, NULL))) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Invalid interface, member or path.");
+		return NULL;
+	}
+	if (path != NULL && path_namespace && strcmp(path, "/") == 0) {
+		// Every path is in the root namespace.
+		path = NULL;
+	}
+
+	struct subscriptions *subscriptions = get_subscriptions(conn);
+	if (subscriptions == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	struct subd_subscription *subscription =
+		calloc(1, sizeof(struct subd_subscription));
+	if (subscription == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	subscription->function = function;
+	subscription->data = data;
+
+	// Spaces are not allowed in either of the parts, so the key is
+	// unambiguous.
+	size_t size = strlen(interface) + (member != NULL ? strlen(member) : 0) + 2;
+	subscription->key = malloc(size);
+	if (subscription->key == NULL) {
+		free(subscription);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	snprintf(subscription->key, size, member != NULL ? "%s %s" : "%s",
+		interface, member);
+
+	pthread_mutex_lock(&subscriptions->mutex);
+	subscription->rule = get_rule(subscriptions, interface, member, path,
+		path_namespace);
+	if (subscription->rule == NULL) {
+		goto error;
+	}
+	subscription->next = hashmap_get(subscriptions->index, subscription->key);
+	if (hashmap_set(subscriptions->index, subscription->key,
+			subscription) == -1) {
+		if (subscription->rule->refs == 0) {
+			hashmap_remove(subscriptions->rules, subscription->rule->text);
+			free_rule(subscription->rule);
+		}
+		goto error;
+	}
+	++subscription->rule->refs;
+	update_rules(conn, subscriptions);
+	pthread_mutex_unlock(&subscriptions->mutex);
+	return subscription;
+
+error:
+	pthread_mutex_unlock(&subscriptions->mutex);
+	free_subscription(subscription);
+	dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	return NULL;
+}
+
+void subd_unsubscribe(DBusConnection *conn,
+		struct subd_subscription *subscription) {
+	if (subscriptions_slot == -1) {
+		return;
+	}
+	struct subscriptions *subscriptions =
+		dbus_connection_get_data(conn, subscriptions_slot);
+	if (subscriptions == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&subscriptions->mutex);
+	struct subd_subscription *head =
+		hashmap_get(subscriptions->index, subscription->key);
+	if (head == subscription) {
+		if (subscription->next != NULL) {
+			hashmap_set(subscriptions->index, subscription->key,
+				subscription->next);
+		} else {
+			hashmap_remove(subscriptions->index, subscription->key);
+		}
+	} else {
+		while (head != NULL && head->next != subscription) {
+			head = head->next;
+		}
+		if (head != NULL) {
+			head->next = subscription->next;
+		}
+	}
+	subscription->removed = true;
+
+	--subscription->rule->refs;
+	update_rules(conn, subscriptions);
+
+	// The callbacks being dispatched might still follow this subscription.
+	if (subscriptions->dispatching > 0) {
+		subscription->next_garbage = subscriptions->garbage;
+		subscriptions->garbage = subscription;
+	} else {
+		free_subscription(subscription);
+	}
+	pthread_mutex_unlock(&subscriptions->mutex);
+}
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timeout.h"
+
+/**
+ * The wheel ticks in milliseconds, which is the resolution of DBus timeout
+ * intervals anyway.
+ */
+struct timeout_timer {
+	struct subd_timer timer;	// must be the first member
+	DBusTimeout *timeout;
+	struct subd_timeouts *timeouts;
+};
+
+/**
+ * The timer whose function is running is remembered, so a DBus timeout that
+ * libdbus removes meanwhile (e.g. from a thread that sends a message) is only
+ * freed once its function returned.
+ */
+struct subd_timeouts {
+	int fd;
+	uint64_t armed;		// the tick the timerfd is armed for, or UINT64_MAX
+	uint64_t epoch;		// monotonic time of tick 0 in milliseconds
+	struct timer_wheel wheel;
+	struct wheel_timer *expired;
+	struct subd_timer *running;
+	bool running_freed;	// the running timer is freed when it returns
+	pthread_mutex_t mutex;
+};
+
+/**
+ * The timeouts are also attached to the connection, so other parts of subd
+ * (e.g. the signal coalescer) can schedule their own timers on the wheel.
+ */
+static dbus_int32_t timeouts_slot = -1;
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Arms the timerfd for the next expiry of the wheel, if it changed. Must be
+ * called with the mutex held.
+ */
+static void rearm(struct subd_timeouts *timeouts) {
+	uint64_t next = wheel_next_expiry(&timeouts->wheel);
+	if (next == timeouts->armed) {
+		return;
+	}
+
+	// A zero it_value disarms the timer.
+	struct itimerspec spec = {0};
+	if (next != UINT64_MAX) {
+		uint64_t ms = timeouts->epoch + next;
+		spec.it_value.tv_sec = ms / 1000;
+		spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+	}
+	if (timerfd_settime(timeouts->fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0) {
+		timeouts->armed = next;
+	}
+}
+
+/**
+ * Schedules "timer" to expire "delay" milliseconds from now. Must be called
+ * with the mutex held.
+ */
+static void schedule(struct subd_timeouts *timeouts, struct subd_timer *timer,
+		unsigned int delay) {
+	uint64_t now = now_ms() - timeouts->epoch;
+	if (now > timeouts->wheel.now) {
+		// Catch up first, so the wheel's notion of now is current. Timers that
+		// expire meanwhile are handled on the next timeouts_handle call.
+		wheel_advance(&timeouts->wheel, now, &timeouts->expired);
+	}
+	wheel_remove(&timeouts->wheel, &timer->wheel_timer);
+	wheel_add(&timeouts->wheel, &timer->wheel_timer,
+		timeouts->wheel.now + delay);
+}
+
+void timer_init(struct subd_timer *timer,
+		void (*function)(struct subd_timer *timer)) {
+	timer->wheel_timer.next = NULL;
+	timer->wheel_timer.pprev = NULL;
+	timer->wheel_timer.slot = -1;
+	timer->function = function;
+	timer->interval = 0;
+}
+
+void timer_schedule(struct subd_timeouts *timeouts, struct subd_timer *timer,
+		unsigned int delay) {
+	pthread_mutex_lock(&timeouts->mutex);
+	schedule(timeouts, timer, delay);
+	rearm(timeouts);
+	pthread_mutex_unlock(&timeouts->mutex);
+}
+
+void timer_cancel(struct subd_timeouts *timeouts, struct subd_timer *timer) {
+	// Timers that are not scheduled might outlive their timeouts (see
+	// timeouts_destroy), so they are not touched at all.
+	if (timer->wheel_timer.pprev == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&timeouts->mutex);
+	wheel_remove(&timeouts->wheel, &timer->wheel_timer);
+	rearm(timeouts);
+	pthread_mutex_unlock(&timeouts->mutex);
+}
+
+/**
+ * Cancels "timer" like timer_cancel, and returns true if its function is not
+ * running either, so the timer can be freed. Unlike timer_cancel, "timeouts"
+ * must be the current timeouts of the timer.
+ */
+bool timer_stop(struct subd_timeouts *timeouts, struct subd_timer *timer) {
+	pthread_mutex_lock(&timeouts->mutex);
+	if (timer->wheel_timer.pprev != NULL) {
+		wheel_remove(&timeouts->wheel, &timer->wheel_timer);
+		rearm(timeouts);
+	}
+	bool running = timeouts->running == timer;
+	pthread_mutex_unlock(&timeouts->mutex);
+	return !running;
+}
+
+static void handle_timeout(struct subd_timer *timer) {
+	//TODO: Error handling. dbus_timeout_handle only fails if out of memory,
+	//      in which case it should be retried later.
+	dbus_timeout_handle(((struct timeout_timer *)timer)->timeout);
+}
+
+/**
+ * Frees the timer of a DBus timeout, unless its function is running, in which
+ * case timeouts_handle frees it when the function returns.
+ */
+static void free_timer(void *data) {
+	struct timeout_timer *timer = data;
+	struct subd_timeouts *timeouts = timer->timeouts;
+	pthread_mutex_lock(&timeouts->mutex);
+	bool running = timeouts->running == &timer->timer;
+	if (running) {
+		timeouts->running_freed = true;
+	}
+	pthread_mutex_unlock(&timeouts->mutex);
+	if (!running) {
+		free(timer);
+	}
+}
+
+static dbus_bool_t add_timeout(DBusTimeout *timeout, void *data) {
+	struct subd_timeouts *timeouts = data;
+
+	struct timeout_timer *timer = malloc(sizeof(struct timeout_timer));
+	if (timer == NULL) {
+		return FALSE;
+	}
+	timer_init(&timer->timer, handle_timeout);
+	timer->timeout = timeout;
+	timer->timeouts = timeouts;
+	dbus_timeout_set_data(timeout, timer, free_timer);
+
+	// DBus timeouts are periodic.
+	if (dbus_timeout_get_enabled(timeout)) {
+		timer->timer.interval = dbus_timeout_get_interval(timeout);
+		timer_schedule(timeouts, &timer->timer, timer->timer.interval);
+	}
+
+	return TRUE;
+}
+
+static void remove_timeout(DBusTimeout *timeout, void *data) {
+	struct subd_timeouts *timeouts = data;
+	struct timeout_timer *timer = dbus_timeout_get_data(timeout);
+	if (timer == NULL) {
+		return;
+	}
+
+	timer_cancel(timeouts, &timer->timer);
+
+	// This frees the timer.
+	dbus_timeout_set_data(timeout, NULL, NULL);
+}
+
+static void toggle_timeout(DBusTimeout *timeout, void *data) {
+	struct subd_timeouts *timeouts = data;
+	struct timeout_timer *timer = dbus_timeout_get_data(timeout);
+	if (timer == NULL) {
+		return;
+	}
+
+	if (dbus_timeout_get_enabled(timeout)) {
+		timer->timer.interval = dbus_timeout_get_interval(timeout);
+		timer_schedule(timeouts, &timer->timer, timer->timer.interval);
+	} else {
+		timer_cancel(timeouts, &timer->timer);
+	}
+}
+
+struct subd_timeouts *timeouts_create(DBusConnection *conn, DBusError *err) {
+	struct subd_timeouts *timeouts = malloc(sizeof(struct subd_timeouts));
+	if (timeouts == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	timeouts->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timeouts->fd == -1) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "timerfd_create failed (%d).",
+			errno);
+		free(timeouts);
+		return NULL;
+	}
+	timeouts->armed = UINT64_MAX;
+	timeouts->epoch = now_ms();
+	timeouts->expired = NULL;
+	timeouts->running = NULL;
+	timeouts->running_freed = false;
+	wheel_init(&timeouts->wheel, 0);
+
+	// The mutex is recursive, because handling a timeout can make libdbus
+	// add or remove timeouts from the same thread.
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&timeouts->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	if (!dbus_connection_allocate_data_slot(&timeouts_slot)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		pthread_mutex_destroy(&timeouts->mutex);
+		close(timeouts->fd);
+		free(timeouts);
+		return NULL;
+	}
+
+	if (!dbus_connection_set_data(conn, timeouts_slot, timeouts, NULL) ||
+			!dbus_connection_set_timeout_functions(conn, add_timeout,
+				remove_timeout, toggle_timeout, timeouts, NULL)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		timeouts_destroy(conn, timeouts);
+		return NULL;
+	}
+
+	return timeouts;
+}
+
+void timeouts_destroy(DBusConnection *conn, struct subd_timeouts *timeouts) {
+	if (conn != NULL) {
+		// This calls remove_timeout for all timeouts.
+		dbus_connection_set_timeout_functions(conn, NULL, NULL, NULL, NULL,
+			NULL);
+		dbus_connection_set_data(conn, timeouts_slot, NULL, NULL);
+	}
+	dbus_connection_free_data_slot(&timeouts_slot);
+
+	// Unlink the timers that are still scheduled (those are not DBus timeouts,
+	// they have all been removed above), so their owners can free them later
+	// without touching the wheel.
+	for (int level = 0; level < WHEEL_LEVELS; ++level) {
+		for (int index = 0; index < WHEEL_SLOTS; ++index) {
+			while (timeouts->wheel.slots[level][index] != NULL) {
+				wheel_remove(&timeouts->wheel,
+					timeouts->wheel.slots[level][index]);
+			}
+		}
+	}
+	while (timeouts->expired != NULL) {
+		wheel_remove(&timeouts->wheel, timeouts->expired);
+	}
+
+	pthread_mutex_destroy(&timeouts->mutex);
+	close(timeouts->fd);
+	free(timeouts);
+}
+
+struct subd_timeouts *timeouts_get(DBusConnection *conn) {
+	if (timeouts_slot == -1) {
+		return NULL;
+	}
+	return dbus_connection_get_data(conn, timeouts_slot);
+}
+
+int timeouts_get_fd(const struct subd_timeouts *timeouts) {
+	return timeouts->fd;
+}
+
+void timeouts_handle(struct subd_timeouts *timeouts) {
+	uint64_t expirations;
+	while (read(timeouts->fd, &expirations, sizeof(expirations)) == -1 &&
+			errno == EINTR);
+
+	pthread_mutex_lock(&timeouts->mutex);
+	timeouts->armed = UINT64_MAX;
+	wheel_advance(&timeouts->wheel, now_ms() - timeouts->epoch,
+		&timeouts->expired);
+
+	// Periodic timers are rescheduled before being handled. The function might
+	// cancel (and free) any of the expired timers, that's why they are taken
+	// off the list one by one. The mutex is released while the function runs,
+	// because libdbus takes the connection lock when handling a timeout, and
+	// other threads might hold that while adding timeouts. Meanwhile the timer
+	// is marked as running, so it is not freed under the function.
+	while (timeouts->expired != NULL) {
+		struct subd_timer *timer = (struct subd_timer *)timeouts->expired;
+		wheel_remove(&timeouts->wheel, &timer->wheel_timer);
+		if (timer->interval != 0) {
+			schedule(timeouts, timer, timer->interval);
+		}
+		timeouts->running = timer;
+		pthread_mutex_unlock(&timeouts->mutex);
+
+		timer->function(timer);
+
+		pthread_mutex_lock(&timeouts->mutex);
+		timeouts->running = NULL;
+		if (timeouts->running_freed) {
+			// Only timers of DBus timeouts are freed this way.
+			timeouts->running_freed = false;
+			if (timer->wheel_timer.pprev != NULL) {
+				wheel_remove(&timeouts->wheel, &timer->wheel_timer);
+			}
+			free(timer);
+		}
+	}
+
+	rearm(timeouts);
+	pthread_mutex_unlock(&timeouts->mutex);
+}
@@ -0,0 +1,313 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashmap.h"
+#include "subd.h"
+#include "trace.h"
+
+#define MAX_RING_SIZE (1 << 24)
+
+/**
+ * The events of one thread. Only the owning thread writes it, by filling the
+ * slot at "head", and then publishing it by incrementing "head", so a ring
+ * never blocks, and the oldest events are overwritten when it is full. Rings
+ * are never freed, so the events of threads that exited can still be dumped.
+ */
+struct ring {
+	uint32_t thread;
+	uint32_t mask;
+	atomic_uint_fast64_t head;
+	struct ring *next;
+	struct trace_event events[];
+};
+
+atomic_bool trace_enabled;
+
+static atomic_uint ring_size;
+static _Thread_local struct ring *thread_ring;
+
+// The mutex protects the ring list, and the name table.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings;
+static uint32_t ring_count;
+static char **names;
+static uint32_t names_capacity;
+static uint32_t names_length;
+static struct hashmap_t *name_ids;	// name to its number + 1
+
+static sem_t dump_sem;
+static char *dump_path;
+static bool dumper_started;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Helper function that creates the ring of the calling thread. Returns NULL
+ * if out of memory.
+ */
+static struct ring *create_ring(void) {
+	unsigned int size = atomic_load(&ring_size);
+	struct ring *ring = malloc(sizeof(struct ring) +
+		size * sizeof(struct trace_event));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->mask = size - 1;
+	atomic_init(&ring->head, 0);
+
+	pthread_mutex_lock(&mutex);
+	ring->thread = ring_count++;
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&mutex);
+
+	thread_ring = ring;
+	return ring;
+}
+
+void trace_record(enum trace_type type, uint32_t id, uint64_t arg) {
+	struct ring *ring = thread_ring;
+	if (ring == NULL && (ring = create_ring()) == NULL) {
+		return;
+	}
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct trace_event *event = &ring->events[head & ring->mask];
+	event->time = now();
+	event->arg = arg;
+	event->type = type;
+	event->id = id;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Returns the number of the name "path interface.member", adding it to the
+ * name table if it is not there yet, so a method that is registered again
+ * gets its old number. Returns UINT32_MAX if out of memory.
+ */
+uint32_t trace_name(const char *path, const char *interface,
+		const char *member) {
+	size_t length = strlen(path) + strlen(interface) + strlen(member) + 3;
+	char *name = malloc(length);
+	if (name == NULL) {
+		return UINT32_MAX;
+	}
+	snprintf(name, length, "%s %s.%s", path, interface, member);
+
+	pthread_mutex_lock(&mutex);
+	uint32_t id = UINT32_MAX;
+	if (name_ids == NULL && (name_ids = hashmap_create(0)) == NULL) {
+		goto out;
+	}
+	uintptr_t found = (uintptr_t)hashmap_get(name_ids, name);
+	if (found != 0) {
+		id = found - 1;
+		goto out;
+	}
+	if (names_length == names_capacity) {
+		uint32_t capacity = names_capacity == 0 ? 64 : 2 * names_capacity;
+		char **t = realloc(names, capacity * sizeof(char *));
+		if (t == NULL) {
+			goto out;
+		}
+		names = t;
+		names_capacity = capacity;
+	}
+	if (hashmap_set(name_ids, name, (void *)(uintptr_t)(names_length + 1)) ==
+			-1) {
+		goto out;
+	}
+	id = names_length++;
+	names[id] = name;
+	name = NULL;
+
+out:
+	pthread_mutex_unlock(&mutex);
+	free(name);
+	return id;
+}
+
+void trace_send(DBusConnection *conn, DBusMessage *msg) {
+	trace_record(TRACE_SEND, dbus_message_get_type(msg),
+		dbus_message_get_serial(msg));
+	trace_record(TRACE_OUTGOING, 0, dbus_connection_get_outgoing_size(conn));
+}
+
+dbus_bool_t subd_trace_start(int events, DBusError *err) {
+	if (events <= 0 || events > MAX_RING_SIZE) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"The ring size must be between 1 and %d", MAX_RING_SIZE);
+		return FALSE;
+	}
+
+	unsigned int size = 1;
+	while (size < (unsigned int)events) {
+		size <<= 1;
+	}
+	atomic_store(&ring_size, size);
+	atomic_store(&trace_enabled, true);
+	return TRUE;
+}
+
+void subd_trace_stop(void) {
+	atomic_store(&trace_enabled, false);
+}
+
+/**
+ * Helper function that copies the events of "ring" that are not being
+ * overwritten into "events", and returns their number.
+ */
+static uint64_t copy_events(struct ring *ring, struct trace_event *events) {
+	uint64_t size = (uint64_t)ring->mask + 1;
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t first = head > size ? head - size : 0;
+	for (uint64_t i = first; i < head; ++i) {
+		events[i - first] = ring->events[i & ring->mask];
+	}
+
+	// The owner might have overwritten the oldest events meanwhile, and it
+	// might be writing the slot after the newest one right now.
+	uint64_t now_head =
+		atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t valid = now_head >= size ? now_head - size + 1 : 0;
+	if (valid > first) {
+		uint64_t skip = valid - first < head - first ? valid - first :
+			head - first;
+		memmove(events, events + skip,
+			(head - first - skip) * sizeof(struct trace_event));
+		first += skip;
+	}
+	return head - first;
+}
+
+static bool write_u32(FILE *f, uint32_t value) {
+	return fwrite(&value, sizeof(value), 1, f) == 1;
+}
+
+/**
+ * Helper function that writes the name table and the rings to "f". Called
+ * with the mutex held.
+ */
+static bool write_trace(FILE *f) {
+	if (fwrite(TRACE_MAGIC, strlen(TRACE_MAGIC), 1, f) != 1 ||
+			!write_u32(f, TRACE_VERSION) || !write_u32(f, names_length)) {
+		return false;
+	}
+	for (uint32_t i = 0; i < names_length; ++i) {
+		uint32_t length = strlen(names[i]);
+		if (!write_u32(f, length) || fwrite(names[i], length, 1, f) != 1) {
+			return false;
+		}
+	}
+
+	if (!write_u32(f, ring_count)) {
+		return false;
+	}
+	for (struct ring *ring = rings; ring != NULL; ring = ring->next) {
+		struct trace_event *events =
+			malloc(((size_t)ring->mask + 1) * sizeof(struct trace_event));
+		if (events == NULL) {
+			return false;
+		}
+		uint64_t count = copy_events(ring, events);
+		bool ok = write_u32(f, ring->thread) && write_u32(f, count) &&
+			fwrite(events, sizeof(struct trace_event), count, f) == count;
+		free(events);
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+dbus_bool_t subd_trace_dump(const char *path, DBusError *err) {
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "Could not open %s: %s", path,
+			strerror(errno));
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&mutex);
+	bool ok = write_trace(f);
+	pthread_mutex_unlock(&mutex);
+
+	if (fclose(f) != 0 || !ok) {
+		dbus_set_error(err, DBUS_ERROR_FAILED, "Could not write %s", path);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void handle_dump_signal(int signo) {
+	// Dumping is not async-signal-safe, so it is left to the dumper thread.
+	sem_post(&dump_sem);
+}
+
+static void *run_dumper(void *data) {
+	for (;;) {
+		if (sem_wait(&dump_sem) == -1) {
+			continue;
+		}
+		pthread_mutex_lock(&mutex);
+		char *path = strdup(dump_path);
+		pthread_mutex_unlock(&mutex);
+		if (path != NULL) {
+			subd_trace_dump(path, NULL);
+			free(path);
+		}
+	}
+	return NULL;
+}
+
+dbus_bool_t subd_trace_dump_on_signal(int signo, const char *path,
+		DBusError *err) {
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&mutex);
+	free(dump_path);
+	dump_path = copy;
+	bool started = dumper_started;
+	if (!started) {
+		pthread_t thread;
+		if (sem_init(&dump_sem, 0, 0) == 0 &&
+				pthread_create(&thread, NULL, run_dumper, NULL) == 0) {
+			pthread_detach(thread);
+			dumper_started = started = true;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!started) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_dump_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(signo, &action, NULL) == -1) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Could not install the handler of signal %d: %s", signo,
+			strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
@@ -1,28 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "list.h"
+#include "hashmap.h"
+#include "memo.h"
+#include "pool.h"
+#include "stats.h"
 #include "subd.h"
+#include "trace.h"
+#include "vtable.h"
 
-struct vtable_userdata {
-	struct list_t *interfaces;
-	void *userdata;
-};
-
-struct interface {
-	const char *name;
-	const struct subd_member *members;
-};
-
-struct path {
-	const char *path;
-	char *introspection_data;
-	struct list_t *interfaces;
-};
-
-static struct list_t *paths = NULL;
+static dbus_int32_t registry_slot = -1;
 
 static bool add_args(FILE *stream, const char *sig, const char *end) {
 	DBusSignatureIter iter;
@@ -42,101 +35,142 @@ static bool add_args(FILE *stream, const char *sig, const char *end) {
 	return true;
 }
 
-static const char *generate_introspection_data(struct path *path) {
-	free(path->introspection_data);
-
-	size_t size;
-	FILE *stream = open_memstream(&path->introspection_data, &size);
+/**
+ * Helper function that generates the XML fragment of "interface". Members of
+ * an interface never change, so the fragment is generated only once.
+ */
+static bool generate_fragment(struct interface *interface) {
+	FILE *stream = open_memstream(&interface->xml, &interface->xml_length);
 	if (stream == NULL) {
-		return NULL;
+		return false;
 	}
 
-	// Write the DOCTYPE entity, and start the <node> element.
-	fputs(DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE, stream);
-	fputs("<node>\n", stream);
-
-	// Iterate through the path's interfaces, ...
-	for (struct node *n = path->interfaces->head; n != NULL; n = n->next) {
-		struct interface *interface = n->data;
-		fprintf(stream, " <interface name=\"%s\">\n", interface->name);
+	fprintf(stream, " <interface name=\"%s\">\n", interface->name);
 
-		const struct subd_member *member = interface->members;
-		while (member->type != SUBD_MEMBERS_END) {
-			switch (member->type) {
-			case SUBD_METHOD:
-				fprintf(stream, "  <method name=\"%s\">\n", member->m.name);
-				add_args(stream, member->m.input_signature, "direction=\"in\"");
-				add_args(stream, member->m.output_signature, "direction=\"out\"");
-				fprintf(stream, "  </method>\n");
-				break;
-			case SUBD_SIGNAL:
-				fprintf(stream, "  <signal name=\"%s\">\n", member->s.name);
-				add_args(stream, member->s.signature, "");
-				fprintf(stream, "  </signal>\n");
+	const struct subd_member *member = interface->members;
+	while (member->type != SUBD_MEMBERS_END) {
+		switch (member->type) {
+		case SUBD_METHOD:
+			fprintf(stream, "  <method name=\"%s\">\n", member->m.name);
+			add_args(stream, member->m.input_signature, "direction=\"in\"");
+			add_args(stream, member->m.output_signature, "direction=\"out\"");
+			fprintf(stream, "  </method>\n");
+			break;
+		case SUBD_SIGNAL:
+			fprintf(stream, "  <signal name=\"%s\">\n", member->s.name);
+			add_args(stream, member->s.signature, "");
+			fprintf(stream, "  </signal>\n");
+			break;
+		case SUBD_PROPERTY:
+			fprintf(stream, "  <property name=\"%s\" type=\"%s\" ",
+				member->p.name, member->p.signature);
+			switch (member->p.access) {
+			case SUBD_PROPERTY_READ:
+				fprintf(stream, "access=\"read\" />\n");
 				break;
-			case SUBD_PROPERTY:
-				fprintf(stream, "  <property name=\"%s\" type=\"%s\" ",
-					member->p.name, member->p.signature);
-				switch (member->p.access) {
-				case SUBD_PROPERTY_READ:
-					fprintf(stream, "\"read\" />\n");
-					break;
-				case SUBD_PROPERTY_WRITE:
-					fprintf(stream, "\"write\" />\n");
-					break;
-				case SUBD_PROPERTY_READWRITE:
-					fprintf(stream, "\"readwrite\" />\n");
-					break;
-				}
+			case SUBD_PROPERTY_WRITE:
+				fprintf(stream, "access=\"write\" />\n");
 				break;
-			case SUBD_MEMBERS_END:
-				// not gonna happen
+			case SUBD_PROPERTY_READWRITE:
+				fprintf(stream, "access=\"readwrite\" />\n");
 				break;
 			}
-			member++;
+			break;
+		case SUBD_MEMBERS_END:
+			// not gonna happen
+			break;
 		}
-		fprintf(stream, " </interface>\n");
+		member++;
 	}
-	fprintf(stream, "</node>");
-	fclose(stream);
+	fprintf(stream, " </interface>\n");
 
-	return path->introspection_data;
+	if (fclose(stream) != 0) {
+		free(interface->xml);
+		interface->xml = NULL;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Helper function that builds the reply to Introspect from the fragments of
+ * the path's interfaces. Like the GetAll cache, the reply is a method return
+ * without a reply serial. Must be called with the mutex held.
+ */
+static DBusMessage *generate_introspection(struct path *path) {
+	static const char header[] =
+		DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE "<node>\n";
+	static const char footer[] = "</node>";
+
+	// Generate the missing fragments, and add up their sizes, so the document
+	// can be put together with a single allocation.
+	size_t size = sizeof(header) - 1 + sizeof(footer);
+	for (int i = 0; i < path->interfaces_length; ++i) {
+		struct interface *interface = path->interfaces[i];
+		if (interface->xml == NULL && !generate_fragment(interface)) {
+			return NULL;
+		}
+		size += interface->xml_length;
+	}
+
+	char *xml = malloc(size);
+	if (xml == NULL) {
+		return NULL;
+	}
+	char *p = xml;
+	memcpy(p, header, sizeof(header) - 1);
+	p += sizeof(header) - 1;
+	for (int i = 0; i < path->interfaces_length; ++i) {
+		struct interface *interface = path->interfaces[i];
+		memcpy(p, interface->xml, interface->xml_length);
+		p += interface->xml_length;
+	}
+	memcpy(p, footer, sizeof(footer));
+
+	DBusMessage *reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (reply != NULL && !dbus_message_append_args(reply,
+			DBUS_TYPE_STRING, &xml, DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		reply = NULL;
+	}
+	free(xml);
+	return reply;
 }
 
 static dbus_bool_t handle_introspect(DBusConnection *conn, DBusMessage *msg,
 		void *data, DBusError *err) {
 	// Find the path the message was sent to, so we can access its list of
 	// implemented interfaces.
-	const char *path_name = dbus_message_get_path(msg);
-	struct path *path = NULL;
-	for (struct node *n = paths->head; n != NULL; n = n->next) {
-		if (strcmp(((struct path *)n->data)->path, path_name) == 0) {
-			path = n->data;
-			break;
-		}
-	}
-
+	struct path *path = find_path(conn, dbus_message_get_path(msg));
 	if (path == NULL) {
 		// Something is seriously weird here. Path was not found, but then how
 		// was the method handler called??
 		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
-			"Path was not found in paths list.");
+			"Path was not found in the registry.");
 		return FALSE;
 	}
 
-	if (path->introspection_data == NULL) {
-		// This shouldn't really happen, introspection data is generated when
-		// the vtable is registered.
-		if (generate_introspection_data(path) == NULL) {
-			dbus_set_error(err, DBUS_ERROR_NO_MEMORY,
-				"Introspection data could not be generated.");
-			return FALSE;
-		}
+	// Introspection data is generated on the first call after the interfaces
+	// of the path changed, and reused until they change again.
+	pthread_mutex_lock(&path->registry->mutex);
+	if (path->introspection == NULL) {
+		path->introspection = generate_introspection(path);
+	}
+	DBusMessage *cache = path->introspection;
+	if (cache != NULL) {
+		dbus_message_ref(cache);
+	}
+	pthread_mutex_unlock(&path->registry->mutex);
+	path_unref(path);
+	if (cache == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY,
+			"Introspection data could not be generated.");
+		return FALSE;
 	}
 
-	return subd_reply_method_return(conn, msg, err,
-		DBUS_TYPE_STRING, &path->introspection_data,
-		DBUS_TYPE_INVALID);
+	dbus_bool_t ret = send_cached_reply(conn, msg, cache, err);
+	dbus_message_unref(cache);
+	return ret;
 }
 
 static const struct subd_member introspectable_members[] = {
@@ -145,158 +179,1315 @@ static const struct subd_member introspectable_members[] = {
 };
 
 /**
- * Helper function for vtable_dispatch that returns wither NULL, or the method
- * object member with the name "name".
+ * Helper function that sends a copy of "cache" as the reply to "msg". Copying
+ * a prebuilt reply only copies its already marshalled body.
  */
-static const struct subd_member *find_member(const struct subd_member *members,
-		const char *name) {
-	const struct subd_member *member = members;
-	while (member->type != SUBD_MEMBERS_END) {
-		if (member->type == SUBD_METHOD && strcmp(member->m.name, name) == 0) {
-			return member;
+dbus_bool_t send_cached_reply(DBusConnection *conn, DBusMessage *msg,
+		DBusMessage *cache, DBusError *err) {
+	DBusMessage *reply = dbus_message_copy(cache);
+	if (reply == NULL ||
+			!dbus_message_set_reply_serial(reply, dbus_message_get_serial(msg)) ||
+			!dbus_message_set_destination(reply, dbus_message_get_sender(msg))) {
+		if (reply != NULL) {
+			dbus_message_unref(reply);
 		}
-		++member;
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	memo_sent(reply);
+	dbus_bool_t ret = dbus_connection_send(conn, reply, NULL);
+	if (ret) {
+		trace_sent(conn, reply);
 	}
-	return NULL;
+	dbus_message_unref(reply);
+	if (!ret) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return ret;
+}
+
+/**
+ * Helper function that writes the member index key of "interface" and "member"
+ * into "key", which must be at least METHOD_KEY_SIZE long. Returns the length
+ * of the key, or 0 if the names are too long.
+ */
+size_t method_key(char *key, const char *interface, const char *member) {
+	size_t interface_length = strlen(interface);
+	size_t member_length = strlen(member);
+	if (interface_length > DBUS_MAXIMUM_NAME_LENGTH ||
+			member_length > DBUS_MAXIMUM_NAME_LENGTH) {
+		return 0;
+	}
+
+	memcpy(key, interface, interface_length);
+	key[interface_length] = '.';
+	memcpy(key + interface_length + 1, member, member_length + 1);
+	return interface_length + 1 + member_length;
+}
+
+/**
+ * Helper function for subd_add_object_vtable that adds the method and property
+ * type members of "interface" to the path's method and property indexes.
+ * Must be called with the mutex held.
+ */
+static bool index_members(struct path *path, struct interface *interface,
+		DBusError *err) {
+	char key[METHOD_KEY_SIZE];
+	struct method *method = interface->methods;
+	for (const struct subd_member *m = interface->members;
+			m->type != SUBD_MEMBERS_END; ++m) {
+		struct hashmap_t *index;
+		const char *name;
+		void *value;
+		if (m->type == SUBD_METHOD) {
+			index = path->methods;
+			name = m->m.name;
+			value = method++;
+		} else if (m->type == SUBD_PROPERTY) {
+			index = path->properties;
+			name = m->p.name;
+			value = (void *)m;
+		} else {
+			continue;
+		}
+		if (method_key(key, interface->name, name) == 0) {
+			dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+				"Member name %s is too long.", name);
+			return false;
+		}
+		if (hashmap_set(index, key, value) == -1) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Helper function that returns the name number of "method" in traces,
+ * adding its name to the trace first if needed.
+ */
+static uint32_t method_trace_id(struct method *method) {
+	int id = atomic_load_explicit(&method->trace_id, memory_order_relaxed);
+	if (id < 0) {
+		id = trace_name(method->interface->path->path,
+			method->interface->name, method->member->m.name);
+		atomic_store_explicit(&method->trace_id, id, memory_order_relaxed);
+	}
+	return id;
 }
 
 /**
  * Helper function for vtable_dispatch that calls the method object member's
- * handler function, and sends an error message if necessary.
+ * handler function, and sends an error message if necessary. If statistics are
+ * enabled, the call is recorded, with the time it waited since "queued" (or 0
+ * if that is not known). The reply of a cacheable method is memoized.
  */
-static bool call_method(const struct subd_member *member, DBusConnection *conn,
-		DBusMessage *msg, void *userdata) {
+static bool call_method(struct method *method, DBusConnection *conn,
+		DBusMessage *msg, void *userdata, uint64_t queued) {
+	struct registry *registry = method->interface->path->registry;
+	struct stats *stats = atomic_load_explicit(&registry->stats,
+		memory_order_acquire);
+	uint64_t start = stats != NULL ? stats_now() : 0;
+	uint32_t trace_id = tracing() ? method_trace_id(method) : 0;
+	trace(TRACE_HANDLER_ENTER, trace_id, dbus_message_get_serial(msg));
+
+	struct memo *memo = (method->member->m.flags & SUBD_METHOD_CACHEABLE) ?
+		atomic_load_explicit(&registry->memo, memory_order_acquire) : NULL;
+	struct memo_capture capture;
+	bool capturing = memo != NULL && memo_capture_begin(memo, &capture, msg);
+
 	DBusError error;
 	dbus_error_init(&error);
-	if (!member->m.handler(conn, msg, userdata, &error)) {
-		DBusMessage *error_message =
-			dbus_message_new_error(msg, error.name, error.message);
-		dbus_connection_send(conn, error_message, 0);
+	bool ok = method->member->m.handler(conn, msg, userdata, &error);
+	trace(TRACE_HANDLER_EXIT, trace_id, ok);
+	if (capturing) {
+		memo_capture_end(memo, &capture, ok, method->member->m.cache_ttl);
+	}
+	if (!ok) {
+		DBusMessage *error_message = dbus_message_new_error(msg,
+			error.name != NULL ? error.name : DBUS_ERROR_FAILED, error.message);
+		if (error_message != NULL) {
+			if (dbus_connection_send(conn, error_message, 0)) {
+				trace_sent(conn, error_message);
+			}
+			dbus_message_unref(error_message);
+		}
 		dbus_error_free(&error);
+	}
+
+	if (stats != NULL) {
+		stats_record(stats, method,
+			queued == 0 || queued > start ? STATS_UNKNOWN : start - queued,
+			stats_now() - start, !ok);
+	}
+	return ok;
+}
+
+/**
+ * A method call that is executed on the worker pool. The connection, the
+ * message, and the interface of the method are referenced until the handler
+ * returns, so the object can be removed while the call is queued.
+ */
+struct offloaded_call {
+	struct method *method;
+	DBusConnection *conn;
+	DBusMessage *msg;
+	void *userdata;
+	uint64_t queued;
+};
+
+static void run_offloaded_call(void *data) {
+	struct offloaded_call *call = data;
+	call_method(call->method, call->conn, call->msg, call->userdata,
+		call->queued);
+	interface_unref(call->method->interface);
+	dbus_message_unref(call->msg);
+	dbus_connection_unref(call->conn);
+	free(call);
+}
+
+/**
+ * Helper function for vtable_dispatch that submits the method call to the
+ * worker pool. Returns false if the call could not be submitted.
+ */
+static bool offload_method(struct subd_pool *pool, struct method *method,
+		DBusConnection *conn, DBusMessage *msg, void *userdata) {
+	struct offloaded_call *call = malloc(sizeof(struct offloaded_call));
+	if (call == NULL) {
+		return false;
+	}
+	call->method = method;
+	call->conn = dbus_connection_ref(conn);
+	call->msg = dbus_message_ref(msg);
+	call->userdata = userdata;
+	call->queued = atomic_load_explicit(
+		&method->interface->path->registry->stats, memory_order_relaxed) ?
+		stats_now() : 0;
+	interface_ref(method->interface);
+
+	if (!pool_submit(pool, run_offloaded_call, call)) {
+		interface_unref(method->interface);
+		dbus_message_unref(call->msg);
+		dbus_connection_unref(call->conn);
+		free(call);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Helper function that calls "method", or submits it to the worker pool if it
+ * is marked with SUBD_METHOD_OFFLOAD, and the connection has one. The caller
+ * holds a reference to the interface of the method, since the handler might
+ * remove its own object.
+ */
+static void dispatch_method(struct method *method, DBusConnection *conn,
+		DBusMessage *msg, uint64_t queued) {
+	dbus_uint32_t serial = dbus_message_get_serial(msg);
+	trace(TRACE_DISPATCH_BEGIN, 0, serial);
+	struct path *path = method->interface->path;
+	struct subd_pool *pool = path->registry->pool;
+	if (pool == NULL || !(method->member->m.flags & SUBD_METHOD_OFFLOAD) ||
+			!offload_method(pool, method, conn, msg, path->userdata)) {
+		call_method(method, conn, msg, path->userdata, queued);
+	}
+	trace(TRACE_DISPATCH_END, 0, serial);
+}
+
+/**
+ * Helper function for vtable_dispatch that answers "msg" with the memoized
+ * reply of "method", if there is one. Returns false if the handler has to be
+ * called.
+ */
+static bool reply_memoized(struct registry *registry, struct method *method,
+		DBusConnection *conn, DBusMessage *msg) {
+	struct memo *memo = atomic_load_explicit(&registry->memo,
+		memory_order_acquire);
+	if (memo == NULL) {
 		return false;
 	}
+	struct stats *stats = atomic_load_explicit(&registry->stats,
+		memory_order_acquire);
+	uint64_t start = stats != NULL ? stats_now() : 0;
+
+	DBusMessage *reply = memo_lookup(memo, msg);
+	if (reply == NULL) {
+		return false;
+	}
+	bool ok = send_cached_reply(conn, msg, reply, NULL);
+	dbus_message_unref(reply);
+	if (ok && stats != NULL) {
+		uint64_t queued = stats_batch_start();
+		stats_record(stats, method,
+			queued == 0 || queued > start ? STATS_UNKNOWN : start - queued,
+			stats_now() - start, false);
+	}
+	return ok;
+}
+
+/**
+ * Helper function that returns the priority of the method whose index key is
+ * "key", which is set either for the method itself, or for its whole
+ * interface.
+ */
+static enum subd_priority method_priority(struct registry *registry,
+		const char *key, size_t length, const char *interface) {
+	void *priority = hashmap_get_n(registry->priorities, key, length);
+	if (priority == NULL) {
+		priority = hashmap_get(registry->priorities, interface);
+	}
+	// The priorities are stored incremented, so NULL means "not set".
+	return priority == NULL ? SUBD_PRIORITY_NORMAL :
+		(enum subd_priority)((intptr_t)priority - 1);
+}
+
+/**
+ * Helper function for vtable_dispatch that puts the call aside, so
+ * dispatch_messages can dispatch it after the calls of higher priority.
+ * Returns false if out of memory.
+ */
+static bool defer_call(struct registry *registry, struct method *method,
+		DBusMessage *msg, enum subd_priority priority) {
+	struct deferred_call *call = malloc(sizeof(struct deferred_call));
+	if (call == NULL) {
+		return false;
+	}
+	call->method = method;
+	call->msg = dbus_message_ref(msg);
+	call->queued = stats_batch_start();
+	call->next = NULL;
+	interface_ref(method->interface);
+
+	int index = priority == SUBD_PRIORITY_LOW ? 1 : 0;
+	pthread_mutex_lock(&registry->mutex);
+	if (registry->deferred_tail[index] != NULL) {
+		registry->deferred_tail[index]->next = call;
+	} else {
+		registry->deferred[index] = call;
+	}
+	registry->deferred_tail[index] = call;
+	++registry->deferrals;
+	pthread_mutex_unlock(&registry->mutex);
 	return true;
 }
 
 /**
- * This function receives a list of interfaces implemented by the destination
- * object in "userdata->interfaces", and iterates through them and their members
- * to find the called method. When the method is found, its handler function is
- * called with "data" set to "userdata->userdata".
+ * Helper function that takes the first deferred call of the highest priority,
+ * or returns NULL if there is none.
+ */
+static struct deferred_call *take_deferred(struct registry *registry) {
+	pthread_mutex_lock(&registry->mutex);
+	struct deferred_call *call = NULL;
+	for (int i = 0; i < 2 && call == NULL; ++i) {
+		call = registry->deferred[i];
+		if (call != NULL) {
+			registry->deferred[i] = call->next;
+			if (registry->deferred[i] == NULL) {
+				registry->deferred_tail[i] = NULL;
+			}
+		}
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	return call;
+}
+
+static void free_deferred(struct deferred_call *call) {
+	interface_unref(call->method->interface);
+	dbus_message_unref(call->msg);
+	free(call);
+}
+
+/**
+ * Helper function that replies with an InvalidArgs error to a call of
+ * "method" whose signature is not the one the method expects.
+ */
+static void reply_bad_signature(DBusConnection *conn, DBusMessage *msg,
+		struct method *method) {
+	if (dbus_message_get_no_reply(msg)) {
+		return;
+	}
+	char text[256];
+	snprintf(text, sizeof(text),
+		"Method %s expects arguments of signature \"%s\", not \"%s\".",
+		method->member->m.name, method->member->m.input_signature,
+		dbus_message_get_signature(msg));
+	DBusMessage *error = dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS,
+		text);
+	if (error != NULL) {
+		if (dbus_connection_send(conn, error, NULL)) {
+			trace_sent(conn, error);
+		}
+		dbus_message_unref(error);
+	}
+}
+
+/**
+ * This function looks up the destination object in the registry, and the
+ * called method in its method index. The object is not taken from "userdata",
+ * because another thread might unregister and free it while libdbus calls
+ * this function. When the method is found, its handler
+ * function is called with "data" set to the object's userdata, if the
+ * arguments of the call match its input signature. Methods marked with
+ * SUBD_METHOD_OFFLOAD are called on the connection's worker pool, if it has
+ * one. If priorities are set, and the messages are dispatched by
+ * dispatch_messages, only the calls of high priority methods are dispatched
+ * right away, the others are deferred. Calls of cacheable methods whose reply
+ * is memoized are answered right away, regardless of their priority.
  */
 static DBusHandlerResult vtable_dispatch(DBusConnection *conn, DBusMessage *msg,
 		void *userdata) {
-	struct vtable_userdata *data = userdata;
+	const char *path_name = dbus_message_get_path(msg);
 	const char *interface_name = dbus_message_get_interface(msg);
 	const char *member_name = dbus_message_get_member(msg);
-	if (interface_name == NULL || member_name == NULL) {
+	struct registry *registry = find_registry(conn);
+	if (path_name == NULL || interface_name == NULL || member_name == NULL ||
+			registry == NULL) {
 		// something is wrong, no need to try with other handlers
 		return DBUS_HANDLER_RESULT_HANDLED;
 	}
 
-	struct list_t *interfaces = data->interfaces;
-	for (struct node *n = interfaces->head; n != NULL; n = n->next) {
-		struct interface *interface = n->data;
-		if (strcmp(interface->name, interface_name) == 0) {
-			const struct subd_member *member =
-				find_member(interface->members, member_name);
-			if (member != NULL) {
-				call_method(member, conn, msg, data->userdata);
-				return DBUS_HANDLER_RESULT_HANDLED;
+	// The interface of the method is referenced until the call is handled,
+	// deferred or offloaded, so it can be removed meanwhile.
+	char key[METHOD_KEY_SIZE];
+	size_t length = method_key(key, interface_name, member_name);
+	pthread_mutex_lock(&registry->mutex);
+	struct path *path = length == 0 ? NULL :
+		hashmap_get(registry->paths, path_name);
+	struct method *method = path == NULL ? NULL :
+		hashmap_get_n(path->methods, key, length);
+	if (method != NULL) {
+		interface_ref(method->interface);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	if (method == NULL) {
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	// Handlers read their arguments without checking their types (e.g. with
+	// subd_message_read), so calls with a different signature never reach
+	// them.
+	if (!dbus_message_has_signature(msg, method->member->m.input_signature)) {
+		reply_bad_signature(conn, msg, method);
+	} else if (!(method->member->m.flags & SUBD_METHOD_CACHEABLE) ||
+			!reply_memoized(registry, method, conn, msg)) {
+		enum subd_priority priority = registry->deferring ?
+			method_priority(registry, key, length, interface_name) :
+			SUBD_PRIORITY_HIGH;
+		if (priority == SUBD_PRIORITY_HIGH ||
+				!defer_call(registry, method, msg, priority)) {
+			dispatch_method(method, conn, msg, stats_batch_start());
+		}
+	}
+	interface_unref(method->interface);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/**
+ * Helper function that dispatches the incoming messages, and the deferred
+ * calls. Without a budget and priorities, this is the same as calling
+ * dbus_connection_dispatch until the queue is empty. Otherwise the incoming
+ * messages are dispatched first (which defers all but the high priority
+ * calls), then the deferred calls in the order of their priority, until the
+ * budget runs out. Deferring a call does not count towards the budget, so
+ * high priority calls don't have to wait for the calls queued before them.
+ * Returns true if there is still something to dispatch.
+ */
+bool dispatch_messages(DBusConnection *conn) {
+	struct registry *registry = find_registry(conn);
+	if (registry == NULL || (registry->priorities == NULL &&
+			registry->budget_messages == 0 && registry->budget_time == 0)) {
+		while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS);
+		return false;
+	}
+
+	uint64_t deadline = registry->budget_time == 0 ? 0 :
+		stats_now() + registry->budget_time * 1000ull;
+	unsigned int count = 0;
+	registry->deferring = registry->priorities != NULL;
+	while ((registry->budget_messages == 0 ||
+			count < registry->budget_messages) &&
+			(deadline == 0 || stats_now() < deadline)) {
+		if (dbus_connection_get_dispatch_status(conn) ==
+				DBUS_DISPATCH_DATA_REMAINS) {
+			unsigned long deferrals = registry->deferrals;
+			dbus_connection_dispatch(conn);
+			if (registry->deferrals == deferrals) {
+				++count;
 			}
+			continue;
+		}
+
+		// libdbus only reads a few kilobytes per watch handling, so there
+		// might be high priority calls still waiting in the socket. They are
+		// read before a deferred call is dispatched.
+		if (registry->deferring && dbus_connection_read_write(conn, 0) &&
+				dbus_connection_get_dispatch_status(conn) ==
+					DBUS_DISPATCH_DATA_REMAINS) {
+			continue;
+		}
+
+		struct deferred_call *call = take_deferred(registry);
+		if (call == NULL) {
+			break;
 		}
+		dispatch_method(call->method, conn, call->msg, call->queued);
+		free_deferred(call);
+		++count;
 	}
+	registry->deferring = false;
 
-	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	pthread_mutex_lock(&registry->mutex);
+	bool deferred = registry->deferred[0] != NULL ||
+		registry->deferred[1] != NULL;
+	pthread_mutex_unlock(&registry->mutex);
+	return deferred || dbus_connection_get_dispatch_status(conn) ==
+		DBUS_DISPATCH_DATA_REMAINS;
+}
+
+/**
+ * Helper function that releases what "interface" holds besides its own block.
+ */
+static void release_interface(struct interface *interface) {
+	// A GetAll reply that is being built for it is not cached anymore.
+	interface->removed = true;
+	release_properties(interface);
+	free(interface->xml);
+	interface->properties = NULL;
+	interface->changed = NULL;
+	interface->changed_capacity = 0;
+	interface->changed_length = 0;
+	interface->xml = NULL;
+}
+
+/**
+ * Helper function that frees "path" along with everything allocated for it.
+ * It does not touch the registry, because the connection might be finalized
+ * already when the last reference is dropped.
+ */
+static void free_path(struct path *path) {
+	if (path->introspection != NULL) {
+		dbus_message_unref(path->introspection);
+	}
+	// Nobody else references the interfaces, they would hold the path too.
+	for (int i = 0; i < path->interfaces_length; ++i) {
+		release_interface(path->interfaces[i]);
+		free(path->interfaces[i]);
+	}
+	free(path->interfaces);
+	if (path->interface_map != NULL) {
+		hashmap_destroy(path->interface_map, NULL);
+	}
+	if (path->methods != NULL) {
+		hashmap_destroy(path->methods, NULL);
+	}
+	if (path->properties != NULL) {
+		hashmap_destroy(path->properties, NULL);
+	}
+	arena_free(&path->arena);
+	free(path);
+}
+
+void path_ref(struct path *path) {
+	atomic_fetch_add_explicit(&path->refs, 1, memory_order_relaxed);
+}
+
+void path_unref(struct path *path) {
+	if (atomic_fetch_sub_explicit(&path->refs, 1, memory_order_acq_rel) == 1) {
+		free_path(path);
+	}
+}
+
+void interface_ref(struct interface *interface) {
+	atomic_fetch_add_explicit(&interface->refs, 1, memory_order_relaxed);
+	path_ref(interface->path);
+}
+
+void interface_unref(struct interface *interface) {
+	struct path *path = interface->path;
+	if (atomic_fetch_sub_explicit(&interface->refs, 1,
+			memory_order_acq_rel) == 1) {
+		free(interface);
+	}
+	path_unref(path);
+}
+
+static void unregister_path(DBusConnection *conn, void *userdata) {
+	path_unref(userdata);
 }
 
 static const DBusObjectPathVTable vtable = {
 	.message_function = vtable_dispatch,
-	.unregister_function = NULL,
+	.unregister_function = unregister_path,
 };
 
-dbus_bool_t subd_add_object_vtable(DBusConnection *conn, const char *path_name,
-		const char *interface, const struct subd_member *members,
-		void *userdata, DBusError *err) {
-	if (paths == NULL) {
-		paths = list_create();
-	}
-
-	// See if this path is already registered. If it is, it must have at least
-	// one interface, so get a pointer to the interfaces list.
-	struct list_t *interfaces = NULL;
-	struct path *path = NULL;
-	for (struct node *n = paths->head; n != NULL; n = n->next) {
-		struct path *p = n->data;
-		if (strcmp(path_name, p->path) == 0) {
-			path = p;
-			interfaces = p->interfaces;
-			break;
+static void unref_path(void *data) {
+	path_unref(data);
+}
+
+static void free_registry(void *data) {
+	struct registry *registry = data;
+#ifdef HAVE_TIMERFD
+	if (registry->timeouts != NULL) {
+		timer_cancel(registry->timeouts, &registry->timer);
+	}
+#endif
+	hashmap_destroy(registry->paths, unref_path);
+	free_managers(registry);
+	for (int i = 0; i < 2; ++i) {
+		while (registry->deferred[i] != NULL) {
+			struct deferred_call *save_next = registry->deferred[i]->next;
+			free_deferred(registry->deferred[i]);
+			registry->deferred[i] = save_next;
 		}
 	}
+	if (registry->priorities != NULL) {
+		hashmap_destroy(registry->priorities, NULL);
+	}
+	if (registry->stats != NULL) {
+		stats_free(registry->stats);
+	}
+	if (registry->memo != NULL) {
+		memo_free(registry->memo);
+	}
+	pthread_mutex_destroy(&registry->mutex);
+	pthread_mutex_destroy(&registry->paths_mutex);
+	free(registry);
+	dbus_connection_free_data_slot(&registry_slot);
+}
 
-	if (interfaces == NULL) {
-		// Path was not registered before, so first we create an interface list,
-		// and append Introspectable to it. We want every path to implement
-		// org.freedesktop.DBus.Introspectable.
-		// TODO: Also implement the following:
-		//        - org.freedesktop.DBus.Peer
-		//        - org.freedesktop.DBus.Properties
-		interfaces = list_create();
-		struct interface *new_interface = malloc(sizeof(struct interface));
-		if (interface == NULL) {
-			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
-			return FALSE;
+/**
+ * Helper function that returns the registry of "conn", creating it first if
+ * it does not exist yet. Returns NULL if out of memory.
+ */
+struct registry *get_registry(DBusConnection *conn) {
+	struct registry *registry = NULL;
+	if (registry_slot != -1) {
+		registry = dbus_connection_get_data(conn, registry_slot);
+		if (registry != NULL) {
+			return registry;
 		}
-		new_interface->name = strdup("org.freedesktop.DBus.Introspectable");
-		new_interface->members = introspectable_members;
-		list_append(interfaces, new_interface);
+	}
 
-		// Create the path with the new interface list, append it to the
-		// list of paths, ...
-		struct path *new_path = malloc(sizeof(struct path));
-		if (new_path == NULL) {
-			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
-			return FALSE;
-		}
-		new_path->path = strdup(path_name);
-		new_path->interfaces = interfaces;
-		new_path->introspection_data = NULL; // This will be set later.
-		list_append(paths, new_path);
-		path = new_path;
-
-		// ... and also register it.
-		// We merge userdata with the interfaces list in a struct
-		// vtable_userdata here, so vtable_dispatch will know what interfaces to
-		// traverse, and what userdata to pass to the actual handler functions.
-		struct vtable_userdata *data = malloc(sizeof(struct vtable_userdata));
-		if (data == NULL) {
+	// Every registry holds a reference to the slot, so it is released when
+	// the last connection using it is finalized.
+	if (!dbus_connection_allocate_data_slot(&registry_slot)) {
+		return NULL;
+	}
+
+	registry = malloc(sizeof(struct registry));
+	if (registry == NULL) {
+		dbus_connection_free_data_slot(&registry_slot);
+		return NULL;
+	}
+	registry->conn = conn;
+	registry->paths = hashmap_create(0);
+	registry->pool = NULL;
+	registry->changed = NULL;
+	registry->managers = NULL;
+	atomic_init(&registry->stats, NULL);
+	atomic_init(&registry->memo, NULL);
+	registry->priorities = NULL;
+	registry->deferred[0] = registry->deferred[1] = NULL;
+	registry->deferred_tail[0] = registry->deferred_tail[1] = NULL;
+	registry->deferrals = 0;
+	registry->deferring = false;
+	registry->budget_messages = 0;
+	registry->budget_time = 0;
+	if (registry->paths == NULL) {
+		free(registry);
+		dbus_connection_free_data_slot(&registry_slot);
+		return NULL;
+	}
+	pthread_mutex_init(&registry->mutex, NULL);
+	pthread_mutex_init(&registry->paths_mutex, NULL);
+#ifdef HAVE_TIMERFD
+	timer_init(&registry->timer, properties_timer);
+	registry->timeouts = NULL;
+#endif
+
+	if (!dbus_connection_set_data(conn, registry_slot, registry,
+			free_registry)) {
+		free_registry(registry);
+		return NULL;
+	}
+
+	return registry;
+}
+
+/**
+ * Helper function that returns the registry of "conn", or NULL if nothing was
+ * registered on it yet.
+ */
+struct registry *find_registry(DBusConnection *conn) {
+	if (registry_slot == -1) {
+		return NULL;
+	}
+	return dbus_connection_get_data(conn, registry_slot);
+}
+
+/**
+ * Helper function that returns the registered path named "path_name" on
+ * "conn" with a reference that the caller has to drop, or NULL if there is no
+ * such path. Must be called without the mutex held.
+ */
+struct path *find_path(DBusConnection *conn, const char *path_name) {
+	struct registry *registry = find_registry(conn);
+	if (registry == NULL || path_name == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&registry->mutex);
+	struct path *path = hashmap_get(registry->paths, path_name);
+	if (path != NULL) {
+		path_ref(path);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	return path;
+}
+
+/**
+ * Helper function that allocates an interface with its name and its methods
+ * stored inline. The interface has one reference, which is the one of "path".
+ */
+static struct interface *create_interface(struct path *path, const char *name,
+		const struct subd_member *members) {
+	int count = 0;
+	for (const struct subd_member *m = members; m->type != SUBD_MEMBERS_END;
+			++m) {
+		count += m->type == SUBD_METHOD;
+	}
+
+	// The methods follow the name, aligned for struct method.
+	size_t length = strlen(name);
+	size_t align = _Alignof(struct method);
+	size_t offset = (sizeof(struct interface) + length + 1 + align - 1) /
+		align * align;
+	struct interface *interface =
+		malloc(offset + count * sizeof(struct method));
+	if (interface == NULL) {
+		return NULL;
+	}
+	memset(interface, 0, sizeof(struct interface));
+	interface->methods = (struct method *)((char *)interface + offset);
+	interface->members = members;
+	interface->path = path;
+	atomic_init(&interface->refs, 1);
+	memcpy(interface->name, name, length + 1);
+
+	struct method *method = interface->methods;
+	for (const struct subd_member *m = members; m->type != SUBD_MEMBERS_END;
+			++m) {
+		if (m->type == SUBD_METHOD) {
+			method->member = m;
+			method->interface = interface;
+			atomic_init(&method->stats_id, -1);
+			atomic_init(&method->trace_id, -1);
+			++method;
+		}
+	}
+	return interface;
+}
+
+/**
+ * Helper function that removes the members of "interface" from the path's
+ * method and property indexes. Members that were replaced by an other
+ * interface in the indexes are left alone. Must be called with the mutex held.
+ */
+static void unindex_members(struct path *path, struct interface *interface) {
+	char key[METHOD_KEY_SIZE];
+	struct method *method = interface->methods;
+	for (const struct subd_member *m = interface->members;
+			m->type != SUBD_MEMBERS_END; ++m) {
+		struct hashmap_t *index;
+		const char *name;
+		void *value;
+		if (m->type == SUBD_METHOD) {
+			index = path->methods;
+			name = m->m.name;
+			value = method++;
+		} else if (m->type == SUBD_PROPERTY) {
+			index = path->properties;
+			name = m->p.name;
+			value = (void *)m;
+		} else {
+			continue;
+		}
+		if (method_key(key, interface->name, name) != 0 &&
+				hashmap_get(index, key) == value) {
+			hashmap_remove(index, key);
+		}
+	}
+	if (hashmap_get(path->interface_map, interface->name) == interface) {
+		hashmap_remove(path->interface_map, interface->name);
+	}
+}
+
+/**
+ * Helper function that removes the interface at "index" from "path", releases
+ * it, and drops the reference of the path to it. Whoever still holds a
+ * reference can keep using it. Must be called with the mutex held.
+ */
+static void remove_interface(struct path *path, int index) {
+	struct interface *interface = path->interfaces[index];
+	unindex_members(path, interface);
+	memmove(&path->interfaces[index], &path->interfaces[index + 1],
+		(path->interfaces_length - index - 1) * sizeof(struct interface *));
+	--path->interfaces_length;
+
+	// Changes that were not signalled yet are dropped.
+	struct interface **changed = &path->registry->changed;
+	if (interface->changed_length > 0) {
+		while (*changed != interface) {
+			changed = &(*changed)->next_changed;
+		}
+		*changed = interface->next_changed;
+	}
+	release_interface(interface);
+	if (atomic_fetch_sub_explicit(&interface->refs, 1,
+			memory_order_acq_rel) == 1) {
+		free(interface);
+	}
+}
+
+/**
+ * Helper function that creates an interface, and adds it to "path" along with
+ * its members. An interface that is registered again replaces the old one in
+ * the indexes. Must be called with the mutex held.
+ */
+static bool add_interface(struct path *path, const char *name,
+		const struct subd_member *members, DBusError *err) {
+	struct interface *interface = create_interface(path, name, members);
+	if (interface == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	if (path->interfaces_length == path->interfaces_capacity) {
+		int c = path->interfaces_capacity == 0 ?
+			4 : path->interfaces_capacity * 2;
+		void *t = realloc(path->interfaces, sizeof(struct interface *) * c);
+		if (t == NULL) {
 			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
-			return FALSE;
+			return false;
+		}
+		path->interfaces = t;
+		path->interfaces_capacity = c;
+	}
+	path->interfaces[path->interfaces_length++] = interface;
+
+	if (hashmap_set(path->interface_map, name, interface) == -1) {
+		remove_interface(path, path->interfaces_length - 1);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return false;
+	}
+	if (!index_members(path, interface, err)) {
+		remove_interface(path, path->interfaces_length - 1);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Helper function for subd_add_object_vtable that creates a new path with the
+ * Introspectable and Properties interfaces. The path is referenced once, and
+ * that reference is handed over to the registry.
+ */
+static struct path *create_path(struct registry *registry,
+		const char *path_name, void *userdata) {
+	struct path *path = calloc(1, sizeof(struct path));
+	if (path == NULL) {
+		return NULL;
+	}
+	arena_init(&path->arena);
+	atomic_init(&path->refs, 1);
+	path->path = arena_strdup(&path->arena, path_name);
+	path->introspection = NULL; // This will be set on the first call.
+	path->interface_map = hashmap_create(0);
+	path->methods = hashmap_create(0);
+	path->properties = hashmap_create(0);
+	path->registry = registry;
+	path->manager = NULL;
+	path->userdata = userdata;
+	if (path->path == NULL || path->interface_map == NULL ||
+			path->methods == NULL || path->properties == NULL) {
+		free_path(path);
+		return NULL;
+	}
+
+	// We want every path to implement org.freedesktop.DBus.Introspectable and
+	// org.freedesktop.DBus.Properties.
+	// TODO: Also implement org.freedesktop.DBus.Peer
+	pthread_mutex_lock(&registry->mutex);
+	bool ok = add_interface(path, DBUS_INTERFACE_INTROSPECTABLE,
+			introspectable_members, NULL) &&
+		add_interface(path, DBUS_INTERFACE_PROPERTIES, properties_members,
+			NULL);
+	pthread_mutex_unlock(&registry->mutex);
+	if (!ok) {
+		free_path(path);
+		return NULL;
+	}
+	return path;
+}
+
+/**
+ * Helper function that registers the new "path" in the registry, and with
+ * libdbus, and puts it under its object manager. libdbus holds a reference to
+ * it while it is registered. If another thread registered a path with the same
+ * name since it was looked up, "path" is dropped and that path is returned
+ * instead. The returned path has a reference for the caller, and "created" is
+ * set if it is "path". Returns NULL, and drops "path", on failure.
+ *
+ * The paths mutex is held until the path is registered with libdbus, so a
+ * path that is removed meanwhile is not registered with libdbus yet, and a
+ * removed path is not registered with libdbus anymore when it is added again.
+ */
+static struct path *register_path(DBusConnection *conn,
+		struct registry *registry, struct path *path, bool *created,
+		DBusError *err) {
+	pthread_mutex_lock(&registry->paths_mutex);
+	pthread_mutex_lock(&registry->mutex);
+	struct path *existing = hashmap_get(registry->paths, path->path);
+	if (existing != NULL) {
+		path_ref(existing);
+		pthread_mutex_unlock(&registry->mutex);
+		pthread_mutex_unlock(&registry->paths_mutex);
+		path_unref(path);
+		*created = false;
+		return existing;
+	}
+	if (hashmap_set(registry->paths, path->path, path) == -1) {
+		pthread_mutex_unlock(&registry->mutex);
+		pthread_mutex_unlock(&registry->paths_mutex);
+		path_unref(path);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	// The reference "path" came with is the one of the registry now, the
+	// caller and libdbus get one each.
+	path_ref(path);
+	path_ref(path);
+	pthread_mutex_unlock(&registry->mutex);
+	if (!dbus_connection_try_register_object_path(conn, path->path, &vtable,
+			path, err)) {
+		pthread_mutex_lock(&registry->mutex);
+		hashmap_remove(registry->paths, path->path);
+		pthread_mutex_unlock(&registry->mutex);
+		pthread_mutex_unlock(&registry->paths_mutex);
+		path_unref(path);
+		path_unref(path);
+		path_unref(path);
+		return NULL;
+	}
+
+	// New paths are managed by the closest object manager above them.
+	pthread_mutex_lock(&registry->mutex);
+	bool managed = manage_path(registry, path);
+	if (!managed) {
+		hashmap_remove(registry->paths, path->path);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	if (!managed) {
+		dbus_connection_unregister_object_path(conn, path->path);
+		pthread_mutex_unlock(&registry->paths_mutex);
+		path_unref(path);
+		path_unref(path);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+	pthread_mutex_unlock(&registry->paths_mutex);
+	*created = true;
+	return path;
+}
+
+/**
+ * Helper function that undoes register_path, and drops the reference of the
+ * registry to "path", unless another thread removed it already.
+ */
+static void forget_path(DBusConnection *conn, struct registry *registry,
+		struct path *path) {
+	pthread_mutex_lock(&registry->paths_mutex);
+	pthread_mutex_lock(&registry->mutex);
+	bool registered = hashmap_get(registry->paths, path->path) == path;
+	if (registered) {
+		unmanage_path(registry, path);
+		hashmap_remove(registry->paths, path->path);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	if (registered) {
+		dbus_connection_unregister_object_path(conn, path->path);
+		path_unref(path);
+	}
+	pthread_mutex_unlock(&registry->paths_mutex);
+}
+
+/**
+ * Helper function that checks that the plans of the members were compiled,
+ * and that they match the signatures of the members.
+ */
+static bool check_plans(const struct subd_member *members, DBusError *err) {
+	for (const struct subd_member *m = members; m->type != SUBD_MEMBERS_END;
+			++m) {
+		struct subd_plan *const *plan;
+		const char *name, *signature;
+		if (m->type == SUBD_METHOD) {
+			plan = m->m.plan;
+			name = m->m.name;
+			signature = m->m.output_signature;
+		} else if (m->type == SUBD_SIGNAL) {
+			plan = m->s.plan;
+			name = m->s.name;
+			signature = m->s.signature;
+		} else {
+			continue;
+		}
+		if (plan == NULL) {
+			continue;
+		}
+		if (*plan == NULL) {
+			dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+				"The plan of %s is not compiled.", name);
+			return false;
+		}
+		if (strcmp(subd_plan_signature(*plan), signature) != 0) {
+			dbus_set_error(err, DBUS_ERROR_INVALID_SIGNATURE,
+				"The plan of %s has signature %s instead of %s.", name,
+				subd_plan_signature(*plan), signature);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Helper function that returns the reply cache of "registry", creating it
+ * first if it does not exist yet. Returns NULL if out of memory.
+ */
+static struct memo *get_memo(struct registry *registry) {
+	pthread_mutex_lock(&registry->mutex);
+	struct memo *memo = registry->memo;
+	if (memo == NULL) {
+		memo = memo_create(MEMO_DEFAULT_SIZE);
+		atomic_store_explicit(&registry->memo, memo, memory_order_release);
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	return memo;
+}
+
+static bool has_cacheable(const struct subd_member *members) {
+	for (const struct subd_member *m = members; m->type != SUBD_MEMBERS_END;
+			++m) {
+		if (m->type == SUBD_METHOD && (m->m.flags & SUBD_METHOD_CACHEABLE)) {
+			return true;
 		}
-		data->interfaces = interfaces;
-		data->userdata = userdata;
-		if (!dbus_connection_try_register_object_path(conn, path_name,
-				&vtable, data, err)) {
-			return FALSE;
+	}
+	return false;
+}
+
+/**
+ * Helper function for subd_add_object_vtable and subd_add_objects that
+ * registers "interface" on "path_name". On success, "added" is set to the
+ * index of the first interface that was added to the path (which is the
+ * first standard interface if the path is new), and the path is returned with
+ * a reference that the caller has to drop.
+ */
+struct path *add_object(DBusConnection *conn, const char *path_name,
+		const char *interface, const struct subd_member *members,
+		void *userdata, int *added, DBusError *err) {
+	if (!dbus_validate_path(path_name, err) ||
+			!dbus_validate_interface(interface, err) ||
+			!check_plans(members, err)) {
+		return NULL;
+	}
+
+	struct registry *registry = get_registry(conn);
+	if (registry == NULL ||
+			(has_cacheable(members) && get_memo(registry) == NULL)) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	// See if this path is already registered. If it is not, create it, and
+	// also register it with libdbus. The path itself is passed as user data,
+	// so vtable_dispatch will know what methods to look up, and what userdata
+	// to pass to the actual handler functions. Another thread might remove
+	// the path before the interface is added, then it is looked up again.
+	struct path *path;
+	bool created;
+	for (;;) {
+		pthread_mutex_lock(&registry->mutex);
+		path = hashmap_get(registry->paths, path_name);
+		if (path != NULL) {
+			path_ref(path);
 		}
+		pthread_mutex_unlock(&registry->mutex);
+		created = false;
+		if (path == NULL) {
+			path = create_path(registry, path_name, userdata);
+			if (path == NULL) {
+				dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+				return NULL;
+			}
+			path = register_path(conn, registry, path, &created, err);
+			if (path == NULL) {
+				return NULL;
+			}
+		}
+
+		pthread_mutex_lock(&registry->mutex);
+		if (hashmap_get(registry->paths, path_name) == path) {
+			break;
+		}
+		pthread_mutex_unlock(&registry->mutex);
+		path_unref(path);
 	}
 
 	//TODO: Decide what to do if interface is already registered. Replace
 	//memeber list? Append new members to list? Throw an error?
 
-	// Append the new interface to the path's interface list.
-	struct interface *new_interface = malloc(sizeof(struct interface));
-	if (new_interface == NULL) {
+	// Append the new interface to the path's interface array, and index the
+	// members, so vtable_dispatch and the Properties methods can find them in
+	// constant time. Introspection data is not generated here, only the
+	// cached reply is dropped.
+	*added = created ? 0 : path->interfaces_length;
+	bool ok = add_interface(path, interface, members, err);
+	if (path->introspection != NULL) {
+		dbus_message_unref(path->introspection);
+		path->introspection = NULL;
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	if (!ok) {
+		// A path that was created for the interface is not left behind with
+		// only the standard interfaces.
+		if (created) {
+			forget_path(conn, registry, path);
+		}
+		path_unref(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+dbus_bool_t subd_add_object_vtable(DBusConnection *conn, const char *path_name,
+		const char *interface, const struct subd_member *members,
+		void *userdata, DBusError *err) {
+	int added;
+	struct path *path =
+		add_object(conn, path_name, interface, members, userdata, &added, err);
+	if (path == NULL) {
+		return FALSE;
+	}
+
+	// Let the clients of the object manager know about the new interfaces.
+	DBusMessage *signal = new_interfaces_added(conn, path, added);
+	if (signal != NULL) {
+		dbus_connection_send(conn, signal, NULL);
+		dbus_message_unref(signal);
+	}
+	path_unref(path);
+
+	return TRUE;
+}
+
+static bool is_standard(const char *interface) {
+	return strcmp(interface, DBUS_INTERFACE_INTROSPECTABLE) == 0 ||
+		strcmp(interface, DBUS_INTERFACE_PROPERTIES) == 0;
+}
+
+dbus_bool_t subd_remove_object_vtable(DBusConnection *conn,
+		const char *path_name, const char *interface, DBusError *err) {
+	struct registry *registry = find_registry(conn);
+	struct path *path = find_path(conn, path_name);
+	if (path == NULL) {
+		dbus_set_error(err, DBUS_ERROR_UNKNOWN_OBJECT,
+			"Path %s is not registered.", path_name);
+		return FALSE;
+	}
+	if (interface != NULL && is_standard(interface)) {
+		path_unref(path);
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"Interface %s can not be removed.", interface);
+		return FALSE;
+	}
+
+	// Another thread might have removed the path since it was looked up. The
+	// paths mutex is held until a removed path is unregistered from libdbus.
+	pthread_mutex_lock(&registry->paths_mutex);
+	pthread_mutex_lock(&registry->mutex);
+	if (hashmap_get(registry->paths, path_name) != path) {
+		pthread_mutex_unlock(&registry->mutex);
+		pthread_mutex_unlock(&registry->paths_mutex);
+		path_unref(path);
+		dbus_set_error(err, DBUS_ERROR_UNKNOWN_OBJECT,
+			"Path %s is not registered.", path_name);
+		return FALSE;
+	}
+	int matching = 0, remaining = 0;
+	for (int i = 0; i < path->interfaces_length; ++i) {
+		const char *name = path->interfaces[i]->name;
+		if (interface == NULL ? !is_standard(name) :
+				strcmp(name, interface) == 0) {
+			++matching;
+		} else if (!is_standard(name)) {
+			++remaining;
+		}
+	}
+	if (interface != NULL && matching == 0) {
+		pthread_mutex_unlock(&registry->mutex);
+		pthread_mutex_unlock(&registry->paths_mutex);
+		path_unref(path);
+		dbus_set_error(err, DBUS_ERROR_UNKNOWN_INTERFACE,
+			"Interface %s does not exist on %s.", interface, path_name);
+		return FALSE;
+	}
+
+	// When nothing but the standard interfaces would remain, the whole path
+	// is removed, and so are the standard interfaces.
+	bool remove_path = remaining == 0;
+	const char **names = malloc(sizeof(char *) * path->interfaces_length);
+	int count = 0;
+	for (int i = 0; names != NULL && i < path->interfaces_length; ++i) {
+		const char *name = path->interfaces[i]->name;
+		if (!remove_path && strcmp(name, interface) != 0) {
+			continue;
+		}
+		// An interface that was registered more than once is listed once.
+		int j = 0;
+		while (j < count && strcmp(names[j], name) != 0) {
+			++j;
+		}
+		if (j == count) {
+			names[count++] = name;
+		}
+	}
+	DBusMessage *signal = names == NULL ? NULL :
+		new_interfaces_removed(path, names, count);
+	free(names);
+
+	for (int i = path->interfaces_length - 1; i >= 0; --i) {
+		const char *name = path->interfaces[i]->name;
+		if (remove_path || strcmp(name, interface) == 0) {
+			remove_interface(path, i);
+		}
+	}
+	if (remove_path) {
+		release_manager(registry, path);
+		unmanage_path(registry, path);
+		hashmap_remove(registry->paths, path->path);
+	} else if (hashmap_get(path->interface_map, INTERFACE_OBJECT_MANAGER) ==
+			NULL) {
+		release_manager(registry, path);
+	}
+	if (path->introspection != NULL) {
+		dbus_message_unref(path->introspection);
+		path->introspection = NULL;
+	}
+	pthread_mutex_unlock(&registry->mutex);
+
+	// The replies of the removed interfaces must not outlive them, a new
+	// object registered on the same path might answer differently.
+	if (registry->memo != NULL) {
+		memo_invalidate(registry->memo, path->path,
+			remove_path ? NULL : interface, NULL);
+	}
+
+	if (remove_path) {
+		dbus_connection_unregister_object_path(conn, path->path);
+		path_unref(path);
+	}
+	pthread_mutex_unlock(&registry->paths_mutex);
+
+	if (signal != NULL) {
+		dbus_connection_send(conn, signal, NULL);
+		dbus_message_unref(signal);
+	}
+	path_unref(path);
+	return TRUE;
+}
+
+dbus_bool_t subd_set_pool(DBusConnection *conn, struct subd_pool *pool,
+		DBusError *err) {
+	struct registry *registry = get_registry(conn);
+	if (registry == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	registry->pool = pool;
+	return TRUE;
+}
+
+dbus_bool_t subd_set_priority(DBusConnection *conn, const char *interface,
+		const char *member, enum subd_priority priority, DBusError *err) {
+	if (interface == NULL || priority < SUBD_PRIORITY_HIGH ||
+			priority > SUBD_PRIORITY_LOW) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"An interface and a valid priority are required.");
+		return FALSE;
+	}
+
+	char key[METHOD_KEY_SIZE];
+	if (member != NULL && method_key(key, interface, member) == 0) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS, "Name is too long.");
+		return FALSE;
+	}
+
+	struct registry *registry = get_registry(conn);
+	if (registry == NULL || (registry->priorities == NULL &&
+			(registry->priorities = hashmap_create(0)) == NULL) ||
+			hashmap_set(registry->priorities, member != NULL ? key : interface,
+				(void *)(intptr_t)(priority + 1)) != 0) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+dbus_bool_t subd_set_dispatch_budget(DBusConnection *conn,
+		unsigned int messages, unsigned int time, DBusError *err) {
+	struct registry *registry = get_registry(conn);
+	if (registry == NULL) {
 		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
 		return FALSE;
 	}
-	new_interface->name = strdup(interface);
-	new_interface->members = members;
-	list_append(interfaces, new_interface);
 
-	// (Re)generate introspection XML for this path.
-	generate_introspection_data(path);
+	registry->budget_messages = messages;
+	registry->budget_time = time;
+	return TRUE;
+}
+
+dbus_bool_t subd_set_reply_cache_size(DBusConnection *conn, size_t size,
+		DBusError *err) {
+	struct registry *registry = get_registry(conn);
+	struct memo *memo = registry == NULL ? NULL : get_memo(registry);
+	if (memo == NULL) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
 
+	memo_set_size(memo, size);
 	return TRUE;
 }
+
+void subd_invalidate_replies(DBusConnection *conn, const char *path,
+		const char *interface, const char *member) {
+	struct registry *registry = find_registry(conn);
+	struct memo *memo = registry == NULL ? NULL :
+		atomic_load_explicit(&registry->memo, memory_order_acquire);
+	if (memo != NULL) {
+		memo_invalidate(memo, path, interface, member);
+	}
+}
+
+void subd_get_reply_cache_stats(DBusConnection *conn,
+		struct subd_cache_stats *stats) {
+	struct registry *registry = find_registry(conn);
+	struct memo *memo = registry == NULL ? NULL :
+		atomic_load_explicit(&registry->memo, memory_order_acquire);
+	if (memo == NULL) {
+		memset(stats, 0, sizeof(struct subd_cache_stats));
+		return;
+	}
+	memo_get_stats(memo, stats);
+}
@@ -1,122 +1,317 @@
 #include <errno.h>
 #include <poll.h>
 #include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "coalesce.h"
+#include "queue.h"
+#include "stats.h"
 #include "subd.h"
+#include "timeout.h"
+#include "trace.h"
+#include "vtable.h"
 
-static dbus_bool_t add_watch(DBusWatch *watch, void *data) {
-	struct subd_watches *watches = data;
-	sem_wait(&watches->mutex);
+/**
+ * A slot of the slot map. Every slot in use owns one entry of the fds array,
+ * which is kept dense for poll, so entries move when others are removed, but
+ * slots (and so the handles) never do. Disabled entries stay in the array with
+ * a negative file descriptor, which poll ignores.
+ */
+struct slot {
+	int entry;					// index in fds, or -1 if the slot is free
+	unsigned int generation;	// incremented whenever the slot is freed
+	int fd;
+	short events;				// events to poll for, 0 if disabled
+	DBusWatch *watch;			// NULL for non-DBus file descriptors
+	subd_fd_function function;
+	void *data;
+	int next_free;
+};
 
-	if (!dbus_watch_get_enabled(watch)) {
-		sem_post(&watches->mutex);
-		return TRUE;
-	}
-
-	if (watches->length == watches->capacity) {
-		int c = watches->capacity + 10;
-		void *t1 = realloc(watches->fds, sizeof(struct pollfd) * c);
-		void *t2 = realloc(watches->watches, sizeof(DBusWatch *) * c);
-		if (t1 == NULL || t2 == NULL) {
-			sem_post(&watches->mutex);
-			return FALSE;
-		} else {
-			watches->capacity = c;
-		}
-	}
+/**
+ * A ready entry, collected before anything is handled, so the handlers can
+ * add and remove file descriptors. The generation tells if the slot was
+ * freed meanwhile.
+ */
+struct ready {
+	int slot;
+	unsigned int generation;
+	short revents;
+};
 
-	short mask = 0;
-	unsigned int flags = dbus_watch_get_flags(watch);
+struct subd_watch_slots {
+	struct slot *slots;		// capacity long
+	int *entries;			// the slot of every entry in fds
+	struct ready *ready;
+	int free;				// the first free slot, or -1
+};
+
+static short flags_to_events(unsigned int flags) {
+	short events = 0;
 	if (flags & DBUS_WATCH_READABLE) {
-		mask |= POLLIN;
+		events |= POLLIN;
 	}
 	if (flags & DBUS_WATCH_WRITABLE) {
-		mask |= POLLOUT;
+		events |= POLLOUT;
 	}
+	return events;
+}
 
-	int fd = dbus_watch_get_unix_fd(watch);
-	struct pollfd pollfd = {fd, mask, 0};
-	int index = watches->length++;
-	watches->fds[index] = pollfd;
-	watches->watches[index] = watch;
+static unsigned int events_to_flags(short events) {
+	unsigned int flags = 0;
+	if (events & POLLIN) {
+		flags |= DBUS_WATCH_READABLE;
+	}
+	if (events & POLLOUT) {
+		flags |= DBUS_WATCH_WRITABLE;
+	}
+	if (events & POLLHUP) {
+		flags |= DBUS_WATCH_HANGUP;
+	}
+	if (events & POLLERR) {
+		flags |= DBUS_WATCH_ERROR;
+	}
+	return flags;
+}
 
-	sem_post(&watches->mutex);
-	return TRUE;
+/**
+ * Helper function that doubles the capacity of the arrays, and puts the new
+ * slots on the free list. Must be called with the mutex held.
+ */
+static bool grow(struct subd_watches *watches) {
+	struct subd_watch_slots *slots = watches->slots;
+	int c = watches->capacity == 0 ? 16 : watches->capacity * 2;
+
+	// The arrays are assigned one by one, so a failure leaves them valid.
+	struct pollfd *fds = realloc(watches->fds, sizeof(struct pollfd) * c);
+	if (fds == NULL) {
+		return false;
+	}
+	watches->fds = fds;
+	int *entries = realloc(slots->entries, sizeof(int) * c);
+	if (entries == NULL) {
+		return false;
+	}
+	slots->entries = entries;
+	struct ready *ready = realloc(slots->ready, sizeof(struct ready) * c);
+	if (ready == NULL) {
+		return false;
+	}
+	slots->ready = ready;
+	struct slot *s = realloc(slots->slots, sizeof(struct slot) * c);
+	if (s == NULL) {
+		return false;
+	}
+	slots->slots = s;
+
+	for (int i = c - 1; i >= watches->capacity; --i) {
+		s[i] = (struct slot){.entry = -1, .next_free = slots->free};
+		slots->free = i;
+	}
+	watches->capacity = c;
+	return true;
 }
 
-static void remove_watch(DBusWatch *watch, void *data) {
+/**
+ * Helper function that takes a free slot, and appends its entry to fds.
+ * Returns the slot, or -1 if out of memory. Must be called with the mutex
+ * held.
+ */
+static int add_slot(struct subd_watches *watches, int fd, short events,
+		DBusWatch *watch, subd_fd_function function, void *data) {
+	struct subd_watch_slots *slots = watches->slots;
+	if (slots->free == -1 && !grow(watches)) {
+		return -1;
+	}
+
+	int index = slots->free;
+	struct slot *slot = &slots->slots[index];
+	slots->free = slot->next_free;
+
+	int entry = watches->length++;
+	slot->entry = entry;
+	slot->fd = fd;
+	slot->events = events;
+	slot->watch = watch;
+	slot->function = function;
+	slot->data = data;
+	watches->fds[entry] = (struct pollfd){
+		.fd = events != 0 ? fd : -1,
+		.events = events,
+	};
+	slots->entries[entry] = index;
+	return index;
+}
+
+/**
+ * Helper function that frees "index", and moves the last entry of fds into
+ * the place of its entry. Must be called with the mutex held.
+ */
+static void remove_slot(struct subd_watches *watches, int index) {
+	struct subd_watch_slots *slots = watches->slots;
+	struct slot *slot = &slots->slots[index];
+	int entry = slot->entry;
+	int last = --watches->length;
+	watches->fds[entry] = watches->fds[last];
+	slots->entries[entry] = slots->entries[last];
+	slots->slots[slots->entries[entry]].entry = entry;
+
+	slot->entry = -1;
+	++slot->generation;
+	slot->watch = NULL;
+	slot->function = NULL;
+	slot->data = NULL;
+	slot->next_free = slots->free;
+	slots->free = index;
+}
+
+/**
+ * Helper function that changes the events "index" is polled for. Zero events
+ * disable the entry. Must be called with the mutex held.
+ */
+static void set_events(struct subd_watches *watches, int index, short events) {
+	struct slot *slot = &watches->slots->slots[index];
+	slot->events = events;
+	watches->fds[slot->entry] = (struct pollfd){
+		.fd = events != 0 ? slot->fd : -1,
+		.events = events,
+	};
+}
+
+/**
+ * Returns the events of "watch" if it is enabled, 0 otherwise.
+ */
+static short watch_events(DBusWatch *watch) {
+	return dbus_watch_get_enabled(watch) ?
+		flags_to_events(dbus_watch_get_flags(watch)) : 0;
+}
+
+static dbus_bool_t add_watch(DBusWatch *watch, void *data) {
 	struct subd_watches *watches = data;
 	sem_wait(&watches->mutex);
 
-	int index = -1;
-	for (int i = 0; i < watches->length; ++i) {
-		if (watches->watches[i] == watch) {
-			index = i;
-			break;
-		}
+	// Disabled watches get a slot too, so toggling them only flips their
+	// entry. The slot is remembered by the watch itself.
+	int index = add_slot(watches, dbus_watch_get_unix_fd(watch),
+		watch_events(watch), watch, NULL, NULL);
+	if (index != -1) {
+		dbus_watch_set_data(watch, (void *)(intptr_t)index, NULL);
 	}
 
-	if (index != -1) {
-		--watches->length;
-		memmove(&watches->fds[index], &watches->fds[index + 1],
-			sizeof(struct pollfd) * watches->length - index);
-		memmove(&watches->watches[index], &watches->watches[index + 1],
-			sizeof(DBusWatch *) * watches->length - index);
+	sem_post(&watches->mutex);
+	return index != -1;
+}
+
+static void remove_watch(DBusWatch *watch, void *data) {
+	struct subd_watches *watches = data;
+	sem_wait(&watches->mutex);
+
+	int index = (intptr_t)dbus_watch_get_data(watch);
+	if (watches->slots->slots[index].watch == watch) {
+		remove_slot(watches, index);
 	}
 
 	sem_post(&watches->mutex);
 }
 
 static void toggle_watch(DBusWatch *watch, void *data) {
-	if (dbus_watch_get_enabled(watch)) {
-		add_watch(watch, data);
-	} else {
-		remove_watch(watch, data);
+	struct subd_watches *watches = data;
+	sem_wait(&watches->mutex);
+
+	int index = (intptr_t)dbus_watch_get_data(watch);
+	if (watches->slots->slots[index].watch == watch) {
+		set_events(watches, index, watch_events(watch));
 	}
+
+	sem_post(&watches->mutex);
+}
+
+static void free_watches(struct subd_watches *watches) {
+	sem_destroy(&watches->mutex);
+	free(watches->fds);
+	free(watches->slots->slots);
+	free(watches->slots->entries);
+	free(watches->slots->ready);
+	free(watches->slots);
+	free(watches);
+}
+
+#ifdef HAVE_TIMERFD
+static void handle_timeouts(int fd, unsigned int flags, void *data) {
+	timeouts_handle(data);
+}
+#endif
+
+static void handle_queue(int fd, unsigned int flags, void *data) {
+	queue_handle(data);
 }
 
 struct subd_watches *subd_init_watches(struct DBusConnection *conn,
 		struct pollfd *fds, int size, DBusError *err) {
-	const char *error_code = NULL;
-
 	// Initialize the watches structure.
-	struct subd_watches *watches = malloc(sizeof(struct subd_watches));
+	struct subd_watches *watches = calloc(1, sizeof(struct subd_watches));
 	if (watches == NULL) {
-		error_code = DBUS_ERROR_NO_MEMORY;
-		goto error;
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
 	}
-
-	watches->capacity = 10 + size;
-	watches->length = size;
-	watches->fds = malloc(watches->capacity * sizeof(struct pollfd));
-	watches->watches = malloc(watches->capacity * sizeof(DBusWatch*));
-	if (watches->fds == NULL || watches->watches == NULL) {
-		error_code = DBUS_ERROR_NO_MEMORY;
-		goto error;
+	watches->slots = calloc(1, sizeof(struct subd_watch_slots));
+	if (watches->slots == NULL) {
+		free(watches);
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
 	}
+	watches->slots->free = -1;
 
 	// Initialize a semaphore for the watches. It is needed to prevent the add,
 	// remove and toggle functions accessing the watch storage while it is being
 	// processed by subd_process_watches.
 	if (sem_init(&watches->mutex, 0, 1) == -1) {
-		if (errno == EINVAL) {
-			error_code = DBUS_ERROR_INVALID_ARGS;
-		} else {
-			error_code = DBUS_ERROR_NO_MEMORY;
+		dbus_set_error(err, errno == EINVAL ?
+			DBUS_ERROR_INVALID_ARGS : DBUS_ERROR_NO_MEMORY, NULL);
+		free(watches->slots);
+		free(watches);
+		return NULL;
+	}
+
+	// Add any non-dbus file descriptors. They have no function, so they are
+	// left for the caller to check after poll, and their handles are 0 to
+	// size - 1.
+	for (int i = 0; i < size; ++i) {
+		if (add_slot(watches, fds[i].fd, fds[i].events, NULL, NULL,
+				NULL) == -1) {
+			dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+			free_watches(watches);
+			return NULL;
 		}
+	}
+
+	// Without a connection (e.g. for the listening socket of a server), only
+	// non-DBus file descriptors are watched.
+	if (conn == NULL) {
+		return watches;
+	}
+
+#ifdef HAVE_TIMERFD
+	// Add the timerfd that drives the DBus timeouts. It is just another
+	// non-DBus file descriptor, with a function that handles the timeouts.
+	watches->timeouts = timeouts_create(conn, err);
+	if (watches->timeouts == NULL || subd_watches_add_fd(watches,
+			timeouts_get_fd(watches->timeouts), DBUS_WATCH_READABLE,
+			handle_timeouts, watches->timeouts, err) == -1) {
 		goto error;
 	}
+#endif
 
-	// Add any non-dbus file descriptors.
-	for (int i = 0; i < size; ++i) {
-		watches->fds[i] = (struct pollfd){
-			.fd = fds->fd,
-			.events = fds->events
-		};
-		watches->watches[i] = NULL;
-		++fds;
+	// Add the send queue, which also wakes up poll when another thread needs
+	// the event loop.
+	watches->queue = queue_create(conn, err);
+	if (watches->queue == NULL || subd_watches_add_fd(watches,
+			queue_get_fd(watches->queue), DBUS_WATCH_READABLE, handle_queue,
+			watches->queue, err) == -1) {
+		goto error;
 	}
 
 	// Register the add, remove, and toggle functions.
@@ -124,58 +319,145 @@ struct subd_watches *subd_init_watches(struct DBusConnection *conn,
 	// watches when connection finalizes, because sometimes it does not work.
 	if (!dbus_connection_set_watch_functions(conn, add_watch, remove_watch,
 			toggle_watch, watches, NULL)) {
-		error_code = DBUS_ERROR_NO_MEMORY;
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
 		goto error;
 	}
 
 	return watches;
 
 error:
-	if (watches != NULL) {
-		if (watches->fds != NULL) {
-			free(watches->fds);
-		}
-		if (watches->watches != NULL) {
-			free(watches->watches);
-		}
+	if (watches->queue != NULL) {
+		queue_destroy(conn, watches->queue);
+	}
+	if (watches->timeouts != NULL) {
+		timeouts_destroy(conn, watches->timeouts);
 	}
-	dbus_set_error(err, error_code, NULL);
+	free_watches(watches);
 	return NULL;
 }
 
-void subd_process_watches(DBusConnection *conn, struct subd_watches *watches) {
+void subd_free_watches(DBusConnection *conn, struct subd_watches *watches) {
+	if (conn != NULL) {
+		// This calls remove_watch for all watches.
+		dbus_connection_set_watch_functions(conn, NULL, NULL, NULL, NULL, NULL);
+	}
+	if (watches->queue != NULL) {
+		queue_destroy(conn, watches->queue);
+	}
+	if (watches->timeouts != NULL) {
+		timeouts_destroy(conn, watches->timeouts);
+	}
+	free_watches(watches);
+}
+
+int subd_watches_add_fd(struct subd_watches *watches, int fd,
+		unsigned int flags, subd_fd_function function, void *data,
+		DBusError *err) {
+	if (fd < 0 || function == NULL) {
+		dbus_set_error(err, DBUS_ERROR_INVALID_ARGS,
+			"A file descriptor and a function are required.");
+		return -1;
+	}
+
 	sem_wait(&watches->mutex);
+	int handle = add_slot(watches, fd, flags_to_events(flags), NULL, function,
+		data);
+	sem_post(&watches->mutex);
 
-	for (int i = 0; i < watches->length; ++i) {
-		struct pollfd pollfd = watches->fds[i];
-		DBusWatch *watch = watches->watches[i];
+	if (handle == -1) {
+		dbus_set_error(err, DBUS_ERROR_NO_MEMORY, NULL);
+	}
+	return handle;
+}
+
+/**
+ * Helper function that checks if "handle" is a slot that holds a non-DBus file
+ * descriptor. Must be called with the mutex held.
+ */
+static bool is_user_slot(struct subd_watches *watches, int handle) {
+	return handle >= 0 && handle < watches->capacity &&
+		watches->slots->slots[handle].entry != -1 &&
+		watches->slots->slots[handle].watch == NULL;
+}
+
+void subd_watches_remove_fd(struct subd_watches *watches, int handle) {
+	sem_wait(&watches->mutex);
+	if (is_user_slot(watches, handle)) {
+		remove_slot(watches, handle);
+	}
+	sem_post(&watches->mutex);
+}
+
+void subd_watches_set_fd_flags(struct subd_watches *watches, int handle,
+		unsigned int flags) {
+	sem_wait(&watches->mutex);
+	if (is_user_slot(watches, handle)) {
+		set_events(watches, handle, flags_to_events(flags));
+	}
+	sem_post(&watches->mutex);
+}
 
-		if (watch == NULL || !dbus_watch_get_enabled(watch)) {
+void subd_process_watches(DBusConnection *conn, struct subd_watches *watches) {
+	stats_mark_batch();
+
+	// Collect the ready entries first. They are handled without the lock held,
+	// because handling a watch can make libdbus toggle watches, and the
+	// functions of non-DBus file descriptors can add or remove others.
+	sem_wait(&watches->mutex);
+	struct subd_watch_slots *slots = watches->slots;
+	int count = 0;
+	for (int i = 0; i < watches->length; ++i) {
+		struct pollfd *pollfd = &watches->fds[i];
+		if (pollfd->revents == 0 || pollfd->fd < 0) {
 			continue;
 		}
+		int index = slots->entries[i];
+		slots->ready[count++] = (struct ready){
+			.slot = index,
+			.generation = slots->slots[index].generation,
+			.revents = pollfd->revents,
+		};
+	}
+	sem_post(&watches->mutex);
+	trace(TRACE_WAKEUP, 0, count);
 
-		if (pollfd.revents & pollfd.events) {
-			unsigned int flags = 0;
-			if (pollfd.revents & POLLIN) {
-				flags |= DBUS_WATCH_READABLE;
-			}
-			if (pollfd.revents & POLLOUT) {
-				flags |= DBUS_WATCH_WRITABLE;
-			}
-			if (pollfd.revents & POLLHUP) {
-				flags |= DBUS_WATCH_HANGUP;
-			}
-			if (pollfd.revents & POLLERR) {
-				flags |= DBUS_WATCH_ERROR;
-			}
+	for (int i = 0; i < count; ++i) {
+		// The arrays might have been reallocated by a handler.
+		sem_wait(&watches->mutex);
+		struct ready ready = slots->ready[i];
+		struct slot slot = slots->slots[ready.slot];
+		sem_post(&watches->mutex);
+		if (slot.entry == -1 || slot.generation != ready.generation) {
+			continue;
+		}
 
+		unsigned int flags = events_to_flags(ready.revents &
+			(slot.events | POLLHUP | POLLERR));
+		if (flags == 0) {
+			continue;
+		}
+		if (slot.watch != NULL) {
 			//TODO: Error handling. Not sure, what is the right move here. Log
 			//      and ignore? Make them fatal?
-			dbus_watch_handle(watch, flags);
-			while (dbus_connection_dispatch(conn) ==
-					DBUS_DISPATCH_DATA_REMAINS);
+			if (dbus_watch_get_enabled(slot.watch)) {
+				dbus_watch_handle(slot.watch, flags);
+			}
+		} else if (slot.function != NULL) {
+			slot.function(slot.fd, flags, slot.data);
 		}
 	}
 
-	sem_post(&watches->mutex);
+	if (conn == NULL) {
+		return;
+	}
+
+	// If the dispatch budget ran out, the next poll must not wait.
+	if (dispatch_messages(conn)) {
+		queue_wake(watches->queue);
+	}
+
+	// Send the signals that were coalesced, and the properties that changed
+	// during this iteration.
+	coalescer_flush(conn);
+	properties_flush(conn);
 }
@@ -0,0 +1,161 @@
+#include <stddef.h>
+#include "timer-wheel.h"
+
+#define LEVEL_SHIFT(level) ((level) * WHEEL_SLOT_BITS)
+#define MAX_DELTA ((uint64_t)1 << (WHEEL_LEVELS * WHEEL_SLOT_BITS))
+
+/**
+ * Links "timer" at the head of the list "head". The list can be a wheel slot or
+ * any other list of timers (e.g. the list of expired timers), so removal works
+ * the same way regardless of where the timer is.
+ */
+static void link_timer(struct wheel_timer **head, struct wheel_timer *timer) {
+	timer->next = *head;
+	if (*head != NULL) {
+		(*head)->pprev = &timer->next;
+	}
+	*head = timer;
+	timer->pprev = head;
+}
+
+static void unlink_timer(struct wheel_timer *timer) {
+	*timer->pprev = timer->next;
+	if (timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+void wheel_init(struct timer_wheel *wheel, uint64_t now) {
+	wheel->now = now;
+	for (int level = 0; level < WHEEL_LEVELS; ++level) {
+		wheel->occupied[level] = 0;
+		for (int index = 0; index < WHEEL_SLOTS; ++index) {
+			wheel->slots[level][index] = NULL;
+		}
+	}
+}
+
+void wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+		uint64_t expires) {
+	// Timers that are already due fire on the next tick.
+	if (expires <= wheel->now) {
+		expires = wheel->now + 1;
+	}
+	timer->expires = expires;
+
+	// Timers that are too far in the future are put in the last level, and
+	// are placed again when that slot is cascaded.
+	uint64_t delta = expires - wheel->now;
+	if (delta >= MAX_DELTA) {
+		delta = MAX_DELTA - 1;
+		expires = wheel->now + delta;
+	}
+
+	int level = 0;
+	while (delta >= (uint64_t)1 << LEVEL_SHIFT(level + 1)) {
+		++level;
+	}
+	int index = (expires >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1);
+
+	link_timer(&wheel->slots[level][index], timer);
+	timer->slot = level * WHEEL_SLOTS + index;
+	wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+void wheel_remove(struct timer_wheel *wheel, struct wheel_timer *timer) {
+	if (timer->pprev == NULL) {
+		return;
+	}
+
+	unlink_timer(timer);
+	if (timer->slot != -1) {
+		int level = timer->slot / WHEEL_SLOTS;
+		int index = timer->slot % WHEEL_SLOTS;
+		if (wheel->slots[level][index] == NULL) {
+			wheel->occupied[level] &= ~((uint64_t)1 << index);
+		}
+		timer->slot = -1;
+	}
+}
+
+bool wheel_pending(const struct wheel_timer *timer) {
+	return timer->pprev != NULL && timer->slot != -1;
+}
+
+/**
+ * Returns the number of slots from "index + 1" to the first occupied slot in
+ * "occupied" (wrapping around), or 0 if there are no occupied slots.
+ */
+static int next_occupied(uint64_t occupied, int index) {
+	if (occupied == 0) {
+		return 0;
+	}
+	int shift = (index + 1) % WHEEL_SLOTS;
+	uint64_t rotated = shift == 0 ? occupied :
+		(occupied >> shift) | (occupied << (WHEEL_SLOTS - shift));
+	return __builtin_ctzll(rotated) + 1;
+}
+
+uint64_t wheel_next_expiry(const struct timer_wheel *wheel) {
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < WHEEL_LEVELS; ++level) {
+		// For level 0 this is the exact expiry of the timers in the slot, for
+		// the other levels it is the tick the slot gets cascaded on.
+		uint64_t period = wheel->now >> LEVEL_SHIFT(level);
+		int offset = next_occupied(wheel->occupied[level],
+			period & (WHEEL_SLOTS - 1));
+		if (offset != 0) {
+			uint64_t tick = (period + offset) << LEVEL_SHIFT(level);
+			if (tick < next) {
+				next = tick;
+			}
+		}
+	}
+	return next;
+}
+
+static void cascade(struct timer_wheel *wheel, int level, int index) {
+	struct wheel_timer *timer = wheel->slots[level][index];
+	wheel->slots[level][index] = NULL;
+	wheel->occupied[level] &= ~((uint64_t)1 << index);
+	while (timer != NULL) {
+		struct wheel_timer *save_next = timer->next;
+		wheel_add(wheel, timer, timer->expires);
+		timer = save_next;
+	}
+}
+
+void wheel_advance(struct timer_wheel *wheel, uint64_t now,
+		struct wheel_timer **expired) {
+	while (wheel->now < now) {
+		// Nothing happens until the next expiry, so skip straight to it.
+		uint64_t next = wheel_next_expiry(wheel);
+		if (next > now) {
+			wheel->now = now;
+			break;
+		}
+		wheel->now = next;
+
+		for (int level = 1; level < WHEEL_LEVELS; ++level) {
+			uint64_t mask = ((uint64_t)1 << LEVEL_SHIFT(level)) - 1;
+			if ((wheel->now & mask) != 0) {
+				break;
+			}
+			cascade(wheel, level,
+				(wheel->now >> LEVEL_SHIFT(level)) & (WHEEL_SLOTS - 1));
+		}
+
+		int index = wheel->now & (WHEEL_SLOTS - 1);
+		struct wheel_timer *timer = wheel->slots[0][index];
+		wheel->slots[0][index] = NULL;
+		wheel->occupied[0] &= ~((uint64_t)1 << index);
+		while (timer != NULL) {
+			struct wheel_timer *save_next = timer->next;
+			link_timer(expired, timer);
+			timer->slot = -1;
+			timer = save_next;
+		}
+	}
+}
@@ -0,0 +1,209 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/*
+ * Converts a trace written by subd_trace_dump to the Chrome trace event
+ * format, which can be loaded into chrome://tracing or Perfetto.
+ *
+ * usage: subd-trace2json trace-file [json-file]
+ */
+
+struct thread {
+	uint32_t number;
+	uint32_t count;
+	struct trace_event *events;
+};
+
+static char **names;
+static uint32_t names_length;
+
+static bool read_u32(FILE *f, uint32_t *value) {
+	return fread(value, sizeof(*value), 1, f) == 1;
+}
+
+static void print_string(FILE *out, const char *s, size_t length) {
+	fputc('"', out);
+	for (size_t i = 0; i < length; ++i) {
+		if (s[i] == '"' || s[i] == '\\') {
+			fputc('\\', out);
+		}
+		fputc(s[i], out);
+	}
+	fputc('"', out);
+}
+
+/**
+ * Helper function that prints the name of method "id", which is stored as
+ * "path interface.member", as the event name and a path argument.
+ */
+static void print_method(FILE *out, uint32_t id) {
+	const char *name = id < names_length ? names[id] : "? ?";
+	const char *space = strchr(name, ' ');
+	if (space == NULL) {
+		space = name;
+	}
+	fputs("\"name\": ", out);
+	print_string(out, space + 1, strlen(space + 1));
+	fputs(", \"cat\": \"handler\", \"args\": {\"path\": ", out);
+	print_string(out, name, space - name);
+}
+
+static const char *message_type(uint32_t type) {
+	switch (type) {
+	case DBUS_MESSAGE_TYPE_METHOD_CALL:
+		return "method_call";
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		return "method_return";
+	case DBUS_MESSAGE_TYPE_ERROR:
+		return "error";
+	case DBUS_MESSAGE_TYPE_SIGNAL:
+		return "signal";
+	default:
+		return "invalid";
+	}
+}
+
+static void print_event(FILE *out, const struct trace_event *e,
+		uint32_t thread, uint64_t start) {
+	uint64_t ts = e->time - start;
+	fprintf(out, "{\"pid\": 1, \"tid\": %" PRIu32 ", \"ts\": %" PRIu64
+		".%03" PRIu64 ", ", thread, ts / 1000, ts % 1000);
+
+	switch (e->type) {
+	case TRACE_WAKEUP:
+		fprintf(out, "\"name\": \"wakeup\", \"ph\": \"i\", \"s\": \"t\", "
+			"\"args\": {\"ready\": %" PRIu64 "}}", e->arg);
+		break;
+	case TRACE_DISPATCH_BEGIN:
+	case TRACE_DISPATCH_END:
+		fprintf(out, "\"name\": \"dispatch\", \"ph\": \"%s\", "
+			"\"args\": {\"serial\": %" PRIu64 "}}",
+			e->type == TRACE_DISPATCH_BEGIN ? "B" : "E", e->arg);
+		break;
+	case TRACE_HANDLER_ENTER:
+		fputs("\"ph\": \"B\", ", out);
+		print_method(out, e->id);
+		fprintf(out, ", \"serial\": %" PRIu64 "}}", e->arg);
+		break;
+	case TRACE_HANDLER_EXIT:
+		fputs("\"ph\": \"E\", ", out);
+		print_method(out, e->id);
+		fprintf(out, ", \"ok\": %" PRIu64 "}}", e->arg);
+		break;
+	case TRACE_SEND:
+		fprintf(out, "\"name\": \"send\", \"ph\": \"i\", \"s\": \"t\", "
+			"\"args\": {\"type\": \"%s\", \"serial\": %" PRIu64 "}}",
+			message_type(e->id), e->arg);
+		break;
+	case TRACE_OUTGOING:
+		fprintf(out, "\"name\": \"outgoing\", \"ph\": \"C\", "
+			"\"args\": {\"bytes\": %" PRIu64 "}}", e->arg);
+		break;
+	default:
+		fprintf(out, "\"name\": \"unknown\", \"ph\": \"i\", \"s\": \"t\", "
+			"\"args\": {\"type\": %" PRIu32 "}}", e->type);
+		break;
+	}
+}
+
+static bool read_trace(FILE *f, struct thread **threads, uint32_t *count) {
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	uint32_t version;
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+			memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+			!read_u32(f, &version) || version != TRACE_VERSION) {
+		fprintf(stderr, "subd-trace2json: not a trace file\n");
+		return false;
+	}
+
+	if (!read_u32(f, &names_length) ||
+			(names = calloc(names_length + 1, sizeof(char *))) == NULL) {
+		goto error;
+	}
+	for (uint32_t i = 0; i < names_length; ++i) {
+		uint32_t length;
+		if (!read_u32(f, &length) ||
+				(names[i] = calloc(length + 1, 1)) == NULL ||
+				fread(names[i], 1, length, f) != length) {
+			goto error;
+		}
+	}
+
+	if (!read_u32(f, count) ||
+			(*threads = calloc(*count + 1, sizeof(struct thread))) == NULL) {
+		goto error;
+	}
+	for (uint32_t i = 0; i < *count; ++i) {
+		struct thread *t = &(*threads)[i];
+		if (!read_u32(f, &t->number) || !read_u32(f, &t->count) ||
+				(t->events = calloc(t->count + 1,
+					sizeof(struct trace_event))) == NULL ||
+				fread(t->events, sizeof(struct trace_event), t->count, f) !=
+					t->count) {
+			goto error;
+		}
+	}
+	return true;
+
+error:
+	fprintf(stderr, "subd-trace2json: truncated trace file\n");
+	return false;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s trace-file [json-file]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	struct thread *threads = NULL;
+	uint32_t count = 0;
+	bool ok = read_trace(in, &threads, &count);
+	fclose(in);
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+
+	FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+	if (out == NULL) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	// Timestamps are made relative to the first event.
+	uint64_t start = UINT64_MAX;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (threads[i].count > 0 && threads[i].events[0].time < start) {
+			start = threads[i].events[0].time;
+		}
+	}
+
+	fputs("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [", out);
+	bool first = true;
+	for (uint32_t i = 0; i < count; ++i) {
+		for (uint32_t j = 0; j < threads[i].count; ++j) {
+			fputs(first ? "\n" : ",\n", out);
+			first = false;
+			print_event(out, &threads[i].events[j], threads[i].number, start);
+		}
+	}
+	fputs("\n]}\n", out);
+
+	if (out != stdout && fclose(out) != 0) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}